@@ -47,8 +47,27 @@ typedef struct {
 	unsigned char	serialnumber[256];	///< Device serial number.
 	uint16_t		vid;				///< USB Vendor ID.
 	uint16_t		pid;				///< USB Product ID.
+	char			location[32];		///< USB bus and port path, e.g. "1-2.4".
 } DISCFERRET_DEVICE;
 
+/**
+ * @brief	Drive timing profile.
+ *
+ * Describes the fastest step rate a disc drive can reliably follow, and the
+ * time its heads take to settle after a seek. Usually measured by
+ * discferret_seek_autotune(), but may also be stored by the application and
+ * re-applied later with discferret_set_drive_profile().
+ */
+typedef struct {
+	unsigned long	step_rate_us;		///< Step rate, in microseconds per step
+	unsigned long	settle_us;			///< Head settle time after a seek, in microseconds
+	unsigned long	tracks_tested;		///< Number of tracks the step rate was verified over
+	bool			settle_measured;	///< True if settle_us was measured, false if it is the default
+} DISCFERRET_DRIVE_PROFILE;
+
+/// Library-private device state (opaque)
+struct discferret_private;
+
 /**
  * @brief	Handle to an open DiscFerret device.
  */
@@ -62,6 +81,9 @@ typedef struct {
 	long	current_track;				///< Current track number
 	int		step_rate_res_us;			///< Step rate resolution in microseconds
 	bool	has_extended_seek;			///< True if device has the "extended seek register" feature
+	bool	has_drive_profile;			///< True if drive_profile is applied to seek operations
+	DISCFERRET_DRIVE_PROFILE drive_profile;	///< Drive timing profile (valid if has_drive_profile is set)
+	struct discferret_private *priv;	///< Library-private state. Do not touch.
 } DISCFERRET_DEVICE_HANDLE;
 
 /**
@@ -77,6 +99,85 @@ typedef struct {
 	unsigned char	serialnumber[256];	///< Device serial number.
 } DISCFERRET_DEVICE_INFO;
 
+/**
+ * @brief	Index period statistics, as gathered by the index monitor.
+ *
+ * All times are in seconds. Host timestamps use the same clock as
+ * discferret_host_time().
+ */
+typedef struct {
+	unsigned long	count;			///< Number of index periods measured since the monitor was started
+	unsigned long	index;			///< Number of the most recent index pulse, counting from zero (includes pulses the monitor missed)
+	unsigned int	window;			///< Number of periods the statistics are calculated over
+	double			last;			///< Most recent index period
+	double			mean;			///< Mean index period
+	double			min;			///< Shortest index period
+	double			max;			///< Longest index period
+	double			jitter;			///< Standard deviation of the index period
+	double			last_index;		///< Estimated host time of the most recent index pulse
+	int				error;			///< Result of the most recent device poll (DISCFERRET_E_OK or a DISCFERRET_E_xxx constant)
+} DISCFERRET_INDEX_STATS;
+
+/**
+ * @brief	Host/device clock correlation results.
+ *
+ * All times are in seconds.
+ */
+typedef struct {
+	unsigned int	samples;			///< Number of USB command round trips timed
+	double			usb_latency_min;	///< Shortest command/response round trip
+	double			usb_latency_mean;	///< Mean command/response round trip
+	double			usb_latency_max;	///< Longest command/response round trip
+	bool			ticker_running;		///< True if the 20MHz clock ticker was seen to advance
+	bool			pll_ticker_running;	///< True if the PLL clock ticker was seen to advance
+	unsigned long	index_pulses;		///< Number of index pulses in the offset/drift estimate (0 = no estimate)
+	double			offset;				///< Host time of index pulse zero, as estimated by the fit
+	double			drift_ppm;			///< Device clock rate relative to the host clock, in parts per million (positive = device fast)
+	double			residual;			///< RMS residual of the fit
+} DISCFERRET_CLOCK_INFO;
+
+/**
+ * @brief	Status wait statistics.
+ *
+ * Every library function which waits for the DiscFerret (seeks, index
+ * measurements, acquisitions and writes) polls the status register through
+ * the same deadline-bounded wait, which keeps these counts.
+ */
+typedef struct {
+	unsigned long	waits;			///< Waits for a status condition
+	unsigned long	polls;			///< Status polls made while waiting
+	unsigned long	timeouts;		///< Waits which reached their deadline
+	unsigned long	errors;			///< Waits ended by a USB or device error, or cancelled
+	unsigned long	wait_us;		///< Total time spent waiting, in microseconds
+	unsigned long	overrun_us;		///< Total time waits ran past their expected end, in microseconds
+} DISCFERRET_WAIT_STATS;
+
+/**
+ * @brief	USB error recovery statistics.
+ *
+ * When a USB transfer fails, the library clears any endpoint halt and
+ * resynchronises the command stream with a NOP, so the handle stays usable.
+ * Commands which are safe to repeat (register reads, RAM address changes,
+ * and RAM reads at a known address) are then retried.
+ */
+typedef struct {
+	unsigned long	errors;			///< Failed USB transfers, including short or out-of-step responses
+	unsigned long	recoveries;		///< Errors after which the command stream was resynchronised
+	unsigned long	retries;		///< Commands (or RAM read chunks) repeated after a recovery
+	unsigned long	failures;		///< Errors which couldn't be recovered from
+} DISCFERRET_USB_STATS;
+
+/**
+ * @brief	Cancellation token for the _deadline functions.
+ *
+ * Zero-initialise it (or call discferret_cancel_reset()), pass it to one or
+ * more _deadline calls, and call discferret_cancel() from any thread to make
+ * them return DISCFERRET_E_CANCELLED.
+ */
+typedef struct {
+	int		cancelled;		///< Nonzero once cancelled. Use the discferret_cancel_xxx functions rather than touching this.
+} DISCFERRET_CANCEL;
+
 /**
  * @brief	DiscFerret library error codes.
  */
@@ -93,7 +194,15 @@ typedef enum {
 	DISCFERRET_E_NOT_SUPPORTED,				///< Feature not supported by this firmware/microcode version
 	DISCFERRET_E_RECAL_FAILED,				///< Recalibrate failed (track0 not reached after specified number of steps)
 	DISCFERRET_E_TRACK0_REACHED,			///< Track 0 reached during seek (informative)
-	DISCFERRET_E_CURRENT_TRACK_UNKNOWN		///< Current track not known before or after seek (need to Recalibrate the head)
+	DISCFERRET_E_CURRENT_TRACK_UNKNOWN,		///< Current track not known before or after seek (need to Recalibrate the head)
+	DISCFERRET_E_CONNECTION_ERROR,			///< Unable to communicate with the DiscFerret daemon
+	DISCFERRET_E_TIMEOUT,					///< Timed out waiting for an event
+	DISCFERRET_E_FILE_ERROR,				///< Unable to create, write or resize a file
+	DISCFERRET_E_WRITE_PROTECTED,			///< Disc is write protected
+	DISCFERRET_E_VERIFY_FAILED,				///< Data read back after a write did not match
+	DISCFERRET_E_SECTOR_NOT_FOUND,			///< Sector ID not found on the track
+	DISCFERRET_E_DATA_ERROR,				///< Sector found, but its data could not be read without errors
+	DISCFERRET_E_CANCELLED					///< Operation cancelled through its DISCFERRET_CANCEL token
 } DISCFERRET_ERROR;
 
 /**
@@ -110,6 +219,29 @@ DISCFERRET_ERROR discferret_init(void);
  */
 DISCFERRET_ERROR discferret_done(void);
 
+/**
+ * @brief	Cancel every operation using a cancellation token.
+ * @param	token	Cancellation token.
+ *
+ * Safe to call from any thread (but not from a signal handler). The
+ * operations notice within a few milliseconds; see the _deadline functions
+ * for what state each leaves the DiscFerret in.
+ */
+void discferret_cancel(DISCFERRET_CANCEL *token);
+
+/**
+ * @brief	Re-arm a cancellation token so it can be used again.
+ * @param	token	Cancellation token.
+ */
+void discferret_cancel_reset(DISCFERRET_CANCEL *token);
+
+/**
+ * @brief	Check whether a cancellation token has been cancelled.
+ * @param	token	Cancellation token, or NULL.
+ * @returns	true if <i>token</i> is not NULL and has been cancelled.
+ */
+bool discferret_cancelled(const DISCFERRET_CANCEL *token);
+
 /**
  * @brief	Enumerate all available DiscFerret devices.
  * @param	devlist		Pointer to a DISCFERRET_DEVICE* block, or NULL.
@@ -120,6 +252,11 @@ DISCFERRET_ERROR discferret_done(void);
  * constant (if there was an error), or a count of the number of available
  * devices.
  *
+ * Libdiscferret keeps a registry of attached DiscFerrets, which is kept up to
+ * date by USB hotplug notifications where the platform supports them. Each
+ * unit's string descriptors are only read once, when it is first seen, so
+ * calling this function repeatedly is cheap.
+ *
  * If devlist is set to NULL, then a count of devices will be performed, but
  * no device list will be returned (for obvious reasons).
  *
@@ -146,6 +283,10 @@ void discferret_devlist_free(DISCFERRET_DEVICE **devlist);
  * fails, then one of the DISCFERRET_E_xxx constants will be returned, and
  * *dh will be set to NULL.
  *
+ * The serial number is looked up in the library's device registry (see
+ * discferret_find_devices()), so only the matching unit is opened. If
+ * <i>serialnum</i> is NULL or empty, the first available unit is opened.
+ *
  * dh (the pointer-to-a-pointer) MUST NOT be set to NULL.
  */
 DISCFERRET_ERROR discferret_open(const char *serialnum, DISCFERRET_DEVICE_HANDLE **dh);
@@ -178,6 +319,39 @@ DISCFERRET_ERROR discferret_open_first(DISCFERRET_DEVICE_HANDLE **dh);
  */
 DISCFERRET_ERROR discferret_close(DISCFERRET_DEVICE_HANDLE *dh);
 
+/**
+ * @brief	Gain exclusive access to a DiscFerret device handle.
+ * @param	dh		DiscFerret device handle.
+ * @returns DISCFERRET_E_OK on success, one of the DISCFERRET_E_xxx constants on error.
+ *
+ * Every libdiscferret call holds the handle lock while it talks to the
+ * device, so calls made from different threads (or by the library's own
+ * background threads, such as the index monitor) can't corrupt each other.
+ *
+ * Applications only need to call this function if they need a sequence of
+ * calls to run without anything else touching the device in between -- for
+ * example, setting the RAM address pointer and then reading RAM. The lock
+ * is recursive; each call to discferret_lock() must be matched by a call to
+ * discferret_unlock().
+ */
+DISCFERRET_ERROR discferret_lock(DISCFERRET_DEVICE_HANDLE *dh);
+
+/**
+ * @brief	Release a DiscFerret device handle locked by discferret_lock().
+ * @param	dh		DiscFerret device handle.
+ * @returns DISCFERRET_E_OK on success, one of the DISCFERRET_E_xxx constants on error.
+ */
+DISCFERRET_ERROR discferret_unlock(DISCFERRET_DEVICE_HANDLE *dh);
+
+/**
+ * @brief	Read the host's monotonic clock.
+ * @returns	Current host time, in seconds, from an arbitrary starting point.
+ *
+ * This is the clock libdiscferret uses to timestamp events (e.g. index pulses
+ * seen by the index monitor).
+ */
+double discferret_host_time(void);
+
 /**
  * @brief	Update a DiscFerret device handle's local copy of the device capability block.
  * @param	dh		DiscFerret device handle.
@@ -271,6 +445,22 @@ DISCFERRET_ERROR discferret_fpga_get_status(DISCFERRET_DEVICE_HANDLE *dh);
  */
 DISCFERRET_ERROR discferret_fpga_load_rbf(DISCFERRET_DEVICE_HANDLE *dh, const unsigned char *rbfdata, const size_t len);
 
+/**
+ * @brief	Load an RBF-format microcode image, with a deadline and cancellation.
+ * @param	dh			DiscFerret device handle.
+ * @param	rbfdata		Pointer to RBF data, as read from the .RBF file.
+ * @param	len			Length of the RBF data buffer.
+ * @param	deadline	Host time (see discferret_host_time()) by which the load must finish, or 0 for none.
+ * @param	cancel		Cancellation token, or NULL.
+ * @returns	As discferret_fpga_load_rbf(), or DISCFERRET_E_TIMEOUT / DISCFERRET_E_CANCELLED.
+ *
+ * The deadline and token are checked between microcode blocks. A load which
+ * is stopped part-way leaves the FPGA unconfigured (the handle itself is
+ * still usable): load the microcode again before using the DiscFerret.
+ */
+DISCFERRET_ERROR discferret_fpga_load_rbf_deadline(DISCFERRET_DEVICE_HANDLE *dh, const unsigned char *rbfdata, const size_t len,
+		const double deadline, const DISCFERRET_CANCEL *cancel);
+
 /**
  * @brief	Load the default DiscFerret microcode image into the FPGA
  *
@@ -340,6 +530,24 @@ DISCFERRET_ERROR discferret_ram_addr_set(DISCFERRET_DEVICE_HANDLE *dh, const uns
  */
 DISCFERRET_ERROR discferret_ram_write(DISCFERRET_DEVICE_HANDLE *dh, const unsigned char *block, const size_t len);
 
+/**
+ * @brief	Write a block of data to Acquisition RAM, with a deadline and cancellation.
+ * @param	dh			DiscFerret device handle.
+ * @param	block		Data block to write.
+ * @param	len			Size of data block.
+ * @param	deadline	Host time (see discferret_host_time()) by which the write must finish, or 0 for none.
+ * @param	cancel		Cancellation token, or NULL.
+ * @returns	DISCFERRET_E_OK, DISCFERRET_E_TIMEOUT, DISCFERRET_E_CANCELLED, or
+ * 			one of the other DISCFERRET_E_xxx constants in case of error.
+ *
+ * No more packets are sent once the deadline passes or the token is
+ * cancelled. Packets already on their way are allowed to finish, so the
+ * DiscFerret never sees half a command, and the RAM address pointer is left
+ * just past the last byte written.
+ */
+DISCFERRET_ERROR discferret_ram_write_deadline(DISCFERRET_DEVICE_HANDLE *dh, const unsigned char *block, const size_t len,
+		const double deadline, const DISCFERRET_CANCEL *cancel);
+
 /**
  * @brief	Read a block of data from Acquisition RAM.
  * @param	dh		DiscFerret device handle.
@@ -350,9 +558,31 @@ DISCFERRET_ERROR discferret_ram_write(DISCFERRET_DEVICE_HANDLE *dh, const unsign
  * Reads a block of data from the DiscFerret's acquisition RAM, at the address
  * set in the address pointer. The value of the address pointer can be read
  * using discferret_ram_addr_get(), or set using discferret_ram_addr_set().
+ *
+ * If the address pointer was last set (or read) through the library, a chunk
+ * interrupted by a USB error is read again from the right address. Register
+ * writes can move the pointer, so set it again after starting an acquisition.
  */
 DISCFERRET_ERROR discferret_ram_read(DISCFERRET_DEVICE_HANDLE *dh, unsigned char *block, const size_t len);
 
+/**
+ * @brief	Read a block of data from Acquisition RAM, with a deadline and cancellation.
+ * @param	dh			DiscFerret device handle.
+ * @param	block		Pointer to data buffer.
+ * @param	len			Number of bytes to read.
+ * @param	deadline	Host time (see discferret_host_time()) by which the read must finish, or 0 for none.
+ * @param	cancel		Cancellation token, or NULL.
+ * @returns	DISCFERRET_E_OK, DISCFERRET_E_TIMEOUT, DISCFERRET_E_CANCELLED, or
+ * 			one of the other DISCFERRET_E_xxx constants in case of error.
+ *
+ * A transfer in flight when the deadline passes or the token is cancelled is
+ * cancelled, and the rest of its data is drained from the DiscFerret so the
+ * handle can be used straight away. The contents of <i>block</i> and the RAM
+ * address pointer are undefined afterwards.
+ */
+DISCFERRET_ERROR discferret_ram_read_deadline(DISCFERRET_DEVICE_HANDLE *dh, unsigned char *block, const size_t len,
+		const double deadline, const DISCFERRET_CANCEL *cancel);
+
 /**
  * @brief	Get the current status of the DiscFerret.
  * @param	dh		DiscFerret device handle.
@@ -362,6 +592,32 @@ DISCFERRET_ERROR discferret_ram_read(DISCFERRET_DEVICE_HANDLE *dh, unsigned char
  */
 long discferret_get_status(DISCFERRET_DEVICE_HANDLE *dh);
 
+/**
+ * @brief	Read the status wait statistics.
+ * @param	dh		DiscFerret device handle.
+ * @param	stats	Pointer to a DISCFERRET_WAIT_STATS block which will receive the statistics.
+ * @param	reset	If true, zero the statistics after reading them.
+ * @returns	DISCFERRET_E_OK on success, or one of the DISCFERRET_E_xxx constants in case of error.
+ *
+ * Polls per wait (<i>polls</i> / <i>waits</i>) shows how much USB traffic
+ * waiting costs; <i>overrun_us</i> shows how well the library is predicting
+ * when operations will finish.
+ */
+DISCFERRET_ERROR discferret_get_wait_stats(DISCFERRET_DEVICE_HANDLE *dh, DISCFERRET_WAIT_STATS *stats, const bool reset);
+
+/**
+ * @brief	Read the USB error recovery statistics.
+ * @param	dh		DiscFerret device handle.
+ * @param	stats	Pointer to a DISCFERRET_USB_STATS block which will receive the statistics.
+ * @param	reset	If true, zero the statistics after reading them.
+ * @returns	DISCFERRET_E_OK on success, or one of the DISCFERRET_E_xxx constants in case of error.
+ *
+ * A library call only returns DISCFERRET_E_USB_ERROR if it couldn't be
+ * retried, or the error couldn't be recovered from. If <i>failures</i> is
+ * still zero, the handle is in sync and can be used without reopening it.
+ */
+DISCFERRET_ERROR discferret_get_usb_stats(DISCFERRET_DEVICE_HANDLE *dh, DISCFERRET_USB_STATS *stats, const bool reset);
+
 /**
  * @brief	Measure the time taken for the last complete revolution of the disc
  * @param	dh		DiscFerret device handle.
@@ -373,6 +629,9 @@ long discferret_get_status(DISCFERRET_DEVICE_HANDLE *dh);
  * This function measures the amount of time which has elapsed between the
  * most recent index pulse, and the one immediately preceding it. This
  * value is proportional to the rotational speed of the disc.
+ *
+ * If no index pulse arrives within a second while waiting (no disc, or the
+ * motor is off), DISCFERRET_E_TIMEOUT is returned.
  */
 DISCFERRET_ERROR discferret_get_index_time(DISCFERRET_DEVICE_HANDLE *dh, const bool wait, double *timeval);
 
@@ -397,6 +656,111 @@ DISCFERRET_ERROR discferret_get_index_time(DISCFERRET_DEVICE_HANDLE *dh, const b
  */
 DISCFERRET_ERROR discferret_get_index_frequency(DISCFERRET_DEVICE_HANDLE *dh, const bool wait, double *freqval);
 
+/**
+ * @brief	Start the background index monitor.
+ * @param	dh			DiscFerret device handle.
+ * @param	interval_us	Polling interval, in microseconds, or 0 for the default (20ms).
+ * @param	window		Number of index periods to calculate statistics over, or 0 for the default (32).
+ * @returns	DISCFERRET_E_OK on success, or one of the DISCFERRET_E_xxx constants in case of error.
+ *
+ * Starts a background thread which polls the DiscFerret for new index period
+ * measurements once every <i>interval_us</i> microseconds, and keeps rolling
+ * statistics over the last <i>window</i> measurements. The statistics can be
+ * read at any time with discferret_index_monitor_get(), without generating
+ * any USB traffic.
+ *
+ * While the monitor is running, discferret_get_index_time() and
+ * discferret_get_index_frequency() return the monitor's measurements instead
+ * of polling the device themselves.
+ *
+ * The polling interval should be well under one revolution, otherwise
+ * measurements will be missed. It also limits the accuracy of the index pulse
+ * timestamps.
+ *
+ * DISCFERRET_E_NOT_SUPPORTED will be returned if the microcode does not have
+ * the "new index measurement available" flag (microcode 0020 or later).
+ */
+DISCFERRET_ERROR discferret_index_monitor_start(DISCFERRET_DEVICE_HANDLE *dh, const unsigned long interval_us, const unsigned int window);
+
+/**
+ * @brief	Stop the background index monitor.
+ * @param	dh			DiscFerret device handle.
+ * @returns	DISCFERRET_E_OK on success, or one of the DISCFERRET_E_xxx constants in case of error.
+ *
+ * DISCFERRET_E_BAD_PARAMETER will be returned if the monitor is not running.
+ * The monitor is stopped automatically by discferret_close().
+ */
+DISCFERRET_ERROR discferret_index_monitor_stop(DISCFERRET_DEVICE_HANDLE *dh);
+
+/**
+ * @brief	Read the index monitor's statistics.
+ * @param	dh			DiscFerret device handle.
+ * @param	stats		Pointer to a DISCFERRET_INDEX_STATS block which will receive the statistics.
+ * @returns	DISCFERRET_E_OK on success, or one of the DISCFERRET_E_xxx constants in case of error.
+ *
+ * Does not generate any USB traffic, and never blocks the monitor thread.
+ * DISCFERRET_E_BAD_PARAMETER will be returned if the monitor is not running.
+ */
+DISCFERRET_ERROR discferret_index_monitor_get(DISCFERRET_DEVICE_HANDLE *dh, DISCFERRET_INDEX_STATS *stats);
+
+/**
+ * @brief	Predict the host time of the next index pulse.
+ * @param	dh			DiscFerret device handle.
+ * @param	next		Pointer to a double which will receive the predicted host time
+ * 						(see discferret_host_time()) of the next index pulse.
+ * @returns	DISCFERRET_E_OK on success, or one of the DISCFERRET_E_xxx constants in case of error.
+ *
+ * The prediction is based on the most recent index pulse and the mean index
+ * period, and is accurate to roughly the monitor's polling interval.
+ * DISCFERRET_E_NO_MATCH will be returned if the monitor has not yet seen
+ * enough index pulses to make a prediction.
+ */
+DISCFERRET_ERROR discferret_index_monitor_predict(DISCFERRET_DEVICE_HANDLE *dh, double *next);
+
+/**
+ * @brief	Correlate the DiscFerret's clocks with the host clock.
+ * @param	dh			DiscFerret device handle.
+ * @param	samples		Number of USB round trips to time (at least 1).
+ * @param	info		Pointer to a DISCFERRET_CLOCK_INFO block which will receive the results.
+ * @returns	DISCFERRET_E_OK on success, or one of the DISCFERRET_E_xxx constants in case of error.
+ *
+ * Reads the DISCFERRET_R_CLOCK_TICKER and DISCFERRET_R_CLOCK_TICKER_PLL
+ * registers <i>samples</i> times each, timing every read against the host
+ * clock. This gives the command/response latency of the USB link, and
+ * confirms that both device clocks are running.
+ *
+ * The ticker registers are only eight bits wide (the 20MHz ticker wraps every
+ * 12.8us), which is far shorter than a USB round trip, so they can't carry
+ * time across to the host. Instead, if the index monitor is running, the
+ * device's index period measurements are used as the device timebase: the
+ * device-measured periods are fitted against the host's timestamps for the
+ * same index pulses to give the clock offset and drift. The estimate improves
+ * the longer the monitor runs. <i>index_pulses</i> is zero if no estimate is
+ * available yet.
+ */
+DISCFERRET_ERROR discferret_clock_correlate(DISCFERRET_DEVICE_HANDLE *dh, const unsigned int samples, DISCFERRET_CLOCK_INFO *info);
+
+/**
+ * @brief	Convert a device-side time to host time.
+ * @param	dh			DiscFerret device handle.
+ * @param	index		Index pulse number the time is relative to (see DISCFERRET_INDEX_STATS::index).
+ * @param	offset		Time after index pulse <i>index</i>, in seconds on the device clock.
+ * @param	host		Pointer to a double which will receive the host time (see discferret_host_time()).
+ * @returns	DISCFERRET_E_OK on success, or one of the DISCFERRET_E_xxx constants in case of error.
+ *
+ * Uses the index monitor's clock fit to timestamp device events in host
+ * time. For example, an acquisition started on the index pulse after the
+ * monitor reported pulse <i>n</i> starts at pulse <i>n</i>+1, and a sample
+ * <i>t</i> seconds into the capture occurred at
+ * discferret_clock_to_host(dh, n+1, t, &host).
+ *
+ * Pulse numbers in the future, or up to a few revolutions in the past, are
+ * extrapolated using the mean index period. DISCFERRET_E_BAD_PARAMETER will be
+ * returned if the index monitor is not running; DISCFERRET_E_NO_MATCH if it
+ * has not seen enough index pulses for a fit.
+ */
+DISCFERRET_ERROR discferret_clock_to_host(DISCFERRET_DEVICE_HANDLE *dh, const unsigned long index, const double offset, double *host);
+
 /**
  * @brief	Set the seek rate.
  * @param	dh			DiscFerret device handle.
@@ -428,6 +792,20 @@ DISCFERRET_ERROR discferret_seek_set_rate(DISCFERRET_DEVICE_HANDLE *dh, const un
  */
 DISCFERRET_ERROR discferret_seek_recalibrate(DISCFERRET_DEVICE_HANDLE *dh, const unsigned long maxsteps);
 
+/**
+ * @brief	Reposition the drive heads at track 0, with a deadline and cancellation.
+ * @param	dh			DiscFerret device handle.
+ * @param	maxsteps	Maximum number of steps to move the head.
+ * @param	deadline	Host time (see discferret_host_time()) by which the seek must finish, or 0 for none.
+ * @param	cancel		Cancellation token, or NULL.
+ * @returns	As discferret_seek_recalibrate(), or DISCFERRET_E_TIMEOUT / DISCFERRET_E_CANCELLED.
+ *
+ * The stepping controller can't be stopped part-way through a seek, so a
+ * seek which times out or is cancelled leaves the head position unknown.
+ */
+DISCFERRET_ERROR discferret_seek_recalibrate_deadline(DISCFERRET_DEVICE_HANDLE *dh, const unsigned long maxsteps,
+		const double deadline, const DISCFERRET_CANCEL *cancel);
+
 /**
  * @brief	Seek the drive heads relative to their current position.
  * @param	dh			DiscFerret device handle.
@@ -447,6 +825,18 @@ DISCFERRET_ERROR discferret_seek_recalibrate(DISCFERRET_DEVICE_HANDLE *dh, const
  */
 DISCFERRET_ERROR discferret_seek_relative(DISCFERRET_DEVICE_HANDLE *dh, const long numsteps);
 
+/**
+ * @brief	Seek the drive heads relative to their current position, with a deadline and cancellation.
+ * @param	dh			DiscFerret device handle.
+ * @param	numsteps	Number of steps (see discferret_seek_relative()).
+ * @param	deadline	Host time (see discferret_host_time()) by which the seek must finish, or 0 for none.
+ * @param	cancel		Cancellation token, or NULL.
+ * @returns	As discferret_seek_relative(), or DISCFERRET_E_TIMEOUT / DISCFERRET_E_CANCELLED
+ * 			(after which the head position is unknown).
+ */
+DISCFERRET_ERROR discferret_seek_relative_deadline(DISCFERRET_DEVICE_HANDLE *dh, const long numsteps,
+		const double deadline, const DISCFERRET_CANCEL *cancel);
+
 /**
  * @brief	Seek the drive heads to an absolute track.
  * @param	dh			DiscFerret device handle.
@@ -461,6 +851,82 @@ DISCFERRET_ERROR discferret_seek_relative(DISCFERRET_DEVICE_HANDLE *dh, const lo
  */
 DISCFERRET_ERROR discferret_seek_absolute(DISCFERRET_DEVICE_HANDLE *dh, const unsigned long track);
 
+/**
+ * @brief	Seek the drive heads to an absolute track, with a deadline and cancellation.
+ * @param	dh			DiscFerret device handle.
+ * @param	track		Target track number.
+ * @param	deadline	Host time (see discferret_host_time()) by which the seek must finish, or 0 for none.
+ * @param	cancel		Cancellation token, or NULL.
+ * @returns	As discferret_seek_absolute(), or DISCFERRET_E_TIMEOUT / DISCFERRET_E_CANCELLED
+ * 			(after which the head position is unknown).
+ */
+DISCFERRET_ERROR discferret_seek_absolute_deadline(DISCFERRET_DEVICE_HANDLE *dh, const unsigned long track,
+		const double deadline, const DISCFERRET_CANCEL *cancel);
+
+/**
+ * @brief	Track identification callback for discferret_seek_autotune().
+ * @param	dh		DiscFerret device handle.
+ * @param	ctx		Context pointer passed to discferret_seek_autotune().
+ * @param	track	Pointer to a long, which will receive the track number
+ * 					recorded on the disc under the head.
+ * @returns	DISCFERRET_E_OK if a track ID was read cleanly,
+ * 			DISCFERRET_E_NOT_SUPPORTED if the disc has no readable track IDs,
+ * 			or any other DISCFERRET_E_xxx constant if the read failed.
+ *
+ * Called with the heads stationary over a track. The callback is expected to
+ * capture and decode one sector header (or equivalent) and return the
+ * cylinder number recorded in it.
+ */
+typedef DISCFERRET_ERROR (*DISCFERRET_TRACK_ID_FN)(DISCFERRET_DEVICE_HANDLE *dh, void *ctx, long *track);
+
+/**
+ * @brief	Measure a drive's fastest reliable step rate and head settle time.
+ * @param	dh			DiscFerret device handle.
+ * @param	tracks		Number of tracks to seek across during each test (at least 2).
+ * @param	readid		Track identification callback, or NULL if none is available.
+ * @param	ctx			Context pointer passed to <i>readid</i>.
+ * @param	profile		Pointer to a DISCFERRET_DRIVE_PROFILE which will receive
+ * 						the results, or NULL.
+ * @returns	DISCFERRET_E_OK on success, or one of the DISCFERRET_E_xxx constants in case of error.
+ *
+ * Characterises the drive by seeking <i>tracks</i> steps out and back at
+ * progressively faster step rates. The head position is checked at the end
+ * of each pass: all but one step are taken back towards track zero at the
+ * rate under test, and the last step at a conservative rate must then set
+ * the Track 0 sensor. A lost step in either direction makes this check fail.
+ * If <i>readid</i> is not NULL, the track ID recorded on the disc is also
+ * checked at the outer end of each pass.
+ *
+ * If <i>readid</i> is available, the settle time is then measured as the
+ * shortest post-seek delay after which the track ID reads cleanly. Otherwise
+ * a conservative default settle time is used.
+ *
+ * On success the profile is applied to the device handle (see
+ * discferret_set_drive_profile()) and the heads are left at track zero. On
+ * failure the previous profile (if any) is kept, but the head position may
+ * be unknown.
+ * DISCFERRET_E_RECAL_FAILED will be returned if the drive does not work
+ * reliably even at the conservative step rate.
+ *
+ * The handle lock is taken for each pass rather than for the whole run, so
+ * the index monitor and status watcher keep working, but nothing else
+ * should move the heads until this returns.
+ */
+DISCFERRET_ERROR discferret_seek_autotune(DISCFERRET_DEVICE_HANDLE *dh, const unsigned long tracks, DISCFERRET_TRACK_ID_FN readid, void *ctx, DISCFERRET_DRIVE_PROFILE *profile);
+
+/**
+ * @brief	Apply a drive timing profile to a device handle.
+ * @param	dh			DiscFerret device handle.
+ * @param	profile		Drive profile to apply, or NULL to remove the current profile.
+ * @returns	DISCFERRET_E_OK on success, or one of the DISCFERRET_E_xxx constants in case of error.
+ *
+ * Programs the profile's step rate into the DiscFerret, and makes every
+ * subsequent discferret_seek_* call wait for the profile's settle time
+ * after the heads stop moving. The step rate is re-applied automatically
+ * when new microcode is loaded.
+ */
+DISCFERRET_ERROR discferret_set_drive_profile(DISCFERRET_DEVICE_HANDLE *dh, const DISCFERRET_DRIVE_PROFILE *profile);
+
 #ifdef __cplusplus
 }
 #endif
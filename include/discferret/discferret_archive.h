@@ -0,0 +1,230 @@
+/****************************************************************************
+ *
+ *                - DiscFerret Interface Library for C / C++ -
+ *
+ * Copyright (C) 2010 - 2011 P. A. Pemberton t/a. Red Fox Engineering.
+ * All Rights Reserved.
+ *
+ * Copyright 2010-2011 Philip Pemberton
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ ****************************************************************************/
+
+
+
+/**
+ * @file	discferret_archive.h
+ * @brief	Random-access flux archive format.
+ *
+ * An archive holds flux for any number of discs, one block per
+ * (disc, cylinder, head, revolution). Blocks are 64-byte aligned and may be
+ * compressed. The index is written at the end of the file when the archive
+ * is finished, with a hash table for O(1) lookup of any block and the
+ * entries sorted by key for iteration.
+ *
+ * Readers map the archive read-only: opening it reads only the header, and
+ * fetching a revolution touches only its index entry and its data block.
+ *
+ * File layout (all integers little-endian):
+ *
+ *   - Header (64 bytes): magic "DFARCHV1", version, index offset and count,
+ *     hash table offset and size.
+ *   - Flux blocks, each starting on a 64-byte boundary.
+ *   - Index: one 48-byte entry per block, sorted by (disc, cyl, head, rev).
+ *   - Hash table: power-of-two number of 32-bit slots, each holding an
+ *     entry number plus one (0 = empty), probed linearly.
+ */
+
+#ifndef _DISCFERRET_ARCHIVE_H
+#define _DISCFERRET_ARCHIVE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "discferret.h"
+#include "discferret_flux.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief	Flux block compression methods.
+ */
+typedef enum {
+	DISCFERRET_ARCHIVE_RAW		= 0,	///< Uncompressed 32-bit intervals
+	DISCFERRET_ARCHIVE_VARINT	= 1,	///< Intervals as LEB128 variable-length integers
+	DISCFERRET_ARCHIVE_FLUX		= 2		///< Flux codec (see discferret_codec.h)
+} DISCFERRET_ARCHIVE_COMPRESSION;
+
+/**
+ * @brief	Details of one revolution in an archive.
+ */
+typedef struct {
+	uint32_t		disc;			///< Disc number
+	uint16_t		cyl;			///< Cylinder
+	uint8_t			head;			///< Head
+	uint8_t			rev;			///< Revolution
+	uint32_t		count;			///< Number of flux intervals
+	uint32_t		clock_hz;		///< Tick rate of the intervals, in Hz
+	uint64_t		ticks;			///< Total length of the revolution, in ticks
+	unsigned int	compression;	///< DISCFERRET_ARCHIVE_xxx compression method
+	uint64_t		stored_len;		///< Size of the stored block in bytes
+	const void		*data;			///< Stored block (points into the mapped archive)
+} DISCFERRET_ARCHIVE_ENTRY;
+
+/**
+ * @brief	Opaque archive writer.
+ */
+typedef struct discferret_archive_writer DISCFERRET_ARCHIVE_WRITER;
+
+/**
+ * @brief	Opaque archive reader.
+ */
+typedef struct discferret_archive DISCFERRET_ARCHIVE;
+
+/**
+ * @brief	Iterator over the entries of an archive.
+ *
+ * Set up with discferret_archive_iter_init(); the fields are private.
+ */
+typedef struct {
+	size_t		next;		///< Next entry number
+	int64_t		disc;		///< Disc to match, or -1 for any
+	int32_t		cyl;		///< Cylinder to match, or -1 for any
+	int32_t		head;		///< Head to match, or -1 for any
+} DISCFERRET_ARCHIVE_ITER;
+
+/**
+ * @brief	Create an archive.
+ * @param	path	File name (an existing file is overwritten).
+ * @param	writer	Pointer which will receive the archive writer.
+ * @returns	DISCFERRET_E_OK on success, one of the DISCFERRET_E_xxx constants on error.
+ */
+DISCFERRET_ERROR discferret_archive_create(const char *path, DISCFERRET_ARCHIVE_WRITER **writer);
+
+/**
+ * @brief	Add one revolution to an archive.
+ * @param	writer		Archive writer.
+ * @param	disc		Disc number.
+ * @param	cyl			Cylinder.
+ * @param	head		Head.
+ * @param	rev			Revolution number.
+ * @param	intervals	Flux intervals.
+ * @param	count		Number of intervals.
+ * @param	clock_hz	Tick rate of the intervals, in Hz.
+ * @param	compression	DISCFERRET_ARCHIVE_xxx compression method.
+ * @returns	DISCFERRET_E_OK on success, one of the DISCFERRET_E_xxx constants on error.
+ *
+ * Adding the same (disc, cyl, head, rev) again replaces the earlier block.
+ */
+DISCFERRET_ERROR discferret_archive_add(DISCFERRET_ARCHIVE_WRITER *writer, const uint32_t disc, const unsigned int cyl,
+		const unsigned int head, const unsigned int rev, const uint32_t *intervals, const size_t count,
+		const uint32_t clock_hz, const unsigned int compression);
+
+/**
+ * @brief	Add a captured track to an archive, split into revolutions at the index pulses.
+ * @param	writer		Archive writer.
+ * @param	disc		Disc number.
+ * @param	cyl			Cylinder.
+ * @param	head		Head.
+ * @param	flux		Flux transitions for the track.
+ * @param	compression	DISCFERRET_ARCHIVE_xxx compression method.
+ * @returns	DISCFERRET_E_OK on success, one of the DISCFERRET_E_xxx constants on error.
+ *
+ * Each complete revolution (index pulse to index pulse) is stored as
+ * revolution 0, 1, ... If the capture has fewer than two index pulses, the
+ * whole capture is stored as revolution 0.
+ */
+DISCFERRET_ERROR discferret_archive_add_track(DISCFERRET_ARCHIVE_WRITER *writer, const uint32_t disc, const unsigned int cyl,
+		const unsigned int head, const DISCFERRET_FLUX *flux, const unsigned int compression);
+
+/**
+ * @brief	Write the index and close an archive.
+ * @param	writer	Archive writer (freed, even on error).
+ * @returns	DISCFERRET_E_OK on success, one of the DISCFERRET_E_xxx constants on error.
+ */
+DISCFERRET_ERROR discferret_archive_finish(DISCFERRET_ARCHIVE_WRITER *writer);
+
+/**
+ * @brief	Open an archive for reading.
+ * @param	path	File name.
+ * @param	archive	Pointer which will receive the archive reader.
+ * @returns	DISCFERRET_E_OK on success, one of the DISCFERRET_E_xxx constants on error.
+ */
+DISCFERRET_ERROR discferret_archive_open(const char *path, DISCFERRET_ARCHIVE **archive);
+
+/**
+ * @brief	Close an archive reader.
+ * @param	archive	Archive reader.
+ * @returns	DISCFERRET_E_OK on success, one of the DISCFERRET_E_xxx constants on error.
+ */
+DISCFERRET_ERROR discferret_archive_close(DISCFERRET_ARCHIVE *archive);
+
+/**
+ * @brief	Get the number of revolutions stored in an archive.
+ */
+size_t discferret_archive_count(DISCFERRET_ARCHIVE *archive);
+
+/**
+ * @brief	Look up one revolution.
+ * @param	archive	Archive reader.
+ * @param	disc	Disc number.
+ * @param	cyl		Cylinder.
+ * @param	head	Head.
+ * @param	rev		Revolution number.
+ * @param	entry	Pointer to a DISCFERRET_ARCHIVE_ENTRY which will receive the details.
+ * @returns	DISCFERRET_E_OK on success, DISCFERRET_E_NO_MATCH if the archive
+ * 			doesn't hold that revolution, or one of the DISCFERRET_E_xxx
+ * 			constants on error.
+ */
+DISCFERRET_ERROR discferret_archive_find(DISCFERRET_ARCHIVE *archive, const uint32_t disc, const unsigned int cyl,
+		const unsigned int head, const unsigned int rev, DISCFERRET_ARCHIVE_ENTRY *entry);
+
+/**
+ * @brief	Start iterating over an archive's entries, in (disc, cyl, head, rev) order.
+ * @param	archive	Archive reader.
+ * @param	iter	Iterator to set up.
+ * @param	disc	Disc to visit, or -1 for all discs.
+ * @param	cyl		Cylinder to visit, or -1 for all cylinders.
+ * @param	head	Head to visit, or -1 for both heads.
+ * @returns	DISCFERRET_E_OK on success, one of the DISCFERRET_E_xxx constants on error.
+ */
+DISCFERRET_ERROR discferret_archive_iter_init(DISCFERRET_ARCHIVE *archive, DISCFERRET_ARCHIVE_ITER *iter,
+		const int64_t disc, const int32_t cyl, const int32_t head);
+
+/**
+ * @brief	Get the next entry from an iterator.
+ * @param	archive	Archive reader.
+ * @param	iter	Iterator.
+ * @param	entry	Pointer to a DISCFERRET_ARCHIVE_ENTRY which will receive the details.
+ * @returns	DISCFERRET_E_OK on success, DISCFERRET_E_NO_MATCH when there are no
+ * 			more entries, or one of the DISCFERRET_E_xxx constants on error.
+ */
+DISCFERRET_ERROR discferret_archive_iter_next(DISCFERRET_ARCHIVE *archive, DISCFERRET_ARCHIVE_ITER *iter, DISCFERRET_ARCHIVE_ENTRY *entry);
+
+/**
+ * @brief	Decompress a revolution's flux intervals.
+ * @param	entry		Entry from discferret_archive_find() or discferret_archive_iter_next().
+ * @param	intervals	Buffer which will receive the intervals.
+ * @param	max			Size of <i>intervals</i>, in elements (at least <i>entry->count</i>).
+ * @returns	DISCFERRET_E_OK on success, one of the DISCFERRET_E_xxx constants on error.
+ */
+DISCFERRET_ERROR discferret_archive_read(const DISCFERRET_ARCHIVE_ENTRY *entry, uint32_t *intervals, const size_t max);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _DISCFERRET_ARCHIVE_H
+
+// vim: ts=4 noet sw=4
@@ -0,0 +1,165 @@
+/****************************************************************************
+ *
+ *                - DiscFerret Interface Library for C / C++ -
+ *
+ * Copyright (C) 2010 - 2011 P. A. Pemberton t/a. Red Fox Engineering.
+ * All Rights Reserved.
+ *
+ * Copyright 2010-2011 Philip Pemberton
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ ****************************************************************************/
+
+
+
+
+/**
+ * @file	discferret_cache.h
+ * @brief	Sector-level reads through a decoded track cache.
+ *
+ * Gives block-device style access to a disc: discferret_cache_read() reads
+ * one sector by cylinder, head and sector number. Whole tracks are read and
+ * decoded (with discferret_retry_track()) and kept in a least-recently-used
+ * cache keyed by cylinder and head, so only the first sector read from a
+ * track costs a capture.
+ *
+ * A worker thread does all the device I/O. When a run of sequential reads
+ * reaches the last sector of a track, or carries on into the first sector
+ * of the next, the worker reads the following track ahead while the caller
+ * is still working through the current one, so sequential reads run at
+ * close to whole-track speed. A read that misses the cache takes the place
+ * of a read-ahead which is queued but hasn't started.
+ *
+ * While a cache is open, its worker thread owns the device: don't seek,
+ * capture or change the drive select lines from anywhere else.
+ *
+ * Tracks can also come from a caller-supplied reader instead of the
+ * device (e.g. a drive simulated from a sector image), which is then
+ * called on the worker thread in place of the seek and capture.
+ */
+
+#ifndef _DISCFERRET_CACHE_H
+#define _DISCFERRET_CACHE_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include "discferret.h"
+#include "discferret_retry.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief	Track reader callback, called on the cache's worker thread.
+ * @param	ctx		Caller's context pointer.
+ * @param	cyl		Cylinder.
+ * @param	head	Head.
+ * @param	config	Retry settings from the cache configuration (sector numbering).
+ * @param	result	DISCFERRET_RETRY_RESULT which will receive the sectors, as
+ * 					discferret_retry_track() would fill it in. Its buffers are
+ * 					reused from track to track and released with
+ * 					discferret_retry_free(), so grow them with realloc().
+ * @returns	DISCFERRET_E_OK on success, or one of the DISCFERRET_E_xxx constants on error.
+ */
+typedef DISCFERRET_ERROR (*DISCFERRET_CACHE_READ_FN)(void *ctx, unsigned int cyl, unsigned int head,
+		const DISCFERRET_RETRY_CONFIG *config, DISCFERRET_RETRY_RESULT *result);
+
+/**
+ * @brief	Sector cache settings.
+ */
+typedef struct {
+	DISCFERRET_RETRY_CONFIG		read;			///< How each track is read, decoded and retried
+	unsigned int				cylinders;		///< Number of cylinders on the disc
+	unsigned int				heads;			///< Number of heads (1 or 2)
+	unsigned int				drive_control;	///< DRIVE_CONTROL value (drive select, motor) for head 0; DISCFERRET_DRIVE_CONTROL_SIDESEL is added for head 1
+	unsigned int				tracks;			///< Number of decoded tracks to keep (0 = 8)
+	bool						read_ahead;		///< Read the next track ahead when reads are sequential
+	DISCFERRET_CACHE_READ_FN	reader;			///< Track reader to use instead of the device, or NULL
+	void						*ctx;			///< Context pointer passed to <i>reader</i>
+} DISCFERRET_CACHE_CONFIG;
+
+/**
+ * @brief	Sector cache statistics.
+ */
+typedef struct {
+	unsigned long	reads;			///< Sector reads
+	unsigned long	hits;			///< Sector reads served from a cached track
+	unsigned long	misses;			///< Sector reads which had to wait for their track
+	unsigned long	tracks_read;	///< Tracks read from the disc
+	unsigned long	ahead;			///< Tracks read ahead
+	unsigned long	ahead_used;		///< Tracks read ahead which were then read from
+	double			wait;			///< Seconds spent waiting for tracks
+} DISCFERRET_CACHE_STATS;
+
+/**
+ * @brief	Opaque sector cache.
+ */
+typedef struct discferret_cache DISCFERRET_CACHE;
+
+/**
+ * @brief	Open a sector cache.
+ * @param	dh		DiscFerret device handle. The head position must be known (see discferret_seek_recalibrate()).
+ * 					May be NULL if <i>config->reader</i> is set.
+ * @param	config	Cache settings.
+ * @param	cache	Pointer which will receive the cache.
+ * @returns	DISCFERRET_E_OK on success, one of the DISCFERRET_E_xxx constants on error.
+ */
+DISCFERRET_ERROR discferret_cache_open(DISCFERRET_DEVICE_HANDLE *dh, const DISCFERRET_CACHE_CONFIG *config, DISCFERRET_CACHE **cache);
+
+/**
+ * @brief	Read a sector.
+ * @param	cache	Sector cache.
+ * @param	cyl		Cylinder.
+ * @param	head	Head.
+ * @param	sector	Sector number.
+ * @param	buf		Buffer which will receive the sector data.
+ * @param	len		Size of <i>buf</i>; longer sectors are truncated.
+ * @param	size	Receives the sector size in bytes, or NULL.
+ * @returns	DISCFERRET_E_OK on success, DISCFERRET_E_SECTOR_NOT_FOUND if the sector's
+ * 			ID was never read, DISCFERRET_E_DATA_ERROR if its data was only
+ * 			read with a bad checksum (the bad copy is returned), or one of the
+ * 			other DISCFERRET_E_xxx constants on error.
+ *
+ * Safe to call from several threads at once. A track which failed to read
+ * (e.g. with DISCFERRET_E_TIMEOUT) is not cached, so the next read tries again.
+ */
+DISCFERRET_ERROR discferret_cache_read(DISCFERRET_CACHE *cache, const unsigned int cyl, const unsigned int head,
+		const unsigned int sector, unsigned char *buf, const size_t len, size_t *size);
+
+/**
+ * @brief	Drop every cached track (e.g. after the disc has been changed).
+ * @param	cache	Sector cache.
+ */
+void discferret_cache_flush(DISCFERRET_CACHE *cache);
+
+/**
+ * @brief	Get a sector cache's statistics.
+ * @param	cache	Sector cache.
+ * @param	stats	Receives the statistics.
+ */
+void discferret_cache_stats(DISCFERRET_CACHE *cache, DISCFERRET_CACHE_STATS *stats);
+
+/**
+ * @brief	Close a sector cache, waiting for any track read in progress.
+ * @param	cache	Sector cache (freed).
+ */
+void discferret_cache_close(DISCFERRET_CACHE *cache);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _DISCFERRET_CACHE_H
+
+// vim: ts=4 noet sw=4
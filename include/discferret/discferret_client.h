@@ -0,0 +1,168 @@
+/****************************************************************************
+ *
+ *                - DiscFerret Interface Library for C / C++ -
+ *
+ * Copyright (C) 2010 - 2011 P. A. Pemberton t/a. Red Fox Engineering.
+ * All Rights Reserved.
+ *
+ * Copyright 2010-2011 Philip Pemberton
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ ****************************************************************************/
+
+
+/**
+ * @file	discferret_client.h
+ * @brief	Client library for the DiscFerret daemon (discferretd).
+ *
+ * discferretd keeps DiscFerret units open and configured, and serialises
+ * access to them. The functions in this file mirror the core libdiscferret
+ * API, but send each call to the daemon over a Unix socket instead of
+ * talking to the hardware directly. A client pays only for a socket connect
+ * instead of library initialisation, enumeration, device open and microcode
+ * upload.
+ *
+ * Each call is executed atomically on the unit. To run a sequence of calls
+ * without other clients' jobs being interleaved (e.g. set the RAM address,
+ * start an acquisition, read back the RAM), bracket them with
+ * discferret_client_lock() and discferret_client_unlock().
+ *
+ * Not available on Windows.
+ */
+
+#ifndef _DISCFERRET_CLIENT_H
+#define _DISCFERRET_CLIENT_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include "discferret.h"
+#include "discferret_flux.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// Default path of the daemon's Unix socket
+#define DISCFERRET_DAEMON_SOCKET	"/tmp/discferretd.sock"
+
+/// Connection to a DiscFerret daemon (opaque)
+typedef struct discferret_client DISCFERRET_CLIENT;
+
+/// Handle to a DiscFerret unit owned by a daemon (opaque)
+typedef struct discferret_client_handle DISCFERRET_CLIENT_HANDLE;
+
+/**
+ * @brief	Connect to a DiscFerret daemon.
+ * @param	path	Path to the daemon's socket, or NULL for DISCFERRET_DAEMON_SOCKET.
+ * @param	conn	Pointer which will receive the connection.
+ * @returns	DISCFERRET_E_OK on success, DISCFERRET_E_CONNECTION_ERROR if the
+ * 			daemon could not be reached, or one of the other DISCFERRET_E_xxx
+ * 			constants on error.
+ *
+ * discferret_init() does not need to be called before using the client
+ * library. A connection may be shared between threads; calls are serialised.
+ */
+DISCFERRET_ERROR discferret_client_connect(const char *path, DISCFERRET_CLIENT **conn);
+
+/**
+ * @brief	Disconnect from a DiscFerret daemon.
+ * @param	conn	Connection.
+ * @returns	DISCFERRET_E_OK on success, one of the DISCFERRET_E_xxx constants on error.
+ *
+ * Any unit handles obtained through this connection must be closed first.
+ * The daemon releases any locks the connection still holds.
+ */
+DISCFERRET_ERROR discferret_client_disconnect(DISCFERRET_CLIENT *conn);
+
+/**
+ * @brief	List the DiscFerret units owned by the daemon.
+ * @see		discferret_find_devices()
+ */
+int discferret_client_find_devices(DISCFERRET_CLIENT *conn, DISCFERRET_DEVICE **devlist);
+
+/**
+ * @brief	Open a unit owned by the daemon.
+ * @param	conn		Connection.
+ * @param	serialnum	Serial number, or NULL (or an empty string) for the first unit.
+ * @param	ch			Pointer which will receive the unit handle.
+ * @see		discferret_open()
+ */
+DISCFERRET_ERROR discferret_client_open(DISCFERRET_CLIENT *conn, const char *serialnum, DISCFERRET_CLIENT_HANDLE **ch);
+
+/**
+ * @brief	Close a unit handle. The unit stays open in the daemon.
+ * @see		discferret_close()
+ */
+DISCFERRET_ERROR discferret_client_close(DISCFERRET_CLIENT_HANDLE *ch);
+
+/**
+ * @brief	Gain exclusive access to a unit. Other clients' calls wait until discferret_client_unlock().
+ * @see		discferret_lock()
+ */
+DISCFERRET_ERROR discferret_client_lock(DISCFERRET_CLIENT_HANDLE *ch);
+
+/**
+ * @brief	Release exclusive access to a unit.
+ * @see		discferret_unlock()
+ */
+DISCFERRET_ERROR discferret_client_unlock(DISCFERRET_CLIENT_HANDLE *ch);
+
+/// @see	discferret_get_info()
+DISCFERRET_ERROR discferret_client_get_info(DISCFERRET_CLIENT_HANDLE *ch, DISCFERRET_DEVICE_INFO *info);
+/// @see	discferret_fpga_load_default()
+DISCFERRET_ERROR discferret_client_fpga_load_default(DISCFERRET_CLIENT_HANDLE *ch);
+/// @see	discferret_reg_peek()
+int discferret_client_reg_peek(DISCFERRET_CLIENT_HANDLE *ch, const unsigned int addr);
+/// @see	discferret_reg_poke()
+DISCFERRET_ERROR discferret_client_reg_poke(DISCFERRET_CLIENT_HANDLE *ch, const unsigned int addr, const unsigned char data);
+/// @see	discferret_ram_addr_get()
+long discferret_client_ram_addr_get(DISCFERRET_CLIENT_HANDLE *ch);
+/// @see	discferret_ram_addr_set()
+DISCFERRET_ERROR discferret_client_ram_addr_set(DISCFERRET_CLIENT_HANDLE *ch, const unsigned long addr);
+/// @see	discferret_ram_write()
+DISCFERRET_ERROR discferret_client_ram_write(DISCFERRET_CLIENT_HANDLE *ch, const unsigned char *block, const size_t len);
+/// @see	discferret_ram_read()
+DISCFERRET_ERROR discferret_client_ram_read(DISCFERRET_CLIENT_HANDLE *ch, unsigned char *block, const size_t len);
+/// @see	discferret_get_status()
+long discferret_client_get_status(DISCFERRET_CLIENT_HANDLE *ch);
+/// @see	discferret_get_index_time()
+DISCFERRET_ERROR discferret_client_get_index_time(DISCFERRET_CLIENT_HANDLE *ch, const bool wait, double *timeval);
+/// @see	discferret_get_index_frequency()
+DISCFERRET_ERROR discferret_client_get_index_frequency(DISCFERRET_CLIENT_HANDLE *ch, const bool wait, double *freqval);
+/// @see	discferret_seek_set_rate()
+DISCFERRET_ERROR discferret_client_seek_set_rate(DISCFERRET_CLIENT_HANDLE *ch, const unsigned long steprate_us);
+/// @see	discferret_seek_recalibrate()
+DISCFERRET_ERROR discferret_client_seek_recalibrate(DISCFERRET_CLIENT_HANDLE *ch, const unsigned long maxsteps);
+/// @see	discferret_seek_relative()
+DISCFERRET_ERROR discferret_client_seek_relative(DISCFERRET_CLIENT_HANDLE *ch, const long numsteps);
+/// @see	discferret_seek_absolute()
+DISCFERRET_ERROR discferret_client_seek_absolute(DISCFERRET_CLIENT_HANDLE *ch, const unsigned long track);
+
+/**
+ * @brief	Capture flux from the disc, in one request.
+ * @see		discferret_flux_capture()
+ *
+ * The daemon runs the whole capture (acquisition, readback and conversion)
+ * with the unit locked, and sends back the intervals and index positions.
+ * <i>flux</i> is grown as needed, as with discferret_flux_capture(); the
+ * drive must already be selected and on the right track.
+ */
+DISCFERRET_ERROR discferret_client_flux_capture(DISCFERRET_CLIENT_HANDLE *ch, const DISCFERRET_CAPTURE_CONFIG *config, DISCFERRET_FLUX *flux);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _DISCFERRET_CLIENT_H
+
+// vim: ts=4 noet sw=4
@@ -0,0 +1,105 @@
+/****************************************************************************
+ *
+ *                - DiscFerret Interface Library for C / C++ -
+ *
+ * Copyright (C) 2010 - 2011 P. A. Pemberton t/a. Red Fox Engineering.
+ * All Rights Reserved.
+ *
+ * Copyright 2010-2011 Philip Pemberton
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ ****************************************************************************/
+
+
+
+/**
+ * @file	discferret_codec.h
+ * @brief	Lossless compression codec for flux intervals.
+ *
+ * Flux intervals cluster tightly around small multiples of the bit cell, so
+ * the codec splits each interval into a bucket (its high bits) and a
+ * residual (its low bits). The intervals are coded in blocks of up to 4096:
+ *
+ *   - Frame of reference: the block minimum is subtracted from every interval.
+ *   - Bucket coding: the number of residual bits <i>k</i> is chosen per block
+ *     to minimise the coded size; each interval becomes bucket (value >> k)
+ *     plus a k-bit residual.
+ *   - Entropy stage: buckets are coded with a per-block canonical Huffman
+ *     code (at most 12 bits, decoded with a single table lookup). Intervals
+ *     too far from the minimum (e.g. long gaps) are escaped and stored as
+ *     varints.
+ *
+ * The bucket/residual split and the final reconstruction are separate,
+ * data-parallel passes, with SSE2 versions on x86; the Huffman coder in
+ * between is scalar and table-driven.
+ */
+
+#ifndef _DISCFERRET_CODEC_H
+#define _DISCFERRET_CODEC_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "discferret.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief	Get the largest possible compressed size.
+ * @param	count	Number of intervals.
+ * @returns	Buffer size in bytes which is always enough for discferret_codec_encode().
+ */
+size_t discferret_codec_bound(const size_t count);
+
+/**
+ * @brief	Compress flux intervals.
+ * @param	in		Flux intervals.
+ * @param	count	Number of intervals.
+ * @param	out		Buffer which will receive the compressed data.
+ * @param	outmax	Size of <i>out</i> (discferret_codec_bound() bytes is always enough).
+ * @param	outlen	Pointer which will receive the compressed size.
+ * @returns	DISCFERRET_E_OK on success, DISCFERRET_E_BAD_PARAMETER if
+ * 			<i>out</i> is too small, or one of the DISCFERRET_E_xxx constants on error.
+ */
+DISCFERRET_ERROR discferret_codec_encode(const uint32_t *in, const size_t count, unsigned char *out, const size_t outmax, size_t *outlen);
+
+/**
+ * @brief	Get the number of intervals in compressed data.
+ * @param	in		Compressed data.
+ * @param	inlen	Size of the compressed data.
+ * @param	count	Pointer which will receive the number of intervals.
+ * @returns	DISCFERRET_E_OK on success, one of the DISCFERRET_E_xxx constants on error.
+ */
+DISCFERRET_ERROR discferret_codec_count(const unsigned char *in, const size_t inlen, size_t *count);
+
+/**
+ * @brief	Decompress flux intervals.
+ * @param	in		Compressed data.
+ * @param	inlen	Size of the compressed data.
+ * @param	out		Buffer which will receive the intervals.
+ * @param	outmax	Size of <i>out</i>, in intervals.
+ * @param	count	Pointer which will receive the number of intervals.
+ * @returns	DISCFERRET_E_OK on success, DISCFERRET_E_BAD_PARAMETER if the data
+ * 			is corrupt or <i>out</i> is too small, or one of the
+ * 			DISCFERRET_E_xxx constants on error.
+ */
+DISCFERRET_ERROR discferret_codec_decode(const unsigned char *in, const size_t inlen, uint32_t *out, const size_t outmax, size_t *count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _DISCFERRET_CODEC_H
+
+// vim: ts=4 noet sw=4
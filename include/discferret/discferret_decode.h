@@ -0,0 +1,189 @@
+/****************************************************************************
+ *
+ *                - DiscFerret Interface Library for C / C++ -
+ *
+ * Copyright (C) 2010 - 2011 P. A. Pemberton t/a. Red Fox Engineering.
+ * All Rights Reserved.
+ *
+ * Copyright 2010-2011 Philip Pemberton
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ ****************************************************************************/
+
+
+
+/**
+ * @file	discferret_decode.h
+ * @brief	Sector decoders for captured flux.
+ *
+ * Decoding runs in two passes. First a software PLL turns the flux intervals
+ * into a bitcell stream, tracking the drive's speed, and notes where the
+ * encoding's sync marks are as it goes. Then the fields after each sync
+ * mark are decoded and their CRCs checked.
+ *
+ * IBM MFM and FM, Amiga trackdisk, Apple II 6-and-2 and Commodore 1541 GCR formats are
+ * supported. The GCR decoders are table driven: each 5- or 8-bit code is
+ * looked up, rather than matched bit by bit.
+ *
+ * Only sectors with a good ID field are reported. If a sector appears more
+ * than once (e.g. in a multi-revolution capture), the first copy with a
+ * good data CRC is kept.
+ */
+
+#ifndef _DISCFERRET_DECODE_H
+#define _DISCFERRET_DECODE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "discferret.h"
+#include "discferret_flux.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief	A decoded sector.
+ */
+typedef struct {
+	uint8_t			cyl;			///< Cylinder number from the ID field
+	uint8_t			head;			///< Head number from the ID field
+	uint8_t			sector;			///< Sector number from the ID field
+	uint8_t			size_code;		///< Size code from the ID field (size is 128 << size_code)
+	bool			data_ok;		///< True if the data field was found and its CRC is good
+	bool			deleted;		///< True if the data field has a Deleted Data mark
+	size_t			size;			///< Payload size in bytes (0 if no data field was found)
+	unsigned char	*data;			///< Payload (owned by the track), or NULL if no data field was found
+	size_t			position;		///< Bitcell offset of the ID field from the start of the capture
+} DISCFERRET_SECTOR;
+
+/**
+ * @brief	A decoded track.
+ *
+ * Zero the structure before its first use. Buffers are kept between calls,
+ * so decoding track after track into the same structure does no allocation
+ * once it has reached full size. Release it with discferret_track_free().
+ */
+typedef struct {
+	DISCFERRET_SECTOR	*sectors;		///< Sectors, in the order their ID fields were found
+	size_t				count;			///< Number of sectors
+	size_t				capacity;		///< Allocated size of <i>sectors</i>
+	unsigned long		bad_ids;		///< ID fields with bad CRCs
+	unsigned long		bad_data;		///< Data fields with bad CRCs
+	size_t				cells;			///< Number of bitcells in the stream
+	unsigned char		*bits;			///< Bitcell stream, most significant first (scratch)
+	size_t				bits_capacity;	///< Allocated size of <i>bits</i>
+	size_t				*marks;			///< Bitcell offsets just past each sync mark (scratch)
+	size_t				marks_count;	///< Number of sync marks
+	size_t				marks_capacity;	///< Allocated size of <i>marks</i>
+	unsigned char		*data;			///< Sector payloads
+	size_t				data_capacity;	///< Allocated size of <i>data</i>
+} DISCFERRET_TRACK;
+
+/**
+ * @brief	Track decoder, e.g. discferret_decode_mfm().
+ * @param	flux	Flux intervals.
+ * @param	bitrate	Nominal data rate in bits per second.
+ * @param	track	DISCFERRET_TRACK which will receive the sectors.
+ */
+typedef DISCFERRET_ERROR (*DISCFERRET_DECODER_FN)(const DISCFERRET_FLUX *flux, const unsigned long bitrate, DISCFERRET_TRACK *track);
+
+/**
+ * @brief	Calculate a CRC-16/CCITT (polynomial 0x1021), as used by IBM format discs.
+ * @param	crc		Initial value (0xFFFF for a new field), or the result of a previous call.
+ * @param	buf		Data.
+ * @param	len		Number of bytes.
+ * @returns	Updated CRC.
+ */
+uint16_t discferret_crc16(uint16_t crc, const unsigned char *buf, const size_t len);
+
+/**
+ * @brief	Decode an IBM format MFM track.
+ * @param	flux	Flux intervals.
+ * @param	bitrate	Nominal data rate in bits per second (e.g. 250000 for DD).
+ * @param	track	DISCFERRET_TRACK which will receive the sectors (previous contents are replaced).
+ * @returns	DISCFERRET_E_OK on success, one of the DISCFERRET_E_xxx constants on error.
+ *
+ * Looks for A1 A1 A1 sync marks (bitcells 0x4489, with a missing clock),
+ * followed by an ID (FE), data (FB) or deleted data (F8) address mark.
+ */
+DISCFERRET_ERROR discferret_decode_mfm(const DISCFERRET_FLUX *flux, const unsigned long bitrate, DISCFERRET_TRACK *track);
+
+/**
+ * @brief	Decode an IBM format FM (single density) track.
+ * @param	flux	Flux intervals.
+ * @param	bitrate	Nominal data rate in bits per second (e.g. 125000 for SD).
+ * @param	track	DISCFERRET_TRACK which will receive the sectors (previous contents are replaced).
+ * @returns	DISCFERRET_E_OK on success, one of the DISCFERRET_E_xxx constants on error.
+ *
+ * Looks for ID (FE), data (FB) and deleted data (F8) address marks, which
+ * have clock pattern C7 and follow a run of 00 bytes.
+ */
+DISCFERRET_ERROR discferret_decode_fm(const DISCFERRET_FLUX *flux, const unsigned long bitrate, DISCFERRET_TRACK *track);
+
+/**
+ * @brief	Decode an Amiga trackdisk (AmigaDOS) track.
+ * @param	flux	Flux intervals.
+ * @param	bitrate	Nominal data rate in bits per second (250000 for DD, 500000 for HD).
+ * @param	track	DISCFERRET_TRACK which will receive the sectors (previous contents are replaced).
+ * @returns	DISCFERRET_E_OK on success, one of the DISCFERRET_E_xxx constants on error.
+ *
+ * Looks for 4489 4489 sync words, then checks the header and data
+ * checksums. Sectors are reported with <i>cyl</i> and <i>head</i> taken
+ * from the track number in the header, and <i>size_code</i> 2 (512 bytes).
+ * The sector label is not returned.
+ */
+DISCFERRET_ERROR discferret_decode_amiga(const DISCFERRET_FLUX *flux, const unsigned long bitrate, DISCFERRET_TRACK *track);
+
+/**
+ * @brief	Decode an Apple II DOS 3.3 / ProDOS (16 sector, 6-and-2) track.
+ * @param	flux	Flux intervals.
+ * @param	bitrate	Nominal bit rate in bits per second (250000 for a Disk II).
+ * @param	track	DISCFERRET_TRACK which will receive the sectors (previous contents are replaced).
+ * @returns	DISCFERRET_E_OK on success, one of the DISCFERRET_E_xxx constants on error.
+ *
+ * The flux is turned into disk nibbles the way the Disk II controller does
+ * it, then D5 AA 96 address fields and D5 AA AD data fields are decoded.
+ * Sectors are reported with <i>cyl</i> set to the track number from the
+ * address field, <i>head</i> 0 and <i>size_code</i> 1 (256 bytes). The
+ * sector numbers are physical; DOS 3.3 and ProDOS interleave them.
+ * <i>bits</i> holds the nibble stream, and <i>cells</i> the nibble count.
+ */
+DISCFERRET_ERROR discferret_decode_apple(const DISCFERRET_FLUX *flux, const unsigned long bitrate, DISCFERRET_TRACK *track);
+
+/**
+ * @brief	Decode a Commodore 1541 (GCR) track.
+ * @param	flux		Flux intervals.
+ * @param	track_no	Track number (1 to 42), which selects the speed zone.
+ * @param	track		DISCFERRET_TRACK which will receive the sectors (previous contents are replaced).
+ * @returns	DISCFERRET_E_OK on success, one of the DISCFERRET_E_xxx constants on error.
+ *
+ * The 1541 writes tracks 1-17 at 307.7 kbit/s (21 sectors), 18-24 at
+ * 285.7 kbit/s (19), 25-30 at 266.7 kbit/s (18) and 31 on at 250 kbit/s
+ * (17). Sectors are reported with <i>cyl</i> set to the track number from
+ * the header block, <i>head</i> 0 and <i>size_code</i> 1 (256 bytes).
+ */
+DISCFERRET_ERROR discferret_decode_c1541(const DISCFERRET_FLUX *flux, const unsigned int track_no, DISCFERRET_TRACK *track);
+
+/**
+ * @brief	Free the buffers in a DISCFERRET_TRACK, and zero it.
+ */
+void discferret_track_free(DISCFERRET_TRACK *track);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _DISCFERRET_DECODE_H
+
+// vim: ts=4 noet sw=4
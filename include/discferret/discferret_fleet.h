@@ -0,0 +1,99 @@
+/****************************************************************************
+ *
+ *                - DiscFerret Interface Library for C / C++ -
+ *
+ * Copyright (C) 2010 - 2011 P. A. Pemberton t/a. Red Fox Engineering.
+ * All Rights Reserved.
+ *
+ * Copyright 2010-2011 Philip Pemberton
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ ****************************************************************************/
+
+
+/**
+ * @file	discferret_fleet.h
+ * @brief	Concurrent bring-up of multiple DiscFerret units.
+ */
+
+#ifndef _DISCFERRET_FLEET_H
+#define _DISCFERRET_FLEET_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include "discferret.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief	Status of one DiscFerret unit in a fleet.
+ *
+ * Times are in seconds.
+ */
+typedef struct {
+	DISCFERRET_DEVICE			device;			///< Device information (serial number, USB location, ...)
+	DISCFERRET_DEVICE_HANDLE	*dh;			///< Device handle, or NULL if the unit could not be opened
+	DISCFERRET_ERROR			open_status;	///< Result of opening the unit
+	DISCFERRET_ERROR			load_status;	///< Result of loading the microcode (DISCFERRET_E_OK if not requested)
+	double						open_time;		///< Time taken to open the unit
+	double						load_time;		///< Time taken to load the microcode
+} DISCFERRET_FLEET_UNIT;
+
+/**
+ * @brief	A set of DiscFerret units opened by discferret_fleet_open().
+ */
+typedef struct {
+	size_t					count;		///< Number of units
+	DISCFERRET_FLEET_UNIT	*units;		///< Per-unit status
+	size_t					ready;		///< Number of units which were opened (and loaded, if requested) successfully
+	double					elapsed;	///< Wall-clock time taken to bring up the whole fleet
+} DISCFERRET_FLEET;
+
+/**
+ * @brief	Open (and optionally configure) many DiscFerret units concurrently.
+ * @param	serials		Array of serial numbers to open, or NULL to open every attached unit.
+ * @param	nserials	Number of entries in <i>serials</i> (ignored if <i>serials</i> is NULL).
+ * @param	load_microcode	If true, load the default microcode into each unit after opening it.
+ * @param	fleet		Pointer which will receive the fleet.
+ * @returns	DISCFERRET_E_OK if the fleet was brought up (even if some units failed),
+ * 			or one of the DISCFERRET_E_xxx constants on error.
+ *
+ * Each unit is opened, and its microcode loaded, on a thread of its own, so
+ * bringing up N units takes roughly as long as bringing up the slowest one.
+ * Check each unit's <i>open_status</i> and <i>load_status</i> (or the
+ * fleet's <i>ready</i> count) to see which units are usable.
+ *
+ * If a serial number in <i>serials</i> is not attached, its unit will have an
+ * <i>open_status</i> of DISCFERRET_E_NO_MATCH.
+ *
+ * The fleet must be released with discferret_fleet_close(), which also
+ * closes all the device handles.
+ */
+DISCFERRET_ERROR discferret_fleet_open(const char * const *serials, const size_t nserials, const bool load_microcode, DISCFERRET_FLEET **fleet);
+
+/**
+ * @brief	Close every unit in a fleet, and free the fleet.
+ * @param	fleet		Fleet created by discferret_fleet_open().
+ * @returns	DISCFERRET_E_OK on success, one of the DISCFERRET_E_xxx constants on error.
+ */
+DISCFERRET_ERROR discferret_fleet_close(DISCFERRET_FLEET *fleet);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _DISCFERRET_FLEET_H
+
+// vim: ts=4 noet sw=4
@@ -0,0 +1,151 @@
+/****************************************************************************
+ *
+ *                - DiscFerret Interface Library for C / C++ -
+ *
+ * Copyright (C) 2010 - 2011 P. A. Pemberton t/a. Red Fox Engineering.
+ * All Rights Reserved.
+ *
+ * Copyright 2010-2011 Philip Pemberton
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ ****************************************************************************/
+
+
+
+/**
+ * @file	discferret_flux.h
+ * @brief	Conversion of DiscFerret acquisition samples into flux intervals.
+ *
+ * During an acquisition the DiscFerret stores one byte per flux transition
+ * in its RAM:
+ *
+ *   - Bits 6..0 hold the number of acquisition clock ticks since the
+ *     previous transition.
+ *   - If the counter reaches 127 before a transition arrives, a byte with
+ *     bits 6..0 all set (0x7F) is stored and counting carries on; the
+ *     interval continues into the next byte.
+ *   - Bit 7 reflects the state of the INDEX line.
+ *
+ * The acquisition clock is set by ACQ_CLKSEL (100MHz, 50MHz, 25MHz or
+ * 12.5MHz).
+ */
+
+#ifndef _DISCFERRET_FLUX_H
+#define _DISCFERRET_FLUX_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "discferret.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// Sample byte: INDEX line state
+#define DISCFERRET_SAMPLE_INDEX		0x80
+/// Sample byte: timing count mask
+#define DISCFERRET_SAMPLE_COUNT		0x7F
+
+/**
+ * @brief	A track's worth of flux transitions.
+ *
+ * Zero the structure before its first use. The arrays are grown as needed
+ * and kept between calls, so converting track after track into the same
+ * structure does no allocation once it has reached full size. Release it
+ * with discferret_flux_free().
+ */
+typedef struct {
+	uint32_t		*intervals;			///< Time between successive transitions, in clock ticks
+	size_t			count;				///< Number of intervals
+	size_t			capacity;			///< Allocated size of <i>intervals</i>
+	size_t			*index;				///< Interval numbers during which an index pulse started
+	size_t			index_count;		///< Number of index pulses
+	size_t			index_capacity;		///< Allocated size of <i>index</i>
+	unsigned long	clock_hz;			///< Tick rate of <i>intervals</i>, in Hz
+} DISCFERRET_FLUX;
+
+/**
+ * @brief	Capture settings.
+ */
+typedef struct {
+	unsigned int	clksel;			///< Acquisition clock (DISCFERRET_ACQ_RATE_xxx)
+	bool			index_start;	///< Start at the next index pulse, rather than straight away
+	unsigned int	revolutions;	///< Stop at this many index pulses after the start (at least 1)
+	double			timeout;		///< Give up (and abort) after this many seconds; 0 = one second plus the expected capture time
+} DISCFERRET_CAPTURE_CONFIG;
+
+/**
+ * @brief	Get the acquisition clock rate for an ACQ_CLKSEL value.
+ * @param	clksel	DISCFERRET_ACQ_RATE_xxx value.
+ * @returns	Clock rate in Hz, or 0 if <i>clksel</i> is not valid.
+ */
+unsigned long discferret_acq_clock_hz(const unsigned int clksel);
+
+/**
+ * @brief	Convert acquisition samples into flux intervals.
+ * @param	samples	Sample bytes read from DiscFerret RAM.
+ * @param	len		Number of sample bytes.
+ * @param	clksel	ACQ_CLKSEL value the samples were acquired with.
+ * @param	flux	DISCFERRET_FLUX which will receive the intervals (previous contents are replaced).
+ * @returns	DISCFERRET_E_OK on success, one of the DISCFERRET_E_xxx constants on error.
+ *
+ * A trailing count with no transition after it is dropped.
+ */
+DISCFERRET_ERROR discferret_flux_from_samples(const unsigned char *samples, const size_t len, const unsigned int clksel, DISCFERRET_FLUX *flux);
+
+/**
+ * @brief	Capture flux from the disc.
+ * @param	dh		DiscFerret device handle. The drive must be selected, spinning and on the right track and head.
+ * @param	config	Capture settings.
+ * @param	flux	DISCFERRET_FLUX which will receive the intervals (previous contents are replaced).
+ * @returns	DISCFERRET_E_OK on success, DISCFERRET_E_TIMEOUT if the capture did not
+ * 			finish in time (it is aborted), or one of the other DISCFERRET_E_xxx constants on error.
+ *
+ * Acquires into RAM from address zero, waits for the DiscFerret to go idle
+ * (sleeping through most of the capture if the index monitor can predict
+ * when it will end), then reads back as many bytes as were stored and
+ * converts them. The RAM buffer comes from the handle's buffer pool.
+ *
+ * Starting straight away and stopping at the first index pulse captures
+ * exactly one revolution right after a write that stopped on index.
+ */
+DISCFERRET_ERROR discferret_flux_capture(DISCFERRET_DEVICE_HANDLE *dh, const DISCFERRET_CAPTURE_CONFIG *config, DISCFERRET_FLUX *flux);
+
+/**
+ * @brief	Capture flux from the disc, with a deadline and cancellation.
+ * @param	dh			DiscFerret device handle.
+ * @param	config		Capture settings.
+ * @param	flux		DISCFERRET_FLUX which will receive the capture.
+ * @param	deadline	Host time (see discferret_host_time()) by which the capture and
+ * 						readback must finish, or 0 for none (<i>config->timeout</i> still applies).
+ * @param	cancel		Cancellation token, or NULL.
+ * @returns	As discferret_flux_capture(), or DISCFERRET_E_TIMEOUT / DISCFERRET_E_CANCELLED.
+ *
+ * An acquisition still running when the deadline passes or the token is
+ * cancelled is aborted; a readback in progress is cut short.
+ */
+DISCFERRET_ERROR discferret_flux_capture_deadline(DISCFERRET_DEVICE_HANDLE *dh, const DISCFERRET_CAPTURE_CONFIG *config, DISCFERRET_FLUX *flux,
+		const double deadline, const DISCFERRET_CANCEL *cancel);
+
+/**
+ * @brief	Free the arrays in a DISCFERRET_FLUX, and zero it.
+ */
+void discferret_flux_free(DISCFERRET_FLUX *flux);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _DISCFERRET_FLUX_H
+
+// vim: ts=4 noet sw=4
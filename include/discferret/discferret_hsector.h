@@ -0,0 +1,127 @@
+/****************************************************************************
+ *
+ *                - DiscFerret Interface Library for C / C++ -
+ *
+ * Copyright (C) 2010 - 2011 P. A. Pemberton t/a. Red Fox Engineering.
+ * All Rights Reserved.
+ *
+ * Copyright 2010-2011 Philip Pemberton
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ ****************************************************************************/
+
+
+
+/**
+ * @file	discferret_hsector.h
+ * @brief	Hard-sectored disc capture.
+ *
+ * Hard-sectored discs have one hole per sector, plus an extra track-mark
+ * hole halfway between the last sector's hole and the first's. All of them
+ * pulse the INDEX line. The DiscFerret's hard sector track mark detector
+ * (HSTMD) watches the time between index pulses and fires when it sees the
+ * short gap either side of the track mark. With DISCFERRET_ACQ_EVENT_WAIT_HSTMD
+ * set, the start/stop event counts index pulses from the track mark, so the
+ * hardware finds sector holes by number with no help from the host.
+ *
+ * Sectors are numbered from 0, the sector whose hole follows the track mark.
+ * The last sector runs from its hole, past the track mark, to sector 0's hole.
+ */
+
+#ifndef _DISCFERRET_HSECTOR_H
+#define _DISCFERRET_HSECTOR_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "discferret.h"
+#include "discferret_flux.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// Resolution of the HSTMD threshold registers, in microseconds
+#define DISCFERRET_HSTMD_UNIT_US	250
+
+/**
+ * @brief	Hard-sector capture settings.
+ */
+typedef struct {
+	unsigned int	clksel;			///< Acquisition clock (DISCFERRET_ACQ_RATE_xxx)
+	unsigned int	sectors;		///< Number of sector holes per track (e.g. 10, 16 or 32)
+	unsigned int	rpm;			///< Nominal rotation speed (e.g. 300 or 360)
+	unsigned long	threshold_us;	///< HSTMD threshold: index gaps shorter than this are the track mark. 0 = 3/4 of a sector.
+	double			timeout;		///< Give up (and abort) after this many seconds; 0 = one second plus two revolutions
+} DISCFERRET_HSECTOR_CONFIG;
+
+/**
+ * @brief	Capture a run of sectors.
+ * @param	dh		DiscFerret device handle. The drive must be selected, spinning and on the right track and head.
+ * @param	config	Capture settings.
+ * @param	first	First sector to capture.
+ * @param	count	Number of sectors (1 to config->sectors).
+ * @param	flux	DISCFERRET_FLUX which will receive the intervals (previous contents are replaced).
+ * @returns	DISCFERRET_E_OK on success, DISCFERRET_E_TIMEOUT if the capture did not
+ * 			finish in time (it is aborted), or one of the other DISCFERRET_E_xxx constants on error.
+ *
+ * Programs the HSTMD thresholds, then has the hardware start at the hole of
+ * sector <i>first</i> and stop at the hole after sector <i>first + count - 1</i>
+ * (wrapping round past the track mark if need be). Only the sectors asked for
+ * are transferred over USB. Use discferret_hsector_slices() with the same
+ * <i>first</i> to split the capture into sectors.
+ */
+DISCFERRET_ERROR discferret_hsector_capture(DISCFERRET_DEVICE_HANDLE *dh, const DISCFERRET_HSECTOR_CONFIG *config,
+		const unsigned int first, const unsigned int count, DISCFERRET_FLUX *flux);
+
+/**
+ * @brief	Capture a whole track, starting at sector 0.
+ * @param	dh		DiscFerret device handle.
+ * @param	config	Capture settings.
+ * @param	flux	DISCFERRET_FLUX which will receive the intervals.
+ * @returns	DISCFERRET_E_OK on success, one of the DISCFERRET_E_xxx constants on error.
+ *
+ * Captures one revolution from sector 0's hole to the next. Every hole is
+ * recorded in flux->index, so discferret_hsector_slices() (with <i>first</i> = 0)
+ * can name each sector without measuring the gaps between holes.
+ */
+DISCFERRET_ERROR discferret_hsector_capture_track(DISCFERRET_DEVICE_HANDLE *dh, const DISCFERRET_HSECTOR_CONFIG *config, DISCFERRET_FLUX *flux);
+
+/**
+ * @brief	Split a hard-sector capture into per-sector flux slices.
+ * @param	flux	Capture from discferret_hsector_capture() or discferret_hsector_capture_track().
+ * @param	sectors	Number of sector holes per track.
+ * @param	first	Sector the capture started at.
+ * @param	slices	Array which will receive one slice per sector, in capture order.
+ * @param	numbers	Array which will receive the sector number of each slice, or NULL.
+ * @param	max		Size of the <i>slices</i> (and <i>numbers</i>) arrays.
+ * @returns	Number of slices, or one of the DISCFERRET_E_xxx constants on error.
+ *
+ * Each slice is a view into <i>flux</i>: its <i>intervals</i> point into the
+ * capture, and it has no index pulses and zero capacity. Slices can be passed
+ * to the decoders as they are, but must not be freed or grown, and are only
+ * valid while <i>flux</i> is unchanged.
+ *
+ * Holes are taken in order from the start of the capture; the track-mark hole
+ * (the one after sector <i>sectors</i> - 1) is stepped over, so the last
+ * sector's slice includes both halves.
+ */
+int discferret_hsector_slices(const DISCFERRET_FLUX *flux, const unsigned int sectors, const unsigned int first,
+		DISCFERRET_FLUX *slices, unsigned int *numbers, const size_t max);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _DISCFERRET_HSECTOR_H
+
+// vim: ts=4 noet sw=4
@@ -0,0 +1,140 @@
+/****************************************************************************
+ *
+ *                - DiscFerret Interface Library for C / C++ -
+ *
+ * Copyright (C) 2010 - 2011 P. A. Pemberton t/a. Red Fox Engineering.
+ * All Rights Reserved.
+ *
+ * Copyright 2010-2011 Philip Pemberton
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ ****************************************************************************/
+
+
+
+/**
+ * @file	discferret_image.h
+ * @brief	Streaming writer for flux image files (SuperCard Pro .scp, HxC .hfe).
+ *
+ * Tracks are appended to a memory-mapped output file as they are captured.
+ * The file is preallocated (and grown in large steps if it fills up), so
+ * adding a track is a conversion straight into the mapping with no
+ * intermediate buffers or write() calls. Offset tables, header fields and
+ * checksums are patched in when the image is closed.
+ *
+ * SCP images keep the raw flux timing, resampled from the acquisition clock
+ * to the SCP resolution. HFE images hold a bitcell stream per side, made by
+ * quantising the flux intervals to the cell rate (twice the data rate).
+ *
+ * Not available on Windows; the functions return DISCFERRET_E_NOT_SUPPORTED.
+ */
+
+#ifndef _DISCFERRET_IMAGE_H
+#define _DISCFERRET_IMAGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "discferret.h"
+#include "discferret_flux.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief	Image file formats.
+ */
+typedef enum {
+	DISCFERRET_IMAGE_SCP,		///< SuperCard Pro flux image
+	DISCFERRET_IMAGE_HFE		///< HxC Floppy Emulator image (version 1)
+} DISCFERRET_IMAGE_FORMAT;
+
+/**
+ * @brief	Image writer settings.
+ *
+ * Fields which don't apply to the chosen format are ignored.
+ */
+typedef struct {
+	DISCFERRET_IMAGE_FORMAT	format;			///< File format
+	unsigned int			cylinders;		///< Number of cylinders (SCP: at most 84)
+	unsigned int			heads;			///< Number of heads (1 or 2)
+	unsigned int			revolutions;	///< SCP: revolutions stored per track (1-5)
+	unsigned int			resolution;		///< SCP: sample period is 25ns x (resolution + 1)
+	unsigned int			disk_type;		///< SCP: disk type byte (0 = "other")
+	unsigned int			bitrate_kbps;	///< HFE: data rate in kbit/s (e.g. 250 for DD MFM)
+	unsigned int			rpm;			///< HFE: rotation speed (e.g. 300)
+	unsigned int			encoding;		///< HFE: track encoding (0 = ISO/IBM MFM, 1 = Amiga MFM, 2 = ISO/IBM FM)
+	unsigned int			interface_mode;	///< HFE: floppy interface mode (0 = IBM PC DD)
+	size_t					preallocate;	///< Bytes to preallocate (0 = estimate from the geometry)
+} DISCFERRET_IMAGE_CONFIG;
+
+/**
+ * @brief	Opaque image writer.
+ */
+typedef struct discferret_image DISCFERRET_IMAGE;
+
+/**
+ * @brief	Create an image file.
+ * @param	path	File name (an existing file is overwritten).
+ * @param	config	Image settings.
+ * @param	image	Pointer which will receive the image writer.
+ * @returns	DISCFERRET_E_OK on success, one of the DISCFERRET_E_xxx constants on error.
+ */
+DISCFERRET_ERROR discferret_image_create(const char *path, const DISCFERRET_IMAGE_CONFIG *config, DISCFERRET_IMAGE **image);
+
+/**
+ * @brief	Append a track to an image.
+ * @param	image	Image writer.
+ * @param	cyl		Cylinder number.
+ * @param	head	Head number.
+ * @param	flux	Flux transitions for the track, including index markers.
+ * @returns	DISCFERRET_E_OK on success, one of the DISCFERRET_E_xxx constants on error.
+ *
+ * SCP images need at least <i>revolutions</i> + 1 index pulses in the
+ * capture; the first <i>revolutions</i> complete revolutions are stored.
+ * HFE images store the first complete revolution (or the whole capture if
+ * there are fewer than two index pulses), and tracks must be added in
+ * cylinder order.
+ */
+DISCFERRET_ERROR discferret_image_add_track(DISCFERRET_IMAGE *image, const unsigned int cyl, const unsigned int head, const DISCFERRET_FLUX *flux);
+
+/**
+ * @brief	Append a track straight from DiscFerret acquisition samples.
+ * @param	image	Image writer.
+ * @param	cyl		Cylinder number.
+ * @param	head	Head number.
+ * @param	samples	Sample bytes read from DiscFerret RAM.
+ * @param	len		Number of sample bytes.
+ * @param	clksel	ACQ_CLKSEL value the samples were acquired with.
+ * @returns	DISCFERRET_E_OK on success, one of the DISCFERRET_E_xxx constants on error.
+ *
+ * Equivalent to discferret_flux_from_samples() followed by
+ * discferret_image_add_track(), using a flux buffer kept by the writer.
+ */
+DISCFERRET_ERROR discferret_image_add_samples(DISCFERRET_IMAGE *image, const unsigned int cyl, const unsigned int head,
+		const unsigned char *samples, const size_t len, const unsigned int clksel);
+
+/**
+ * @brief	Finish an image: write the track table and header, and close the file.
+ * @param	image	Image writer (freed, even on error).
+ * @returns	DISCFERRET_E_OK on success, one of the DISCFERRET_E_xxx constants on error.
+ */
+DISCFERRET_ERROR discferret_image_close(DISCFERRET_IMAGE *image);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _DISCFERRET_IMAGE_H
+
+// vim: ts=4 noet sw=4
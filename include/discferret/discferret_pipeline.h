@@ -0,0 +1,159 @@
+/****************************************************************************
+ *
+ *                - DiscFerret Interface Library for C / C++ -
+ *
+ * Copyright (C) 2010 - 2011 P. A. Pemberton t/a. Red Fox Engineering.
+ * All Rights Reserved.
+ *
+ * Copyright 2010-2011 Philip Pemberton
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ ****************************************************************************/
+
+
+
+/**
+ * @file	discferret_pipeline.h
+ * @brief	Capture/decode/output pipeline.
+ *
+ * Runs capture, decode and output on separate threads so the USB link keeps
+ * working while earlier tracks are decoded and written:
+ *
+ *   capture (calling thread) --> decode workers --> output writer
+ *
+ * The capture stage owns the device handle. Each decode worker has a
+ * bounded lock-free single-producer/single-consumer ring to the capture
+ * stage and another to the output writer. Jobs are dealt to the workers in
+ * turn and collected in the same order, so the output callback always sees
+ * jobs in order, however many workers there are. When a ring fills up, the
+ * stage feeding it waits (backpressure), so memory use is fixed at
+ * <i>workers</i> x <i>depth</i> capture buffers.
+ */
+
+#ifndef _DISCFERRET_PIPELINE_H
+#define _DISCFERRET_PIPELINE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "discferret.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief	Capture callback: acquire one job's data (e.g. seek, capture a track, read RAM).
+ * @param	dh		Device handle.
+ * @param	ctx		Caller's context pointer.
+ * @param	job		Job number (0 .. jobs-1).
+ * @param	buf		Buffer to read the data into.
+ * @param	bufsize	Size of <i>buf</i>.
+ * @param	len		Pointer which will receive the number of bytes placed in <i>buf</i>.
+ * @returns	DISCFERRET_E_OK on success; any other value stops the pipeline.
+ */
+typedef DISCFERRET_ERROR (*DISCFERRET_PIPELINE_CAPTURE_FN)(DISCFERRET_DEVICE_HANDLE *dh, void *ctx,
+		unsigned int job, unsigned char *buf, size_t bufsize, size_t *len);
+
+/**
+ * @brief	Decode callback, called on a decode worker thread.
+ * @param	ctx		Caller's context pointer.
+ * @param	job		Job number.
+ * @param	raw		Captured data (valid only until the callback returns).
+ * @param	len		Length of the captured data.
+ * @param	result	Pointer which will receive the decoded result, handed to the output callback.
+ * @param	resultlen	Pointer which will receive the size of the decoded result, in bytes.
+ * @returns	Decode status, passed to the output callback. A decode failure
+ * 			does not stop the pipeline.
+ *
+ * Decode callbacks run concurrently on different workers, so they must not
+ * share unprotected state. <i>result</i> must be allocated with malloc(): if
+ * the pipeline stops before a result reaches the output callback, it is
+ * released with free().
+ */
+typedef DISCFERRET_ERROR (*DISCFERRET_PIPELINE_DECODE_FN)(void *ctx, unsigned int job,
+		const unsigned char *raw, size_t len, void **result, size_t *resultlen);
+
+/**
+ * @brief	Output callback, called on the output thread in job order.
+ * @param	ctx		Caller's context pointer.
+ * @param	job		Job number.
+ * @param	status	Status returned by the decode callback.
+ * @param	result	Decoded result (ownership passes to the callback).
+ * @param	resultlen	Size of the decoded result.
+ * @returns	DISCFERRET_E_OK on success; any other value stops the pipeline.
+ */
+typedef DISCFERRET_ERROR (*DISCFERRET_PIPELINE_OUTPUT_FN)(void *ctx, unsigned int job,
+		DISCFERRET_ERROR status, void *result, size_t resultlen);
+
+/**
+ * @brief	Pipeline configuration.
+ */
+typedef struct {
+	unsigned int					jobs;			///< Number of jobs (e.g. tracks) to run
+	unsigned int					workers;		///< Number of decode workers (0 = one per CPU)
+	unsigned int					depth;			///< Ring depth per worker (0 = default of 2)
+	size_t							buffer_size;	///< Size of each capture buffer (e.g. the DiscFerret RAM size)
+	DISCFERRET_PIPELINE_CAPTURE_FN	capture;		///< Capture callback
+	DISCFERRET_PIPELINE_DECODE_FN	decode;			///< Decode callback
+	DISCFERRET_PIPELINE_OUTPUT_FN	output;			///< Output callback
+	void							*ctx;			///< Context pointer passed to the callbacks
+} DISCFERRET_PIPELINE_CONFIG;
+
+/**
+ * @brief	Throughput of one pipeline stage.
+ *
+ * Times are in seconds. For the decode stage, counts and times are summed
+ * over all the workers.
+ */
+typedef struct {
+	unsigned long	items;		///< Number of jobs processed
+	uint64_t		bytes;		///< Number of bytes processed (captured, decoded from, or written)
+	double			busy;		///< Time spent in the stage's callback
+	double			stalled;	///< Time spent waiting on a full or empty ring
+	double			rate;		///< Bytes per second while busy (bytes / busy)
+} DISCFERRET_PIPELINE_STAGE_STATS;
+
+/**
+ * @brief	Pipeline statistics.
+ */
+typedef struct {
+	DISCFERRET_PIPELINE_STAGE_STATS	capture;	///< Capture stage
+	DISCFERRET_PIPELINE_STAGE_STATS	decode;		///< Decode workers
+	DISCFERRET_PIPELINE_STAGE_STATS	output;		///< Output writer
+	unsigned int					workers;	///< Number of decode workers used
+	double							elapsed;	///< Wall-clock time for the whole run
+	double							rate;		///< Captured bytes per second of wall-clock time
+} DISCFERRET_PIPELINE_STATS;
+
+/**
+ * @brief	Run a capture/decode/output pipeline to completion.
+ * @param	dh		Device handle, used only by the capture stage.
+ * @param	config	Pipeline configuration.
+ * @param	stats	Pointer to a DISCFERRET_PIPELINE_STATS which will receive the
+ * 					per-stage statistics (may be NULL).
+ * @returns	DISCFERRET_E_OK if every job was captured and output, otherwise the
+ * 			first error returned by the capture or output callback (or one of
+ * 			the DISCFERRET_E_xxx constants).
+ *
+ * The capture stage runs on the calling thread; the function returns when
+ * all jobs have been output or the pipeline has been stopped by an error.
+ */
+DISCFERRET_ERROR discferret_pipeline_run(DISCFERRET_DEVICE_HANDLE *dh, const DISCFERRET_PIPELINE_CONFIG *config, DISCFERRET_PIPELINE_STATS *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _DISCFERRET_PIPELINE_H
+
+// vim: ts=4 noet sw=4
@@ -0,0 +1,113 @@
+/****************************************************************************
+ *
+ *                - DiscFerret Interface Library for C / C++ -
+ *
+ * Copyright (C) 2010 - 2011 P. A. Pemberton t/a. Red Fox Engineering.
+ * All Rights Reserved.
+ *
+ * Copyright 2010-2011 Philip Pemberton
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ ****************************************************************************/
+
+
+
+/**
+ * @file	discferret_pool.h
+ * @brief	Per-handle pool of reusable capture and decode buffers.
+ *
+ * Buffers are handed out from size classes (powers of two, 4 KiB and up)
+ * and kept on a free list when they are returned, so an imaging loop which
+ * gets and puts the same sizes of buffer every track stops allocating after
+ * the first track. Buffers are aligned to a cache line (or to a huge page
+ * when huge pages are enabled).
+ *
+ * The pool has its own lock, separate from the handle lock, so decode
+ * threads can use it without waiting for USB transfers.
+ */
+
+#ifndef _DISCFERRET_POOL_H
+#define _DISCFERRET_POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "discferret.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// Back buffers of 2 MiB and larger with (transparent) huge pages where the platform supports it
+#define DISCFERRET_POOL_HUGE_PAGES	0x0001
+
+/**
+ * @brief	Buffer pool statistics.
+ */
+typedef struct {
+	unsigned long	allocations;	///< Number of buffers allocated from the heap
+	unsigned long	reuses;			///< Number of requests satisfied from the free lists
+	unsigned long	in_use;			///< Number of buffers currently handed out
+	unsigned long	cached;			///< Number of buffers on the free lists
+	uint64_t		bytes_cached;	///< Total size of the buffers on the free lists
+} DISCFERRET_POOL_STATS;
+
+/**
+ * @brief	Set the buffer pool options for a device handle.
+ * @param	dh		DiscFerret device handle.
+ * @param	flags	DISCFERRET_POOL_xxx flags.
+ * @returns	DISCFERRET_E_OK on success, one of the DISCFERRET_E_xxx constants on error.
+ *
+ * Affects buffers allocated from now on; cached buffers are kept.
+ */
+DISCFERRET_ERROR discferret_pool_configure(DISCFERRET_DEVICE_HANDLE *dh, const unsigned int flags);
+
+/**
+ * @brief	Get a buffer from a handle's pool.
+ * @param	dh		DiscFerret device handle.
+ * @param	size	Minimum size of the buffer, in bytes.
+ * @returns	Pointer to the buffer, or NULL if out of memory.
+ *
+ * The buffer's contents are undefined. Return it with discferret_buffer_put()
+ * (not free()) before closing the handle.
+ */
+void *discferret_buffer_get(DISCFERRET_DEVICE_HANDLE *dh, const size_t size);
+
+/**
+ * @brief	Return a buffer to a handle's pool.
+ * @param	dh		DiscFerret device handle.
+ * @param	buf		Buffer from discferret_buffer_get() on the same handle (may be NULL).
+ */
+void discferret_buffer_put(DISCFERRET_DEVICE_HANDLE *dh, void *buf);
+
+/**
+ * @brief	Free all the cached buffers in a handle's pool.
+ * @param	dh		DiscFerret device handle.
+ * @returns	DISCFERRET_E_OK on success, one of the DISCFERRET_E_xxx constants on error.
+ */
+DISCFERRET_ERROR discferret_pool_trim(DISCFERRET_DEVICE_HANDLE *dh);
+
+/**
+ * @brief	Get a handle's buffer pool statistics.
+ * @param	dh		DiscFerret device handle.
+ * @param	stats	Pointer to a DISCFERRET_POOL_STATS which will receive the statistics.
+ * @returns	DISCFERRET_E_OK on success, one of the DISCFERRET_E_xxx constants on error.
+ */
+DISCFERRET_ERROR discferret_pool_get_stats(DISCFERRET_DEVICE_HANDLE *dh, DISCFERRET_POOL_STATS *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _DISCFERRET_POOL_H
+
+// vim: ts=4 noet sw=4
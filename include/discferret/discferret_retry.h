@@ -0,0 +1,144 @@
+/****************************************************************************
+ *
+ *                - DiscFerret Interface Library for C / C++ -
+ *
+ * Copyright (C) 2010 - 2011 P. A. Pemberton t/a. Red Fox Engineering.
+ * All Rights Reserved.
+ *
+ * Copyright 2010-2011 Philip Pemberton
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ ****************************************************************************/
+
+
+
+
+/**
+ * @file	discferret_retry.h
+ * @brief	Sector reads with targeted retries.
+ *
+ * A track is captured and decoded, and each expected sector's status is
+ * tracked across captures. Only sectors which haven't yet been read with a
+ * good checksum are retried, and the retries are aimed at them:
+ *
+ *  - Once a sector's ID has been seen, its place around the track is known.
+ *    If every missing sector has been placed, the retry starts at the index
+ *    pulse and uses the sync word detector to stop just after the last of
+ *    them, so the rest of the track is neither waited for nor transferred.
+ *  - Otherwise the retry is a multi-revolution capture.
+ *  - If several retries in a row turn up nothing new, the heads are stepped
+ *    away and back before the next one, alternating the direction they
+ *    come back from. Off-track writes often read better from one side.
+ *
+ * Retrying stops when every sector has been read, or the revolution budget
+ * has been spent. The cost of each sector (captures, revolutions, head
+ * movements and time spent while it was outstanding) is reported.
+ */
+
+#ifndef _DISCFERRET_RETRY_H
+#define _DISCFERRET_RETRY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "discferret.h"
+#include "discferret_flux.h"
+#include "discferret_decode.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief	Retry settings.
+ */
+typedef struct {
+	unsigned int			clksel;				///< Acquisition clock (DISCFERRET_ACQ_RATE_xxx)
+	DISCFERRET_DECODER_FN	decoder;			///< Track decoder
+	unsigned long			bitrate;			///< Data rate passed to the decoder, in bits per second
+	unsigned int			first_sector;		///< Lowest sector number on the track
+	unsigned int			sectors;			///< Number of sectors expected (first_sector upwards)
+	unsigned int			first_revs;			///< Revolutions in the first capture (0 = 2)
+	unsigned int			retry_revs;			///< Revolutions in each untargeted retry (0 = 1)
+	unsigned int			budget;				///< Most revolutions to capture, including the first capture (0 = 20)
+	uint16_t				sync_word;			///< Sync word for targeted retries (0x4489 for IBM MFM and Amiga)
+	unsigned int			syncs_per_sector;	///< Sync words in each sector (e.g. 6 for IBM MFM, 1 for Amiga). 0 = no targeted retries
+	unsigned int			reseek_after;		///< Fruitless retries in a row before the heads are moved away and back (0 = never)
+	unsigned int			reseek_steps;		///< Steps to move the heads away (0 = 1)
+	double					timeout;			///< Per-capture timeout in seconds (0 = default)
+} DISCFERRET_RETRY_CONFIG;
+
+/**
+ * @brief	Status and cost of one sector.
+ */
+typedef struct {
+	unsigned int	sector;			///< Sector number
+	bool			found;			///< True if the sector's ID has been read
+	bool			data_ok;		///< True if the sector has been read with a good checksum
+	uint8_t			cyl;			///< Cylinder number from the ID field
+	uint8_t			head;			///< Head number from the ID field
+	uint8_t			size_code;		///< Size code from the ID field
+	size_t			size;			///< Payload size in bytes (0 if no data has been read)
+	unsigned char	*data;			///< Payload (owned by the result): the good copy, or the first bad one
+	unsigned int	order;			///< Place around the track from the index pulse (0 = first), if <i>found</i>
+	unsigned int	captures;		///< Captures made while the sector was outstanding
+	unsigned int	revolutions;	///< Revolutions captured while the sector was outstanding
+	unsigned int	reseeks;		///< Times the heads were moved away and back while it was outstanding
+	double			time;			///< Seconds spent while the sector was outstanding
+} DISCFERRET_RETRY_SECTOR;
+
+/**
+ * @brief	Result of a retried track read.
+ *
+ * Zero the structure before its first use. Buffers are kept between calls;
+ * release it with discferret_retry_free().
+ */
+typedef struct {
+	DISCFERRET_RETRY_SECTOR	*sectors;		///< Expected sectors, in sector number order
+	size_t					count;			///< Number of sectors
+	size_t					capacity;		///< Allocated size of <i>sectors</i>
+	unsigned int			missing;		///< Sectors still without a good checksum
+	unsigned int			captures;		///< Captures made
+	unsigned int			targeted;		///< How many of those were targeted (sync word stop)
+	unsigned int			revolutions;	///< Revolutions spent
+	unsigned int			reseeks;		///< Times the heads were moved away and back
+	double					time;			///< Seconds spent
+	DISCFERRET_FLUX			flux;			///< Last capture (scratch)
+	DISCFERRET_TRACK		track;			///< Last decode (scratch)
+} DISCFERRET_RETRY_RESULT;
+
+/**
+ * @brief	Read a track, retrying sectors which fail.
+ * @param	dh		DiscFerret device handle. The drive must be selected, spinning and on the right track and head.
+ * @param	config	Retry settings.
+ * @param	result	DISCFERRET_RETRY_RESULT which will receive the sectors (previous contents are replaced).
+ * @returns	DISCFERRET_E_OK if the retries ran (check <i>result->missing</i>),
+ * 			or one of the DISCFERRET_E_xxx constants on error.
+ *
+ * Reseeking needs the head position to be known (see discferret_seek_recalibrate());
+ * if it isn't, the heads are left where they are.
+ */
+DISCFERRET_ERROR discferret_retry_track(DISCFERRET_DEVICE_HANDLE *dh, const DISCFERRET_RETRY_CONFIG *config, DISCFERRET_RETRY_RESULT *result);
+
+/**
+ * @brief	Free the buffers in a DISCFERRET_RETRY_RESULT, and zero it.
+ */
+void discferret_retry_free(DISCFERRET_RETRY_RESULT *result);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _DISCFERRET_RETRY_H
+
+// vim: ts=4 noet sw=4
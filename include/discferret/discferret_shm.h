@@ -0,0 +1,203 @@
+/****************************************************************************
+ *
+ *                - DiscFerret Interface Library for C / C++ -
+ *
+ * Copyright (C) 2010 - 2011 P. A. Pemberton t/a. Red Fox Engineering.
+ * All Rights Reserved.
+ *
+ * Copyright 2010-2011 Philip Pemberton
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ ****************************************************************************/
+
+
+
+/**
+ * @file	discferret_shm.h
+ * @brief	Shared-memory capture ring for handing RAM dumps to other processes.
+ *
+ * The acquisition process creates a ring of fixed-size slots in an anonymous
+ * shared memory file (memfd), and reads DiscFerret RAM straight into the
+ * slots. Consumer processes (decoders, archivers, viewers) map the same file
+ * read-only and process each capture in place, so a track reaches any number
+ * of consumers without being copied.
+ *
+ * Captures are numbered from 1. Consumers sleep on a futex in the shared
+ * header until a new capture is published. Slots are reused in turn, so a
+ * consumer which falls more than a ring's length behind loses captures; use
+ * discferret_shm_ring_check() after processing a capture to find out whether
+ * it was overwritten in the meantime.
+ *
+ * Only available on Linux; elsewhere the functions return
+ * DISCFERRET_E_NOT_SUPPORTED.
+ */
+
+#ifndef _DISCFERRET_SHM_H
+#define _DISCFERRET_SHM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "discferret.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief	Opaque shared-memory capture ring.
+ */
+typedef struct discferret_shm_ring DISCFERRET_SHM_RING;
+
+/**
+ * @brief	Information about one capture in a ring.
+ */
+typedef struct {
+	uint32_t	seq;		///< Capture sequence number
+	size_t		len;		///< Length of the capture in bytes
+	double		host_time;	///< Host time (discferret_host_time()) at which the capture was published
+} DISCFERRET_SHM_CAPTURE;
+
+/**
+ * @brief	Create a capture ring.
+ * @param	slot_size	Maximum size of one capture, in bytes (rounded up to a whole number of pages).
+ * @param	nslots		Number of slots in the ring (at least 2).
+ * @param	ring		Pointer which will receive the ring.
+ * @returns	DISCFERRET_E_OK on success, one of the DISCFERRET_E_xxx constants on error.
+ */
+DISCFERRET_ERROR discferret_shm_ring_create(const size_t slot_size, const unsigned int nslots, DISCFERRET_SHM_RING **ring);
+
+/**
+ * @brief	Attach to a ring created by another process.
+ * @param	fd		File descriptor of the ring's shared memory (see discferret_shm_ring_fd()).
+ * @param	ring	Pointer which will receive the ring.
+ * @returns	DISCFERRET_E_OK on success, one of the DISCFERRET_E_xxx constants on error.
+ *
+ * The ring is mapped read-only. The file descriptor is duplicated, so the
+ * caller may close its copy afterwards.
+ */
+DISCFERRET_ERROR discferret_shm_ring_attach(const int fd, DISCFERRET_SHM_RING **ring);
+
+/**
+ * @brief	Get the file descriptor of a ring's shared memory.
+ * @param	ring	Ring.
+ * @returns	File descriptor, to be passed to consumer processes (e.g. with
+ * 			discferret_shm_ring_send() or by fork/exec).
+ */
+int discferret_shm_ring_fd(DISCFERRET_SHM_RING *ring);
+
+/**
+ * @brief	Pass a ring to another process over a Unix domain socket.
+ * @param	sock	Connected Unix domain socket.
+ * @param	ring	Ring.
+ * @returns	DISCFERRET_E_OK on success, one of the DISCFERRET_E_xxx constants on error.
+ */
+DISCFERRET_ERROR discferret_shm_ring_send(const int sock, DISCFERRET_SHM_RING *ring);
+
+/**
+ * @brief	Receive a ring sent with discferret_shm_ring_send(), and attach to it.
+ * @param	sock	Connected Unix domain socket.
+ * @param	ring	Pointer which will receive the ring.
+ * @returns	DISCFERRET_E_OK on success, one of the DISCFERRET_E_xxx constants on error.
+ */
+DISCFERRET_ERROR discferret_shm_ring_receive(const int sock, DISCFERRET_SHM_RING **ring);
+
+/**
+ * @brief	Release a ring.
+ * @param	ring	Ring.
+ * @returns	DISCFERRET_E_OK on success, one of the DISCFERRET_E_xxx constants on error.
+ *
+ * The shared memory is freed when the creator and every consumer have
+ * released it.
+ */
+DISCFERRET_ERROR discferret_shm_ring_close(DISCFERRET_SHM_RING *ring);
+
+/**
+ * @brief	Read DiscFerret RAM directly into the next slot of a ring, and publish it.
+ * @param	ring	Ring (must have been created by this process).
+ * @param	dh		Device handle.
+ * @param	len		Number of bytes to read (no more than the ring's slot size).
+ * @param	seq		Pointer which will receive the capture's sequence number (may be NULL).
+ * @returns	DISCFERRET_E_OK on success, one of the DISCFERRET_E_xxx constants on error.
+ *
+ * The RAM is read from the current RAM address, as with discferret_ram_read().
+ */
+DISCFERRET_ERROR discferret_shm_ring_capture(DISCFERRET_SHM_RING *ring, DISCFERRET_DEVICE_HANDLE *dh, const size_t len, uint32_t *seq);
+
+/**
+ * @brief	Get a writable pointer to the next slot of a ring.
+ * @param	ring	Ring (must have been created by this process).
+ * @returns	Pointer to the slot, or NULL on error.
+ *
+ * Fill the slot, then publish it with discferret_shm_ring_commit(). The slot
+ * is withdrawn from consumers until it is committed.
+ */
+void *discferret_shm_ring_begin(DISCFERRET_SHM_RING *ring);
+
+/**
+ * @brief	Publish the slot filled since discferret_shm_ring_begin().
+ * @param	ring	Ring.
+ * @param	len		Number of bytes written to the slot.
+ * @param	seq		Pointer which will receive the capture's sequence number (may be NULL).
+ * @returns	DISCFERRET_E_OK on success, one of the DISCFERRET_E_xxx constants on error.
+ */
+DISCFERRET_ERROR discferret_shm_ring_commit(DISCFERRET_SHM_RING *ring, const size_t len, uint32_t *seq);
+
+/**
+ * @brief	Wait for a capture newer than the one specified.
+ * @param	ring		Ring.
+ * @param	after		Sequence number of the last capture seen (0 if none).
+ * @param	timeout_ms	Maximum time to wait in milliseconds, or -1 to wait forever.
+ * @param	seq			Pointer which will receive the sequence number of the newest capture.
+ * @returns	DISCFERRET_E_OK if a newer capture is available, DISCFERRET_E_TIMEOUT
+ * 			if none arrived in time, or one of the DISCFERRET_E_xxx constants on error.
+ *
+ * If more than one capture has been published since <i>after</i>, the
+ * newest is returned; the ones in between can still be fetched with
+ * discferret_shm_ring_get() as long as they haven't been overwritten.
+ */
+DISCFERRET_ERROR discferret_shm_ring_wait(DISCFERRET_SHM_RING *ring, const uint32_t after, const int timeout_ms, uint32_t *seq);
+
+/**
+ * @brief	Get a capture from a ring.
+ * @param	ring	Ring.
+ * @param	seq		Sequence number of the capture.
+ * @param	data	Pointer which will receive the address of the capture data.
+ * @param	info	Pointer to a DISCFERRET_SHM_CAPTURE which will receive the capture's details (may be NULL).
+ * @returns	DISCFERRET_E_OK on success, DISCFERRET_E_NO_MATCH if the capture
+ * 			is not (or no longer) in the ring, or one of the DISCFERRET_E_xxx
+ * 			constants on error.
+ *
+ * The data is not copied: <i>data</i> points into the shared memory, and
+ * stays valid until the producer reuses the slot.
+ */
+DISCFERRET_ERROR discferret_shm_ring_get(DISCFERRET_SHM_RING *ring, const uint32_t seq, const void **data, DISCFERRET_SHM_CAPTURE *info);
+
+/**
+ * @brief	Check that a capture hasn't been overwritten.
+ * @param	ring	Ring.
+ * @param	seq		Sequence number of the capture.
+ * @returns	DISCFERRET_E_OK if the capture is still intact, DISCFERRET_E_NO_MATCH
+ * 			if the producer has reused its slot.
+ *
+ * Call this after processing a capture obtained from discferret_shm_ring_get()
+ * to make sure the data didn't change underneath you.
+ */
+DISCFERRET_ERROR discferret_shm_ring_check(DISCFERRET_SHM_RING *ring, const uint32_t seq);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _DISCFERRET_SHM_H
+
+// vim: ts=4 noet sw=4
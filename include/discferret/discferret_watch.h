@@ -0,0 +1,199 @@
+/****************************************************************************
+ *
+ *                - DiscFerret Interface Library for C / C++ -
+ *
+ * Copyright (C) 2010 - 2011 P. A. Pemberton t/a. Red Fox Engineering.
+ * All Rights Reserved.
+ *
+ * Copyright 2010-2011 Philip Pemberton
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ ****************************************************************************/
+
+
+
+
+
+/**
+ * @file	discferret_watch.h
+ * @brief	Event-driven DiscFerret status notifications.
+ *
+ * Rather than have every part of an application poll discferret_get_status()
+ * in a loop (two USB round trips per poll, and a busy CPU core while it
+ * waits), the status watcher polls the device from a single background
+ * thread and notifies any number of watches when their conditions become
+ * true. A watch can call a function, signal a file descriptor (an eventfd on
+ * Linux, a pipe elsewhere) which can be added to a poll()/epoll() set
+ * alongside the application's other I/O, or both.
+ *
+ * The polling rate adapts to what the device is doing: it runs at the
+ * fastest interval while an acquisition is running or the head is stepping,
+ * or just after the status changed or discferret_watch_poke() was called, and
+ * backs off towards the slowest interval while nothing is happening. With no
+ * watches registered, the watcher doesn't poll at all.
+ */
+
+#ifndef _DISCFERRET_WATCH_H
+#define _DISCFERRET_WATCH_H
+
+#include "discferret.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief	When a watch fires.
+ *
+ * A watch fires when its condition becomes true: once on the first poll after
+ * it's added if the condition is already true, then again each time the
+ * condition goes from false to true. DISCFERRET_WATCH_CHANGE fires on every
+ * change in the masked bits after the first poll.
+ */
+typedef enum {
+	DISCFERRET_WATCH_SET,		///< Any of the masked status bits are set (e.g. DISCFERRET_STATUS_DISC_CHANGE)
+	DISCFERRET_WATCH_CLEAR,		///< All of the masked status bits are clear (e.g. DISCFERRET_STATUS_ACQSTATUS_MASK for acquisition idle)
+	DISCFERRET_WATCH_CHANGE		///< Any of the masked status bits change
+} DISCFERRET_WATCH_MODE;
+
+/**
+ * @brief	Status watch callback.
+ * @param	dh		DiscFerret device handle.
+ * @param	status	Status word which fired the watch (see discferret_get_status()),
+ * 					or a negative DISCFERRET_E_xxx constant if polling the device failed.
+ * @param	user	User pointer passed to discferret_watch_add().
+ *
+ * Called on the watcher thread, after the watcher lock has been released.
+ * Callbacks should be short, since the next poll waits for them, and must
+ * not call discferret_watch_remove() or discferret_watch_stop().
+ */
+typedef void (*DISCFERRET_WATCH_CALLBACK)(DISCFERRET_DEVICE_HANDLE *dh, long status, void *user);
+
+/**
+ * @brief	Status watcher settings.
+ */
+typedef struct {
+	unsigned long	min_interval_us;	///< Fastest polling interval, in microseconds (0 = 1000)
+	unsigned long	max_interval_us;	///< Slowest polling interval, in microseconds (0 = 50000)
+} DISCFERRET_WATCH_CONFIG;
+
+/**
+ * @brief	Status watcher statistics.
+ */
+typedef struct {
+	unsigned long	polls;			///< Status polls
+	unsigned long	changes;		///< Polls where the status had changed
+	unsigned long	errors;			///< Polls which failed
+	unsigned long	fired;			///< Watch notifications delivered
+	unsigned int	watches;		///< Watches currently registered
+	unsigned long	interval_us;	///< Current polling interval, in microseconds
+	long			status;			///< Most recent status word, or DISCFERRET_E_xxx error
+} DISCFERRET_WATCH_STATS;
+
+/**
+ * @brief	Opaque status watch.
+ */
+typedef struct discferret_watch DISCFERRET_WATCH;
+
+/**
+ * @brief	Start the status watcher.
+ * @param	dh		DiscFerret device handle.
+ * @param	config	Watcher settings, or NULL for the defaults.
+ * @returns	DISCFERRET_E_OK on success, or one of the DISCFERRET_E_xxx constants in case of error.
+ *
+ * DISCFERRET_E_BAD_PARAMETER will be returned if the watcher is already
+ * running. The watcher is stopped automatically by discferret_close().
+ *
+ * DISCFERRET_STATUS_NEW_INDEX_MEAS is shared with the index monitor and
+ * discferret_get_index_time(), so a watch on it can miss measurements those
+ * have already taken. Use the index monitor for index timing.
+ */
+DISCFERRET_ERROR discferret_watch_start(DISCFERRET_DEVICE_HANDLE *dh, const DISCFERRET_WATCH_CONFIG *config);
+
+/**
+ * @brief	Stop the status watcher, removing (and freeing) any remaining watches.
+ * @param	dh		DiscFerret device handle.
+ * @returns	DISCFERRET_E_OK on success, or one of the DISCFERRET_E_xxx constants in case of error.
+ */
+DISCFERRET_ERROR discferret_watch_stop(DISCFERRET_DEVICE_HANDLE *dh);
+
+/**
+ * @brief	Add a status watch.
+ * @param	dh			DiscFerret device handle.
+ * @param	mask		DISCFERRET_STATUS_xxx bits to watch.
+ * @param	mode		When the watch fires.
+ * @param	callback	Function to call when the watch fires, or NULL.
+ * @param	user		User pointer passed to <i>callback</i>.
+ * @param	fd			Pointer to an int which will receive a file descriptor which
+ * 						becomes readable when the watch fires, or NULL. The descriptor
+ * 						belongs to the watch; use discferret_watch_read() to reset it.
+ * @param	watch		Pointer which will receive the watch.
+ * @returns	DISCFERRET_E_OK on success, or one of the DISCFERRET_E_xxx constants in case of error.
+ *
+ * If polling the device fails, every watch fires once with the error, so
+ * nothing waits forever on a device which has gone away.
+ * DISCFERRET_E_NOT_SUPPORTED will be returned if a file descriptor was asked
+ * for on a platform which doesn't have them (Windows).
+ */
+DISCFERRET_ERROR discferret_watch_add(DISCFERRET_DEVICE_HANDLE *dh, const unsigned long mask, const DISCFERRET_WATCH_MODE mode,
+		DISCFERRET_WATCH_CALLBACK callback, void *user, int *fd, DISCFERRET_WATCH **watch);
+
+/**
+ * @brief	Remove a status watch, closing its file descriptor.
+ * @param	dh			DiscFerret device handle.
+ * @param	watch		Watch to remove (freed).
+ * @returns	DISCFERRET_E_OK on success, or one of the DISCFERRET_E_xxx constants in case of error.
+ *
+ * Once this returns, the watch's callback will not be called again. If the
+ * watcher is making callbacks, this waits for them to return, so don't call
+ * it while holding anything a callback might wait for.
+ */
+DISCFERRET_ERROR discferret_watch_remove(DISCFERRET_DEVICE_HANDLE *dh, DISCFERRET_WATCH *watch);
+
+/**
+ * @brief	Collect a watch's notifications, resetting its file descriptor.
+ * @param	dh			DiscFerret device handle.
+ * @param	watch		Watch.
+ * @param	count		Receives the number of times the watch has fired since the last call, or NULL.
+ * @param	status		Receives the status word (or error) from the most recent firing, or NULL.
+ * @returns	DISCFERRET_E_OK on success, or one of the DISCFERRET_E_xxx constants in case of error.
+ *
+ * Never blocks, and never touches the USB bus.
+ */
+DISCFERRET_ERROR discferret_watch_read(DISCFERRET_DEVICE_HANDLE *dh, DISCFERRET_WATCH *watch, unsigned long *count, long *status);
+
+/**
+ * @brief	Poll at the fastest rate for a while.
+ * @param	dh			DiscFerret device handle.
+ *
+ * Call after starting something whose completion is being watched (e.g. a
+ * seek or an acquisition), so the watcher doesn't sleep through it at a
+ * backed-off polling interval.
+ */
+void discferret_watch_poke(DISCFERRET_DEVICE_HANDLE *dh);
+
+/**
+ * @brief	Get the status watcher's statistics.
+ * @param	dh			DiscFerret device handle.
+ * @param	stats		Receives the statistics (including the most recent status word).
+ * @returns	DISCFERRET_E_OK on success, or one of the DISCFERRET_E_xxx constants in case of error.
+ */
+DISCFERRET_ERROR discferret_watch_stats(DISCFERRET_DEVICE_HANDLE *dh, DISCFERRET_WATCH_STATS *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _DISCFERRET_WATCH_H
+
+// vim: ts=4 noet sw=4
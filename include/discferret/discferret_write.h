@@ -0,0 +1,269 @@
+/****************************************************************************
+ *
+ *                - DiscFerret Interface Library for C / C++ -
+ *
+ * Copyright (C) 2010 - 2011 P. A. Pemberton t/a. Red Fox Engineering.
+ * All Rights Reserved.
+ *
+ * Copyright 2010-2011 Philip Pemberton
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ ****************************************************************************/
+
+
+
+/**
+ * @file	discferret_write.h
+ * @brief	Flux encoding and disc writing.
+ *
+ * When a write is started, the DiscFerret plays its RAM back from address
+ * zero, using the same byte format as an acquisition (see discferret_flux.h).
+ * Bits 6..0 of each byte are the number of write clock ticks until the next
+ * flux transition. A byte with bits 6..0 all set (0x7F) carries: no
+ * transition is written, and the count continues into the next byte. Bit 7
+ * must be clear.
+ *
+ * The track encoder turns sector data (or captured flux) into this format.
+ * discferret_write_samples() uploads the result and writes it to disc, and
+ * discferret_write_verify() writes it, reads it back and checks it.
+ */
+
+#ifndef _DISCFERRET_WRITE_H
+#define _DISCFERRET_WRITE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "discferret.h"
+#include "discferret_flux.h"
+#include "discferret_decode.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// Size of the DiscFerret's acquisition RAM, in bytes
+#define DISCFERRET_RAM_SIZE		(512UL * 1024UL)
+
+/**
+ * @brief	Track encodings.
+ */
+typedef enum {
+	DISCFERRET_ENCODING_MFM,		///< Modified Frequency Modulation (IBM double density, Amiga)
+	DISCFERRET_ENCODING_FM			///< Frequency Modulation (IBM single density)
+} DISCFERRET_ENCODING;
+
+/**
+ * @brief	Track encoder settings.
+ */
+typedef struct {
+	DISCFERRET_ENCODING	encoding;		///< Track encoding
+	unsigned int		clksel;			///< Write clock (DISCFERRET_ACQ_RATE_xxx)
+	unsigned long		bitrate;		///< Data rate in bits per second (e.g. 250000 for DD MFM); 0 if only flux will be encoded
+	unsigned long		precomp_ns;		///< Write precompensation in nanoseconds (0 = none)
+} DISCFERRET_ENCODER_CONFIG;
+
+/// Track encoder (opaque)
+typedef struct discferret_encoder DISCFERRET_ENCODER;
+
+/**
+ * @brief	Write settings.
+ */
+typedef struct {
+	unsigned int	clksel;			///< Write clock (DISCFERRET_ACQ_RATE_xxx); must match the encoder's
+	bool			index_start;	///< Arm the write, and start it at the next index pulse
+	bool			index_stop;		///< Stop at the next index pulse after the start, rather than at the end of the data
+	double			timeout;		///< Give up (and abort) after this many seconds; 0 = one second plus the write time
+} DISCFERRET_WRITE_CONFIG;
+
+/**
+ * @brief	Write statistics.
+ *
+ * All times are in seconds.
+ */
+typedef struct {
+	size_t			bytes;			///< Bytes uploaded to the DiscFerret's RAM
+	double			upload_time;	///< Time taken by the upload
+	double			write_time;		///< Time from starting (or arming) the write until the DiscFerret went idle
+	double			duration;		///< Length of the flux stream
+	unsigned long	polls;			///< Status polls made while waiting for the write to finish
+} DISCFERRET_WRITE_STATS;
+
+/**
+ * @brief	Verify settings.
+ */
+typedef struct {
+	unsigned long	bitrate;		///< Data rate in bits per second, for the decoder
+	unsigned int	retries;		///< Number of times to rewrite the track if it fails to verify
+} DISCFERRET_VERIFY_CONFIG;
+
+/**
+ * @brief	Verify results.
+ */
+typedef struct {
+	unsigned int			attempts;		///< Number of times the track was written
+	size_t					sectors_ok;		///< Sectors which matched, on the last attempt
+	size_t					sectors_bad;	///< Sectors which were missing, had bad CRCs or didn't match, on the last attempt
+	double					verify_time;	///< Time spent capturing, decoding and comparing, over all attempts (seconds)
+	DISCFERRET_WRITE_STATS	write;			///< Statistics for the last write
+} DISCFERRET_VERIFY_RESULT;
+
+/**
+ * @brief	Create a track encoder.
+ * @param	config	Encoder settings.
+ * @param	enc		Pointer which will receive the encoder.
+ * @returns	DISCFERRET_E_OK on success, one of the DISCFERRET_E_xxx constants on error.
+ */
+DISCFERRET_ERROR discferret_encoder_create(const DISCFERRET_ENCODER_CONFIG *config, DISCFERRET_ENCODER **enc);
+
+/**
+ * @brief	Discard the encoded track, and start a new one.
+ *
+ * The sample buffer is kept, so encoding track after track does no
+ * allocation once it has reached full size.
+ */
+void discferret_encoder_reset(DISCFERRET_ENCODER *enc);
+
+/**
+ * @brief	Free a track encoder.
+ */
+void discferret_encoder_free(DISCFERRET_ENCODER *enc);
+
+/**
+ * @brief	Encode data bytes.
+ * @param	enc		Track encoder.
+ * @param	data	Data bytes; each is written most significant bit first.
+ * @param	len		Number of bytes.
+ * @returns	DISCFERRET_E_OK on success, one of the DISCFERRET_E_xxx constants on error.
+ *
+ * Clock bits are added according to the encoding.
+ */
+DISCFERRET_ERROR discferret_encoder_bytes(DISCFERRET_ENCODER *enc, const unsigned char *data, const size_t len);
+
+/**
+ * @brief	Append raw bitcells.
+ * @param	enc		Track encoder.
+ * @param	cells	Bitcells, most significant first; a 1 is a flux transition.
+ * @param	count	Number of bitcells (at most 32).
+ * @returns	DISCFERRET_E_OK on success, one of the DISCFERRET_E_xxx constants on error.
+ *
+ * Used for address marks with missing clock bits, e.g. 0x4489 (MFM A1) or
+ * 0xF57E (FM FE mark, clock C7). Cells are clock/data pairs, so <i>count</i>
+ * should be even; the last cell is taken as the previous data bit when
+ * choosing the next MFM clock bit.
+ */
+DISCFERRET_ERROR discferret_encoder_cells(DISCFERRET_ENCODER *enc, const uint32_t cells, const unsigned int count);
+
+/**
+ * @brief	Append flux intervals.
+ * @param	enc			Track encoder.
+ * @param	intervals	Time between transitions, in ticks of <i>clock_hz</i>.
+ * @param	count		Number of intervals.
+ * @param	clock_hz	Tick rate of <i>intervals</i>.
+ * @returns	DISCFERRET_E_OK on success, one of the DISCFERRET_E_xxx constants on error.
+ *
+ * Intervals are resampled to the write clock. No precompensation is applied;
+ * captured flux already carries whatever the original writer used.
+ */
+DISCFERRET_ERROR discferret_encoder_flux(DISCFERRET_ENCODER *enc, const uint32_t *intervals, const size_t count, const unsigned long clock_hz);
+
+/**
+ * @brief	Finish a track, and get its sample bytes.
+ * @param	enc		Track encoder.
+ * @param	samples	Pointer which will receive the sample bytes (owned by the encoder; valid until the next call on it).
+ * @param	len		Pointer which will receive the number of sample bytes.
+ * @returns	DISCFERRET_E_OK on success, one of the DISCFERRET_E_xxx constants on error.
+ *
+ * Flushes the last transition (which is held back until its successor is
+ * known, for precompensation). Further data may be appended afterwards.
+ */
+DISCFERRET_ERROR discferret_encoder_finish(DISCFERRET_ENCODER *enc, const unsigned char **samples, size_t *len);
+
+/**
+ * @brief	Write sample bytes to disc.
+ * @param	dh		DiscFerret device handle. The drive must be selected, spinning and on the right track and head.
+ * @param	samples	Sample bytes (at most DISCFERRET_RAM_SIZE).
+ * @param	len		Number of sample bytes.
+ * @param	config	Write settings.
+ * @param	stats	Pointer which will receive the write statistics, or NULL.
+ * @returns	DISCFERRET_E_OK on success, DISCFERRET_E_WRITE_PROTECTED if the disc is
+ * 			write protected, DISCFERRET_E_TIMEOUT if the write did not finish in
+ * 			time (it is aborted) or overran the end of the data, or one of the
+ * 			other DISCFERRET_E_xxx constants on error.
+ *
+ * Uploads the samples to RAM address zero with the fastest RAM write the
+ * device supports, followed by 20ms of blank samples (no transitions),
+ * programs the write clock and start/stop events, points the RAM back at
+ * address zero, and starts (or arms) the write. Returns when the DiscFerret
+ * has gone idle. Rather than polling the status register for the whole
+ * write, it sleeps until the write is expected to end (using the index
+ * monitor's prediction of the next index pulse if the monitor is running),
+ * and only polls after that.
+ *
+ * The DiscFerret can't stop by itself at the end of the data, so without
+ * <i>index_stop</i> the write is aborted once the data has played out; the
+ * blank samples cover the delay. If the abort comes after they have run out
+ * too, DISCFERRET_E_TIMEOUT is returned. With <i>index_stop</i>, data
+ * shorter than a revolution is followed by the blank samples, then by
+ * whatever was left in RAM.
+ */
+DISCFERRET_ERROR discferret_write_samples(DISCFERRET_DEVICE_HANDLE *dh, const unsigned char *samples, const size_t len, const DISCFERRET_WRITE_CONFIG *config, DISCFERRET_WRITE_STATS *stats);
+
+/**
+ * @brief	Write captured flux to disc.
+ * @param	dh		DiscFerret device handle.
+ * @param	flux	Flux intervals (e.g. from discferret_flux_from_samples()).
+ * @param	config	Write settings.
+ * @param	stats	Pointer which will receive the write statistics, or NULL.
+ * @returns	DISCFERRET_E_OK on success, one of the DISCFERRET_E_xxx constants on error.
+ *
+ * Copies a track: one revolution of intervals, from the first index pulse
+ * to the second, is resampled to the write clock and written with
+ * discferret_write_samples(). If the capture has fewer than two index pulses,
+ * everything after the first one (or the whole capture) is written.
+ */
+DISCFERRET_ERROR discferret_write_flux(DISCFERRET_DEVICE_HANDLE *dh, const DISCFERRET_FLUX *flux, const DISCFERRET_WRITE_CONFIG *config, DISCFERRET_WRITE_STATS *stats);
+
+/**
+ * @brief	Write sample bytes to disc, and read them back to check them.
+ * @param	dh			DiscFerret device handle.
+ * @param	samples		Encoded track (e.g. from discferret_encoder_finish()).
+ * @param	len			Number of sample bytes.
+ * @param	config		Write settings.
+ * @param	expected	Sectors the track should contain (ID and payload).
+ * @param	nexpected	Number of sectors in <i>expected</i>.
+ * @param	vconfig		Verify settings.
+ * @param	result		Pointer which will receive the results, or NULL.
+ * @returns	DISCFERRET_E_OK if every sector read back intact, DISCFERRET_E_VERIFY_FAILED
+ * 			if some didn't after all the retries, or one of the other DISCFERRET_E_xxx constants on error.
+ *
+ * As soon as the write finishes, one revolution is captured. If the write
+ * stopped on index, the capture starts straight away and ends at the next
+ * index pulse, so verifying costs one revolution; otherwise it runs from
+ * index to index. The capture is decoded as IBM MFM, and each expected
+ * sector must be present with good ID and data CRCs and a payload identical
+ * to the source (compared 16 bytes at a time with SSE2 where available).
+ *
+ * If anything doesn't match, the same samples are written again (there's
+ * no need to encode the track again), up to <i>retries</i> more times.
+ */
+DISCFERRET_ERROR discferret_write_verify(DISCFERRET_DEVICE_HANDLE *dh, const unsigned char *samples, const size_t len,
+		const DISCFERRET_WRITE_CONFIG *config, const DISCFERRET_SECTOR *expected, const size_t nexpected,
+		const DISCFERRET_VERIFY_CONFIG *vconfig, DISCFERRET_VERIFY_RESULT *result);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _DISCFERRET_WRITE_H
+
+// vim: ts=4 noet sw=4
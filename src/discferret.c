@@ -20,16 +20,60 @@
  * limitations under the License.
  ****************************************************************************/
 
+#define _POSIX_C_SOURCE 200809L
+
 #include <string.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
 #include <libusb-1.0/libusb.h>
+#ifdef _WIN32
+#include <windows.h>
+#endif
 #include "discferret.h"
+#include "discferret_watch.h"
+#include "discferret_private.h"
 #include "discferret_version.h"
 
 /// USB timeout value, in milliseconds
 #define USB_TIMEOUT 1000
+/// How often a cancellable transfer checks its deadline and cancellation token, in microseconds
+#define USB_CANCEL_POLL_US	5000
+/// Timeout for draining the rest of a cancelled response, in milliseconds
+#define USB_DRAIN_TIMEOUT	1000
+/// Number of times a command which is safe to repeat is retried after a USB error
+#define USB_RETRIES			2
+/// Number of NOPs sent to resynchronise the command stream before giving up
+#define USB_SYNC_TRIES		2
+/// Timeout for each read while flushing stale response data, in milliseconds
+#define USB_FLUSH_TIMEOUT	20
+/// Most packets to flush while resynchronising (a few Fast Read responses' worth)
+#define USB_FLUSH_PACKETS	8
+
+/// Number of Fast Write packets discferret_ram_write() keeps in flight
+#define RAM_WRITE_DEPTH	4
+
+/// Conservative step rate used as a reference during drive autotuning, in microseconds
+#define AUTOTUNE_SAFE_STEP_US	6000
+/// Default head settle time, used if the settle time cannot be measured, in microseconds
+#define AUTOTUNE_SAFE_SETTLE_US	15000
+/// Number of out-and-back passes a step rate must survive to be considered reliable
+#define AUTOTUNE_PASSES			2
+
+/// Start polling this long before a wait is expected to end, in seconds
+#define WAIT_POLL_MARGIN		0.001
+/// First status poll interval, in microseconds
+#define WAIT_POLL_MIN_US		100
+/// Longest status poll interval, in microseconds
+#define WAIT_POLL_MAX_US		2000
+/// Time allowed for a seek on top of twice its stepping time, in seconds
+#define WAIT_SEEK_MARGIN		0.1
+/// Longest a cancellable wait sleeps without checking its cancellation token, in microseconds
+#define WAIT_CANCEL_SLICE_US	5000
 
 /// DiscFerret hardware commands
 enum {
@@ -65,6 +109,11 @@ enum {
 /// DiscFerret library's libusb context
 static libusb_context *usbctx = NULL;
 
+libusb_context *discferret_usb_context(void)
+{
+	return usbctx;
+}
+
 /***
  * Microcode data -- in discferret_microcode.inc.c
  *
@@ -105,6 +154,296 @@ static unsigned char bitswap(unsigned char num)
 	return val;
 }
 
+void discferret_sleep_us(unsigned long us)
+{
+#ifdef _WIN32
+	Sleep((us + 999) / 1000);
+#else
+	struct timespec ts;
+	ts.tv_sec = us / 1000000;
+	ts.tv_nsec = (us % 1000000) * 1000;
+	while (nanosleep(&ts, &ts) != 0)
+		;
+#endif
+}
+
+double discferret_host_time(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER freq, count;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&count);
+	return (double)count.QuadPart / (double)freq.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + ((double)ts.tv_nsec * 1.0e-9);
+#endif
+}
+
+void discferret_cancel(DISCFERRET_CANCEL *token)
+{
+	if (token != NULL) __atomic_store_n(&token->cancelled, 1, __ATOMIC_RELEASE);
+}
+
+void discferret_cancel_reset(DISCFERRET_CANCEL *token)
+{
+	if (token != NULL) __atomic_store_n(&token->cancelled, 0, __ATOMIC_RELEASE);
+}
+
+bool discferret_cancelled(const DISCFERRET_CANCEL *token)
+{
+	return (token != NULL) && (__atomic_load_n(&token->cancelled, __ATOMIC_ACQUIRE) != 0);
+}
+
+DISCFERRET_ERROR discferret_deadline_check(const struct discferret_deadline *dl)
+{
+	if (dl == NULL) return DISCFERRET_E_OK;
+	if (discferret_cancelled(dl->cancel)) return DISCFERRET_E_CANCELLED;
+	if ((dl->deadline > 0.0) && (discferret_host_time() >= dl->deadline)) return DISCFERRET_E_TIMEOUT;
+	return DISCFERRET_E_OK;
+}
+
+/**
+ * @brief	Check whether a deadline actually limits anything
+ */
+static bool deadline_bounded(const struct discferret_deadline *dl)
+{
+	return (dl != NULL) && ((dl->deadline > 0.0) || (dl->cancel != NULL));
+}
+
+/// libusb completion callback for usb_read_cancellable()
+static void usb_read_cb(struct libusb_transfer *xfer)
+{
+	__atomic_store_n((int *)xfer->user_data, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief	Get the command stream back in step after a USB error
+ * @returns	DISCFERRET_E_OK if the DiscFerret answered a NOP correctly,
+ * 			DISCFERRET_E_USB_ERROR if the device is gone or still out of step.
+ *
+ * Caller must hold the handle lock. Clears any halt on the bulk endpoints,
+ * throws away the rest of whatever response was in flight, then checks that
+ * a NOP gets exactly one FW_ERR_OK byte back. Uses the packet buffer.
+ */
+static DISCFERRET_ERROR usb_recover(DISCFERRET_DEVICE_HANDLE *dh)
+{
+	unsigned char *packet = dh->priv->packet;
+	DISCFERRET_USB_STATS *us = &dh->priv->usb_stats;
+	int r, a;
+
+	for (int tries = 0; tries < USB_SYNC_TRIES; tries++) {
+		// A stalled endpoint stays halted until the host clears it
+		if ((libusb_clear_halt(dh->dh, 1 | LIBUSB_ENDPOINT_OUT) == LIBUSB_ERROR_NO_DEVICE) ||
+				(libusb_clear_halt(dh->dh, 1 | LIBUSB_ENDPOINT_IN) == LIBUSB_ERROR_NO_DEVICE))
+			break;
+
+		// Flush the rest of the failed command's response
+		for (int i = 0; i < USB_FLUSH_PACKETS; i++) {
+			a = 0;
+			r = libusb_bulk_transfer(dh->dh, 1 | LIBUSB_ENDPOINT_IN, packet, DISCFERRET_PACKET_SIZE, &a, USB_FLUSH_TIMEOUT);
+			if ((r == LIBUSB_ERROR_NO_DEVICE) || (a == 0)) break;
+		}
+
+		// A NOP's response is a lone FW_ERR_OK; anything else means we're still out of step
+		packet[0] = CMD_NOP;
+		r = libusb_bulk_transfer(dh->dh, 1 | LIBUSB_ENDPOINT_OUT, packet, 1, &a, USB_TIMEOUT);
+		if (r == LIBUSB_ERROR_NO_DEVICE) break;
+		if ((r != 0) || (a != 1)) continue;
+		r = libusb_bulk_transfer(dh->dh, 1 | LIBUSB_ENDPOINT_IN, packet, 64, &a, USB_TIMEOUT);
+		if (r == LIBUSB_ERROR_NO_DEVICE) break;
+		if ((r == 0) && (a == 1) && (packet[0] == FW_ERR_OK)) {
+			__atomic_add_fetch(&us->recoveries, 1, __ATOMIC_RELAXED);
+			dh->priv->usb_lost = false;
+			return DISCFERRET_E_OK;
+		}
+	}
+
+	__atomic_add_fetch(&us->failures, 1, __ATOMIC_RELAXED);
+	dh->priv->usb_lost = true;
+	return DISCFERRET_E_USB_ERROR;
+}
+
+/**
+ * @brief	Throw away the rest of a response whose read was cancelled
+ * @param	dh		DiscFerret device handle.
+ * @param	left	Number of response bytes which hadn't arrived yet.
+ * @returns	DISCFERRET_E_OK if the whole response was read,
+ * 			DISCFERRET_E_USB_ERROR if the drain timed out or failed first.
+ *
+ * Caller must hold the handle lock. The DiscFerret keeps sending a response
+ * once it has started, so whatever is left has to be read before the next
+ * command, or that command would get this one's data as its response.
+ */
+static DISCFERRET_ERROR usb_drain(DISCFERRET_DEVICE_HANDLE *dh, size_t left)
+{
+	int r, a;
+
+	while (left > 0) {
+		size_t n = (left > DISCFERRET_PACKET_SIZE) ? DISCFERRET_PACKET_SIZE : left;
+
+		a = 0;
+		r = libusb_bulk_transfer(dh->dh, 1 | LIBUSB_ENDPOINT_IN, dh->priv->packet, n, &a, USB_DRAIN_TIMEOUT);
+		if ((r != 0) || (a == 0)) return DISCFERRET_E_USB_ERROR;
+		left -= ((size_t)a < left) ? (size_t)a : left;
+	}
+	return DISCFERRET_E_OK;
+}
+
+/**
+ * @brief	Read a response packet, cancelling the read if the deadline passes or the token is cancelled
+ *
+ * Caller must hold the handle lock. The read runs as an asynchronous
+ * transfer so it can be cancelled while in flight; a cancelled response is
+ * drained, leaving the handle ready for the next command. If the rest of
+ * the response doesn't turn up, the command stream is resynchronised with
+ * usb_recover(); DISCFERRET_E_USB_ERROR is returned if that fails too.
+ */
+static DISCFERRET_ERROR usb_read_cancellable(DISCFERRET_DEVICE_HANDLE *dh, unsigned char *resp, const size_t resplen, int *actual,
+		const struct discferret_deadline *dl)
+{
+	struct libusb_transfer *xfer;
+	struct timeval tv = { 0, USB_CANCEL_POLL_US };
+	DISCFERRET_ERROR stop = DISCFERRET_E_OK, err;
+	int done = 0;
+
+	if ((xfer = libusb_alloc_transfer(0)) == NULL) return DISCFERRET_E_OUT_OF_MEMORY;
+	libusb_fill_bulk_transfer(xfer, dh->dh, 1 | LIBUSB_ENDPOINT_IN, resp, resplen, usb_read_cb, &done, USB_TIMEOUT);
+	if (libusb_submit_transfer(xfer) != 0) {
+		libusb_free_transfer(xfer);
+		return DISCFERRET_E_USB_ERROR;
+	}
+
+	// The registry's event thread may be handling events too; see ram_write_slot_wait()
+	while (!__atomic_load_n(&done, __ATOMIC_ACQUIRE)) {
+		libusb_handle_events_timeout_completed(usbctx, &tv, &done);
+		if ((stop == DISCFERRET_E_OK) && ((stop = discferret_deadline_check(dl)) != DISCFERRET_E_OK))
+			libusb_cancel_transfer(xfer);
+	}
+
+	switch (xfer->status) {
+		case LIBUSB_TRANSFER_COMPLETED:
+			// Finished before the cancellation took effect
+			*actual = xfer->actual_length;
+			err = DISCFERRET_E_OK;
+			break;
+		case LIBUSB_TRANSFER_CANCELLED:
+			err = stop;
+			// Late data would otherwise be taken as the next command's response
+			if (usb_drain(dh, resplen - xfer->actual_length) != DISCFERRET_E_OK) {
+				__atomic_add_fetch(&dh->priv->usb_stats.errors, 1, __ATOMIC_RELAXED);
+				if (usb_recover(dh) != DISCFERRET_E_OK) err = DISCFERRET_E_USB_ERROR;
+			}
+			break;
+		default:
+			err = DISCFERRET_E_USB_ERROR;
+			break;
+	}
+
+	libusb_free_transfer(xfer);
+	return err;
+}
+
+/**
+ * @brief	Send one command packet and read its response, with no error recovery
+ *
+ * Caller must hold the handle lock. See usb_command_dl().
+ */
+static DISCFERRET_ERROR usb_exchange(DISCFERRET_DEVICE_HANDLE *dh, unsigned char *cmd, const size_t cmdlen,
+		unsigned char *resp, const size_t resplen, int *actual, const struct discferret_deadline *dl)
+{
+	int r, a;
+
+	// Send the command packet
+	r = libusb_bulk_transfer(dh->dh, 1 | LIBUSB_ENDPOINT_OUT, cmd, cmdlen, &a, USB_TIMEOUT);
+	if ((r != 0) || (a != cmdlen)) return DISCFERRET_E_USB_ERROR;
+
+	// Read the response
+	if (deadline_bounded(dl)) {
+		r = usb_read_cancellable(dh, resp, resplen, &a, dl);
+		if (r != DISCFERRET_E_OK) return r;
+	} else {
+		r = libusb_bulk_transfer(dh->dh, 1 | LIBUSB_ENDPOINT_IN, resp, resplen, &a, USB_TIMEOUT);
+		if (r != 0) return DISCFERRET_E_USB_ERROR;
+	}
+
+	if (actual != NULL)
+		*actual = a;
+	else if (a != resplen)
+		return DISCFERRET_E_USB_ERROR;
+
+	return DISCFERRET_E_OK;
+}
+
+/**
+ * @brief	Send a command packet to the DiscFerret and read its response
+ * @param	dh		DiscFerret device handle.
+ * @param	cmd		Command packet.
+ * @param	cmdlen	Length of the command packet.
+ * @param	resp	Buffer for the response packet (may be the same as <i>cmd</i>).
+ * @param	resplen	Expected length of the response packet.
+ * @param	actual	Pointer to an int which will receive the number of bytes
+ * 					actually received, or NULL to treat a short response as an error.
+ * @param	dl		Deadline and cancellation token, or NULL.
+ * @param	retries	Number of times to repeat the command after a USB error.
+ * 					Only nonzero for commands which are safe to repeat.
+ *
+ * The handle lock is held across the command and response transfers, so
+ * command/response pairs from different threads can't be interleaved.
+ *
+ * The deadline is checked before the command is sent, and the response read
+ * is cancelled if it passes. The command transfer itself always runs to
+ * completion: cutting it short would leave the DiscFerret waiting for the
+ * rest of the packet.
+ *
+ * After a USB error the command stream is resynchronised (see usb_recover()),
+ * so the handle stays usable even when the error is passed on.
+ */
+static DISCFERRET_ERROR usb_command_dl(DISCFERRET_DEVICE_HANDLE *dh, unsigned char *cmd, const size_t cmdlen,
+		unsigned char *resp, const size_t resplen, int *actual, const struct discferret_deadline *dl, unsigned int retries)
+{
+	DISCFERRET_USB_STATS *us = &dh->priv->usb_stats;
+	unsigned char saved[16];
+	int r;
+
+	if ((r = discferret_deadline_check(dl)) != DISCFERRET_E_OK) return r;
+
+	// The response may overwrite the command, so keep a copy to resend
+	if (cmdlen > sizeof(saved)) retries = 0;
+	if (retries > 0) memcpy(saved, cmd, cmdlen);
+
+	discferret_lock(dh);
+	while ((r = usb_exchange(dh, cmd, cmdlen, resp, resplen, actual, dl)) == DISCFERRET_E_USB_ERROR) {
+		__atomic_add_fetch(&us->errors, 1, __ATOMIC_RELAXED);
+		if ((usb_recover(dh) != DISCFERRET_E_OK) || (retries == 0)) break;
+		retries--;
+		__atomic_add_fetch(&us->retries, 1, __ATOMIC_RELAXED);
+		memcpy(cmd, saved, cmdlen);
+	}
+	discferret_unlock(dh);
+
+	return r;
+}
+
+/**
+ * @brief	Send a command packet to the DiscFerret and read its response, with no deadline
+ */
+static DISCFERRET_ERROR usb_command(DISCFERRET_DEVICE_HANDLE *dh, unsigned char *cmd, const size_t cmdlen,
+		unsigned char *resp, const size_t resplen, int *actual)
+{
+	return usb_command_dl(dh, cmd, cmdlen, resp, resplen, actual, NULL, 0);
+}
+
+/**
+ * @brief	Send a command which is safe to repeat, retrying it after a USB error
+ */
+static DISCFERRET_ERROR usb_command_retry(DISCFERRET_DEVICE_HANDLE *dh, unsigned char *cmd, const size_t cmdlen,
+		unsigned char *resp, const size_t resplen, int *actual)
+{
+	return usb_command_dl(dh, cmd, cmdlen, resp, resplen, actual, NULL, USB_RETRIES);
+}
+
 DISCFERRET_ERROR discferret_init(void)
 {
 	// Check if library has already been initialised
@@ -115,6 +454,13 @@ DISCFERRET_ERROR discferret_init(void)
 	if (libusb_init(&usbctx) < 0)
 		return DISCFERRET_E_USB_ERROR;
 
+	// Start keeping track of attached devices
+	if (discferret_registry_init(usbctx) != DISCFERRET_E_OK) {
+		libusb_exit(usbctx);
+		usbctx = NULL;
+		return DISCFERRET_E_USB_ERROR;
+	}
+
 #ifndef NDEBUG
 	// Set libusb verbosity level
 	libusb_set_debug(usbctx, 3);
@@ -131,97 +477,22 @@ DISCFERRET_ERROR discferret_done(void)
 	// Check if library has been initialised
 	if (usbctx == NULL) return DISCFERRET_E_NOT_INIT;
 
-	// Close down libusb
+	// Close down the device registry and libusb
+	discferret_registry_done();
 	libusb_exit(usbctx);
+	usbctx = NULL;
 
 	return DISCFERRET_E_OK;
 }
 
 int discferret_find_devices(DISCFERRET_DEVICE **devlist)
 {
-	int devcount = 0;
-	libusb_device **usb_devices;
-	int cnt;
-
 	// Check that the library has been initialised
 	if (usbctx == NULL)
 		return DISCFERRET_E_NOT_INIT;
 
-	// Initialise the device list pointer
-	if (devlist != NULL)
-		*devlist = NULL;
-
-	// Scan for libusb devices
-	cnt = libusb_get_device_list(usbctx, &usb_devices);
-
-	// If no devices (or an error), then we can't do anything...
-	if (cnt <= 0) {
-		return (cnt < 0) ? DISCFERRET_E_USB_ERROR : 0;
-	}
-
-	// Device count more than 0. Loop through the device list looking for DiscFerrets.
-	for (int i=0; i<cnt; i++) {
-		// Read the device descriptor
-		struct libusb_device_descriptor desc;
-		if (libusb_get_device_descriptor(usb_devices[i], &desc) != 0) continue;
-
-		// If this is a DiscFerret, then add it to the device list
-		if ((desc.idVendor == 0x04d8) && (desc.idProduct == 0xfbbb)) {
-			if (devlist != NULL) {
-				// Try and open the device (to get the string descriptors)
-				struct libusb_device_handle *dh;
-				int r = libusb_open(usb_devices[i], &dh);
-				if (r != 0) continue;
-
-				// Allocate memory for the device descriptor
-				DISCFERRET_DEVICE *tmp = realloc(*devlist, (devcount+1)*sizeof(DISCFERRET_DEVICE));
-
-				// Did the memory allocation operation succeed?
-				if (tmp == NULL) {
-					free(*devlist);
-					*devlist = NULL;
-					return DISCFERRET_E_OUT_OF_MEMORY;
-				} else {
-					*devlist = tmp;
-				}
-
-				// Allocation succeeded. Fill in the info for the new device
-				devlist[devcount]->vid = desc.idVendor;
-				devlist[devcount]->pid = desc.idProduct;
-
-				// Get string descriptors
-				devlist[devcount]->productname[0] = '\0';
-				if (desc.iProduct != 0) {
-					int len = libusb_get_string_descriptor_ascii(dh, desc.iProduct, devlist[devcount]->productname, sizeof(devlist[devcount]->productname));
-					if (len <= 0) devlist[devcount]->productname[0] = '\0';
-				}
-
-				devlist[devcount]->manufacturer[0] = '\0';
-				if (desc.iManufacturer != 0) {
-					int len = libusb_get_string_descriptor_ascii(dh, desc.iManufacturer, devlist[devcount]->manufacturer, sizeof(devlist[devcount]->manufacturer));
-					if (len <= 0) devlist[devcount]->manufacturer[0] = '\0';
-				}
-
-				devlist[devcount]->serialnumber[0] = '\0';
-				if (desc.iSerialNumber != 0) {
-					int len = libusb_get_string_descriptor_ascii(dh, desc.iSerialNumber, devlist[devcount]->serialnumber, sizeof(devlist[devcount]->serialnumber));
-					if (len <= 0) devlist[devcount]->serialnumber[0] = '\0';
-				}
-
-				// Close the device
-				libusb_close(dh);
-			}
-
-			// Increment device counter
-			devcount++;
-		}
-	}
-
-	// We're done with the device list... free it.
-	libusb_free_device_list(usb_devices, true);
-
-	// Return number of devices we found
-	return devcount;
+	// The registry does all the work (and initialises the device list pointer)
+	return discferret_registry_list(devlist, NULL);
 }
 
 void discferret_devlist_free(DISCFERRET_DEVICE **devlist)
@@ -234,10 +505,106 @@ void discferret_devlist_free(DISCFERRET_DEVICE **devlist)
 	free(*devlist);
 }
 
+/**
+ * @brief	Allocate and initialise the library-private part of a device handle
+ */
+static DISCFERRET_ERROR handle_private_init(DISCFERRET_DEVICE_HANDLE *dh)
+{
+	pthread_mutexattr_t attr;
+
+	dh->priv = calloc(1, sizeof(struct discferret_private));
+	if (dh->priv == NULL) return DISCFERRET_E_OUT_OF_MEMORY;
+
+	// The handle lock is recursive, so applications can hold it across several library calls
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	if (pthread_mutex_init(&dh->priv->lock, &attr) != 0) {
+		pthread_mutexattr_destroy(&attr);
+		free(dh->priv);
+		dh->priv = NULL;
+		return DISCFERRET_E_OUT_OF_MEMORY;
+	}
+	pthread_mutexattr_destroy(&attr);
+
+	// Nothing is known about the RAM address pointer until it's set
+	dh->priv->ram_addr = -1;
+
+	// Buffer pool, and the packet buffer the RAM write path uses
+	dh->priv->pool = discferret_pool_create();
+	if (dh->priv->pool != NULL) dh->priv->packet = discferret_pool_get(dh->priv->pool, DISCFERRET_PACKET_SIZE);
+	if (dh->priv->packet == NULL) {
+		discferret_pool_destroy(dh->priv->pool);
+		pthread_mutex_destroy(&dh->priv->lock);
+		free(dh->priv);
+		dh->priv = NULL;
+		return DISCFERRET_E_OUT_OF_MEMORY;
+	}
+
+	return DISCFERRET_E_OK;
+}
+
+/**
+ * @brief	Free the library-private part of a device handle
+ */
+static void handle_private_free(DISCFERRET_DEVICE_HANDLE *dh)
+{
+	if (dh->priv == NULL) return;
+	discferret_pool_put(dh->priv->pool, dh->priv->packet);
+	discferret_pool_destroy(dh->priv->pool);
+	pthread_mutex_destroy(&dh->priv->lock);
+	free(dh->priv);
+	dh->priv = NULL;
+}
+
+DISCFERRET_ERROR discferret_open_device(libusb_device *dev, DISCFERRET_DEVICE_HANDLE **dh)
+{
+	struct libusb_device_handle *ldh;
+	DISCFERRET_ERROR err;
+
+	if (libusb_open(dev, &ldh) != 0) return DISCFERRET_E_USB_ERROR;
+
+	// Try and claim the primary interface
+	if (libusb_claim_interface(ldh, 0) < 0) {
+		libusb_close(ldh);
+		return DISCFERRET_E_NO_MATCH;
+	}
+
+	// Interface claimed! Set up the device handle.
+	*dh = malloc(sizeof(DISCFERRET_DEVICE_HANDLE));
+	if (*dh == NULL) {
+		libusb_close(ldh);
+		return DISCFERRET_E_OUT_OF_MEMORY;
+	}
+	(*dh)->dh = ldh;
+	(*dh)->has_drive_profile = false;
+
+	// Set up the library-private state
+	if (handle_private_init(*dh) != DISCFERRET_E_OK) {
+		libusb_close(ldh);
+		free(*dh);
+		*dh = NULL;
+		return DISCFERRET_E_OUT_OF_MEMORY;
+	}
+
+	// Pull the firmware version and set the capability flags
+	if ((err = discferret_update_capabilities(*dh)) != DISCFERRET_E_OK) {
+		libusb_close(ldh);
+		handle_private_free(*dh);
+		free(*dh);
+		*dh = NULL;
+		return err;
+	}
+
+	// Set the initial track number to "unknown"
+	(*dh)->current_track = -1;
+
+	return DISCFERRET_E_OK;
+}
+
 DISCFERRET_ERROR discferret_open(const char *serialnum, DISCFERRET_DEVICE_HANDLE **dh)
 {
 	libusb_device **usb_devices;
-	bool match = false;
+	DISCFERRET_ERROR err;
 	int cnt;
 
 	// Check that the library has been initialised
@@ -245,102 +612,37 @@ DISCFERRET_ERROR discferret_open(const char *serialnum, DISCFERRET_DEVICE_HANDLE
 
 	// Make sure the device handle is not null
 	if (dh == NULL) return DISCFERRET_E_BAD_PARAMETER;
+	*dh = NULL;
 
-	// Scan for libusb devices
-	cnt = libusb_get_device_list(usbctx, &usb_devices);
-
-	// If no devices (or an error), then we can't do anything...
-	if (cnt <= 0) {
-		*dh = NULL;
-		return (cnt < 0) ? DISCFERRET_E_USB_ERROR : 0;
-	}
-
-	// Device count more than 0. Loop through the device list looking for a
-	// matching DiscFerret
-	for (int i=0; i<cnt; i++) {
+	// Are we matching on serial number?
+	if ((serialnum != NULL) && (strlen(serialnum) > 0)) {
+		libusb_device *dev;
 
-		// Read the device descriptor
-		struct libusb_device_descriptor desc;
-		libusb_get_device_descriptor(usb_devices[i], &desc);
+		// Yes -- ask the registry which device that is, and open it
+		if ((err = discferret_registry_lookup(serialnum, &dev)) != DISCFERRET_E_OK)
+			return err;
+		err = discferret_open_device(dev, dh);
+		libusb_unref_device(dev);
 
-		// If the VID, PID and serial number (if specified) match, open it.
-		if ((desc.idVendor == 0x04d8) && (desc.idProduct == 0xfbbb)) {
-			struct libusb_device_handle *ldh;
+		return (err == DISCFERRET_E_OK) ? DISCFERRET_E_OK : DISCFERRET_E_NO_MATCH;
+	}
 
-			// Are we matching on serial number?
-			if ((serialnum == NULL) || (strlen(serialnum) == 0)) {
-				// No, just opening a device based on VPID. Therefore, this is a match.
-				int r = libusb_open(usb_devices[i], &ldh);
-				if (r != 0) continue;
-				match = true;
-			} else {
-				// VID/PID match, check the serial number
-				int r = libusb_open(usb_devices[i], &ldh);
-				if (r != 0) continue;
-
-				// Get the serial number
-				if (desc.iSerialNumber != 0) {
-					unsigned char sernum[256];
-					int len = libusb_get_string_descriptor_ascii(ldh, desc.iSerialNumber, sernum, sizeof(sernum));
-					if (len <= 0) sernum[0] = '\0';
-
-					// if lengths do not match, this is not a match!
-					if (strlen(serialnum) != len) {
-						libusb_close(ldh);
-						continue;
-					}
-
-					if (strncmp((char *)sernum, (char *)serialnum, len) == 0) {
-						// Serial number matches. This is a match!
-						match = true;
-					}
-				}
-			}
+	// No, just open the first device we can claim
+	cnt = discferret_registry_list(NULL, &usb_devices);
+	if (cnt < 0) return cnt;
 
-			// Do we have a match?
-			if (match) {
-				// Try and claim the primary interface
-				int r = libusb_claim_interface(ldh, 0);
-				if (r < 0) {
-					// Failed to claim interface, so close the device and go around again.
-					libusb_close(ldh);
-					match = false;
-					continue;
-				} else {
-					// Interface claimed! Pass the device handle back to the caller.
-					*dh = malloc(sizeof(DISCFERRET_DEVICE_HANDLE));
-					if (*dh == NULL) {
-						libusb_close(ldh);
-						return DISCFERRET_E_OUT_OF_MEMORY;
-					}
-					(*dh)->dh = ldh;
-
-					// Pull the firmware version and set the capability flags
-					if (discferret_update_capabilities(*dh) != DISCFERRET_E_OK) {
-						libusb_close(ldh);
-						free(*dh);
-						match = false;
-						continue;
-					}
-
-					// Set the initial track number to "unknown"
-					(*dh)->current_track = -1;
-					break;
-				}
-			}
+	err = DISCFERRET_E_NO_MATCH;
+	for (int i=0; i<cnt; i++) {
+		if (discferret_open_device(usb_devices[i], dh) == DISCFERRET_E_OK) {
+			err = DISCFERRET_E_OK;
+			break;
 		}
 	}
 
 	// We're done with the device list... free it.
-	libusb_free_device_list(usb_devices, true);
+	discferret_registry_list_free(usb_devices, cnt);
 
-	// Any matches?
-	if (!match) {
-		*dh = NULL;
-		return DISCFERRET_E_NO_MATCH;
-	} else {
-		return DISCFERRET_E_OK;
-	}
+	return err;
 }
 
 DISCFERRET_ERROR discferret_open_first(DISCFERRET_DEVICE_HANDLE **dh)
@@ -356,15 +658,40 @@ DISCFERRET_ERROR discferret_close(DISCFERRET_DEVICE_HANDLE *dh)
 	// Make sure device handle is not NULL
 	if (dh == NULL) return DISCFERRET_E_BAD_PARAMETER;
 
+	// Stop any background activity on this handle
+	if (dh->priv->index_monitor != NULL)
+		discferret_index_monitor_stop(dh);
+	if (dh->priv->watcher != NULL)
+		discferret_watch_stop(dh);
+
 	// Close the device handle
 	libusb_close(dh->dh);
 
 	// Free allocated memory
+	handle_private_free(dh);
 	free(dh);
 
 	return DISCFERRET_E_OK;
 }
 
+DISCFERRET_ERROR discferret_lock(DISCFERRET_DEVICE_HANDLE *dh)
+{
+	// Make sure device handle is not NULL
+	if (dh == NULL) return DISCFERRET_E_BAD_PARAMETER;
+
+	pthread_mutex_lock(&dh->priv->lock);
+	return DISCFERRET_E_OK;
+}
+
+DISCFERRET_ERROR discferret_unlock(DISCFERRET_DEVICE_HANDLE *dh)
+{
+	// Make sure device handle is not NULL
+	if (dh == NULL) return DISCFERRET_E_BAD_PARAMETER;
+
+	pthread_mutex_unlock(&dh->priv->lock);
+	return DISCFERRET_E_OK;
+}
+
 DISCFERRET_ERROR discferret_update_capabilities(DISCFERRET_DEVICE_HANDLE *dh)
 {
 	int err;
@@ -439,12 +766,10 @@ DISCFERRET_ERROR discferret_get_info(DISCFERRET_DEVICE_HANDLE *dh, DISCFERRET_DE
 	// Send a GET VERSION command to the device
 	i=0;
 	buf[i++] = CMD_GET_VERSION;
-	r = libusb_bulk_transfer(dh->dh, 1 | LIBUSB_ENDPOINT_OUT, buf, i, &a, USB_TIMEOUT);
-	if ((r != 0) || (a != i)) return DISCFERRET_E_USB_ERROR;
-
-	// Read the response
-	r = libusb_bulk_transfer(dh->dh, 1 | LIBUSB_ENDPOINT_IN, buf, 64, &a, USB_TIMEOUT);
-	if ((r != 0) || (a < 11)) return DISCFERRET_E_USB_ERROR;
+	// Send the command and read the response
+	r = usb_command_retry(dh, buf, i, buf, 64, &a);
+	if (r != DISCFERRET_E_OK) return r;
+	if (a < 11) return DISCFERRET_E_USB_ERROR;
 
 	// Decode the response packet
 	for (i=1; i<5; i++)
@@ -487,15 +812,14 @@ DISCFERRET_ERROR discferret_fpga_load_begin(DISCFERRET_DEVICE_HANDLE *dh)
 	// Make sure device handle is not NULL
 	if (dh == NULL) return DISCFERRET_E_BAD_PARAMETER;
 
-	// Send an FPGA_INIT command
+	// Send an FPGA_INIT command and read the response code
 	unsigned char buf = CMD_FPGA_INIT;
-	int a, r;
-	r = libusb_bulk_transfer(dh->dh, 1 | LIBUSB_ENDPOINT_OUT, &buf, 1, &a, USB_TIMEOUT);
-	if ((r != 0) || (a != 1)) return DISCFERRET_E_USB_ERROR;
-
-	// Read the response code
-	r = libusb_bulk_transfer(dh->dh, 1 | LIBUSB_ENDPOINT_IN, &buf, 1, &a, USB_TIMEOUT);
-	if ((r != 0) || (a != 1)) return DISCFERRET_E_USB_ERROR;
+	int r;
+	discferret_lock(dh);
+	dh->priv->ram_addr = -1;
+	r = usb_command(dh, &buf, 1, &buf, 1, NULL);
+	discferret_unlock(dh);
+	if (r != DISCFERRET_E_OK) return r;
 
 	// Check the response code
 	switch (buf) {
@@ -533,12 +857,9 @@ DISCFERRET_ERROR discferret_fpga_load_block(DISCFERRET_DEVICE_HANDLE *dh, const
 		for (a=0; a<len; a++)
 			buf[i++] = bitswap(block[a]);
 	}
-	r = libusb_bulk_transfer(dh->dh, 1 | LIBUSB_ENDPOINT_OUT, buf, i, &a, USB_TIMEOUT);
-	if ((r != 0) || (a != i)) return DISCFERRET_E_USB_ERROR;
-
-	// Read the response code
-	r = libusb_bulk_transfer(dh->dh, 1 | LIBUSB_ENDPOINT_IN, buf, 1, &a, USB_TIMEOUT);
-	if ((r != 0) || (a != 1)) return DISCFERRET_E_USB_ERROR;
+	// Send the command and read the response code
+	r = usb_command(dh, buf, i, buf, 1, NULL);
+	if (r != DISCFERRET_E_OK) return r;
 
 	// Check the response code
 	switch (buf[0]) {
@@ -560,15 +881,11 @@ DISCFERRET_ERROR discferret_fpga_get_status(DISCFERRET_DEVICE_HANDLE *dh)
 	// Make sure device handle is not NULL
 	if (dh == NULL) return DISCFERRET_E_BAD_PARAMETER;
 
-	// Send an FPGA_POLL command
+	// Send an FPGA_POLL command and read the response code
 	unsigned char buf = CMD_FPGA_POLL;
-	int a, r;
-	r = libusb_bulk_transfer(dh->dh, 1 | LIBUSB_ENDPOINT_OUT, &buf, 1, &a, USB_TIMEOUT);
-	if ((r != 0) || (a != 1)) return DISCFERRET_E_USB_ERROR;
-
-	// Read the response code
-	r = libusb_bulk_transfer(dh->dh, 1 | LIBUSB_ENDPOINT_IN, &buf, 1, &a, USB_TIMEOUT);
-	if ((r != 0) || (a != 1)) return DISCFERRET_E_USB_ERROR;
+	int r;
+	r = usb_command_retry(dh, &buf, 1, &buf, 1, NULL);
+	if (r != DISCFERRET_E_OK) return r;
 
 	// Check the response code
 	switch (buf) {
@@ -583,6 +900,13 @@ DISCFERRET_ERROR discferret_fpga_get_status(DISCFERRET_DEVICE_HANDLE *dh)
 
 DISCFERRET_ERROR discferret_fpga_load_rbf(DISCFERRET_DEVICE_HANDLE *dh, const unsigned char *rbfdata, size_t len)
 {
+	return discferret_fpga_load_rbf_deadline(dh, rbfdata, len, 0.0, NULL);
+}
+
+DISCFERRET_ERROR discferret_fpga_load_rbf_deadline(DISCFERRET_DEVICE_HANDLE *dh, const unsigned char *rbfdata, const size_t len,
+		const double deadline, const DISCFERRET_CANCEL *cancel)
+{
+	struct discferret_deadline dl = { deadline, cancel };
 	int resp;
 
 	// Check that the library has been initialised
@@ -603,6 +927,9 @@ DISCFERRET_ERROR discferret_fpga_load_rbf(DISCFERRET_DEVICE_HANDLE *dh, const un
 	size_t pos, i;
 	pos = 0;
 	while (pos < len) {
+		// stop between blocks if we've run out of time
+		resp = discferret_deadline_check(&dl);
+		if (resp != DISCFERRET_E_OK) return resp;
 		// calculate largest block we can send without overflowing the device buffer
 		i = ((len - pos) > 62) ? 62 : (len - pos);
 		// send the block
@@ -617,7 +944,15 @@ DISCFERRET_ERROR discferret_fpga_load_rbf(DISCFERRET_DEVICE_HANDLE *dh, const un
 	if (resp != DISCFERRET_E_OK) return DISCFERRET_E_FPGA_NOT_CONFIGURED;
 
 	// Load complete. Update the capability flags.
-	return discferret_update_capabilities(dh);
+	resp = discferret_update_capabilities(dh);
+	if (resp != DISCFERRET_E_OK) return resp;
+
+	// New microcode starts with the default step rate; re-apply the drive profile
+	dh->priv->step_rate_us = 0;
+	if (dh->has_drive_profile)
+		return discferret_seek_set_rate(dh, dh->drive_profile.step_rate_us);
+
+	return DISCFERRET_E_OK;
 }
 
 int discferret_reg_peek(DISCFERRET_DEVICE_HANDLE *dh, unsigned int addr)
@@ -629,17 +964,14 @@ int discferret_reg_peek(DISCFERRET_DEVICE_HANDLE *dh, unsigned int addr)
 	if (dh == NULL) return DISCFERRET_E_BAD_PARAMETER;
 
 	unsigned char buf[64];
-	int i = 0, a, r;
+	int i = 0, r;
 	// Command code and length
 	buf[i++] = CMD_FPGA_PEEK;
 	buf[i++] = addr >> 8;
 	buf[i++] = addr & 0xff;
-	r = libusb_bulk_transfer(dh->dh, 1 | LIBUSB_ENDPOINT_OUT, buf, i, &a, USB_TIMEOUT);
-	if ((r != 0) || (a != i)) return DISCFERRET_E_USB_ERROR;
-
-	// Read the response code and data byte
-	r = libusb_bulk_transfer(dh->dh, 1 | LIBUSB_ENDPOINT_IN, buf, 2, &a, USB_TIMEOUT);
-	if ((r != 0) || (a != 2)) return DISCFERRET_E_USB_ERROR;
+	// Send the command and read the response code and data byte
+	r = usb_command_retry(dh, buf, i, buf, 2, NULL);
+	if (r != DISCFERRET_E_OK) return r;
 
 	// Check the response code
 	switch (buf[0]) {
@@ -664,18 +996,19 @@ DISCFERRET_ERROR discferret_reg_poke(DISCFERRET_DEVICE_HANDLE *dh, unsigned int
 	if (dh == NULL) return DISCFERRET_E_BAD_PARAMETER;
 
 	unsigned char buf[64];
-	int i = 0, a, r;
+	int i = 0, r;
 	// Command code and length
 	buf[i++] = CMD_FPGA_POKE;
 	buf[i++] = addr >> 8;
 	buf[i++] = addr & 0xff;
 	buf[i++] = data;
-	r = libusb_bulk_transfer(dh->dh, 1 | LIBUSB_ENDPOINT_OUT, buf, i, &a, USB_TIMEOUT);
-	if ((r != 0) || (a != i)) return DISCFERRET_E_USB_ERROR;
-
-	// Read the response code
-	r = libusb_bulk_transfer(dh->dh, 1 | LIBUSB_ENDPOINT_IN, buf, 1, &a, USB_TIMEOUT);
-	if ((r != 0) || (a != 1)) return DISCFERRET_E_USB_ERROR;
+	// Send the command and read the response code. Acquisitions and writes
+	// are started by register writes, and move the RAM address pointer.
+	discferret_lock(dh);
+	dh->priv->ram_addr = -1;
+	r = usb_command(dh, buf, i, buf, 1, NULL);
+	discferret_unlock(dh);
+	if (r != DISCFERRET_E_OK) return r;
 
 	// Check the response code
 	switch (buf[0]) {
@@ -695,23 +1028,19 @@ long discferret_ram_addr_get(DISCFERRET_DEVICE_HANDLE *dh)
 	if (dh == NULL) return DISCFERRET_E_BAD_PARAMETER;
 
 	unsigned char buf[64];
-	int i = 0, a, r;
+	int i = 0, r;
+	long addr;
 	// Command code and length
 	buf[i++] = CMD_RAM_ADDR_GET;
-	r = libusb_bulk_transfer(dh->dh, 1 | LIBUSB_ENDPOINT_OUT, buf, i, &a, USB_TIMEOUT);
-	if ((r != 0) || (a != i)) return DISCFERRET_E_USB_ERROR;
-
-	// Read the response code and data byte
-	r = libusb_bulk_transfer(dh->dh, 1 | LIBUSB_ENDPOINT_IN, buf, 4, &a, USB_TIMEOUT);
-	if ((r != 0) || (a != 4)) return DISCFERRET_E_USB_ERROR;
-
-	// Check the response code
-	switch (buf[0]) {
-		case FW_ERR_OK:
-			return (buf[1]) + (buf[2] << 8) + (buf[3] << 16);
-		default:
-			return DISCFERRET_E_USB_ERROR;
-	}
+	// Send the command and read the response code and data byte
+	discferret_lock(dh);
+	r = usb_command_retry(dh, buf, i, buf, 4, NULL);
+	if ((r == DISCFERRET_E_OK) && (buf[0] != FW_ERR_OK)) r = DISCFERRET_E_USB_ERROR;
+	addr = (r == DISCFERRET_E_OK) ? (buf[1]) + (buf[2] << 8) + (buf[3] << 16) : r;
+	dh->priv->ram_addr = (r == DISCFERRET_E_OK) ? addr : -1;
+	discferret_unlock(dh);
+
+	return addr;
 }
 
 DISCFERRET_ERROR discferret_ram_addr_set(DISCFERRET_DEVICE_HANDLE *dh, unsigned long addr)
@@ -723,37 +1052,51 @@ DISCFERRET_ERROR discferret_ram_addr_set(DISCFERRET_DEVICE_HANDLE *dh, unsigned
 	if (dh == NULL) return DISCFERRET_E_BAD_PARAMETER;
 
 	unsigned char buf[64];
-	int i = 0, a, r;
+	int i = 0, r;
 	// Command code and length
 	buf[i++] = CMD_RAM_ADDR_SET;
 	buf[i++] = addr & 0xff;
 	buf[i++] = addr >> 8;
 	buf[i++] = addr >> 16;
-	r = libusb_bulk_transfer(dh->dh, 1 | LIBUSB_ENDPOINT_OUT, buf, i, &a, USB_TIMEOUT);
-	if ((r != 0) || (a != i)) return DISCFERRET_E_USB_ERROR;
-
-	// Read the response code
-	r = libusb_bulk_transfer(dh->dh, 1 | LIBUSB_ENDPOINT_IN, buf, 1, &a, USB_TIMEOUT);
-	if ((r != 0) || (a != 1)) return DISCFERRET_E_USB_ERROR;
+	// Send the command and read the response code
+	discferret_lock(dh);
+	r = usb_command_retry(dh, buf, i, buf, 1, NULL);
+	if ((r == DISCFERRET_E_OK) && (buf[0] != FW_ERR_OK)) r = DISCFERRET_E_USB_ERROR;
+	// Remember where the pointer is, so a failed RAM read can be retried from the right place
+	dh->priv->ram_addr = (r == DISCFERRET_E_OK) ? (long)addr : -1;
+	discferret_unlock(dh);
+
+	return r;
+}
 
-	// Check the response code
-	switch (buf[0]) {
-		case FW_ERR_OK:
-			return DISCFERRET_E_OK;
-		default:
-			return DISCFERRET_E_USB_ERROR;
-	}
+/**
+ * @brief	Move the tracked RAM address pointer on after a transfer
+ * @param	dh		DiscFerret device handle.
+ * @param	len		Number of bytes transferred, or 0 if the transfer failed
+ * 					(which leaves the pointer's position unknown).
+ *
+ * Caller must hold the handle lock.
+ */
+static void ram_addr_advance(DISCFERRET_DEVICE_HANDLE *dh, const size_t len)
+{
+	if ((len == 0) || (dh->priv->ram_addr < 0))
+		dh->priv->ram_addr = -1;
+	else
+		dh->priv->ram_addr += len;
 }
 
-static int ramWrite_private(DISCFERRET_DEVICE_HANDLE *dh, const unsigned char *block, size_t len)
+/**
+ * Caller must hold the handle lock (the packet buffer is shared).
+ */
+static int ramWrite_private(DISCFERRET_DEVICE_HANDLE *dh, const unsigned char *block, size_t len, const struct discferret_deadline *dl)
 {
-	unsigned char packet[65536+3];
+	unsigned char *packet = dh->priv->packet;
 	size_t i = 0;
-	int r, a;
+	int r;
 
 	if (dh->has_fast_ram_access) {
-		// Fast Write can write up to 64K in a chunk
-		if (len > 65536) return DISCFERRET_E_BAD_PARAMETER;
+		// Fast Write can write up to 64K in a chunk; we only send full packets
+		if (len > DISCFERRET_PACKET_SIZE-3) return DISCFERRET_E_BAD_PARAMETER;
 		packet[i++] = CMD_RAM_WRITE_FAST;
 		packet[i++] = (len-1) & 0xff;
 		packet[i++] = (len-1) >> 8;
@@ -769,13 +1112,9 @@ static int ramWrite_private(DISCFERRET_DEVICE_HANDLE *dh, const unsigned char *b
 	memcpy(&packet[i], block, len);
 	i += len;
 
-	// Send the packet
-	r = libusb_bulk_transfer(dh->dh, 1 | LIBUSB_ENDPOINT_OUT, packet, i, &a, USB_TIMEOUT);
-	if ((r != 0) || (a != i)) return DISCFERRET_E_USB_ERROR;
-
-	// Read the response code
-	r = libusb_bulk_transfer(dh->dh, 1 | LIBUSB_ENDPOINT_IN, packet, 1, &a, USB_TIMEOUT);
-	if ((r != 0) || (a != 1)) return DISCFERRET_E_USB_ERROR;
+	// Send the packet and read the response code
+	r = usb_command_dl(dh, packet, i, packet, 1, NULL, dl, 0);
+	if (r != DISCFERRET_E_OK) return r;
 
 	// Check the response code
 	switch (packet[0]) {
@@ -786,8 +1125,188 @@ static int ramWrite_private(DISCFERRET_DEVICE_HANDLE *dh, const unsigned char *b
 	}
 }
 
+/**
+ * @brief	A Fast Write packet in flight: the command transfer, and the
+ * 			transfer which collects its response.
+ */
+struct ram_write_slot {
+	struct libusb_transfer	*out;		///< Command packet (header and data)
+	struct libusb_transfer	*in;		///< Response packet (status byte)
+	unsigned char			*packet;	///< Packet buffer, from the handle's pool
+	unsigned char			resp[64];	///< Response buffer
+	int						pending;	///< Number of transfers still outstanding (atomic)
+	int						done;		///< Set once both transfers have completed (atomic)
+	bool					busy;		///< True while the slot's transfers are submitted
+};
+
+/// libusb completion callback for Fast Write transfers
+static void ram_write_cb(struct libusb_transfer *xfer)
+{
+	struct ram_write_slot *slot = xfer->user_data;
+
+	if (__atomic_sub_fetch(&slot->pending, 1, __ATOMIC_ACQ_REL) == 0)
+		__atomic_store_n(&slot->done, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief	Wait for a slot's transfers to complete
+ *
+ * The registry's event thread may be handling events too; libusb lets
+ * several threads do that as long as each waits on its own completion flag.
+ */
+static void ram_write_slot_wait(struct ram_write_slot *slot)
+{
+	while (!__atomic_load_n(&slot->done, __ATOMIC_ACQUIRE))
+		libusb_handle_events_completed(usbctx, &slot->done);
+	slot->busy = false;
+}
+
+/**
+ * @brief	Check the outcome of a completed slot
+ */
+static DISCFERRET_ERROR ram_write_slot_result(const struct ram_write_slot *slot)
+{
+	if ((slot->out->status != LIBUSB_TRANSFER_COMPLETED) || (slot->out->actual_length != slot->out->length))
+		return DISCFERRET_E_USB_ERROR;
+	if ((slot->in->status != LIBUSB_TRANSFER_COMPLETED) || (slot->in->actual_length < 1))
+		return DISCFERRET_E_USB_ERROR;
+	return (slot->resp[0] == FW_ERR_OK) ? DISCFERRET_E_OK : DISCFERRET_E_USB_ERROR;
+}
+
+/**
+ * @brief	Track whether the command stream was left part way through a packet
+ * @param	slot	Completed slot, taken in the order the packets were sent.
+ * @param	prev	Result for the packets sent before this one.
+ * @returns	The slot whose command was cut short, if it's the last one to
+ * 			have reached the device; otherwise NULL.
+ */
+static struct ram_write_slot *ram_write_slot_short(struct ram_write_slot *slot, struct ram_write_slot *prev)
+{
+	if (slot->out->actual_length == 0) return prev;
+	return (slot->out->actual_length < slot->out->length) ? slot : NULL;
+}
+
+/**
+ * @brief	Upload a block to RAM with pipelined Fast Write packets
+ *
+ * Caller must hold the handle lock. Each packet is sent along with a
+ * transfer to collect its response, and up to RAM_WRITE_DEPTH packets are
+ * kept in flight, so the device always has the next packet queued instead
+ * of waiting a round trip for the host to see each ack. Responses are
+ * checked in order as the oldest slot completes.
+ *
+ * Once the deadline passes (or the token is cancelled), or a packet fails,
+ * no more packets are queued, but the ones in flight are left to finish.
+ */
+static DISCFERRET_ERROR ramWrite_pipelined(DISCFERRET_DEVICE_HANDLE *dh, const unsigned char *block, size_t len,
+		const struct discferret_deadline *dl)
+{
+	struct ram_write_slot slots[RAM_WRITE_DEPTH];
+	const size_t blksz = DISCFERRET_PACKET_SIZE - 3;
+	DISCFERRET_ERROR err = DISCFERRET_E_OK, stop = DISCFERRET_E_OK;
+	struct ram_write_slot *short_slot = NULL;
+	size_t pos = 0;
+	unsigned int head = 0, tail = 0;
+
+	memset(slots, 0, sizeof(slots));
+	for (unsigned int i = 0; i < RAM_WRITE_DEPTH; i++) {
+		slots[i].out = libusb_alloc_transfer(0);
+		slots[i].in = libusb_alloc_transfer(0);
+		slots[i].packet = discferret_pool_get(dh->priv->pool, DISCFERRET_PACKET_SIZE);
+		if ((slots[i].out == NULL) || (slots[i].in == NULL) || (slots[i].packet == NULL)) {
+			err = DISCFERRET_E_OUT_OF_MEMORY;
+			break;
+		}
+	}
+
+	while ((err == DISCFERRET_E_OK) && (((pos < len) && (stop == DISCFERRET_E_OK)) || (tail != head))) {
+		// Queue packets until the pipeline is full
+		if ((pos < len) && (head - tail < RAM_WRITE_DEPTH) && ((stop = discferret_deadline_check(dl)) == DISCFERRET_E_OK)) {
+			struct ram_write_slot *slot = &slots[head % RAM_WRITE_DEPTH];
+			size_t n = ((len - pos) > blksz) ? blksz : (len - pos);
+
+			slot->packet[0] = CMD_RAM_WRITE_FAST;
+			slot->packet[1] = (n-1) & 0xff;
+			slot->packet[2] = (n-1) >> 8;
+			memcpy(&slot->packet[3], &block[pos], n);
+
+			libusb_fill_bulk_transfer(slot->out, dh->dh, 1 | LIBUSB_ENDPOINT_OUT, slot->packet, n + 3, ram_write_cb, slot, USB_TIMEOUT);
+			libusb_fill_bulk_transfer(slot->in, dh->dh, 1 | LIBUSB_ENDPOINT_IN, slot->resp, sizeof(slot->resp), ram_write_cb, slot, USB_TIMEOUT);
+			slot->pending = 2;
+			slot->done = 0;
+
+			if (libusb_submit_transfer(slot->out) != 0) {
+				err = DISCFERRET_E_USB_ERROR;
+				break;
+			}
+			slot->busy = true;
+			if (libusb_submit_transfer(slot->in) != 0) {
+				// The response transfer never started, so count it as finished;
+				// the command is already on its way and is left to complete below
+				ram_write_cb(slot->in);
+				err = DISCFERRET_E_USB_ERROR;
+				break;
+			}
+
+			head++;
+			pos += n;
+			continue;
+		}
+
+		// Pipeline full (or all sent, or out of time): retire the oldest packet
+		if (tail == head) continue;
+		ram_write_slot_wait(&slots[tail % RAM_WRITE_DEPTH]);
+		short_slot = ram_write_slot_short(&slots[tail % RAM_WRITE_DEPTH], short_slot);
+		err = ram_write_slot_result(&slots[tail % RAM_WRITE_DEPTH]);
+		tail++;
+	}
+
+	// On error, stop collecting responses but let the commands already queued
+	// finish: a Fast Write cut off part way through leaves the device waiting
+	// for the rest of its payload, and it would take the resync for data.
+	// Slots are walked in the order they were sent (the one at head is still
+	// busy if its response transfer failed to submit).
+	for (unsigned int i = tail; i != head + 1; i++) {
+		struct ram_write_slot *slot = &slots[i % RAM_WRITE_DEPTH];
+
+		if (!slot->busy) continue;
+		libusb_cancel_transfer(slot->in);
+		ram_write_slot_wait(slot);
+		short_slot = ram_write_slot_short(slot, short_slot);
+	}
+
+	// If the last packet to get anywhere timed out part way, send the rest
+	// of it so the device is back at a command boundary
+	if (short_slot != NULL) {
+		int done;
+		libusb_bulk_transfer(dh->dh, 1 | LIBUSB_ENDPOINT_OUT, short_slot->packet + short_slot->out->actual_length,
+				short_slot->out->length - short_slot->out->actual_length, &done, USB_TIMEOUT);
+	}
+
+	for (unsigned int i = 0; i < RAM_WRITE_DEPTH; i++) {
+		if (slots[i].out != NULL) libusb_free_transfer(slots[i].out);
+		if (slots[i].in != NULL) libusb_free_transfer(slots[i].in);
+		if (slots[i].packet != NULL) discferret_pool_put(dh->priv->pool, slots[i].packet);
+	}
+
+	// Get the command stream back in step so the handle stays usable
+	if (err == DISCFERRET_E_USB_ERROR) {
+		__atomic_add_fetch(&dh->priv->usb_stats.errors, 1, __ATOMIC_RELAXED);
+		usb_recover(dh);
+	}
+
+	return (err != DISCFERRET_E_OK) ? err : stop;
+}
+
 DISCFERRET_ERROR discferret_ram_write(DISCFERRET_DEVICE_HANDLE *dh, const unsigned char *block, size_t len)
 {
+	return discferret_ram_write_deadline(dh, block, len, 0.0, NULL);
+}
+
+DISCFERRET_ERROR discferret_ram_write_deadline(DISCFERRET_DEVICE_HANDLE *dh, const unsigned char *block, const size_t len,
+		const double deadline, const DISCFERRET_CANCEL *cancel)
+{
+	struct discferret_deadline dl = { deadline, cancel };
 	size_t blksz, pos, i;
 	int resp;
 
@@ -801,6 +1320,17 @@ DISCFERRET_ERROR discferret_ram_write(DISCFERRET_DEVICE_HANDLE *dh, const unsign
 	if (block == NULL) return DISCFERRET_E_BAD_PARAMETER;
 	if (len == 0) return DISCFERRET_E_BAD_PARAMETER;
 
+	// Keep the RAM address pointer to ourselves until the transfer is done
+	discferret_lock(dh);
+
+	// Anything more than one Fast Write packet goes through the pipeline
+	if (dh->has_fast_ram_access && (len > DISCFERRET_PACKET_SIZE-3)) {
+		resp = ramWrite_pipelined(dh, block, len, &dl);
+		ram_addr_advance(dh, (resp == DISCFERRET_E_OK) ? len : 0);
+		discferret_unlock(dh);
+		return resp;
+	}
+
 	if (dh->has_fast_ram_access)
 		// Note that Fast Write can send 65536 bytes, but this involves sending
 		// a final packet with only 3 bytes in it, which is a bit wasteful.
@@ -815,20 +1345,26 @@ DISCFERRET_ERROR discferret_ram_write(DISCFERRET_DEVICE_HANDLE *dh, const unsign
 		// Calculate largest possible block size
 		i = ((len - pos) > blksz) ? blksz : (len - pos);
 		// Send the data block
-		resp = ramWrite_private(dh, &block[pos], i);
-		if (resp != DISCFERRET_E_OK) return resp;
+		resp = ramWrite_private(dh, &block[pos], i, &dl);
+		if (resp != DISCFERRET_E_OK) {
+			ram_addr_advance(dh, 0);
+			discferret_unlock(dh);
+			return resp;
+		}
 		// update read pointer
 		pos += i;
 	}
 
+	ram_addr_advance(dh, len);
+	discferret_unlock(dh);
 	return DISCFERRET_E_OK;
 }
 
-static int ramRead_private(DISCFERRET_DEVICE_HANDLE *dh, unsigned char *block, size_t len)
+static int ramRead_private(DISCFERRET_DEVICE_HANDLE *dh, unsigned char *block, size_t len, const struct discferret_deadline *dl)
 {
-	unsigned char packet[65536+3];
+	unsigned char packet[64];
 	size_t i = 0;
-	int r, a;
+	int r;
 
 	if (dh->has_fast_ram_access) {
 		// Fast Read can read up to 64K in a chunk
@@ -844,23 +1380,13 @@ static int ramRead_private(DISCFERRET_DEVICE_HANDLE *dh, unsigned char *block, s
 		packet[i++] = len >> 8;
 	}
 
-	// Send the command packet
-	r = libusb_bulk_transfer(dh->dh, 1 | LIBUSB_ENDPOINT_OUT, packet, i, &a, USB_TIMEOUT);
-	if ((r != 0) || (a != i)) return DISCFERRET_E_USB_ERROR;
-
 	if (dh->has_fast_ram_access) {
-		// Fast Read: read the data block
-		r = libusb_bulk_transfer(dh->dh, 1 | LIBUSB_ENDPOINT_IN, packet, len, &a, USB_TIMEOUT);
-		if ((r != 0) || (a != len)) return DISCFERRET_E_USB_ERROR;
-
-		// Copy data block into user buffer
-		memcpy(block, packet, len);
-
-		return DISCFERRET_E_OK;
+		// Fast Read: send the command and read the data block straight into the user buffer
+		return usb_command_dl(dh, packet, i, block, len, NULL, dl, 0);
 	} else {
-		// Slow Read: read the response code and data block
-		r = libusb_bulk_transfer(dh->dh, 1 | LIBUSB_ENDPOINT_IN, packet, len+1, &a, USB_TIMEOUT);
-		if ((r != 0) || (a != (len+1))) return DISCFERRET_E_USB_ERROR;
+		// Slow Read: send the command and read the response code and data block
+		r = usb_command_dl(dh, packet, i, packet, len+1, NULL, dl, 0);
+		if (r != DISCFERRET_E_OK) return r;
 
 		// Copy data block into user buffer
 		memcpy(block, &packet[1], len);
@@ -877,7 +1403,16 @@ static int ramRead_private(DISCFERRET_DEVICE_HANDLE *dh, unsigned char *block, s
 
 DISCFERRET_ERROR discferret_ram_read(DISCFERRET_DEVICE_HANDLE *dh, unsigned char *block, size_t len)
 {
+	return discferret_ram_read_deadline(dh, block, len, 0.0, NULL);
+}
+
+DISCFERRET_ERROR discferret_ram_read_deadline(DISCFERRET_DEVICE_HANDLE *dh, unsigned char *block, const size_t len,
+		const double deadline, const DISCFERRET_CANCEL *cancel)
+{
+	struct discferret_deadline dl = { deadline, cancel };
 	size_t blksz, pos, i;
+	unsigned int n;
+	long start;
 	int resp;
 
 	// Check that the library has been initialised
@@ -897,17 +1432,33 @@ DISCFERRET_ERROR discferret_ram_read(DISCFERRET_DEVICE_HANDLE *dh, unsigned char
 		// no Fast Read support, max 64 bytes in a packet, less 1-byte header
 		blksz = 64-1;
 
+	// Keep the RAM address pointer to ourselves until the transfer is done
+	discferret_lock(dh);
+	start = dh->priv->ram_addr;
+
 	pos = 0;
 	while (pos < len) {
 		// Calculate largest possible block size
 		i = ((len - pos) > blksz) ? blksz : (len - pos);
 		// Read the data block
-		resp = ramRead_private(dh, &block[pos], i);
-		if (resp != DISCFERRET_E_OK) return resp;
+		resp = ramRead_private(dh, &block[pos], i, &dl);
+		// If we know where the chunk started and the link is back in step, read it again
+		for (n = 0; (resp == DISCFERRET_E_USB_ERROR) && (start >= 0) && !dh->priv->usb_lost && (n < USB_RETRIES); n++) {
+			if (discferret_ram_addr_set(dh, start + pos) != DISCFERRET_E_OK) break;
+			__atomic_add_fetch(&dh->priv->usb_stats.retries, 1, __ATOMIC_RELAXED);
+			resp = ramRead_private(dh, &block[pos], i, &dl);
+		}
+		if (resp != DISCFERRET_E_OK) {
+			ram_addr_advance(dh, 0);
+			discferret_unlock(dh);
+			return resp;
+		}
 		// update read pointer
 		pos += i;
 	}
 
+	ram_addr_advance(dh, len);
+	discferret_unlock(dh);
 	return DISCFERRET_E_OK;
 }
 
@@ -928,6 +1479,130 @@ long discferret_get_status(DISCFERRET_DEVICE_HANDLE *dh)
 	return (rvb << 8) + rva;
 }
 
+/**
+ * @brief	Sleep for <i>us</i> microseconds, or until the token is cancelled
+ */
+static void wait_sleep(unsigned long us, const struct discferret_deadline *dl)
+{
+	if ((dl == NULL) || (dl->cancel == NULL)) {
+		discferret_sleep_us(us);
+		return;
+	}
+
+	while ((us > 0) && !discferret_cancelled(dl->cancel)) {
+		unsigned long slice = (us > WAIT_CANCEL_SLICE_US) ? WAIT_CANCEL_SLICE_US : us;
+		discferret_sleep_us(slice);
+		us -= slice;
+	}
+}
+
+DISCFERRET_ERROR discferret_wait_status(DISCFERRET_DEVICE_HANDLE *dh, const unsigned long mask, const unsigned long value,
+		const double expect, const double deadline_in, long *status, unsigned long *polls, const struct discferret_deadline *dl)
+{
+	DISCFERRET_WAIT_STATS *ws = &dh->priv->wait_stats;
+	unsigned long sleep_us = WAIT_POLL_MIN_US, n = 0;
+	double start = discferret_host_time(), deadline = deadline_in, wake, now;
+	DISCFERRET_ERROR err;
+	long st = 0;
+
+	// The caller's deadline may be tighter than the operation's own
+	if ((dl != NULL) && (dl->deadline > 0.0) && (dl->deadline < deadline)) deadline = dl->deadline;
+
+	// Sleep through the bulk of the operation (but not past the deadline)
+	wake = ((expect < deadline) ? expect : deadline) - WAIT_POLL_MARGIN;
+	if (wake > start) wait_sleep((unsigned long)((wake - start) * 1e6), dl);
+
+	// Then poll with a backoff
+	for (;;) {
+		if ((dl != NULL) && discferret_cancelled(dl->cancel)) {
+			now = discferret_host_time();
+			err = DISCFERRET_E_CANCELLED;
+			break;
+		}
+
+		st = discferret_get_status(dh);
+		now = discferret_host_time();
+		n++;
+		if (st < 0) {
+			err = st;
+			break;
+		}
+		if (((unsigned long)st & mask) == value) {
+			err = DISCFERRET_E_OK;
+			break;
+		}
+		if (now >= deadline) {
+			err = DISCFERRET_E_TIMEOUT;
+			break;
+		}
+
+		if (sleep_us > (deadline - now) * 1e6) sleep_us = (unsigned long)((deadline - now) * 1e6) + 1;
+		wait_sleep(sleep_us, dl);
+		sleep_us = (sleep_us * 2 < WAIT_POLL_MAX_US) ? sleep_us * 2 : WAIT_POLL_MAX_US;
+	}
+
+	__atomic_add_fetch(&ws->waits, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&ws->polls, n, __ATOMIC_RELAXED);
+	if (err == DISCFERRET_E_TIMEOUT) __atomic_add_fetch(&ws->timeouts, 1, __ATOMIC_RELAXED);
+	else if (err != DISCFERRET_E_OK) __atomic_add_fetch(&ws->errors, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&ws->wait_us, (unsigned long)((now - start) * 1e6), __ATOMIC_RELAXED);
+	if (now > expect) __atomic_add_fetch(&ws->overrun_us, (unsigned long)((now - ((expect > start) ? expect : start)) * 1e6), __ATOMIC_RELAXED);
+
+	if (status != NULL) *status = st;
+	if (polls != NULL) *polls += n;
+	return err;
+}
+
+DISCFERRET_ERROR discferret_get_wait_stats(DISCFERRET_DEVICE_HANDLE *dh, DISCFERRET_WAIT_STATS *stats, const bool reset)
+{
+	DISCFERRET_WAIT_STATS *ws;
+
+	// Make sure parameters are not NULL
+	if ((dh == NULL) || (stats == NULL)) return DISCFERRET_E_BAD_PARAMETER;
+	ws = &dh->priv->wait_stats;
+
+	if (reset) {
+		stats->waits = __atomic_exchange_n(&ws->waits, 0, __ATOMIC_RELAXED);
+		stats->polls = __atomic_exchange_n(&ws->polls, 0, __ATOMIC_RELAXED);
+		stats->timeouts = __atomic_exchange_n(&ws->timeouts, 0, __ATOMIC_RELAXED);
+		stats->errors = __atomic_exchange_n(&ws->errors, 0, __ATOMIC_RELAXED);
+		stats->wait_us = __atomic_exchange_n(&ws->wait_us, 0, __ATOMIC_RELAXED);
+		stats->overrun_us = __atomic_exchange_n(&ws->overrun_us, 0, __ATOMIC_RELAXED);
+	} else {
+		stats->waits = __atomic_load_n(&ws->waits, __ATOMIC_RELAXED);
+		stats->polls = __atomic_load_n(&ws->polls, __ATOMIC_RELAXED);
+		stats->timeouts = __atomic_load_n(&ws->timeouts, __ATOMIC_RELAXED);
+		stats->errors = __atomic_load_n(&ws->errors, __ATOMIC_RELAXED);
+		stats->wait_us = __atomic_load_n(&ws->wait_us, __ATOMIC_RELAXED);
+		stats->overrun_us = __atomic_load_n(&ws->overrun_us, __ATOMIC_RELAXED);
+	}
+
+	return DISCFERRET_E_OK;
+}
+
+DISCFERRET_ERROR discferret_get_usb_stats(DISCFERRET_DEVICE_HANDLE *dh, DISCFERRET_USB_STATS *stats, const bool reset)
+{
+	DISCFERRET_USB_STATS *us;
+
+	// Make sure parameters are not NULL
+	if ((dh == NULL) || (stats == NULL)) return DISCFERRET_E_BAD_PARAMETER;
+	us = &dh->priv->usb_stats;
+
+	if (reset) {
+		stats->errors = __atomic_exchange_n(&us->errors, 0, __ATOMIC_RELAXED);
+		stats->recoveries = __atomic_exchange_n(&us->recoveries, 0, __ATOMIC_RELAXED);
+		stats->retries = __atomic_exchange_n(&us->retries, 0, __ATOMIC_RELAXED);
+		stats->failures = __atomic_exchange_n(&us->failures, 0, __ATOMIC_RELAXED);
+	} else {
+		stats->errors = __atomic_load_n(&us->errors, __ATOMIC_RELAXED);
+		stats->recoveries = __atomic_load_n(&us->recoveries, __ATOMIC_RELAXED);
+		stats->retries = __atomic_load_n(&us->retries, __ATOMIC_RELAXED);
+		stats->failures = __atomic_load_n(&us->failures, __ATOMIC_RELAXED);
+	}
+
+	return DISCFERRET_E_OK;
+}
+
 DISCFERRET_ERROR discferret_get_index_time(DISCFERRET_DEVICE_HANDLE *dh, bool wait, double *timeval)
 {
 	int err;
@@ -938,25 +1613,46 @@ DISCFERRET_ERROR discferret_get_index_time(DISCFERRET_DEVICE_HANDLE *dh, bool wa
 		return DISCFERRET_E_NOT_SUPPORTED;
 	}
 
+	// If the index monitor is running, it has the measurement already
+	if (dh->priv->index_monitor != NULL)
+		return discferret_index_monitor_sample(dh, wait, timeval);
+
 	// Wait for a new measurement if we've been asked to do so
 	if (wait && dh->has_index_freq_avail_flag) {
-		int x = 0;
-		do {
-			x = discferret_get_status(dh);
-		} while ((x >= 0) && ((x & DISCFERRET_STATUS_NEW_INDEX_MEAS) == 0));
-		if (x < 0) return x;
+		double now = discferret_host_time(), expect = now, period, seen;
+
+		// The next measurement is due a whole number of revolutions after the last one we saw
+		discferret_lock(dh);
+		period = dh->priv->index_period;
+		seen = dh->priv->index_seen;
+		discferret_unlock(dh);
+		if ((period > 0.0) && (seen > 0.0))
+			expect = seen + (floor((now - seen) / period) + 1.0) * period;
+
+		err = discferret_wait_status(dh, DISCFERRET_STATUS_NEW_INDEX_MEAS, DISCFERRET_STATUS_NEW_INDEX_MEAS,
+				expect, now + DISCFERRET_INDEX_TIMEOUT, NULL, NULL, NULL);
+		if (err != DISCFERRET_E_OK) return err;
+		now = discferret_host_time();
+
+		discferret_lock(dh);
+		dh->priv->index_seen = now;
+		discferret_unlock(dh);
 	}
 
-	// Get the time measurement
+	// Get the time measurement. Reading the high byte latches the low byte,
+	// so nothing else may read the index registers in between.
+	discferret_lock(dh);
 	err = discferret_reg_peek(dh, DISCFERRET_R_INDEX_FREQ_HIGH);
-	if (err < 0) return err;
+	if (err < 0) { discferret_unlock(dh); return err; }
 	i = ((uint16_t)err) << 8;
 	err = discferret_reg_peek(dh, DISCFERRET_R_INDEX_FREQ_LOW);
-	if (err < 0) return err;
+	if (err < 0) { discferret_unlock(dh); return err; }
 	i = i + (err & 0xff);
 
 	// Convert number of counts into a real time value
 	*timeval = ((double)i) * dh->index_freq_multiplier;
+	dh->priv->index_period = *timeval;
+	discferret_unlock(dh);
 
 	return DISCFERRET_E_OK;
 }
@@ -978,7 +1674,7 @@ DISCFERRET_ERROR discferret_get_index_frequency(DISCFERRET_DEVICE_HANDLE *dh, bo
 
 DISCFERRET_ERROR discferret_seek_set_rate(DISCFERRET_DEVICE_HANDLE *dh, unsigned long steprate_us)
 {
-	int srval;
+	int srval, err;
 
 	// Make sure step rate is sane (at least 1*RES and no greater than 256*RES)
 	if (steprate_us < dh->step_rate_res_us)
@@ -993,11 +1689,52 @@ DISCFERRET_ERROR discferret_seek_set_rate(DISCFERRET_DEVICE_HANDLE *dh, unsigned
 	if ((srval < 0) || (srval > 255))
 		return DISCFERRET_E_BAD_PARAMETER;
 
-	return discferret_reg_poke(dh, DISCFERRET_R_STEP_RATE, srval);
+	if ((err = discferret_reg_poke(dh, DISCFERRET_R_STEP_RATE, srval)) != DISCFERRET_E_OK) return err;
+
+	dh->priv->step_rate_us = steprate_us;
+	return DISCFERRET_E_OK;
+}
+
+/**
+ * @brief	Wait for the stepping controller to finish a seek
+ * @param	dh		DiscFerret device handle.
+ * @param	steps	Number of steps issued.
+ * @param	expect	Number of steps expected before the seek ends (fewer than <i>steps</i> if it will stop at track zero).
+ * @param	status	Receives the status word at the end of the seek.
+ * @param	dl		Caller's deadline and cancellation token, or NULL.
+ *
+ * The expected duration comes from the step rate, if one has been set.
+ * Without it, the deadline assumes the slowest step rate the DiscFerret supports.
+ */
+static DISCFERRET_ERROR seek_wait(DISCFERRET_DEVICE_HANDLE *dh, const unsigned long steps, const unsigned long expect, long *status,
+		const struct discferret_deadline *dl)
+{
+	unsigned long rate = dh->priv->step_rate_us;
+	unsigned long worst = (rate > 0) ? rate : ((unsigned long)dh->step_rate_res_us * 256);
+	double now = discferret_host_time();
+
+	return discferret_wait_status(dh, DISCFERRET_STATUS_STEPPING, 0, now + ((double)expect * rate * 1.0e-6),
+			now + (2.0 * steps * worst * 1.0e-6) + WAIT_SEEK_MARGIN, status, NULL, dl);
+}
+
+/**
+ * @brief	Wait for the heads to settle after a seek, if a drive profile is set
+ */
+static void seek_settle(DISCFERRET_DEVICE_HANDLE *dh)
+{
+	if (dh->has_drive_profile && !dh->priv->autotuning && (dh->drive_profile.settle_us > 0))
+		discferret_sleep_us(dh->drive_profile.settle_us);
 }
 
 DISCFERRET_ERROR discferret_seek_recalibrate(DISCFERRET_DEVICE_HANDLE *dh, unsigned long maxsteps)
 {
+	return discferret_seek_recalibrate_deadline(dh, maxsteps, 0.0, NULL);
+}
+
+DISCFERRET_ERROR discferret_seek_recalibrate_deadline(DISCFERRET_DEVICE_HANDLE *dh, const unsigned long maxsteps,
+		const double deadline, const DISCFERRET_CANCEL *cancel)
+{
+	struct discferret_deadline dl = { deadline, cancel };
 	unsigned long stepcnt = maxsteps;
 
 	// max number of steps must be at least 1
@@ -1008,9 +1745,13 @@ DISCFERRET_ERROR discferret_seek_recalibrate(DISCFERRET_DEVICE_HANDLE *dh, unsig
 	// seek back, abort if we hit track 0
 	bool track0_hit = false;
 	while ((stepcnt > 0) && (!track0_hit)) {
+		unsigned long thisstep, expect;
+		long status;
+		DISCFERRET_ERROR err;
+
 		if (dh->has_extended_seek) {
 			// figure out how many steps we can move
-			unsigned long thisstep = (stepcnt > 32768) ? 32768 : stepcnt;
+			thisstep = (stepcnt > 32768) ? 32768 : stepcnt;
 			stepcnt -= thisstep;
 
 			// now move the head by that number of steps
@@ -1018,23 +1759,24 @@ DISCFERRET_ERROR discferret_seek_recalibrate(DISCFERRET_DEVICE_HANDLE *dh, unsig
 			discferret_reg_poke(dh, DISCFERRET_R_STEP_CMD, DISCFERRET_STEP_CMD_TOWARDS_ZERO | ((thisstep-1) & 0x7f));
 		} else {
 			// figure out how many steps we can move
-			unsigned long thisstep = (stepcnt > (DISCFERRET_STEP_COUNT_MASK+1)) ? (DISCFERRET_STEP_COUNT_MASK+1) : stepcnt;
+			thisstep = (stepcnt > (DISCFERRET_STEP_COUNT_MASK+1)) ? (DISCFERRET_STEP_COUNT_MASK+1) : stepcnt;
 			stepcnt -= thisstep;
 
 			// now move the head by that number of steps
 			discferret_reg_poke(dh, DISCFERRET_R_STEP_CMD, DISCFERRET_STEP_CMD_TOWARDS_ZERO | (thisstep-1));
 		}
 
-		// wait for the seek to complete
-		long status;
-		do {
-			// get discferret status
-			status = discferret_get_status(dh);
-
-			// if get_status returns an error code, pass it back to the caller
-			if (status < 0)
-				return status;
-		} while ((status & DISCFERRET_STATUS_STEPPING) != 0);
+		// wait for the seek to complete. It stops at track 0, so if we know
+		// where the heads are, we know roughly how long it'll take.
+		expect = thisstep;
+		if (dh->current_track < 0)
+			expect = 0;
+		else if ((unsigned long)dh->current_track < thisstep)
+			expect = dh->current_track;
+		if ((err = seek_wait(dh, thisstep, expect, &status, &dl)) != DISCFERRET_E_OK) {
+			dh->current_track = -1;
+			return err;
+		}
 
 		// did we reach track 0?
 		if (dh->has_track0_flag) {
@@ -1046,6 +1788,9 @@ DISCFERRET_ERROR discferret_seek_recalibrate(DISCFERRET_DEVICE_HANDLE *dh, unsig
 		}
 	}
 
+	// let the heads settle before anyone tries to read
+	seek_settle(dh);
+
 	// we're now either at track 0, or somewhere between last_known_track and track 0...
 	// if we didn't hit T0, then the recalibrate failed.
 	if (track0_hit) {
@@ -1059,6 +1804,13 @@ DISCFERRET_ERROR discferret_seek_recalibrate(DISCFERRET_DEVICE_HANDLE *dh, unsig
 
 DISCFERRET_ERROR discferret_seek_relative(DISCFERRET_DEVICE_HANDLE *dh, long numsteps)
 {
+	return discferret_seek_relative_deadline(dh, numsteps, 0.0, NULL);
+}
+
+DISCFERRET_ERROR discferret_seek_relative_deadline(DISCFERRET_DEVICE_HANDLE *dh, const long numsteps,
+		const double deadline, const DISCFERRET_CANCEL *cancel)
+{
+	struct discferret_deadline dl = { deadline, cancel };
 	unsigned long stepcnt = (numsteps < 0) ? (-numsteps) : numsteps;
 
 	// number of steps must be at least 1
@@ -1069,9 +1821,13 @@ DISCFERRET_ERROR discferret_seek_relative(DISCFERRET_DEVICE_HANDLE *dh, long num
 	// seek, abort if we hit track 0
 	bool track0_hit = false;
 	while ((stepcnt > 0) && (!track0_hit)) {
+		unsigned long thisstep, expect;
+		long status;
+		DISCFERRET_ERROR err;
+
 		if (dh->has_extended_seek) {
 			// figure out how many steps we can move
-			unsigned long thisstep = (stepcnt > 32768) ? 32768 : stepcnt;
+			thisstep = (stepcnt > 32768) ? 32768 : stepcnt;
 			stepcnt -= thisstep;
 
 			// now move the head by that number of steps
@@ -1086,7 +1842,7 @@ DISCFERRET_ERROR discferret_seek_relative(DISCFERRET_DEVICE_HANDLE *dh, long num
 			}
 		} else {
 			// figure out how many steps we can move
-			unsigned long thisstep = (stepcnt > (DISCFERRET_STEP_COUNT_MASK+1)) ? (DISCFERRET_STEP_COUNT_MASK+1) : stepcnt;
+			thisstep = (stepcnt > (DISCFERRET_STEP_COUNT_MASK+1)) ? (DISCFERRET_STEP_COUNT_MASK+1) : stepcnt;
 			stepcnt -= thisstep;
 
 			// now move the head by that number of steps
@@ -1099,16 +1855,14 @@ DISCFERRET_ERROR discferret_seek_relative(DISCFERRET_DEVICE_HANDLE *dh, long num
 			}
 		}
 
-		// wait for the seek to complete
-		long status;
-		do {
-			// get discferret status
-			status = discferret_get_status(dh);
-
-			// if get_status returns an error code, pass it back to the caller
-			if (status < 0)
-				return status;
-		} while ((status & DISCFERRET_STATUS_STEPPING) != 0);
+		// wait for the seek to complete (early, if seeking into track 0)
+		expect = thisstep;
+		if ((numsteps < 0) && (dh->current_track >= 0) && ((unsigned long)dh->current_track < thisstep))
+			expect = dh->current_track;
+		if ((err = seek_wait(dh, thisstep, expect, &status, &dl)) != DISCFERRET_E_OK) {
+			dh->current_track = -1;
+			return err;
+		}
 
 		// did we reach track 0?
 		if (dh->has_track0_flag) {
@@ -1120,6 +1874,9 @@ DISCFERRET_ERROR discferret_seek_relative(DISCFERRET_DEVICE_HANDLE *dh, long num
 		}
 	}
 
+	// let the heads settle before anyone tries to read
+	seek_settle(dh);
+
 	// we're now either at track 0, or at the track we requested
 	if ((track0_hit) && (numsteps < 0)) {
 		// hit track 0
@@ -1138,12 +1895,256 @@ DISCFERRET_ERROR discferret_seek_relative(DISCFERRET_DEVICE_HANDLE *dh, long num
 }
 
 DISCFERRET_ERROR discferret_seek_absolute(DISCFERRET_DEVICE_HANDLE *dh, unsigned long track)
+{
+	return discferret_seek_absolute_deadline(dh, track, 0.0, NULL);
+}
+
+DISCFERRET_ERROR discferret_seek_absolute_deadline(DISCFERRET_DEVICE_HANDLE *dh, const unsigned long track,
+		const double deadline, const DISCFERRET_CANCEL *cancel)
 {
 	if (dh->current_track == -1)
 		return DISCFERRET_E_CURRENT_TRACK_UNKNOWN;
 
 	// track number is known. move the disc head.
-	return discferret_seek_relative(dh, track - dh->current_track);
+	return discferret_seek_relative_deadline(dh, track - dh->current_track, deadline, cancel);
+}
+
+/**
+ * @brief	Seek out and back at a given step rate, and check that no steps were lost
+ *
+ * Starts from track zero. Returns DISCFERRET_E_OK if the head position was
+ * correct at the end of the pass, DISCFERRET_E_RECAL_FAILED if steps were
+ * lost, or another DISCFERRET_E_xxx constant on error.
+ */
+static DISCFERRET_ERROR autotune_pass(DISCFERRET_DEVICE_HANDLE *dh, unsigned long steprate_us,
+		unsigned long tracks, DISCFERRET_TRACK_ID_FN readid, void *ctx)
+{
+	DISCFERRET_ERROR err;
+	long status;
+
+	// seek outwards at the rate under test
+	if ((err = discferret_seek_set_rate(dh, steprate_us)) != DISCFERRET_E_OK) return err;
+	err = discferret_seek_relative(dh, tracks);
+	if (err != DISCFERRET_E_OK) return err;
+
+	// check the track ID, if we have some way of reading it
+	if (readid != NULL) {
+		long track;
+		discferret_sleep_us(AUTOTUNE_SAFE_SETTLE_US);
+		err = readid(dh, ctx, &track);
+		if ((err == DISCFERRET_E_OK) && (track != (long)tracks))
+			return DISCFERRET_E_RECAL_FAILED;
+		if ((err != DISCFERRET_E_OK) && (err != DISCFERRET_E_NOT_SUPPORTED))
+			return err;
+	}
+
+	// come back all but one track. Hitting track 0 here means we lost steps on the way out.
+	err = discferret_seek_relative(dh, -(long)(tracks - 1));
+	if (err == DISCFERRET_E_TRACK0_REACHED) return DISCFERRET_E_RECAL_FAILED;
+	if (err != DISCFERRET_E_OK) return err;
+	if ((status = discferret_get_status(dh)) < 0) return status;
+	if ((status & DISCFERRET_STATUS_TRACK0) != 0) return DISCFERRET_E_RECAL_FAILED;
+
+	// take the last step at a safe rate. If we don't reach track 0, we lost steps on the way back.
+	if ((err = discferret_seek_set_rate(dh, AUTOTUNE_SAFE_STEP_US)) != DISCFERRET_E_OK) return err;
+	return discferret_seek_recalibrate(dh, 1);
+}
+
+/**
+ * @brief	Take the handle lock for one step of the autotune
+ *
+ * Sets the handle's autotuning flag while the lock is held, so the current
+ * profile's settle delay doesn't get added to the test seeks.
+ */
+static void autotune_lock(DISCFERRET_DEVICE_HANDLE *dh)
+{
+	discferret_lock(dh);
+	dh->priv->autotuning = true;
+}
+
+/**
+ * @brief	Release the handle lock after one step of the autotune
+ *
+ * Yields afterwards: the mutex isn't fair, and without giving a waiting
+ * thread the chance to run, the next step would take the lock straight back.
+ */
+static void autotune_unlock(DISCFERRET_DEVICE_HANDLE *dh)
+{
+	dh->priv->autotuning = false;
+	discferret_unlock(dh);
+	sched_yield();
+}
+
+/**
+ * @brief	Find track 0 at the safe step rate, for the autotune
+ */
+static DISCFERRET_ERROR autotune_recalibrate(DISCFERRET_DEVICE_HANDLE *dh, const unsigned long tracks)
+{
+	DISCFERRET_ERROR err;
+
+	autotune_lock(dh);
+	if ((err = discferret_seek_set_rate(dh, AUTOTUNE_SAFE_STEP_US)) == DISCFERRET_E_OK)
+		err = discferret_seek_recalibrate(dh, tracks + 10);
+	autotune_unlock(dh);
+	return err;
+}
+
+/**
+ * @brief	Run the autotune measurements, without applying the result
+ *
+ * The handle lock is only held for one pass (or settle measurement) at a
+ * time, so the index monitor and the status watcher aren't locked out for
+ * the whole run.
+ */
+static DISCFERRET_ERROR autotune_measure(DISCFERRET_DEVICE_HANDLE *dh, const unsigned long tracks,
+		DISCFERRET_TRACK_ID_FN readid, void *ctx, DISCFERRET_DRIVE_PROFILE *result)
+{
+	static const unsigned long settle_times_us[] = {
+		0, 1000, 2000, 3000, 4000, 6000, 8000, 10000, 12000, 15000, 20000, 25000, 30000
+	};
+	unsigned long rate, good_rate = 0;
+	DISCFERRET_ERROR err;
+
+	// Start from a known position
+	if ((err = autotune_recalibrate(dh, tracks)) != DISCFERRET_E_OK) return err;
+
+	// Try progressively faster step rates until the drive starts losing steps
+	rate = AUTOTUNE_SAFE_STEP_US;
+	while (rate >= (unsigned long)dh->step_rate_res_us) {
+		bool ok = true;
+
+		for (int pass = 0; ok && (pass < AUTOTUNE_PASSES); pass++) {
+			autotune_lock(dh);
+			err = autotune_pass(dh, rate, tracks, readid, ctx);
+			autotune_unlock(dh);
+			if (err == DISCFERRET_E_RECAL_FAILED) {
+				ok = false;
+			} else if (err != DISCFERRET_E_OK) {
+				return err;
+			}
+		}
+
+		// After a failed pass the head position is unknown; find track 0 again
+		if (!ok) {
+			if ((err = autotune_recalibrate(dh, tracks)) != DISCFERRET_E_OK) return err;
+			break;
+		}
+
+		good_rate = rate;
+
+		// Next rate: about 1/8th faster, rounded down to the step rate resolution
+		unsigned long next = rate - (rate / 8);
+		next -= next % dh->step_rate_res_us;
+		if (next >= rate) next = rate - dh->step_rate_res_us;
+		rate = next;
+	}
+
+	// If the drive can't even manage the safe rate, there's something wrong with it
+	if (good_rate == 0) return DISCFERRET_E_RECAL_FAILED;
+
+	result->step_rate_us = good_rate;
+	result->settle_us = AUTOTUNE_SAFE_SETTLE_US;
+	result->tracks_tested = tracks;
+	result->settle_measured = false;
+
+	// Measure the settle time: the shortest delay after which a track ID reads cleanly
+	if (readid != NULL) {
+		for (size_t i = 0; i < sizeof(settle_times_us) / sizeof(settle_times_us[0]); i++) {
+			DISCFERRET_ERROR id_err = DISCFERRET_E_NOT_SUPPORTED;
+			long track;
+
+			autotune_lock(dh);
+			if (((err = discferret_seek_set_rate(dh, good_rate)) == DISCFERRET_E_OK) &&
+					((err = discferret_seek_recalibrate(dh, tracks + 10)) == DISCFERRET_E_OK) &&
+					((err = discferret_seek_relative(dh, tracks)) == DISCFERRET_E_OK)) {
+				discferret_sleep_us(settle_times_us[i]);
+				id_err = readid(dh, ctx, &track);
+			}
+			autotune_unlock(dh);
+			if (err != DISCFERRET_E_OK) return err;
+
+			if (id_err == DISCFERRET_E_NOT_SUPPORTED) break;
+			if ((id_err == DISCFERRET_E_OK) && (track == (long)tracks)) {
+				result->settle_us = settle_times_us[i];
+				result->settle_measured = true;
+				break;
+			}
+		}
+	}
+
+	// Park the heads at track 0
+	autotune_lock(dh);
+	err = discferret_seek_recalibrate(dh, tracks + 10);
+	autotune_unlock(dh);
+	return err;
+}
+
+DISCFERRET_ERROR discferret_seek_autotune(DISCFERRET_DEVICE_HANDLE *dh, const unsigned long tracks,
+		DISCFERRET_TRACK_ID_FN readid, void *ctx, DISCFERRET_DRIVE_PROFILE *profile)
+{
+	DISCFERRET_DRIVE_PROFILE result;
+	unsigned long old_rate;
+	DISCFERRET_ERROR err;
+
+	// Check that the library has been initialised
+	if (usbctx == NULL) return DISCFERRET_E_NOT_INIT;
+
+	// Make sure device handle is not NULL, and we have enough tracks to do the test
+	if (dh == NULL) return DISCFERRET_E_BAD_PARAMETER;
+	if (tracks < 2) return DISCFERRET_E_BAD_PARAMETER;
+
+	// Keep the current profile until there's a new one to replace it
+	discferret_lock(dh);
+	old_rate = dh->priv->step_rate_us;
+	discferret_unlock(dh);
+	err = autotune_measure(dh, tracks, readid, ctx, &result);
+
+	discferret_lock(dh);
+	if (err != DISCFERRET_E_OK) {
+		// Put the step rate back the way it was
+		if (dh->has_drive_profile)
+			discferret_seek_set_rate(dh, dh->drive_profile.step_rate_us);
+		else if (old_rate != 0)
+			discferret_seek_set_rate(dh, old_rate);
+		discferret_unlock(dh);
+		return err;
+	}
+
+	// Apply the new profile
+	err = discferret_set_drive_profile(dh, &result);
+	discferret_unlock(dh);
+	if (err != DISCFERRET_E_OK) return err;
+
+	if (profile != NULL)
+		*profile = result;
+
+	return DISCFERRET_E_OK;
+}
+
+DISCFERRET_ERROR discferret_set_drive_profile(DISCFERRET_DEVICE_HANDLE *dh, const DISCFERRET_DRIVE_PROFILE *profile)
+{
+	DISCFERRET_ERROR err;
+
+	// Check that the library has been initialised
+	if (usbctx == NULL) return DISCFERRET_E_NOT_INIT;
+
+	// Make sure device handle is not NULL
+	if (dh == NULL) return DISCFERRET_E_BAD_PARAMETER;
+
+	// NULL profile means "go back to manual step rate and no settle delay"
+	if (profile == NULL) {
+		dh->has_drive_profile = false;
+		return DISCFERRET_E_OK;
+	}
+
+	// Program the step rate, then start applying the settle time
+	if ((err = discferret_seek_set_rate(dh, profile->step_rate_us)) != DISCFERRET_E_OK)
+		return err;
+
+	dh->drive_profile = *profile;
+	dh->has_drive_profile = true;
+
+	return DISCFERRET_E_OK;
 }
 
 // vim: ts=4 noet sw=4
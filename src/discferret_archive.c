@@ -0,0 +1,639 @@
+/****************************************************************************
+ *
+ *                - DiscFerret Interface Library for C / C++ -
+ *
+ * Copyright (C) 2010 - 2011 P. A. Pemberton t/a. Red Fox Engineering.
+ * All Rights Reserved.
+ *
+ * Copyright 2010-2011 Philip Pemberton
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ ****************************************************************************/
+
+
+
+/**
+ * @file	discferret_archive.c
+ * @brief	Random-access flux archive format.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "discferret.h"
+#include "discferret_flux.h"
+#include "discferret_archive.h"
+#include "discferret_codec.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#else
+#define fseeko _fseeki64
+#endif
+
+/// Archive magic number
+static const char ARCHIVE_MAGIC[8] = { 'D', 'F', 'A', 'R', 'C', 'H', 'V', '1' };
+/// Archive format version
+#define ARCHIVE_VERSION		1
+/// Size of the file header
+#define ARCHIVE_HEADER_LEN	64
+/// Size of an index entry
+#define ARCHIVE_ENTRY_LEN	48
+/// Alignment of flux blocks (and of the index)
+#define ARCHIVE_ALIGN		64
+/// Smallest hash table
+#define ARCHIVE_MIN_HASH	16
+
+/**
+ * @brief	Index entry as held by the writer
+ */
+struct wentry {
+	uint32_t	disc;
+	uint16_t	cyl;
+	uint8_t		head;
+	uint8_t		rev;
+	uint32_t	count;
+	uint32_t	clock_hz;
+	uint64_t	offset;
+	uint64_t	stored_len;
+	uint64_t	ticks;
+	uint32_t	compression;
+	size_t		seq;		///< Order the entry was added in, so later additions win
+};
+
+struct discferret_archive_writer {
+	FILE			*f;
+	uint64_t		pos;			///< Current end of file
+	struct wentry	*entries;
+	size_t			count;
+	size_t			capacity;
+	unsigned char	*scratch;		///< Encoding buffer, reused between blocks
+	size_t			scratch_cap;
+};
+
+struct discferret_archive {
+	unsigned char	*map;
+	size_t			size;
+	const unsigned char	*index;		///< First index entry
+	size_t			count;			///< Number of index entries
+	const unsigned char	*hash;		///< Hash table
+	uint32_t		hash_size;		///< Number of hash slots (power of two)
+};
+
+static void put_le16(unsigned char *p, const uint16_t v)
+{
+	p[0] = v & 0xff;
+	p[1] = v >> 8;
+}
+
+static void put_le32(unsigned char *p, const uint32_t v)
+{
+	p[0] = v & 0xff;
+	p[1] = (v >> 8) & 0xff;
+	p[2] = (v >> 16) & 0xff;
+	p[3] = v >> 24;
+}
+
+static void put_le64(unsigned char *p, const uint64_t v)
+{
+	put_le32(p, (uint32_t)v);
+	put_le32(p + 4, (uint32_t)(v >> 32));
+}
+
+static uint16_t get_le16(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static uint32_t get_le32(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t get_le64(const unsigned char *p)
+{
+	return get_le32(p) | ((uint64_t)get_le32(p + 4) << 32);
+}
+
+/**
+ * @brief	FNV-1a hash of a (disc, cyl, head, rev) key
+ */
+static uint32_t key_hash(const uint32_t disc, const uint16_t cyl, const uint8_t head, const uint8_t rev)
+{
+	unsigned char k[8];
+	uint32_t h = 2166136261u;
+
+	put_le32(k, disc);
+	put_le16(k + 4, cyl);
+	k[6] = head;
+	k[7] = rev;
+	for (unsigned int i = 0; i < sizeof(k); i++) {
+		h ^= k[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+/// Pack a key so keys compare in (disc, cyl, head, rev) order
+static uint64_t key_pack(const uint32_t disc, const uint16_t cyl, const uint8_t head, const uint8_t rev)
+{
+	return ((uint64_t)disc << 32) | ((uint64_t)cyl << 16) | ((uint64_t)head << 8) | rev;
+}
+
+/****************************************************************************
+ * Writer
+ ****************************************************************************/
+
+static DISCFERRET_ERROR write_bytes(DISCFERRET_ARCHIVE_WRITER *w, const void *buf, const size_t len)
+{
+	if (fwrite(buf, 1, len, w->f) != len) return DISCFERRET_E_FILE_ERROR;
+	w->pos += len;
+	return DISCFERRET_E_OK;
+}
+
+/// Pad the file with zeroes up to the next ARCHIVE_ALIGN boundary
+static DISCFERRET_ERROR write_align(DISCFERRET_ARCHIVE_WRITER *w)
+{
+	static const unsigned char zero[ARCHIVE_ALIGN];
+	size_t pad = (ARCHIVE_ALIGN - (w->pos % ARCHIVE_ALIGN)) % ARCHIVE_ALIGN;
+	return write_bytes(w, zero, pad);
+}
+
+DISCFERRET_ERROR discferret_archive_create(const char *path, DISCFERRET_ARCHIVE_WRITER **writer)
+{
+	unsigned char hdr[ARCHIVE_HEADER_LEN];
+	DISCFERRET_ARCHIVE_WRITER *w;
+
+	if ((path == NULL) || (writer == NULL)) return DISCFERRET_E_BAD_PARAMETER;
+
+	w = calloc(1, sizeof(DISCFERRET_ARCHIVE_WRITER));
+	if (w == NULL) return DISCFERRET_E_OUT_OF_MEMORY;
+	if ((w->f = fopen(path, "wb")) == NULL) {
+		free(w);
+		return DISCFERRET_E_FILE_ERROR;
+	}
+
+	// Placeholder header; it's filled in by discferret_archive_finish()
+	memset(hdr, 0, sizeof(hdr));
+	if (write_bytes(w, hdr, sizeof(hdr)) != DISCFERRET_E_OK) {
+		fclose(w->f);
+		free(w);
+		return DISCFERRET_E_FILE_ERROR;
+	}
+
+	*writer = w;
+	return DISCFERRET_E_OK;
+}
+
+DISCFERRET_ERROR discferret_archive_add(DISCFERRET_ARCHIVE_WRITER *writer, const uint32_t disc, const unsigned int cyl,
+		const unsigned int head, const unsigned int rev, const uint32_t *intervals, const size_t count,
+		const uint32_t clock_hz, const unsigned int compression)
+{
+	struct wentry *e;
+	size_t maxlen, len = 0;
+	uint64_t ticks = 0;
+	DISCFERRET_ERROR err;
+
+	if ((writer == NULL) || ((intervals == NULL) && (count > 0))) return DISCFERRET_E_BAD_PARAMETER;
+	if ((cyl > 0xFFFF) || (head > 0xFF) || (rev > 0xFF) || (count > 0xFFFFFFFFu) || (clock_hz == 0)) return DISCFERRET_E_BAD_PARAMETER;
+
+	switch (compression) {
+		case DISCFERRET_ARCHIVE_RAW:	maxlen = count * 4; break;
+		case DISCFERRET_ARCHIVE_VARINT:	maxlen = count * 5; break;
+		case DISCFERRET_ARCHIVE_FLUX:	maxlen = discferret_codec_bound(count); break;
+		default:						return DISCFERRET_E_BAD_PARAMETER;
+	}
+
+	// Make room for the index entry and the encoded block
+	if (writer->count == writer->capacity) {
+		size_t n = (writer->capacity > 0) ? writer->capacity * 2 : 256;
+		e = realloc(writer->entries, n * sizeof(struct wentry));
+		if (e == NULL) return DISCFERRET_E_OUT_OF_MEMORY;
+		writer->entries = e;
+		writer->capacity = n;
+	}
+	if (maxlen > writer->scratch_cap) {
+		unsigned char *p = realloc(writer->scratch, maxlen);
+		if (p == NULL) return DISCFERRET_E_OUT_OF_MEMORY;
+		writer->scratch = p;
+		writer->scratch_cap = maxlen;
+	}
+
+	// Encode the block
+	for (size_t i = 0; i < count; i++) {
+		uint32_t v = intervals[i];
+		ticks += v;
+		if (compression == DISCFERRET_ARCHIVE_RAW) {
+			put_le32(writer->scratch + len, v);
+			len += 4;
+		} else if (compression == DISCFERRET_ARCHIVE_VARINT) {
+			while (v >= 0x80) {
+				writer->scratch[len++] = (v & 0x7F) | 0x80;
+				v >>= 7;
+			}
+			writer->scratch[len++] = v;
+		}
+	}
+	if (compression == DISCFERRET_ARCHIVE_FLUX) {
+		if ((err = discferret_codec_encode(intervals, count, writer->scratch, maxlen, &len)) != DISCFERRET_E_OK) return err;
+	}
+
+	if ((err = write_align(writer)) != DISCFERRET_E_OK) return err;
+
+	e = &writer->entries[writer->count];
+	e->disc = disc;
+	e->cyl = cyl;
+	e->head = head;
+	e->rev = rev;
+	e->count = count;
+	e->clock_hz = clock_hz;
+	e->offset = writer->pos;
+	e->stored_len = len;
+	e->ticks = ticks;
+	e->compression = compression;
+	e->seq = writer->count;
+
+	if ((err = write_bytes(writer, writer->scratch, len)) != DISCFERRET_E_OK) return err;
+	writer->count++;
+
+	return DISCFERRET_E_OK;
+}
+
+DISCFERRET_ERROR discferret_archive_add_track(DISCFERRET_ARCHIVE_WRITER *writer, const uint32_t disc, const unsigned int cyl,
+		const unsigned int head, const DISCFERRET_FLUX *flux, const unsigned int compression)
+{
+	DISCFERRET_ERROR err;
+
+	if ((writer == NULL) || (flux == NULL)) return DISCFERRET_E_BAD_PARAMETER;
+
+	// No complete revolution: store the whole capture
+	if (flux->index_count < 2)
+		return discferret_archive_add(writer, disc, cyl, head, 0, flux->intervals, flux->count, flux->clock_hz, compression);
+
+	for (size_t r = 0; r + 1 < flux->index_count; r++) {
+		size_t start = flux->index[r], end = flux->index[r + 1];
+		if (end > flux->count) break;
+		err = discferret_archive_add(writer, disc, cyl, head, r, flux->intervals + start, end - start, flux->clock_hz, compression);
+		if (err != DISCFERRET_E_OK) return err;
+	}
+	return DISCFERRET_E_OK;
+}
+
+static int wentry_compare(const void *a, const void *b)
+{
+	const struct wentry *x = a, *y = b;
+	uint64_t kx = key_pack(x->disc, x->cyl, x->head, x->rev);
+	uint64_t ky = key_pack(y->disc, y->cyl, y->head, y->rev);
+
+	if (kx != ky) return (kx < ky) ? -1 : 1;
+	return (x->seq < y->seq) ? -1 : (x->seq > y->seq);
+}
+
+DISCFERRET_ERROR discferret_archive_finish(DISCFERRET_ARCHIVE_WRITER *writer)
+{
+	unsigned char hdr[ARCHIVE_HEADER_LEN], ent[ARCHIVE_ENTRY_LEN];
+	uint64_t index_offset, hash_offset;
+	DISCFERRET_ERROR err = DISCFERRET_E_OK;
+	uint32_t hash_size = ARCHIVE_MIN_HASH;
+	uint32_t *hash = NULL;
+	size_t n = 0;
+
+	if (writer == NULL) return DISCFERRET_E_BAD_PARAMETER;
+
+	// Sort the index, keeping only the last block added for each key
+	qsort(writer->entries, writer->count, sizeof(struct wentry), wentry_compare);
+	for (size_t i = 0; i < writer->count; i++) {
+		const struct wentry *e = &writer->entries[i], *f = e + 1;
+		if ((i + 1 < writer->count) && (key_pack(e->disc, e->cyl, e->head, e->rev) == key_pack(f->disc, f->cyl, f->head, f->rev)))
+			continue;
+		writer->entries[n++] = *e;
+	}
+
+	// Hash table at most half full
+	while (hash_size < n * 2) hash_size *= 2;
+	hash = calloc(hash_size, sizeof(uint32_t));
+	if (hash == NULL) {
+		err = DISCFERRET_E_OUT_OF_MEMORY;
+		goto done;
+	}
+
+	// Index
+	if ((err = write_align(writer)) != DISCFERRET_E_OK) goto done;
+	index_offset = writer->pos;
+	for (size_t i = 0; i < n; i++) {
+		const struct wentry *e = &writer->entries[i];
+		uint32_t slot = key_hash(e->disc, e->cyl, e->head, e->rev) & (hash_size - 1);
+
+		put_le32(ent, e->disc);
+		put_le16(ent + 4, e->cyl);
+		ent[6] = e->head;
+		ent[7] = e->rev;
+		put_le32(ent + 8, e->count);
+		put_le32(ent + 12, e->clock_hz);
+		put_le64(ent + 16, e->offset);
+		put_le64(ent + 24, e->stored_len);
+		put_le64(ent + 32, e->ticks);
+		put_le32(ent + 40, e->compression);
+		put_le32(ent + 44, 0);
+		if ((err = write_bytes(writer, ent, sizeof(ent))) != DISCFERRET_E_OK) goto done;
+
+		while (hash[slot] != 0) slot = (slot + 1) & (hash_size - 1);
+		hash[slot] = i + 1;
+	}
+
+	// Hash table
+	hash_offset = writer->pos;
+	for (uint32_t i = 0; i < hash_size; i++) {
+		unsigned char b[4];
+		put_le32(b, hash[i]);
+		if ((err = write_bytes(writer, b, 4)) != DISCFERRET_E_OK) goto done;
+	}
+
+	// Header
+	memset(hdr, 0, sizeof(hdr));
+	memcpy(hdr, ARCHIVE_MAGIC, sizeof(ARCHIVE_MAGIC));
+	put_le32(hdr + 8, ARCHIVE_VERSION);
+	put_le32(hdr + 12, 0);
+	put_le64(hdr + 16, index_offset);
+	put_le64(hdr + 24, n);
+	put_le64(hdr + 32, hash_offset);
+	put_le32(hdr + 40, hash_size);
+	put_le32(hdr + 44, ARCHIVE_ALIGN);
+	if ((fseeko(writer->f, 0, SEEK_SET) != 0) || (fwrite(hdr, 1, sizeof(hdr), writer->f) != sizeof(hdr)))
+		err = DISCFERRET_E_FILE_ERROR;
+
+done:
+	if ((fclose(writer->f) != 0) && (err == DISCFERRET_E_OK)) err = DISCFERRET_E_FILE_ERROR;
+	free(hash);
+	free(writer->entries);
+	free(writer->scratch);
+	free(writer);
+	return err;
+}
+
+/****************************************************************************
+ * Reader
+ ****************************************************************************/
+
+#ifndef _WIN32
+
+/**
+ * @brief	Decode index entry <i>n</i>
+ */
+static DISCFERRET_ERROR parse_entry(DISCFERRET_ARCHIVE *ar, const size_t n, DISCFERRET_ARCHIVE_ENTRY *entry)
+{
+	const unsigned char *p = ar->index + (n * ARCHIVE_ENTRY_LEN);
+	uint64_t offset = get_le64(p + 16);
+
+	entry->disc = get_le32(p);
+	entry->cyl = get_le16(p + 4);
+	entry->head = p[6];
+	entry->rev = p[7];
+	entry->count = get_le32(p + 8);
+	entry->clock_hz = get_le32(p + 12);
+	entry->stored_len = get_le64(p + 24);
+	entry->ticks = get_le64(p + 32);
+	entry->compression = get_le32(p + 40);
+
+	// Don't hand out pointers outside the file
+	if ((offset > ar->size) || (entry->stored_len > ar->size - offset)) return DISCFERRET_E_BAD_PARAMETER;
+	entry->data = ar->map + offset;
+	return DISCFERRET_E_OK;
+}
+
+DISCFERRET_ERROR discferret_archive_open(const char *path, DISCFERRET_ARCHIVE **archive)
+{
+	DISCFERRET_ARCHIVE *ar;
+	uint64_t index_offset, count, hash_offset;
+	uint32_t hash_size;
+	struct stat st;
+	void *map;
+	int fd;
+
+	if ((path == NULL) || (archive == NULL)) return DISCFERRET_E_BAD_PARAMETER;
+
+	if ((fd = open(path, O_RDONLY)) < 0) return DISCFERRET_E_FILE_ERROR;
+	if ((fstat(fd, &st) != 0) || (st.st_size < ARCHIVE_HEADER_LEN)) {
+		close(fd);
+		return DISCFERRET_E_FILE_ERROR;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) return DISCFERRET_E_FILE_ERROR;
+
+	ar = calloc(1, sizeof(DISCFERRET_ARCHIVE));
+	if (ar == NULL) {
+		munmap(map, st.st_size);
+		return DISCFERRET_E_OUT_OF_MEMORY;
+	}
+	ar->map = map;
+	ar->size = st.st_size;
+
+	// Check the header, and that the index and hash table lie within the file
+	index_offset = get_le64(ar->map + 16);
+	count = get_le64(ar->map + 24);
+	hash_offset = get_le64(ar->map + 32);
+	hash_size = get_le32(ar->map + 40);
+	if ((memcmp(ar->map, ARCHIVE_MAGIC, sizeof(ARCHIVE_MAGIC)) != 0) || (get_le32(ar->map + 8) != ARCHIVE_VERSION) ||
+			(index_offset > ar->size) || (count > (ar->size - index_offset) / ARCHIVE_ENTRY_LEN) ||
+			(hash_size == 0) || ((hash_size & (hash_size - 1)) != 0) || (hash_size < count) ||
+			(hash_offset > ar->size) || (hash_size > (ar->size - hash_offset) / 4)) {
+		discferret_archive_close(ar);
+		return DISCFERRET_E_BAD_PARAMETER;
+	}
+	ar->index = ar->map + index_offset;
+	ar->count = count;
+	ar->hash = ar->map + hash_offset;
+	ar->hash_size = hash_size;
+
+	*archive = ar;
+	return DISCFERRET_E_OK;
+}
+
+DISCFERRET_ERROR discferret_archive_close(DISCFERRET_ARCHIVE *archive)
+{
+	if (archive == NULL) return DISCFERRET_E_BAD_PARAMETER;
+	munmap(archive->map, archive->size);
+	free(archive);
+	return DISCFERRET_E_OK;
+}
+
+size_t discferret_archive_count(DISCFERRET_ARCHIVE *archive)
+{
+	return (archive == NULL) ? 0 : archive->count;
+}
+
+DISCFERRET_ERROR discferret_archive_find(DISCFERRET_ARCHIVE *archive, const uint32_t disc, const unsigned int cyl,
+		const unsigned int head, const unsigned int rev, DISCFERRET_ARCHIVE_ENTRY *entry)
+{
+	uint32_t slot;
+
+	if ((archive == NULL) || (entry == NULL)) return DISCFERRET_E_BAD_PARAMETER;
+	if ((cyl > 0xFFFF) || (head > 0xFF) || (rev > 0xFF)) return DISCFERRET_E_NO_MATCH;
+
+	// Probe until we hit the key or an empty slot (the table is never full)
+	slot = key_hash(disc, cyl, head, rev) & (archive->hash_size - 1);
+	for (uint32_t probes = 0; probes < archive->hash_size; probes++) {
+		uint32_t n = get_le32(archive->hash + (slot * 4));
+		const unsigned char *p;
+
+		if (n == 0) break;
+		if (n <= archive->count) {
+			p = archive->index + ((n - 1) * ARCHIVE_ENTRY_LEN);
+			if ((get_le32(p) == disc) && (get_le16(p + 4) == cyl) && (p[6] == head) && (p[7] == rev))
+				return parse_entry(archive, n - 1, entry);
+		}
+		slot = (slot + 1) & (archive->hash_size - 1);
+	}
+
+	return DISCFERRET_E_NO_MATCH;
+}
+
+/// Key of index entry <i>n</i>, for searching
+static uint64_t entry_key(DISCFERRET_ARCHIVE *ar, const size_t n)
+{
+	const unsigned char *p = ar->index + (n * ARCHIVE_ENTRY_LEN);
+	return key_pack(get_le32(p), get_le16(p + 4), p[6], p[7]);
+}
+
+DISCFERRET_ERROR discferret_archive_iter_init(DISCFERRET_ARCHIVE *archive, DISCFERRET_ARCHIVE_ITER *iter,
+		const int64_t disc, const int32_t cyl, const int32_t head)
+{
+	if ((archive == NULL) || (iter == NULL)) return DISCFERRET_E_BAD_PARAMETER;
+
+	iter->next = 0;
+	iter->disc = disc;
+	iter->cyl = cyl;
+	iter->head = head;
+
+	// If a disc was given, jump straight to its first entry (the index is sorted)
+	if (disc >= 0) {
+		uint64_t key = key_pack(disc, (cyl >= 0) ? cyl : 0, ((cyl >= 0) && (head >= 0)) ? head : 0, 0);
+		size_t lo = 0, hi = archive->count;
+		while (lo < hi) {
+			size_t mid = lo + (hi - lo) / 2;
+			if (entry_key(archive, mid) < key) lo = mid + 1; else hi = mid;
+		}
+		iter->next = lo;
+	}
+
+	return DISCFERRET_E_OK;
+}
+
+DISCFERRET_ERROR discferret_archive_iter_next(DISCFERRET_ARCHIVE *archive, DISCFERRET_ARCHIVE_ITER *iter, DISCFERRET_ARCHIVE_ENTRY *entry)
+{
+	if ((archive == NULL) || (iter == NULL) || (entry == NULL)) return DISCFERRET_E_BAD_PARAMETER;
+
+	while (iter->next < archive->count) {
+		const unsigned char *p = archive->index + (iter->next * ARCHIVE_ENTRY_LEN);
+		uint32_t disc = get_le32(p);
+		uint16_t cyl = get_le16(p + 4);
+
+		// Past the disc (or the disc's cylinder) we were asked for: done
+		if ((iter->disc >= 0) && (disc > iter->disc)) break;
+		if ((iter->disc >= 0) && (iter->cyl >= 0) && (cyl > iter->cyl)) break;
+
+		iter->next++;
+		if ((iter->disc >= 0) && (disc != iter->disc)) continue;
+		if ((iter->cyl >= 0) && (cyl != iter->cyl)) continue;
+		if ((iter->head >= 0) && (p[6] != iter->head)) continue;
+		return parse_entry(archive, iter->next - 1, entry);
+	}
+
+	return DISCFERRET_E_NO_MATCH;
+}
+
+#else // _WIN32
+
+DISCFERRET_ERROR discferret_archive_open(const char *path, DISCFERRET_ARCHIVE **archive)
+{
+	return DISCFERRET_E_NOT_SUPPORTED;
+}
+
+DISCFERRET_ERROR discferret_archive_close(DISCFERRET_ARCHIVE *archive)
+{
+	return DISCFERRET_E_NOT_SUPPORTED;
+}
+
+size_t discferret_archive_count(DISCFERRET_ARCHIVE *archive)
+{
+	return 0;
+}
+
+DISCFERRET_ERROR discferret_archive_find(DISCFERRET_ARCHIVE *archive, const uint32_t disc, const unsigned int cyl,
+		const unsigned int head, const unsigned int rev, DISCFERRET_ARCHIVE_ENTRY *entry)
+{
+	return DISCFERRET_E_NOT_SUPPORTED;
+}
+
+DISCFERRET_ERROR discferret_archive_iter_init(DISCFERRET_ARCHIVE *archive, DISCFERRET_ARCHIVE_ITER *iter,
+		const int64_t disc, const int32_t cyl, const int32_t head)
+{
+	return DISCFERRET_E_NOT_SUPPORTED;
+}
+
+DISCFERRET_ERROR discferret_archive_iter_next(DISCFERRET_ARCHIVE *archive, DISCFERRET_ARCHIVE_ITER *iter, DISCFERRET_ARCHIVE_ENTRY *entry)
+{
+	return DISCFERRET_E_NOT_SUPPORTED;
+}
+
+#endif // _WIN32
+
+DISCFERRET_ERROR discferret_archive_read(const DISCFERRET_ARCHIVE_ENTRY *entry, uint32_t *intervals, const size_t max)
+{
+	const unsigned char *p, *end;
+
+	if ((entry == NULL) || (intervals == NULL) || (max < entry->count)) return DISCFERRET_E_BAD_PARAMETER;
+
+	p = entry->data;
+	end = p + entry->stored_len;
+
+	switch (entry->compression) {
+		case DISCFERRET_ARCHIVE_RAW:
+			if (entry->stored_len < (uint64_t)entry->count * 4) return DISCFERRET_E_BAD_PARAMETER;
+			for (uint32_t i = 0; i < entry->count; i++)
+				intervals[i] = get_le32(p + (i * 4));
+			return DISCFERRET_E_OK;
+
+		case DISCFERRET_ARCHIVE_VARINT:
+			for (uint32_t i = 0; i < entry->count; i++) {
+				uint32_t v = 0;
+				unsigned int shift = 0;
+				for (;;) {
+					if ((p >= end) || (shift > 28)) return DISCFERRET_E_BAD_PARAMETER;
+					v |= (uint32_t)(*p & 0x7F) << shift;
+					if ((*p++ & 0x80) == 0) break;
+					shift += 7;
+				}
+				intervals[i] = v;
+			}
+			return DISCFERRET_E_OK;
+
+		case DISCFERRET_ARCHIVE_FLUX: {
+			size_t n;
+			DISCFERRET_ERROR err = discferret_codec_decode(p, entry->stored_len, intervals, entry->count, &n);
+			if (err != DISCFERRET_E_OK) return err;
+			return (n == entry->count) ? DISCFERRET_E_OK : DISCFERRET_E_BAD_PARAMETER;
+		}
+
+		default:
+			return DISCFERRET_E_NOT_SUPPORTED;
+	}
+}
+
+// vim: ts=4 noet sw=4
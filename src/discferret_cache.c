@@ -0,0 +1,354 @@
+/****************************************************************************
+ *
+ *                - DiscFerret Interface Library for C / C++ -
+ *
+ * Copyright (C) 2010 - 2011 P. A. Pemberton t/a. Red Fox Engineering.
+ * All Rights Reserved.
+ *
+ * Copyright 2010-2011 Philip Pemberton
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ ****************************************************************************/
+
+
+
+
+/**
+ * @file	discferret_cache.c
+ * @brief	Sector-level reads through a decoded track cache.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "discferret.h"
+#include "discferret_registers.h"
+#include "discferret_retry.h"
+#include "discferret_cache.h"
+#include "discferret_private.h"
+
+/// Default number of cached tracks
+#define CACHE_TRACKS	8
+
+/**
+ * @brief	A cached track
+ */
+struct cache_entry {
+	bool					valid;		///< Entry holds a track
+	bool					ahead;		///< Read ahead, and not read from yet
+	unsigned int			cyl;		///< Cylinder
+	unsigned int			head;		///< Head
+	unsigned long long		used;		///< LRU clock value at the last read
+	DISCFERRET_ERROR		status;		///< Result of reading the track
+	DISCFERRET_RETRY_RESULT	result;		///< Decoded sectors
+};
+
+struct discferret_cache {
+	DISCFERRET_DEVICE_HANDLE	*dh;
+	DISCFERRET_CACHE_CONFIG		config;
+	struct cache_entry			*entries;
+	unsigned int				count;
+	DISCFERRET_RETRY_RESULT		scratch;	///< Worker's read buffer, swapped into an entry when it's done
+
+	pthread_mutex_t				lock;
+	pthread_cond_t				cond;		///< Signalled when a request is queued or a track is loaded
+	pthread_t					thread;
+	bool						quit;
+
+	bool						pending;	///< A track read is queued
+	bool						pending_ahead;	///< ...and it's a read-ahead (a demand read may replace it)
+	unsigned int				pending_cyl, pending_head;
+	bool						loading;	///< The worker is reading a track
+	unsigned int				loading_cyl, loading_head;
+	unsigned long				generation;	///< Bumped by a flush, so tracks read before it are dropped
+
+	long						last_cyl, last_head, last_sector;	///< Previous read, for spotting sequential access
+	long						run_first;	///< Sector the sequential run on the previous read's track started at
+	unsigned long long			clock;		///< LRU clock
+	DISCFERRET_CACHE_STATS		stats;
+};
+
+/**
+ * @brief	Find a cached track. Caller must hold the cache lock.
+ */
+static struct cache_entry *find(DISCFERRET_CACHE *cache, const unsigned int cyl, const unsigned int head)
+{
+	for (unsigned int i = 0; i < cache->count; i++) {
+		struct cache_entry *e = &cache->entries[i];
+		if (e->valid && (e->cyl == cyl) && (e->head == head)) return e;
+	}
+	return NULL;
+}
+
+/**
+ * @brief	Check whether a track is cached, being read or queued. Caller must hold the cache lock.
+ */
+static bool wanted(DISCFERRET_CACHE *cache, const unsigned int cyl, const unsigned int head)
+{
+	if (find(cache, cyl, head) != NULL) return true;
+	if (cache->loading && (cache->loading_cyl == cyl) && (cache->loading_head == head)) return true;
+	return cache->pending && (cache->pending_cyl == cyl) && (cache->pending_head == head);
+}
+
+/**
+ * @brief	Seek to a track and read it, or have the caller's reader read it
+ */
+static DISCFERRET_ERROR read_track(DISCFERRET_CACHE *cache, const unsigned int cyl, const unsigned int head)
+{
+	unsigned int dc = cache->config.drive_control & ~DISCFERRET_DRIVE_CONTROL_SIDESEL;
+	int r;
+
+	if (cache->config.reader != NULL)
+		return cache->config.reader(cache->config.ctx, cyl, head, &cache->config.read, &cache->scratch);
+
+	if (head != 0) dc |= DISCFERRET_DRIVE_CONTROL_SIDESEL;
+	if ((long)cyl != cache->dh->current_track) {
+		if ((r = discferret_seek_absolute(cache->dh, cyl)) != DISCFERRET_E_OK) return r;
+	}
+	if ((r = discferret_reg_poke(cache->dh, DISCFERRET_R_DRIVE_CONTROL, dc)) != DISCFERRET_E_OK) return r;
+	return discferret_retry_track(cache->dh, &cache->config.read, &cache->scratch);
+}
+
+static void *worker_thread(void *arg)
+{
+	DISCFERRET_CACHE *cache = arg;
+
+	pthread_mutex_lock(&cache->lock);
+	for (;;) {
+		struct cache_entry *victim = NULL;
+		DISCFERRET_RETRY_RESULT tmp;
+		unsigned long generation;
+		bool ahead;
+		int r;
+
+		while (!cache->pending && !cache->quit) pthread_cond_wait(&cache->cond, &cache->lock);
+		if (cache->quit) break;
+
+		cache->pending = false;
+		ahead = cache->pending_ahead;
+		cache->loading = true;
+		cache->loading_cyl = cache->pending_cyl;
+		cache->loading_head = cache->pending_head;
+		generation = cache->generation;
+		pthread_mutex_unlock(&cache->lock);
+
+		r = read_track(cache, cache->loading_cyl, cache->loading_head);
+
+		pthread_mutex_lock(&cache->lock);
+		cache->loading = false;
+		cache->stats.tracks_read++;
+		if (ahead) cache->stats.ahead++;
+
+		if (generation == cache->generation) {
+			// Replace an empty entry, or the least recently used one
+			for (unsigned int i = 0; i < cache->count; i++) {
+				struct cache_entry *e = &cache->entries[i];
+				if (!e->valid) {
+					victim = e;
+					break;
+				}
+				if ((victim == NULL) || (e->used < victim->used)) victim = e;
+			}
+
+			// The victim's buffers become the next read's scratch space
+			tmp = victim->result;
+			victim->result = cache->scratch;
+			cache->scratch = tmp;
+			victim->valid = true;
+			victim->ahead = ahead;
+			victim->cyl = cache->loading_cyl;
+			victim->head = cache->loading_head;
+			victim->used = ++cache->clock;
+			victim->status = r;
+		}
+		pthread_cond_broadcast(&cache->cond);
+	}
+	pthread_mutex_unlock(&cache->lock);
+	return NULL;
+}
+
+DISCFERRET_ERROR discferret_cache_open(DISCFERRET_DEVICE_HANDLE *dh, const DISCFERRET_CACHE_CONFIG *config, DISCFERRET_CACHE **cache)
+{
+	DISCFERRET_CACHE *c;
+
+	if ((config == NULL) || (cache == NULL)) return DISCFERRET_E_BAD_PARAMETER;
+	if ((config->cylinders < 1) || (config->heads < 1) || (config->heads > 2)) return DISCFERRET_E_BAD_PARAMETER;
+	if (config->reader == NULL) {
+		if ((dh == NULL) || (config->read.decoder == NULL)) return DISCFERRET_E_BAD_PARAMETER;
+		if (dh->current_track < 0) return DISCFERRET_E_CURRENT_TRACK_UNKNOWN;
+	}
+
+	if ((c = calloc(1, sizeof(DISCFERRET_CACHE))) == NULL) return DISCFERRET_E_OUT_OF_MEMORY;
+	c->dh = dh;
+	c->config = *config;
+	c->count = (config->tracks > 0) ? config->tracks : CACHE_TRACKS;
+	c->last_cyl = c->last_head = c->last_sector = c->run_first = -1;
+	if ((c->entries = calloc(c->count, sizeof(struct cache_entry))) == NULL) {
+		free(c);
+		return DISCFERRET_E_OUT_OF_MEMORY;
+	}
+
+	pthread_mutex_init(&c->lock, NULL);
+	pthread_cond_init(&c->cond, NULL);
+	if (pthread_create(&c->thread, NULL, worker_thread, c) != 0) {
+		pthread_cond_destroy(&c->cond);
+		pthread_mutex_destroy(&c->lock);
+		free(c->entries);
+		free(c);
+		return DISCFERRET_E_OUT_OF_MEMORY;
+	}
+
+	*cache = c;
+	return DISCFERRET_E_OK;
+}
+
+DISCFERRET_ERROR discferret_cache_read(DISCFERRET_CACHE *cache, const unsigned int cyl, const unsigned int head,
+		const unsigned int sector, unsigned char *buf, const size_t len, size_t *size)
+{
+	const DISCFERRET_RETRY_CONFIG *rc;
+	const DISCFERRET_RETRY_SECTOR *s;
+	struct cache_entry *e;
+	bool in_track, crossed, sequential, waited = false;
+	double t = 0.0;
+	int r;
+
+	if ((cache == NULL) || ((buf == NULL) && (len > 0))) return DISCFERRET_E_BAD_PARAMETER;
+	if ((cyl >= cache->config.cylinders) || (head >= cache->config.heads)) return DISCFERRET_E_BAD_PARAMETER;
+	rc = &cache->config.read;
+
+	pthread_mutex_lock(&cache->lock);
+	cache->stats.reads++;
+	while ((e = find(cache, cyl, head)) == NULL) {
+		// Queue the track, unless it's on its way; a demand read jumps a read-ahead
+		if (!wanted(cache, cyl, head) && (!cache->pending || cache->pending_ahead)) {
+			cache->pending = true;
+			cache->pending_ahead = false;
+			cache->pending_cyl = cyl;
+			cache->pending_head = head;
+			pthread_cond_broadcast(&cache->cond);
+		}
+		if (!waited) {
+			waited = true;
+			t = discferret_host_time();
+		}
+		pthread_cond_wait(&cache->cond, &cache->lock);
+	}
+
+	if (waited) {
+		cache->stats.misses++;
+		cache->stats.wait += discferret_host_time() - t;
+	} else {
+		cache->stats.hits++;
+	}
+	if (e->ahead) {
+		cache->stats.ahead_used++;
+		e->ahead = false;
+	}
+	e->used = ++cache->clock;
+
+	// Copy the sector out while the entry can't be replaced
+	if ((r = e->status) == DISCFERRET_E_OK) {
+		if ((sector < rc->first_sector) || (sector >= rc->first_sector + e->result.count)) {
+			r = DISCFERRET_E_SECTOR_NOT_FOUND;
+		} else {
+			s = &e->result.sectors[sector - rc->first_sector];
+			if (!s->found || (s->data == NULL)) {
+				r = DISCFERRET_E_SECTOR_NOT_FOUND;
+			} else {
+				memcpy(buf, s->data, (s->size < len) ? s->size : len);
+				if (size != NULL) *size = s->size;
+				if (!s->data_ok) r = DISCFERRET_E_DATA_ERROR;
+			}
+		}
+	} else {
+		// Don't cache failures; the next read tries again
+		e->valid = false;
+	}
+
+	// Read the next track ahead once a sequential run has covered a whole
+	// track: on reaching its last sector, and again on carrying on into the
+	// next track. A read-ahead that has started can't be pre-empted, so a
+	// short run (e.g. one random 4KiB block, even one which crosses a track
+	// boundary) doesn't start one.
+	in_track = (cache->last_cyl == (long)cyl) && (cache->last_head == (long)head) && (cache->last_sector + 1 == (long)sector);
+	crossed = (sector == rc->first_sector) && (cache->last_sector + 1 == (long)(rc->first_sector + rc->sectors)) &&
+			(((cache->last_cyl == (long)cyl) && (cache->last_head + 1 == (long)head)) ||
+			 ((cache->last_cyl + 1 == (long)cyl) && (head == 0)));
+	sequential = (cache->run_first == (long)rc->first_sector) &&
+			(crossed || (in_track && (sector + 1 == rc->first_sector + rc->sectors)));
+	if (!in_track) cache->run_first = sector;
+	cache->last_cyl = cyl;
+	cache->last_head = head;
+	cache->last_sector = sector;
+
+	if (cache->config.read_ahead && sequential && !cache->pending) {
+		unsigned int nc = cyl, nh = head + 1;
+
+		if (nh >= cache->config.heads) {
+			nh = 0;
+			nc++;
+		}
+		if ((nc < cache->config.cylinders) && !wanted(cache, nc, nh)) {
+			cache->pending = true;
+			cache->pending_ahead = true;
+			cache->pending_cyl = nc;
+			cache->pending_head = nh;
+			pthread_cond_broadcast(&cache->cond);
+		}
+	}
+	pthread_mutex_unlock(&cache->lock);
+
+	return r;
+}
+
+void discferret_cache_flush(DISCFERRET_CACHE *cache)
+{
+	if (cache == NULL) return;
+
+	pthread_mutex_lock(&cache->lock);
+	for (unsigned int i = 0; i < cache->count; i++) cache->entries[i].valid = false;
+	if (cache->pending_ahead) cache->pending = false;
+	cache->generation++;
+	pthread_mutex_unlock(&cache->lock);
+}
+
+void discferret_cache_stats(DISCFERRET_CACHE *cache, DISCFERRET_CACHE_STATS *stats)
+{
+	if ((cache == NULL) || (stats == NULL)) return;
+
+	pthread_mutex_lock(&cache->lock);
+	*stats = cache->stats;
+	pthread_mutex_unlock(&cache->lock);
+}
+
+void discferret_cache_close(DISCFERRET_CACHE *cache)
+{
+	if (cache == NULL) return;
+
+	pthread_mutex_lock(&cache->lock);
+	cache->quit = true;
+	pthread_cond_broadcast(&cache->cond);
+	pthread_mutex_unlock(&cache->lock);
+	pthread_join(cache->thread, NULL);
+
+	for (unsigned int i = 0; i < cache->count; i++) discferret_retry_free(&cache->entries[i].result);
+	discferret_retry_free(&cache->scratch);
+	pthread_cond_destroy(&cache->cond);
+	pthread_mutex_destroy(&cache->lock);
+	free(cache->entries);
+	free(cache);
+}
+
+// vim: ts=4 noet sw=4
@@ -0,0 +1,549 @@
+/****************************************************************************
+ *
+ *                - DiscFerret Interface Library for C / C++ -
+ *
+ * Copyright (C) 2010 - 2011 P. A. Pemberton t/a. Red Fox Engineering.
+ * All Rights Reserved.
+ *
+ * Copyright 2010-2011 Philip Pemberton
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ ****************************************************************************/
+
+
+/**
+ * @file	discferret_client.c
+ * @brief	Client library for the DiscFerret daemon (discferretd).
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+#include "discferret.h"
+#include "discferret_flux.h"
+#include "discferret_client.h"
+#include "discferret_proto.h"
+
+/**
+ * @brief	Connection to a daemon
+ */
+struct discferret_client {
+	int				fd;			///< Socket
+	pthread_mutex_t	lock;		///< Serialises requests on this connection
+};
+
+/**
+ * @brief	Handle to a unit owned by a daemon
+ */
+struct discferret_client_handle {
+	DISCFERRET_CLIENT	*conn;	///< Connection the unit was opened on
+	uint16_t			unit;	///< Daemon's unit number
+};
+
+/**
+ * @brief	Send a request to the daemon and read its response
+ * @param	conn		Connection.
+ * @param	op			Opcode.
+ * @param	unit		Unit number.
+ * @param	req			Request payload (may be NULL if reqlen is zero).
+ * @param	reqlen		Length of the request payload.
+ * @param	resp		Buffer for the response payload (may be NULL if respmax is zero).
+ * @param	respmax		Size of the response buffer.
+ * @param	alloc		If not NULL, <i>resp</i> and <i>respmax</i> are ignored and
+ * 						this receives a malloc()ed buffer holding the response
+ * 						payload (NULL if the payload is empty).
+ * @param	resplen		Pointer which will receive the length of the response payload, or NULL.
+ * @returns	Status code from the daemon, or DISCFERRET_E_CONNECTION_ERROR.
+ */
+static DISCFERRET_ERROR transact_ex(DISCFERRET_CLIENT *conn, uint16_t op, uint16_t unit,
+		const void *req, size_t reqlen, void *resp, size_t respmax, unsigned char **alloc, size_t *resplen)
+{
+#ifdef _WIN32
+	return DISCFERRET_E_CONNECTION_ERROR;
+#else
+	unsigned char hdr[PROTO_REQ_HDR_LEN];
+	struct proto_request rq = { PROTO_MAGIC, op, unit, reqlen };
+	int32_t status;
+	uint32_t len;
+
+	proto_put_request(hdr, &rq);
+
+	pthread_mutex_lock(&conn->lock);
+
+	if ((proto_write_all(conn->fd, hdr, sizeof(hdr)) != 0) ||
+			((reqlen > 0) && (proto_write_all(conn->fd, req, reqlen) != 0)) ||
+			(proto_read_all(conn->fd, hdr, PROTO_RESP_HDR_LEN) != 0)) {
+		pthread_mutex_unlock(&conn->lock);
+		return DISCFERRET_E_CONNECTION_ERROR;
+	}
+
+	status = (int32_t)proto_get_u32(hdr);
+	len = proto_get_u32(hdr + 4);
+
+	if (alloc != NULL) {
+		*alloc = NULL;
+		if (len > PROTO_MAX_PAYLOAD) {
+			pthread_mutex_unlock(&conn->lock);
+			return DISCFERRET_E_CONNECTION_ERROR;
+		}
+		// If there's no memory for it, the payload still has to be read to keep the stream in step
+		if ((len > 0) && ((*alloc = malloc(len)) == NULL)) {
+			unsigned char scratch[256];
+			for (uint32_t n; len > 0; len -= n) {
+				n = (len > sizeof(scratch)) ? sizeof(scratch) : len;
+				if (proto_read_all(conn->fd, scratch, n) != 0) break;
+			}
+			pthread_mutex_unlock(&conn->lock);
+			return (len > 0) ? DISCFERRET_E_CONNECTION_ERROR : DISCFERRET_E_OUT_OF_MEMORY;
+		}
+		resp = *alloc;
+		respmax = len;
+	}
+
+	// If the response won't fit, something has gone badly wrong with the stream
+	if ((len > respmax) || ((len > 0) && (proto_read_all(conn->fd, resp, len) != 0))) {
+		pthread_mutex_unlock(&conn->lock);
+		if (alloc != NULL) {
+			free(*alloc);
+			*alloc = NULL;
+		}
+		return DISCFERRET_E_CONNECTION_ERROR;
+	}
+
+	pthread_mutex_unlock(&conn->lock);
+
+	if (resplen != NULL) *resplen = len;
+	return status;
+#endif
+}
+
+/**
+ * @brief	Send a request to the daemon and read its response into a caller-supplied buffer
+ * @see		transact_ex()
+ */
+static DISCFERRET_ERROR transact(DISCFERRET_CLIENT *conn, uint16_t op, uint16_t unit,
+		const void *req, size_t reqlen, void *resp, size_t respmax, size_t *resplen)
+{
+	return transact_ex(conn, op, unit, req, reqlen, resp, respmax, NULL, resplen);
+}
+
+/**
+ * @brief	Send a request with a single 32-bit parameter, and no response payload
+ */
+static DISCFERRET_ERROR transact_u32(DISCFERRET_CLIENT_HANDLE *ch, uint16_t op, uint32_t param)
+{
+	unsigned char buf[4];
+
+	if (ch == NULL) return DISCFERRET_E_BAD_PARAMETER;
+
+	proto_put_u32(buf, param);
+	return transact(ch->conn, op, ch->unit, buf, sizeof(buf), NULL, 0, NULL);
+}
+
+/**
+ * @brief	Send a request with an optional 32-bit parameter, and a 32-bit response
+ * @returns	Response value (0 and up), or a negative DISCFERRET_E_xxx constant on error
+ */
+static long transact_get_u32(DISCFERRET_CLIENT_HANDLE *ch, uint16_t op, const uint32_t *param)
+{
+	unsigned char buf[4] = { 0 };
+	DISCFERRET_ERROR err;
+	size_t len;
+
+	if (ch == NULL) return DISCFERRET_E_BAD_PARAMETER;
+
+	if (param != NULL) proto_put_u32(buf, *param);
+	err = transact(ch->conn, op, ch->unit, buf, (param != NULL) ? sizeof(buf) : 0, buf, sizeof(buf), &len);
+	if (err != DISCFERRET_E_OK) return err;
+	if (len != sizeof(buf)) return DISCFERRET_E_CONNECTION_ERROR;
+
+	return proto_get_u32(buf);
+}
+
+/**
+ * @brief	Copy a NUL-terminated string out of a response payload
+ * @returns	Pointer to the start of the next string, or NULL if the payload is malformed
+ */
+static const unsigned char *get_string(const unsigned char *p, const unsigned char *end, unsigned char *dest, size_t destlen)
+{
+	const unsigned char *nul = memchr(p, '\0', end - p);
+	size_t len;
+
+	if (nul == NULL) return NULL;
+	len = nul - p;
+	if (len >= destlen) len = destlen - 1;
+	memcpy(dest, p, len);
+	dest[len] = '\0';
+	return nul + 1;
+}
+
+DISCFERRET_ERROR discferret_client_connect(const char *path, DISCFERRET_CLIENT **conn)
+{
+#ifdef _WIN32
+	return DISCFERRET_E_NOT_SUPPORTED;
+#else
+	struct sockaddr_un addr;
+
+	if (conn == NULL) return DISCFERRET_E_BAD_PARAMETER;
+	*conn = NULL;
+
+	if (path == NULL) path = DISCFERRET_DAEMON_SOCKET;
+	if (strlen(path) >= sizeof(addr.sun_path)) return DISCFERRET_E_BAD_PARAMETER;
+
+	*conn = malloc(sizeof(DISCFERRET_CLIENT));
+	if (*conn == NULL) return DISCFERRET_E_OUT_OF_MEMORY;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	(*conn)->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (((*conn)->fd < 0) || (connect((*conn)->fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)) {
+		if ((*conn)->fd >= 0) close((*conn)->fd);
+		free(*conn);
+		*conn = NULL;
+		return DISCFERRET_E_CONNECTION_ERROR;
+	}
+
+	pthread_mutex_init(&(*conn)->lock, NULL);
+	return DISCFERRET_E_OK;
+#endif
+}
+
+DISCFERRET_ERROR discferret_client_disconnect(DISCFERRET_CLIENT *conn)
+{
+	if (conn == NULL) return DISCFERRET_E_BAD_PARAMETER;
+
+	close(conn->fd);
+	pthread_mutex_destroy(&conn->lock);
+	free(conn);
+
+	return DISCFERRET_E_OK;
+}
+
+int discferret_client_find_devices(DISCFERRET_CLIENT *conn, DISCFERRET_DEVICE **devlist)
+{
+	const unsigned char *p, *end;
+	unsigned char *buf;
+	DISCFERRET_ERROR err;
+	uint32_t count;
+	size_t len;
+
+	if (conn == NULL) return DISCFERRET_E_BAD_PARAMETER;
+	if (devlist != NULL) *devlist = NULL;
+
+	// Let transact_ex() size the buffer from the response header
+	err = transact_ex(conn, OP_LIST, 0, NULL, 0, NULL, 0, &buf, &len);
+	if ((err == DISCFERRET_E_OK) && (len < 4)) err = DISCFERRET_E_CONNECTION_ERROR;
+	if (err != DISCFERRET_E_OK) {
+		free(buf);
+		return err;
+	}
+
+	// Each device takes at least four bytes (four empty strings)
+	count = proto_get_u32(buf);
+	if (count > (len - 4) / 4) {
+		free(buf);
+		return DISCFERRET_E_CONNECTION_ERROR;
+	}
+	if ((devlist == NULL) || (count == 0)) {
+		free(buf);
+		return count;
+	}
+
+	*devlist = calloc(count, sizeof(DISCFERRET_DEVICE));
+	if (*devlist == NULL) {
+		free(buf);
+		return DISCFERRET_E_OUT_OF_MEMORY;
+	}
+
+	p = buf + 4;
+	end = buf + len;
+	for (uint32_t i = 0; (i < count) && (p != NULL); i++) {
+		DISCFERRET_DEVICE *d = &(*devlist)[i];
+		d->vid = 0x04d8;
+		d->pid = 0xfbbb;
+		p = get_string(p, end, d->serialnumber, sizeof(d->serialnumber));
+		if (p != NULL) p = get_string(p, end, d->productname, sizeof(d->productname));
+		if (p != NULL) p = get_string(p, end, d->manufacturer, sizeof(d->manufacturer));
+		if (p != NULL) p = get_string(p, end, (unsigned char *)d->location, sizeof(d->location));
+	}
+	free(buf);
+
+	if (p == NULL) {
+		free(*devlist);
+		*devlist = NULL;
+		return DISCFERRET_E_CONNECTION_ERROR;
+	}
+
+	return count;
+}
+
+DISCFERRET_ERROR discferret_client_open(DISCFERRET_CLIENT *conn, const char *serialnum, DISCFERRET_CLIENT_HANDLE **ch)
+{
+	unsigned char buf[4];
+	DISCFERRET_ERROR err;
+	size_t len;
+
+	if ((conn == NULL) || (ch == NULL)) return DISCFERRET_E_BAD_PARAMETER;
+	*ch = NULL;
+
+	if (serialnum == NULL) serialnum = "";
+	err = transact(conn, OP_OPEN, 0, serialnum, strlen(serialnum) + 1, buf, sizeof(buf), &len);
+	if (err != DISCFERRET_E_OK) return err;
+	if (len != sizeof(buf)) return DISCFERRET_E_CONNECTION_ERROR;
+
+	*ch = malloc(sizeof(DISCFERRET_CLIENT_HANDLE));
+	if (*ch == NULL) return DISCFERRET_E_OUT_OF_MEMORY;
+	(*ch)->conn = conn;
+	(*ch)->unit = proto_get_u32(buf);
+
+	return DISCFERRET_E_OK;
+}
+
+DISCFERRET_ERROR discferret_client_close(DISCFERRET_CLIENT_HANDLE *ch)
+{
+	DISCFERRET_ERROR err;
+
+	if (ch == NULL) return DISCFERRET_E_BAD_PARAMETER;
+
+	err = transact(ch->conn, OP_CLOSE, ch->unit, NULL, 0, NULL, 0, NULL);
+	free(ch);
+
+	return err;
+}
+
+DISCFERRET_ERROR discferret_client_lock(DISCFERRET_CLIENT_HANDLE *ch)
+{
+	if (ch == NULL) return DISCFERRET_E_BAD_PARAMETER;
+	return transact(ch->conn, OP_LOCK, ch->unit, NULL, 0, NULL, 0, NULL);
+}
+
+DISCFERRET_ERROR discferret_client_unlock(DISCFERRET_CLIENT_HANDLE *ch)
+{
+	if (ch == NULL) return DISCFERRET_E_BAD_PARAMETER;
+	return transact(ch->conn, OP_UNLOCK, ch->unit, NULL, 0, NULL, 0, NULL);
+}
+
+DISCFERRET_ERROR discferret_client_get_info(DISCFERRET_CLIENT_HANDLE *ch, DISCFERRET_DEVICE_INFO *info)
+{
+	unsigned char buf[16 + (3 * 256)];
+	const unsigned char *p;
+	DISCFERRET_ERROR err;
+	size_t len;
+
+	if ((ch == NULL) || (info == NULL)) return DISCFERRET_E_BAD_PARAMETER;
+
+	err = transact(ch->conn, OP_GET_INFO, ch->unit, NULL, 0, buf, sizeof(buf), &len);
+	if (err != DISCFERRET_E_OK) return err;
+	if (len < 16) return DISCFERRET_E_CONNECTION_ERROR;
+
+	info->firmware_ver = proto_get_u32(buf);
+	info->microcode_type = proto_get_u32(buf + 4);
+	info->microcode_ver = proto_get_u32(buf + 8);
+	memcpy(info->hardware_rev, buf + 12, 4);
+	info->hardware_rev[4] = '\0';
+
+	p = get_string(buf + 16, buf + len, info->productname, sizeof(info->productname));
+	if (p != NULL) p = get_string(p, buf + len, info->manufacturer, sizeof(info->manufacturer));
+	if (p != NULL) p = get_string(p, buf + len, info->serialnumber, sizeof(info->serialnumber));
+
+	return (p == NULL) ? DISCFERRET_E_CONNECTION_ERROR : DISCFERRET_E_OK;
+}
+
+DISCFERRET_ERROR discferret_client_fpga_load_default(DISCFERRET_CLIENT_HANDLE *ch)
+{
+	if (ch == NULL) return DISCFERRET_E_BAD_PARAMETER;
+	return transact(ch->conn, OP_FPGA_LOAD_DEFAULT, ch->unit, NULL, 0, NULL, 0, NULL);
+}
+
+int discferret_client_reg_peek(DISCFERRET_CLIENT_HANDLE *ch, const unsigned int addr)
+{
+	uint32_t a = addr;
+	return transact_get_u32(ch, OP_REG_PEEK, &a);
+}
+
+DISCFERRET_ERROR discferret_client_reg_poke(DISCFERRET_CLIENT_HANDLE *ch, const unsigned int addr, const unsigned char data)
+{
+	unsigned char buf[8];
+
+	if (ch == NULL) return DISCFERRET_E_BAD_PARAMETER;
+
+	proto_put_u32(buf, addr);
+	proto_put_u32(buf + 4, data);
+	return transact(ch->conn, OP_REG_POKE, ch->unit, buf, sizeof(buf), NULL, 0, NULL);
+}
+
+long discferret_client_ram_addr_get(DISCFERRET_CLIENT_HANDLE *ch)
+{
+	return transact_get_u32(ch, OP_RAM_ADDR_GET, NULL);
+}
+
+DISCFERRET_ERROR discferret_client_ram_addr_set(DISCFERRET_CLIENT_HANDLE *ch, const unsigned long addr)
+{
+	return transact_u32(ch, OP_RAM_ADDR_SET, addr);
+}
+
+DISCFERRET_ERROR discferret_client_ram_write(DISCFERRET_CLIENT_HANDLE *ch, const unsigned char *block, const size_t len)
+{
+	if ((ch == NULL) || (block == NULL) || (len == 0) || (len > PROTO_MAX_PAYLOAD))
+		return DISCFERRET_E_BAD_PARAMETER;
+
+	return transact(ch->conn, OP_RAM_WRITE, ch->unit, block, len, NULL, 0, NULL);
+}
+
+DISCFERRET_ERROR discferret_client_ram_read(DISCFERRET_CLIENT_HANDLE *ch, unsigned char *block, const size_t len)
+{
+	unsigned char buf[4];
+	DISCFERRET_ERROR err;
+	size_t got;
+
+	if ((ch == NULL) || (block == NULL) || (len == 0) || (len > PROTO_MAX_PAYLOAD))
+		return DISCFERRET_E_BAD_PARAMETER;
+
+	// The daemon sends the data straight into the caller's buffer
+	proto_put_u32(buf, len);
+	err = transact(ch->conn, OP_RAM_READ, ch->unit, buf, sizeof(buf), block, len, &got);
+	if (err != DISCFERRET_E_OK) return err;
+
+	return (got == len) ? DISCFERRET_E_OK : DISCFERRET_E_CONNECTION_ERROR;
+}
+
+long discferret_client_get_status(DISCFERRET_CLIENT_HANDLE *ch)
+{
+	return transact_get_u32(ch, OP_GET_STATUS, NULL);
+}
+
+DISCFERRET_ERROR discferret_client_get_index_time(DISCFERRET_CLIENT_HANDLE *ch, const bool wait, double *timeval)
+{
+	unsigned char buf[8];
+	DISCFERRET_ERROR err;
+	size_t len;
+
+	if ((ch == NULL) || (timeval == NULL)) return DISCFERRET_E_BAD_PARAMETER;
+
+	proto_put_u32(buf, wait ? 1 : 0);
+	err = transact(ch->conn, OP_GET_INDEX_TIME, ch->unit, buf, 4, buf, sizeof(buf), &len);
+	if (err != DISCFERRET_E_OK) return err;
+	if (len != sizeof(buf)) return DISCFERRET_E_CONNECTION_ERROR;
+
+	*timeval = proto_get_double(buf);
+	return DISCFERRET_E_OK;
+}
+
+DISCFERRET_ERROR discferret_client_get_index_frequency(DISCFERRET_CLIENT_HANDLE *ch, const bool wait, double *freqval)
+{
+	DISCFERRET_ERROR err;
+	double tm;
+
+	if (freqval == NULL) return DISCFERRET_E_BAD_PARAMETER;
+
+	// Get time taken for one revolution, and convert to RPM
+	err = discferret_client_get_index_time(ch, wait, &tm);
+	if (err != DISCFERRET_E_OK) return err;
+	*freqval = 60.0 / tm;
+
+	return DISCFERRET_E_OK;
+}
+
+DISCFERRET_ERROR discferret_client_seek_set_rate(DISCFERRET_CLIENT_HANDLE *ch, const unsigned long steprate_us)
+{
+	return transact_u32(ch, OP_SEEK_SET_RATE, steprate_us);
+}
+
+DISCFERRET_ERROR discferret_client_seek_recalibrate(DISCFERRET_CLIENT_HANDLE *ch, const unsigned long maxsteps)
+{
+	return transact_u32(ch, OP_SEEK_RECALIBRATE, maxsteps);
+}
+
+DISCFERRET_ERROR discferret_client_seek_relative(DISCFERRET_CLIENT_HANDLE *ch, const long numsteps)
+{
+	return transact_u32(ch, OP_SEEK_RELATIVE, (uint32_t)(int32_t)numsteps);
+}
+
+DISCFERRET_ERROR discferret_client_seek_absolute(DISCFERRET_CLIENT_HANDLE *ch, const unsigned long track)
+{
+	return transact_u32(ch, OP_SEEK_ABSOLUTE, track);
+}
+
+DISCFERRET_ERROR discferret_client_flux_capture(DISCFERRET_CLIENT_HANDLE *ch, const DISCFERRET_CAPTURE_CONFIG *config, DISCFERRET_FLUX *flux)
+{
+	unsigned char req[20], *buf;
+	DISCFERRET_ERROR err;
+	uint32_t count, index_count;
+	size_t len, pos = 12;
+
+	if ((ch == NULL) || (config == NULL) || (flux == NULL)) return DISCFERRET_E_BAD_PARAMETER;
+
+	proto_put_u32(req, config->clksel);
+	proto_put_u32(req + 4, config->index_start ? 1 : 0);
+	proto_put_u32(req + 8, config->revolutions);
+	proto_put_double(req + 12, config->timeout);
+	err = transact_ex(ch->conn, OP_FLUX_CAPTURE, ch->unit, req, sizeof(req), NULL, 0, &buf, &len);
+	if (err != DISCFERRET_E_OK) {
+		free(buf);
+		return err;
+	}
+
+	// Check the counts agree with the payload length before trusting them
+	if (len < 12) {
+		free(buf);
+		return DISCFERRET_E_CONNECTION_ERROR;
+	}
+	count = proto_get_u32(buf + 4);
+	index_count = proto_get_u32(buf + 8);
+	if (((len - 12) / 4 < (size_t)count + index_count) || (len != 12 + (4 * ((size_t)count + index_count)))) {
+		free(buf);
+		return DISCFERRET_E_CONNECTION_ERROR;
+	}
+
+	// Grow the caller's arrays the same way discferret_flux_from_samples() does
+	if (count > flux->capacity) {
+		uint32_t *p = realloc(flux->intervals, count * sizeof(uint32_t));
+		if (p == NULL) {
+			free(buf);
+			return DISCFERRET_E_OUT_OF_MEMORY;
+		}
+		flux->intervals = p;
+		flux->capacity = count;
+	}
+	if (index_count > flux->index_capacity) {
+		size_t *p = realloc(flux->index, index_count * sizeof(size_t));
+		if (p == NULL) {
+			free(buf);
+			return DISCFERRET_E_OUT_OF_MEMORY;
+		}
+		flux->index = p;
+		flux->index_capacity = index_count;
+	}
+
+	flux->clock_hz = proto_get_u32(buf);
+	for (uint32_t i = 0; i < index_count; i++, pos += 4)
+		flux->index[i] = proto_get_u32(buf + pos);
+	for (uint32_t i = 0; i < count; i++, pos += 4)
+		flux->intervals[i] = proto_get_u32(buf + pos);
+	flux->index_count = index_count;
+	flux->count = count;
+
+	free(buf);
+	return DISCFERRET_E_OK;
+}
+
+// vim: ts=4 noet sw=4
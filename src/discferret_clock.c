@@ -0,0 +1,124 @@
+/****************************************************************************
+ *
+ *                - DiscFerret Interface Library for C / C++ -
+ *
+ * Copyright (C) 2010 - 2011 P. A. Pemberton t/a. Red Fox Engineering.
+ * All Rights Reserved.
+ *
+ * Copyright 2010-2011 Philip Pemberton
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ ****************************************************************************/
+
+
+/**
+ * @file	discferret_clock.c
+ * @brief	Host/device clock correlation.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdbool.h>
+#include <math.h>
+#include "discferret.h"
+#include "discferret_private.h"
+
+/// Minimum number of index pulses before we'll trust the clock fit
+#define CLOCKFIT_MIN_PULSES	3
+
+DISCFERRET_ERROR discferret_clock_correlate(DISCFERRET_DEVICE_HANDLE *dh, const unsigned int samples, DISCFERRET_CLOCK_INFO *info)
+{
+	struct discferret_clockfit fit;
+	int last_tick = -1, last_pll = -1;
+	double total = 0.0;
+
+	// Check that the library has been initialised
+	if (discferret_usb_context() == NULL) return DISCFERRET_E_NOT_INIT;
+
+	// Make sure parameters are valid
+	if ((dh == NULL) || (info == NULL) || (samples < 1)) return DISCFERRET_E_BAD_PARAMETER;
+
+	info->samples = 0;
+	info->usb_latency_min = INFINITY;
+	info->usb_latency_max = 0.0;
+	info->ticker_running = false;
+	info->pll_ticker_running = false;
+
+	// Time a series of ticker reads. Each register read is one command/response round trip.
+	for (unsigned int i = 0; i < samples; i++) {
+		double t0, t1;
+		int tick, pll;
+
+		t0 = discferret_host_time();
+		tick = discferret_reg_peek(dh, DISCFERRET_R_CLOCK_TICKER);
+		t1 = discferret_host_time();
+		if (tick < 0) return tick;
+
+		pll = discferret_reg_peek(dh, DISCFERRET_R_CLOCK_TICKER_PLL);
+		if (pll < 0) return pll;
+
+		if ((last_tick >= 0) && (tick != last_tick)) info->ticker_running = true;
+		if ((last_pll >= 0) && (pll != last_pll)) info->pll_ticker_running = true;
+		last_tick = tick;
+		last_pll = pll;
+
+		if ((t1 - t0) < info->usb_latency_min) info->usb_latency_min = t1 - t0;
+		if ((t1 - t0) > info->usb_latency_max) info->usb_latency_max = t1 - t0;
+		total += t1 - t0;
+		info->samples++;
+	}
+	info->usb_latency_mean = total / info->samples;
+
+	// Offset and drift come from the index monitor's clock fit, if there is one
+	info->index_pulses = 0;
+	info->offset = 0.0;
+	info->drift_ppm = 0.0;
+	info->residual = 0.0;
+	if (discferret_index_monitor_clockfit(dh, &fit) && (fit.n >= CLOCKFIT_MIN_PULSES) && (fit.m2x > 0.0)) {
+		double slope = fit.cxy / fit.m2x;
+		double intercept = fit.mean_y - (slope * fit.mean_x);
+		double resvar = (fit.m2y - (slope * fit.cxy)) / fit.n;
+
+		info->index_pulses = fit.n;
+		info->offset = fit.host0 + intercept;
+		// slope is host seconds per device second. A fast device clock counts extra
+		// ticks, so periods read long in device time and the slope is below 1.
+		info->drift_ppm = ((1.0 / slope) - 1.0) * 1.0e6;
+		info->residual = sqrt(fmax(0.0, resvar));
+	}
+
+	return DISCFERRET_E_OK;
+}
+
+DISCFERRET_ERROR discferret_clock_to_host(DISCFERRET_DEVICE_HANDLE *dh, const unsigned long index, const double offset, double *host)
+{
+	struct discferret_clockfit fit;
+	double slope, intercept, devtime;
+
+	// Make sure parameters are valid
+	if ((dh == NULL) || (host == NULL)) return DISCFERRET_E_BAD_PARAMETER;
+
+	if (!discferret_index_monitor_clockfit(dh, &fit)) return DISCFERRET_E_BAD_PARAMETER;
+	if ((fit.n < CLOCKFIT_MIN_PULSES) || (fit.m2x <= 0.0)) return DISCFERRET_E_NO_MATCH;
+
+	slope = fit.cxy / fit.m2x;
+	intercept = fit.mean_y - (slope * fit.mean_x);
+
+	// Device time of the requested index pulse, extrapolated from the most recent one
+	devtime = fit.device_time + (((double)index - (double)fit.index) * fit.period) + offset;
+
+	*host = fit.host0 + intercept + (slope * devtime);
+	return DISCFERRET_E_OK;
+}
+
+// vim: ts=4 noet sw=4
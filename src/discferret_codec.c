@@ -0,0 +1,581 @@
+/****************************************************************************
+ *
+ *                - DiscFerret Interface Library for C / C++ -
+ *
+ * Copyright (C) 2010 - 2011 P. A. Pemberton t/a. Red Fox Engineering.
+ * All Rights Reserved.
+ *
+ * Copyright 2010-2011 Philip Pemberton
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ ****************************************************************************/
+
+
+
+/**
+ * @file	discferret_codec.c
+ * @brief	Lossless compression codec for flux intervals.
+ *
+ * Stream format (all multi-byte values little-endian or LEB128 varints):
+ *
+ *   varint  total number of intervals
+ *   then for each block of up to CODEC_BLOCK intervals:
+ *     varint  base (block minimum)
+ *     u8      k (residual bits)
+ *     16 x u8 Huffman code lengths, two 4-bit lengths per byte (symbol 2n in the low nibble)
+ *     varint  length of the Huffman-coded bucket stream, in bytes
+ *     ...     bucket stream (LSB-first canonical Huffman codes)
+ *     ...     residual stream, k bits per interval, LSB first, padded to a byte
+ *     varint  value of each escaped interval, in order
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+#include "discferret.h"
+#include "discferret_codec.h"
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define CODEC_SSE2
+#endif
+
+/// Intervals per block
+#define CODEC_BLOCK			4096
+/// Number of Huffman symbols: buckets 0-30, plus the escape
+#define CODEC_SYMBOLS		32
+/// Escape symbol: interval stored as a varint after the residuals
+#define CODEC_ESCAPE		31
+/// Longest Huffman code; also the width of the decode table index
+#define CODEC_MAX_CODE		12
+/// Largest residual width
+#define CODEC_MAX_K			24
+
+/****************************************************************************
+ * Helpers
+ ****************************************************************************/
+
+static size_t put_varint(unsigned char *p, uint64_t v)
+{
+	size_t n = 0;
+	while (v >= 0x80) {
+		p[n++] = (v & 0x7F) | 0x80;
+		v >>= 7;
+	}
+	p[n++] = v;
+	return n;
+}
+
+static bool get_varint(const unsigned char **p, const unsigned char *end, uint64_t *v)
+{
+	unsigned int shift = 0;
+	*v = 0;
+	for (;;) {
+		if ((*p >= end) || (shift > 63)) return false;
+		*v |= (uint64_t)(**p & 0x7F) << shift;
+		if ((*(*p)++ & 0x80) == 0) return true;
+		shift += 7;
+	}
+}
+
+/// Load 8 bytes as a little-endian 64-bit value
+static inline uint64_t load_le64(const unsigned char *p)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+	v = __builtin_bswap64(v);
+#endif
+	return v;
+}
+
+/**
+ * @brief	LSB-first bit writer
+ *
+ * The caller guarantees there is room for everything written, so there are
+ * no bounds checks.
+ */
+struct bitwriter {
+	unsigned char	*p;
+	uint64_t		acc;
+	unsigned int	n;
+};
+
+static inline void bw_put(struct bitwriter *bw, const uint32_t v, const unsigned int len)
+{
+	bw->acc |= (uint64_t)v << bw->n;
+	bw->n += len;
+	if (bw->n >= 32) {
+		bw->p[0] = bw->acc;
+		bw->p[1] = bw->acc >> 8;
+		bw->p[2] = bw->acc >> 16;
+		bw->p[3] = bw->acc >> 24;
+		bw->p += 4;
+		bw->acc >>= 32;
+		bw->n -= 32;
+	}
+}
+
+static inline void bw_flush(struct bitwriter *bw)
+{
+	while (bw->n > 0) {
+		*bw->p++ = bw->acc;
+		bw->acc >>= 8;
+		bw->n = (bw->n > 8) ? bw->n - 8 : 0;
+	}
+	bw->acc = 0;
+}
+
+/**
+ * @brief	LSB-first bit reader
+ *
+ * Reads past the end return zero bits; callers check how many bits they
+ * consumed against the length of the stream.
+ */
+struct bitreader {
+	const unsigned char	*p, *end;
+	uint64_t			acc;
+	unsigned int		n;
+};
+
+static inline void br_refill(struct bitreader *br)
+{
+	if (br->end - br->p >= 8) {
+		// Branch-free refill: top up to at least 56 bits in one load
+		br->acc |= load_le64(br->p) << br->n;
+		br->p += (63 - br->n) >> 3;
+		br->n |= 56;
+	} else {
+		while (br->n <= 56) {
+			if (br->p < br->end) br->acc |= (uint64_t)*br->p++ << br->n;
+			br->n += 8;
+		}
+	}
+}
+
+/****************************************************************************
+ * Huffman code construction
+ ****************************************************************************/
+
+/**
+ * @brief	Build code lengths (at most CODEC_MAX_CODE bits) for a histogram
+ */
+static void huff_lengths(const uint32_t *hist, uint8_t *len)
+{
+	uint32_t freq[CODEC_SYMBOLS];
+	memcpy(freq, hist, sizeof(freq));
+
+	for (;;) {
+		uint64_t weight[CODEC_SYMBOLS * 2];
+		int parent[CODEC_SYMBOLS * 2];
+		bool live[CODEC_SYMBOLS * 2];
+		int nodes = 0, used = 0, maxlen = 0;
+
+		for (int s = 0; s < CODEC_SYMBOLS; s++) {
+			weight[s] = freq[s];
+			live[s] = (freq[s] > 0);
+			parent[s] = -1;
+			if (live[s]) used++;
+		}
+		nodes = CODEC_SYMBOLS;
+		memset(len, 0, CODEC_SYMBOLS);
+
+		if (used == 0) return;
+		if (used == 1) {
+			// A lone symbol still needs a one-bit code
+			for (int s = 0; s < CODEC_SYMBOLS; s++) if (live[s]) len[s] = 1;
+			return;
+		}
+
+		// Repeatedly merge the two lightest live nodes (32 symbols: O(n^2) is fine)
+		while (used > 1) {
+			int a = -1, b = -1;
+			for (int i = 0; i < nodes; i++) {
+				if (!live[i]) continue;
+				if ((a < 0) || (weight[i] < weight[a])) { b = a; a = i; }
+				else if ((b < 0) || (weight[i] < weight[b])) b = i;
+			}
+			weight[nodes] = weight[a] + weight[b];
+			live[nodes] = true;
+			parent[nodes] = -1;
+			live[a] = live[b] = false;
+			parent[a] = parent[b] = nodes;
+			nodes++;
+			used--;
+		}
+
+		for (int s = 0; s < CODEC_SYMBOLS; s++) {
+			int d = 0;
+			if (freq[s] == 0) continue;
+			for (int n = s; parent[n] >= 0; n = parent[n]) d++;
+			len[s] = d;
+			if (d > maxlen) maxlen = d;
+		}
+		if (maxlen <= CODEC_MAX_CODE) return;
+
+		// Too deep: flatten the distribution and try again
+		for (int s = 0; s < CODEC_SYMBOLS; s++)
+			if (freq[s] > 0) freq[s] = (freq[s] + 1) / 2;
+	}
+}
+
+/**
+ * @brief	Assign canonical codes to a set of code lengths, bit-reversed for an LSB-first stream
+ * @returns	false if the lengths don't form a valid prefix code
+ */
+static bool huff_codes(const uint8_t *len, uint16_t *code)
+{
+	unsigned int count[CODEC_MAX_CODE + 1] = { 0 }, next[CODEC_MAX_CODE + 2];
+	unsigned int c = 0, kraft = 0;
+
+	for (int s = 0; s < CODEC_SYMBOLS; s++) {
+		if (len[s] > CODEC_MAX_CODE) return false;
+		if (len[s] > 0) {
+			count[len[s]]++;
+			kraft += 1u << (CODEC_MAX_CODE - len[s]);
+		}
+	}
+	if (kraft > (1u << CODEC_MAX_CODE)) return false;
+
+	for (int l = 1; l <= CODEC_MAX_CODE; l++) {
+		c = (c + count[l - 1]) << 1;
+		next[l] = c;
+	}
+	for (int s = 0; s < CODEC_SYMBOLS; s++) {
+		unsigned int v, r = 0;
+		if (len[s] == 0) continue;
+		v = next[len[s]]++;
+		for (int i = 0; i < len[s]; i++) r |= ((v >> i) & 1) << (len[s] - 1 - i);
+		code[s] = r;
+	}
+	return true;
+}
+
+/****************************************************************************
+ * Data-parallel passes
+ ****************************************************************************/
+
+/// Minimum of a block
+static uint32_t block_min(const uint32_t *in, const size_t n)
+{
+	uint32_t m = UINT32_MAX;
+	size_t i = 0;
+
+#ifdef CODEC_SSE2
+	// SSE2 has no unsigned 32-bit min, so flip the sign bits and use a signed compare
+	const __m128i flip = _mm_set1_epi32((int)0x80000000);
+	__m128i vm = _mm_set1_epi32(0x7FFFFFFF);
+	for (; i + 4 <= n; i += 4) {
+		__m128i v = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(in + i)), flip);
+		__m128i lt = _mm_cmplt_epi32(v, vm);
+		vm = _mm_or_si128(_mm_and_si128(lt, v), _mm_andnot_si128(lt, vm));
+	}
+	{
+		uint32_t t[4];
+		_mm_storeu_si128((__m128i *)t, _mm_xor_si128(vm, flip));
+		for (int j = 0; j < 4; j++) if (t[j] < m) m = t[j];
+	}
+#endif
+	for (; i < n; i++) if (in[i] < m) m = in[i];
+	return m;
+}
+
+/// Split a block into offsets from the base (d) and bucket symbols (sym)
+static void block_split(const uint32_t *in, const size_t n, const uint32_t base, const unsigned int k, uint32_t *d, uint8_t *sym)
+{
+	size_t i = 0;
+
+#ifdef CODEC_SSE2
+	const __m128i vbase = _mm_set1_epi32((int)base);
+	const __m128i flip = _mm_set1_epi32((int)0x80000000);
+	const __m128i limit = _mm_set1_epi32((int)(0x80000000u + CODEC_ESCAPE - 1));
+	const __m128i esc = _mm_set1_epi32(CODEC_ESCAPE);
+	const __m128i shift = _mm_cvtsi32_si128(k);
+	for (; i + 16 <= n; i += 16) {
+		__m128i s[4];
+		for (int j = 0; j < 4; j++) {
+			__m128i v = _mm_sub_epi32(_mm_loadu_si128((const __m128i *)(in + i + (j * 4))), vbase);
+			__m128i b = _mm_srl_epi32(v, shift);
+			__m128i m = _mm_cmpgt_epi32(_mm_xor_si128(b, flip), limit);
+			_mm_storeu_si128((__m128i *)(d + i + (j * 4)), v);
+			s[j] = _mm_or_si128(_mm_andnot_si128(m, b), _mm_and_si128(m, esc));
+		}
+		_mm_storeu_si128((__m128i *)(sym + i),
+				_mm_packus_epi16(_mm_packs_epi32(s[0], s[1]), _mm_packs_epi32(s[2], s[3])));
+	}
+#endif
+	for (; i < n; i++) {
+		uint32_t b;
+		d[i] = in[i] - base;
+		b = d[i] >> k;
+		sym[i] = (b < CODEC_ESCAPE) ? b : CODEC_ESCAPE;
+	}
+}
+
+/// Rebuild intervals from buckets and residuals (out[] holds the residuals on entry)
+static void block_combine(uint32_t *out, const size_t n, const uint8_t *sym, const uint32_t base, const unsigned int k)
+{
+	size_t i = 0;
+
+#ifdef CODEC_SSE2
+	const __m128i vbase = _mm_set1_epi32((int)base);
+	const __m128i shift = _mm_cvtsi32_si128(k);
+	const __m128i zero = _mm_setzero_si128();
+	for (; i + 16 <= n; i += 16) {
+		__m128i b8 = _mm_loadu_si128((const __m128i *)(sym + i));
+		__m128i lo = _mm_unpacklo_epi8(b8, zero), hi = _mm_unpackhi_epi8(b8, zero);
+		__m128i b32[4] = {
+			_mm_unpacklo_epi16(lo, zero), _mm_unpackhi_epi16(lo, zero),
+			_mm_unpacklo_epi16(hi, zero), _mm_unpackhi_epi16(hi, zero)
+		};
+		for (int j = 0; j < 4; j++) {
+			__m128i *o = (__m128i *)(out + i + (j * 4));
+			__m128i v = _mm_add_epi32(_mm_sll_epi32(b32[j], shift), vbase);
+			_mm_storeu_si128(o, _mm_add_epi32(v, _mm_loadu_si128(o)));
+		}
+	}
+#endif
+	for (; i < n; i++)
+		out[i] += base + ((uint32_t)sym[i] << k);
+}
+
+/****************************************************************************
+ * Encoder
+ ****************************************************************************/
+
+/// Stride for sampling a block when choosing k (1 in 8 intervals is plenty for an estimate)
+#define CODEC_SAMPLE_STRIDE	8
+
+/**
+ * @brief	Choose the residual width which minimises the estimated block size
+ *
+ * Works on a sample of the block; the exact histogram for the chosen width
+ * is counted afterwards.
+ */
+static unsigned int choose_k(const uint32_t *d, const size_t n)
+{
+	const size_t stride = (n >= 64 * CODEC_SAMPLE_STRIDE) ? CODEC_SAMPLE_STRIDE : 1;
+	const size_t ns = (n + stride - 1) / stride;
+	double best = HUGE_VAL;
+	unsigned int best_k = 0;
+
+	for (unsigned int k = 0; k <= CODEC_MAX_K; k++) {
+		uint32_t hist[CODEC_SYMBOLS] = { 0 };
+		double cost = (double)ns * k;
+
+		for (size_t i = 0; i < n; i += stride) {
+			uint32_t b = d[i] >> k;
+			hist[(b < CODEC_ESCAPE) ? b : CODEC_ESCAPE]++;
+		}
+		// Entropy of the buckets, plus roughly three bytes per escape
+		for (int s = 0; s < CODEC_SYMBOLS; s++)
+			if (hist[s] > 0) cost += hist[s] * log2((double)ns / hist[s]);
+		cost += hist[CODEC_ESCAPE] * 24.0;
+
+		if (cost < best) {
+			best = cost;
+			best_k = k;
+		} else if (hist[CODEC_ESCAPE] == 0) {
+			// Once nothing escapes, every extra bit of k only adds cost
+			break;
+		}
+	}
+
+	return best_k;
+}
+
+size_t discferret_codec_bound(const size_t count)
+{
+	size_t blocks = (count + CODEC_BLOCK - 1) / CODEC_BLOCK;
+	// Per interval: 12-bit code + 24-bit residual + 5-byte escape; per block: header
+	return 10 + (blocks * 40) + (count * 10);
+}
+
+DISCFERRET_ERROR discferret_codec_encode(const uint32_t *in, const size_t count, unsigned char *out, const size_t outmax, size_t *outlen)
+{
+	uint32_t d[CODEC_BLOCK];
+	uint8_t sym[CODEC_BLOCK];
+	unsigned char *p = out;
+
+	if (((in == NULL) && (count > 0)) || (out == NULL) || (outlen == NULL)) return DISCFERRET_E_BAD_PARAMETER;
+	if (outmax < 10) return DISCFERRET_E_BAD_PARAMETER;
+
+	p += put_varint(p, count);
+
+	for (size_t pos = 0; pos < count; pos += CODEC_BLOCK) {
+		const size_t n = ((count - pos) < CODEC_BLOCK) ? (count - pos) : CODEC_BLOCK;
+		const uint32_t *blk = in + pos;
+		uint32_t hist[CODEC_SYMBOLS], base;
+		uint8_t len[CODEC_SYMBOLS];
+		uint16_t code[CODEC_SYMBOLS];
+		unsigned char *hstart, *hlenp;
+		struct bitwriter bw;
+		unsigned int k;
+		size_t hlen;
+
+		// Worst case for this block must fit before we start writing it
+		if ((size_t)(out + outmax - p) < 40 + (n * 10)) return DISCFERRET_E_BAD_PARAMETER;
+
+		// Frame of reference, then pick the bucket size
+		base = block_min(blk, n);
+		block_split(blk, n, base, 0, d, sym);
+		k = choose_k(d, n);
+		if (k > 0) block_split(blk, n, base, k, d, sym);
+		memset(hist, 0, sizeof(hist));
+		for (size_t i = 0; i < n; i++) hist[sym[i]]++;
+
+		huff_lengths(hist, len);
+		huff_codes(len, code);
+
+		// Block header
+		p += put_varint(p, base);
+		*p++ = k;
+		for (int s = 0; s < CODEC_SYMBOLS; s += 2) *p++ = len[s] | (len[s + 1] << 4);
+
+		// Bucket stream. Its length goes in front of it, in a fixed
+		// three-byte varint so it can be patched afterwards.
+		hlenp = p;
+		p += 3;
+		hstart = p;
+		bw.p = p; bw.acc = 0; bw.n = 0;
+		for (size_t i = 0; i < n; i++) bw_put(&bw, code[sym[i]], len[sym[i]]);
+		bw_flush(&bw);
+		p = bw.p;
+		hlen = p - hstart;
+		hlenp[0] = (hlen & 0x7F) | 0x80;
+		hlenp[1] = ((hlen >> 7) & 0x7F) | 0x80;
+		hlenp[2] = (hlen >> 14) & 0x7F;
+
+		// Residuals
+		if (k > 0) {
+			const uint32_t mask = (1u << k) - 1;
+			bw.p = p; bw.acc = 0; bw.n = 0;
+			for (size_t i = 0; i < n; i++) bw_put(&bw, (sym[i] == CODEC_ESCAPE) ? 0 : (d[i] & mask), k);
+			bw_flush(&bw);
+			p = bw.p;
+		}
+
+		// Escaped intervals
+		if (hist[CODEC_ESCAPE] > 0) {
+			for (size_t i = 0; i < n; i++)
+				if (sym[i] == CODEC_ESCAPE) p += put_varint(p, blk[i]);
+		}
+	}
+
+	*outlen = p - out;
+	return DISCFERRET_E_OK;
+}
+
+/****************************************************************************
+ * Decoder
+ ****************************************************************************/
+
+DISCFERRET_ERROR discferret_codec_count(const unsigned char *in, const size_t inlen, size_t *count)
+{
+	uint64_t v;
+
+	if ((in == NULL) || (count == NULL)) return DISCFERRET_E_BAD_PARAMETER;
+	if (!get_varint(&in, in + inlen, &v) || (v > SIZE_MAX)) return DISCFERRET_E_BAD_PARAMETER;
+	*count = v;
+	return DISCFERRET_E_OK;
+}
+
+DISCFERRET_ERROR discferret_codec_decode(const unsigned char *in, const size_t inlen, uint32_t *out, const size_t outmax, size_t *count)
+{
+	const unsigned char *p = in, *end = in + inlen;
+	uint8_t sym[CODEC_BLOCK];
+	uint16_t escpos[CODEC_BLOCK];
+	uint16_t table[1 << CODEC_MAX_CODE];
+	uint64_t total;
+
+	if ((in == NULL) || (out == NULL) || (count == NULL)) return DISCFERRET_E_BAD_PARAMETER;
+	if (!get_varint(&p, end, &total) || (total > outmax)) return DISCFERRET_E_BAD_PARAMETER;
+
+	for (size_t pos = 0; pos < total; pos += CODEC_BLOCK) {
+		const size_t n = ((total - pos) < CODEC_BLOCK) ? (total - pos) : CODEC_BLOCK;
+		uint32_t *blk = out + pos;
+		uint8_t len[CODEC_SYMBOLS];
+		uint16_t code[CODEC_SYMBOLS];
+		struct bitreader br;
+		uint64_t base, hlen, used = 0;
+		size_t nesc = 0;
+		unsigned int k;
+
+		// Block header
+		if (!get_varint(&p, end, &base) || (base > UINT32_MAX)) return DISCFERRET_E_BAD_PARAMETER;
+		if (end - p < 1 + (CODEC_SYMBOLS / 2)) return DISCFERRET_E_BAD_PARAMETER;
+		k = *p++;
+		if (k > CODEC_MAX_K) return DISCFERRET_E_BAD_PARAMETER;
+		for (int s = 0; s < CODEC_SYMBOLS; s += 2) {
+			len[s] = *p & 0x0F;
+			len[s + 1] = *p++ >> 4;
+		}
+		if (!get_varint(&p, end, &hlen) || (hlen > (uint64_t)(end - p))) return DISCFERRET_E_BAD_PARAMETER;
+
+		// Decode table: every CODEC_MAX_CODE-bit pattern maps to (symbol, length)
+		if (!huff_codes(len, code)) return DISCFERRET_E_BAD_PARAMETER;
+		memset(table, 0, sizeof(table));
+		for (int s = 0; s < CODEC_SYMBOLS; s++) {
+			if (len[s] == 0) continue;
+			for (unsigned int j = code[s]; j < (1u << CODEC_MAX_CODE); j += 1u << len[s])
+				table[j] = (s << 4) | len[s];
+		}
+
+		// Bucket stream
+		br.p = p; br.end = p + hlen; br.acc = 0; br.n = 0;
+		for (size_t i = 0; i < n; i++) {
+			uint16_t e;
+			if (br.n < CODEC_MAX_CODE) br_refill(&br);
+			e = table[br.acc & ((1u << CODEC_MAX_CODE) - 1)];
+			if ((e & 0x0F) == 0) return DISCFERRET_E_BAD_PARAMETER;
+			br.acc >>= e & 0x0F;
+			br.n -= e & 0x0F;
+			used += e & 0x0F;
+			sym[i] = e >> 4;
+			if (sym[i] == CODEC_ESCAPE) escpos[nesc++] = i;
+		}
+		if (used > hlen * 8) return DISCFERRET_E_BAD_PARAMETER;
+		p += hlen;
+
+		// Residuals go straight into the output
+		if (k > 0) {
+			const uint32_t mask = (1u << k) - 1;
+			const size_t rlen = ((n * k) + 7) / 8;
+			if (rlen > (size_t)(end - p)) return DISCFERRET_E_BAD_PARAMETER;
+			br.p = p; br.end = p + rlen; br.acc = 0; br.n = 0;
+			for (size_t i = 0; i < n; i++) {
+				if (br.n < k) br_refill(&br);
+				blk[i] = br.acc & mask;
+				br.acc >>= k;
+				br.n -= k;
+			}
+			p += rlen;
+		} else {
+			memset(blk, 0, n * sizeof(uint32_t));
+		}
+
+		block_combine(blk, n, sym, base, k);
+
+		// Patch in the escaped intervals
+		for (size_t i = 0; i < nesc; i++) {
+			uint64_t v;
+			if (!get_varint(&p, end, &v) || (v > UINT32_MAX)) return DISCFERRET_E_BAD_PARAMETER;
+			blk[escpos[i]] = v;
+		}
+	}
+
+	*count = total;
+	return DISCFERRET_E_OK;
+}
+
+// vim: ts=4 noet sw=4
@@ -0,0 +1,808 @@
+/****************************************************************************
+ *
+ *                - DiscFerret Interface Library for C / C++ -
+ *
+ * Copyright (C) 2010 - 2011 P. A. Pemberton t/a. Red Fox Engineering.
+ * All Rights Reserved.
+ *
+ * Copyright 2010-2011 Philip Pemberton
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ ****************************************************************************/
+
+
+
+
+/**
+ * @file	discferret_decode.c
+ * @brief	Sector decoders for captured flux.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include "discferret.h"
+#include "discferret_flux.h"
+#include "discferret_decode.h"
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define DECODE_SSE2
+#endif
+
+/// PLL gain: fraction of each bitcell timing error fed back into the cell period
+#define PLL_GAIN		(1.0 / 16.0)
+/// PLL range: how far the cell period may drift from nominal
+#define PLL_RANGE		0.10
+/// Longest run of bitcells between transitions which the PLL tracks; longer runs are clipped
+#define PLL_MAX_RUN		8
+
+/// MFM: three A1 sync bytes (data A1, missing clock between bits 4 and 5)
+#define MFM_SYNC		0x448944894489ULL
+#define MFM_SYNC_MASK	0xFFFFFFFFFFFFULL
+/// IBM: CRC after the three A1 sync bytes
+#define IBM_CRC_A1A1A1	0xCDB4
+
+/**
+ * FM: the end of a 00 sync byte (clock FF), then the first eleven cells of
+ * an address mark with clock C7, up to the last transition they all share
+ * (FE, FB and F8 marks differ from data bit 2 on).
+ */
+#define FM_SYNC			0x557ABULL
+#define FM_SYNC_MASK	0x7FFFFULL
+/// FM: bitcells from the start of the mark byte to the end of the sync pattern
+#define FM_SYNC_BACK	11
+
+/// Apple: address and data field prologues (D5 AA 96, D5 AA AD)
+enum {
+	APPLE_PROLOGUE1		= 0xD5,
+	APPLE_PROLOGUE2		= 0xAA,
+	APPLE_MARK_ADDRESS	= 0x96,
+	APPLE_MARK_DATA		= 0xAD
+};
+/// Apple: 6-and-2 encoded data field length in nibbles (342, plus a checksum)
+#define APPLE_DATA_NIBBLES	343
+/// Apple: longest distance from an address field to its data field, in nibbles
+#define APPLE_MAX_ID_GAP	64
+
+/// Commodore: a sync mark is at least ten 1 bits in a row
+#define C1541_SYNC			0x3FFULL
+#define C1541_SYNC_MASK		0x3FFULL
+/// Commodore: header and data block IDs
+enum {
+	C1541_BLOCK_HEADER	= 0x08,
+	C1541_BLOCK_DATA	= 0x07
+};
+/// Commodore: longest distance from a header to its data block, in bitcells
+#define C1541_MAX_ID_GAP	(100 * 10)
+
+/// Amiga: two 4489 sync words, after a 00 00 (AAAA) preamble
+#define AMIGA_SYNC		0xAAAA44894489ULL
+#define AMIGA_SYNC_MASK	0xFFFFFFFFFFFFULL
+/// Amiga: MFM data bits of a raw longword (the rest are clock bits)
+#define AMIGA_DATA_BITS	0x55
+/**
+ * Amiga: raw (MFM) bytes in a sector after the sync words: info and
+ * label (40), header checksum (8), data checksum (8) and data (1024).
+ */
+enum {
+	AMIGA_RAW_INFO		= 0,
+	AMIGA_RAW_HDR_SUM	= 40,
+	AMIGA_RAW_DATA_SUM	= 48,
+	AMIGA_RAW_DATA		= 56,
+	AMIGA_RAW_SECTOR	= 56 + 1024
+};
+/// Amiga: info longword format byte
+#define AMIGA_FORMAT	0xFF
+
+/**
+ * @brief	Commodore 1541 speed zones
+ *
+ * The drive clocks outer tracks faster, to fit more sectors on them.
+ */
+static const struct {
+	unsigned int	first_track;	///< First track in the zone
+	unsigned long	bitrate;		///< Bit rate (16MHz / 13, 14, 15 or 16 / 4)
+	unsigned int	sectors;		///< Sectors per track
+} c1541_zones[] = {
+	{ 31, 250000, 17 },
+	{ 25, 266667, 18 },
+	{ 18, 285714, 19 },
+	{ 1,  307692, 21 }
+};
+
+/// IBM address marks
+enum {
+	IBM_MARK_ID			= 0xFE,
+	IBM_MARK_DATA		= 0xFB,
+	IBM_MARK_DELETED	= 0xF8
+};
+
+/// Longest distance from an ID field to its data field, in bitcells (43 bytes covers the 1.2M gap; allow plenty more)
+#define IBM_MAX_ID_GAP	(100 * 16)
+
+static const uint16_t crc16_table[256] = {
+	0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50a5, 0x60c6, 0x70e7,
+	0x8108, 0x9129, 0xa14a, 0xb16b, 0xc18c, 0xd1ad, 0xe1ce, 0xf1ef,
+	0x1231, 0x0210, 0x3273, 0x2252, 0x52b5, 0x4294, 0x72f7, 0x62d6,
+	0x9339, 0x8318, 0xb37b, 0xa35a, 0xd3bd, 0xc39c, 0xf3ff, 0xe3de,
+	0x2462, 0x3443, 0x0420, 0x1401, 0x64e6, 0x74c7, 0x44a4, 0x5485,
+	0xa56a, 0xb54b, 0x8528, 0x9509, 0xe5ee, 0xf5cf, 0xc5ac, 0xd58d,
+	0x3653, 0x2672, 0x1611, 0x0630, 0x76d7, 0x66f6, 0x5695, 0x46b4,
+	0xb75b, 0xa77a, 0x9719, 0x8738, 0xf7df, 0xe7fe, 0xd79d, 0xc7bc,
+	0x48c4, 0x58e5, 0x6886, 0x78a7, 0x0840, 0x1861, 0x2802, 0x3823,
+	0xc9cc, 0xd9ed, 0xe98e, 0xf9af, 0x8948, 0x9969, 0xa90a, 0xb92b,
+	0x5af5, 0x4ad4, 0x7ab7, 0x6a96, 0x1a71, 0x0a50, 0x3a33, 0x2a12,
+	0xdbfd, 0xcbdc, 0xfbbf, 0xeb9e, 0x9b79, 0x8b58, 0xbb3b, 0xab1a,
+	0x6ca6, 0x7c87, 0x4ce4, 0x5cc5, 0x2c22, 0x3c03, 0x0c60, 0x1c41,
+	0xedae, 0xfd8f, 0xcdec, 0xddcd, 0xad2a, 0xbd0b, 0x8d68, 0x9d49,
+	0x7e97, 0x6eb6, 0x5ed5, 0x4ef4, 0x3e13, 0x2e32, 0x1e51, 0x0e70,
+	0xff9f, 0xefbe, 0xdfdd, 0xcffc, 0xbf1b, 0xaf3a, 0x9f59, 0x8f78,
+	0x9188, 0x81a9, 0xb1ca, 0xa1eb, 0xd10c, 0xc12d, 0xf14e, 0xe16f,
+	0x1080, 0x00a1, 0x30c2, 0x20e3, 0x5004, 0x4025, 0x7046, 0x6067,
+	0x83b9, 0x9398, 0xa3fb, 0xb3da, 0xc33d, 0xd31c, 0xe37f, 0xf35e,
+	0x02b1, 0x1290, 0x22f3, 0x32d2, 0x4235, 0x5214, 0x6277, 0x7256,
+	0xb5ea, 0xa5cb, 0x95a8, 0x8589, 0xf56e, 0xe54f, 0xd52c, 0xc50d,
+	0x34e2, 0x24c3, 0x14a0, 0x0481, 0x7466, 0x6447, 0x5424, 0x4405,
+	0xa7db, 0xb7fa, 0x8799, 0x97b8, 0xe75f, 0xf77e, 0xc71d, 0xd73c,
+	0x26d3, 0x36f2, 0x0691, 0x16b0, 0x6657, 0x7676, 0x4615, 0x5634,
+	0xd94c, 0xc96d, 0xf90e, 0xe92f, 0x99c8, 0x89e9, 0xb98a, 0xa9ab,
+	0x5844, 0x4865, 0x7806, 0x6827, 0x18c0, 0x08e1, 0x3882, 0x28a3,
+	0xcb7d, 0xdb5c, 0xeb3f, 0xfb1e, 0x8bf9, 0x9bd8, 0xabbb, 0xbb9a,
+	0x4a75, 0x5a54, 0x6a37, 0x7a16, 0x0af1, 0x1ad0, 0x2ab3, 0x3a92,
+	0xfd2e, 0xed0f, 0xdd6c, 0xcd4d, 0xbdaa, 0xad8b, 0x9de8, 0x8dc9,
+	0x7c26, 0x6c07, 0x5c64, 0x4c45, 0x3ca2, 0x2c83, 0x1ce0, 0x0cc1,
+	0xef1f, 0xff3e, 0xcf5d, 0xdf7c, 0xaf9b, 0xbfba, 0x8fd9, 0x9ff8,
+	0x6e17, 0x7e36, 0x4e55, 0x5e74, 0x2e93, 0x3eb2, 0x0ed1, 0x1ef0
+};
+
+/**
+ * Data bits of four MFM/FM clock+data cell pairs. Index with a byte of
+ * bitcells (clock, data, clock, data, ...); returns the four data bits.
+ */
+static const unsigned char cell_data[256] = {
+	0, 1, 0, 1, 2, 3, 2, 3, 0, 1, 0, 1, 2, 3, 2, 3,
+	4, 5, 4, 5, 6, 7, 6, 7, 4, 5, 4, 5, 6, 7, 6, 7,
+	0, 1, 0, 1, 2, 3, 2, 3, 0, 1, 0, 1, 2, 3, 2, 3,
+	4, 5, 4, 5, 6, 7, 6, 7, 4, 5, 4, 5, 6, 7, 6, 7,
+	8, 9, 8, 9, 10, 11, 10, 11, 8, 9, 8, 9, 10, 11, 10, 11,
+	12, 13, 12, 13, 14, 15, 14, 15, 12, 13, 12, 13, 14, 15, 14, 15,
+	8, 9, 8, 9, 10, 11, 10, 11, 8, 9, 8, 9, 10, 11, 10, 11,
+	12, 13, 12, 13, 14, 15, 14, 15, 12, 13, 12, 13, 14, 15, 14, 15,
+	0, 1, 0, 1, 2, 3, 2, 3, 0, 1, 0, 1, 2, 3, 2, 3,
+	4, 5, 4, 5, 6, 7, 6, 7, 4, 5, 4, 5, 6, 7, 6, 7,
+	0, 1, 0, 1, 2, 3, 2, 3, 0, 1, 0, 1, 2, 3, 2, 3,
+	4, 5, 4, 5, 6, 7, 6, 7, 4, 5, 4, 5, 6, 7, 6, 7,
+	8, 9, 8, 9, 10, 11, 10, 11, 8, 9, 8, 9, 10, 11, 10, 11,
+	12, 13, 12, 13, 14, 15, 14, 15, 12, 13, 12, 13, 14, 15, 14, 15,
+	8, 9, 8, 9, 10, 11, 10, 11, 8, 9, 8, 9, 10, 11, 10, 11,
+	12, 13, 12, 13, 14, 15, 14, 15, 12, 13, 12, 13, 14, 15, 14, 15
+};
+
+/**
+ * Apple 6-and-2 read translate table, for disk nibbles 0x80 to 0xFF.
+ * 0xFF marks nibbles which never appear in a data field.
+ */
+static const unsigned char apple_gcr[128] = {
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x00, 0x01, 0xff, 0xff, 0x02, 0x03, 0xff, 0x04, 0x05, 0x06,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x07, 0x08, 0xff, 0xff, 0xff, 0x09, 0x0a, 0x0b, 0x0c, 0x0d,
+	0xff, 0xff, 0x0e, 0x0f, 0x10, 0x11, 0x12, 0x13, 0xff, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0x1a,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x1b, 0xff, 0x1c, 0x1d, 0x1e,
+	0xff, 0xff, 0xff, 0x1f, 0xff, 0xff, 0x20, 0x21, 0xff, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0x29, 0x2a, 0x2b, 0xff, 0x2c, 0x2d, 0x2e, 0x2f, 0x30, 0x31, 0x32,
+	0xff, 0xff, 0x33, 0x34, 0x35, 0x36, 0x37, 0x38, 0xff, 0x39, 0x3a, 0x3b, 0x3c, 0x3d, 0x3e, 0x3f
+};
+
+/// Commodore GCR: 5-bit code to nibble. 0xFF marks invalid codes.
+static const unsigned char c1541_gcr[32] = {
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x08, 0x00, 0x01, 0xff, 0x0c, 0x04, 0x05,
+	0xff, 0xff, 0x02, 0x03, 0xff, 0x0f, 0x06, 0x07, 0xff, 0x09, 0x0a, 0x0b, 0xff, 0x0d, 0x0e, 0xff
+};
+
+uint16_t discferret_crc16(uint16_t crc, const unsigned char *buf, const size_t len)
+{
+	for (size_t i = 0; i < len; i++)
+		crc = (crc << 8) ^ crc16_table[(crc >> 8) ^ buf[i]];
+	return crc;
+}
+
+/**
+ * @brief	Grow an array to hold at least <i>n</i> elements
+ */
+static bool grow(void **array, size_t *capacity, const size_t n, const size_t elemsize)
+{
+	void *p;
+
+	if (n <= *capacity) return true;
+	p = realloc(*array, n * elemsize);
+	if (p == NULL) return false;
+	*array = p;
+	*capacity = n;
+	return true;
+}
+
+/**
+ * @brief	Software PLL state
+ */
+struct pll {
+	double	cell;		///< Current bitcell period, in flux clock ticks
+	double	lo;			///< Shortest allowed period
+	double	hi;			///< Longest allowed period
+};
+
+static void pll_init(struct pll *pll, const double cell)
+{
+	pll->cell = cell;
+	pll->lo = cell * (1.0 - PLL_RANGE);
+	pll->hi = cell * (1.0 + PLL_RANGE);
+}
+
+/**
+ * @brief	Convert a flux interval into a number of bitcells
+ *
+ * The interval is rounded to a whole number of cells at the PLL's current
+ * cell period, and the period is nudged towards the measured one.
+ */
+static inline unsigned int pll_step(struct pll *pll, const double iv)
+{
+	unsigned int n = (unsigned int)(iv / pll->cell + 0.5);
+
+	if (n < 1) n = 1;
+	if (n <= PLL_MAX_RUN) {
+		pll->cell += ((iv / n) - pll->cell) * PLL_GAIN;
+		if (pll->cell < pll->lo) pll->cell = pll->lo;
+		if (pll->cell > pll->hi) pll->cell = pll->hi;
+	} else {
+		// Unformatted area or a dropout; don't let it drag the clock
+		n = PLL_MAX_RUN;
+	}
+	return n;
+}
+
+/**
+ * @brief	Run the PLL over a flux stream
+ * @param	flux		Flux intervals.
+ * @param	cell		Nominal bitcell period, in flux clock ticks.
+ * @param	sync		Sync pattern (must end with a transition).
+ * @param	syncmask	Bits of the pattern to compare.
+ * @param	back		Bitcells to step back from the end of a sync match, to get the mark position.
+ * @param	track		Receives the bitcell stream and the sync mark positions.
+ */
+static DISCFERRET_ERROR flux_to_cells(const DISCFERRET_FLUX *flux, const double cell, const uint64_t sync, const uint64_t syncmask,
+		const size_t back, DISCFERRET_TRACK *track)
+{
+	// Four bytes of slack so cells can be read 32 bits at a time
+	size_t nbytes = ((flux->count * PLL_MAX_RUN) / 8) + 4;
+	struct pll pll;
+	uint64_t sr = 0;
+	size_t pos = 0, nm = 0;
+
+	if (!grow((void **)&track->bits, &track->bits_capacity, nbytes, 1)) return DISCFERRET_E_OUT_OF_MEMORY;
+	memset(track->bits, 0, nbytes);
+	pll_init(&pll, cell);
+
+	for (size_t i = 0; i < flux->count; i++) {
+		const unsigned int n = pll_step(&pll, flux->intervals[i]);
+
+		pos += n;
+		track->bits[(pos - 1) >> 3] |= 0x80 >> ((pos - 1) & 7);
+		sr = (sr << n) | 1;
+
+		if (((sr & syncmask) == sync) && (pos >= back)) {
+			if (nm == track->marks_capacity) {
+				if (!grow((void **)&track->marks, &track->marks_capacity, (nm < 64) ? 64 : nm * 2, sizeof(size_t)))
+					return DISCFERRET_E_OUT_OF_MEMORY;
+			}
+			track->marks[nm++] = pos - back;
+		}
+	}
+
+	track->cells = pos;
+	track->marks_count = nm;
+	return DISCFERRET_E_OK;
+}
+
+/**
+ * @brief	Read up to 24 bitcells from the bitcell stream, most significant first
+ */
+static inline uint32_t get_cells(const unsigned char *bits, const size_t pos, const unsigned int n)
+{
+	const unsigned char *p = bits + (pos >> 3);
+	uint32_t w = ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+	return (w << (pos & 7)) >> (32 - n);
+}
+
+/**
+ * @brief	Decode MFM/FM bytes from the bitcell stream
+ * @param	bits	Bitcell stream.
+ * @param	pos		Bitcell offset of the first byte (its first clock cell).
+ * @param	out		Receives the bytes.
+ * @param	len		Number of bytes.
+ */
+static void cells_to_bytes(const unsigned char *bits, size_t pos, unsigned char *out, const size_t len)
+{
+	for (size_t i = 0; i < len; i++, pos += 16) {
+		uint32_t w = get_cells(bits, pos, 16);
+		out[i] = (cell_data[w >> 8] << 4) | cell_data[w & 0xFF];
+	}
+}
+
+/**
+ * @brief	Find a sector by ID, or add a new one
+ */
+static DISCFERRET_SECTOR *find_sector(DISCFERRET_TRACK *track, const unsigned char *id, bool *is_new)
+{
+	DISCFERRET_SECTOR *s;
+
+	for (size_t i = 0; i < track->count; i++) {
+		s = &track->sectors[i];
+		if ((s->cyl == id[0]) && (s->head == id[1]) && (s->sector == id[2]) && (s->size_code == id[3])) {
+			*is_new = false;
+			return s;
+		}
+	}
+
+	if (track->count == track->capacity) {
+		if (!grow((void **)&track->sectors, &track->capacity, (track->capacity > 0) ? track->capacity * 2 : 32, sizeof(DISCFERRET_SECTOR)))
+			return NULL;
+	}
+	s = &track->sectors[track->count++];
+	memset(s, 0, sizeof(DISCFERRET_SECTOR));
+	s->cyl = id[0];
+	s->head = id[1];
+	s->sector = id[2];
+	s->size_code = id[3];
+	*is_new = true;
+	return s;
+}
+
+/**
+ * @brief	Reset a track's sector list, and size its payload buffer
+ * @param	max_data	Most payload bytes the stream could hold.
+ *
+ * The buffer is sized once and never moved, as the sectors point into it.
+ */
+static DISCFERRET_ERROR track_begin(DISCFERRET_TRACK *track, const size_t max_data)
+{
+	track->count = 0;
+	track->bad_ids = track->bad_data = 0;
+	if (!grow((void **)&track->data, &track->data_capacity, max_data, 1)) return DISCFERRET_E_OUT_OF_MEMORY;
+	return DISCFERRET_E_OK;
+}
+
+/**
+ * @brief	Store a decoded payload against a sector
+ * @param	used	Bytes of the track's payload buffer in use; updated.
+ * @returns	true if the payload was kept.
+ */
+static bool sector_store(DISCFERRET_TRACK *track, DISCFERRET_SECTOR *cur, unsigned char *p, const size_t size, const bool ok, size_t *used)
+{
+	if (!ok) track->bad_data++;
+	// Keep a bad copy only until a good one turns up
+	if (ok || (cur->data == NULL)) {
+		cur->data = p;
+		cur->size = size;
+		cur->data_ok = ok;
+		*used += size;
+		return true;
+	}
+	return false;
+}
+
+/**
+ * @brief	Decode IBM ID and data fields following each sync mark
+ * @param	track	Track, with the bitcell stream and sync mark positions filled in.
+ * @param	crc0	CRC of the sync bytes, which the field CRCs include.
+ */
+static DISCFERRET_ERROR decode_ibm_fields(DISCFERRET_TRACK *track, const uint16_t crc0)
+{
+	DISCFERRET_SECTOR *cur = NULL;
+	size_t id_pos = 0, used = 0;
+	unsigned char buf[7];
+	DISCFERRET_ERROR err;
+
+	// Payloads can't take up more than the stream does
+	if ((err = track_begin(track, (track->cells / 16) + 1)) != DISCFERRET_E_OK) return err;
+
+	for (size_t m = 0; m < track->marks_count; m++) {
+		const size_t pos = track->marks[m];
+
+		if (pos + 16 > track->cells) break;
+		cells_to_bytes(track->bits, pos, buf, 1);
+
+		if (buf[0] == IBM_MARK_ID) {
+			bool is_new;
+
+			// Mark, C, H, R, N, CRC
+			cur = NULL;
+			if (pos + (7 * 16) > track->cells) break;
+			cells_to_bytes(track->bits, pos, buf, 7);
+			if (discferret_crc16(crc0, buf, 7) != 0) {
+				track->bad_ids++;
+				continue;
+			}
+			if ((cur = find_sector(track, buf + 1, &is_new)) == NULL) return DISCFERRET_E_OUT_OF_MEMORY;
+			if (is_new) cur->position = pos;
+			// Already have a good copy of this one
+			if (cur->data_ok) cur = NULL;
+			id_pos = pos;
+		} else if ((buf[0] == IBM_MARK_DATA) || (buf[0] == IBM_MARK_DELETED)) {
+			unsigned char *p = track->data + used;
+			size_t size;
+			uint16_t crc;
+
+			// Data fields only count straight after their ID field
+			if ((cur == NULL) || (pos - id_pos > IBM_MAX_ID_GAP)) continue;
+			size = (size_t)128 << (cur->size_code & 7);
+			if (pos + ((size + 3) * 16) > track->cells) break;
+			if (used + size > track->data_capacity) break;
+
+			cells_to_bytes(track->bits, pos + 16, p, size);
+			cells_to_bytes(track->bits, pos + ((size + 1) * 16), buf + 1, 2);
+			crc = discferret_crc16(crc0, buf, 1);
+			crc = discferret_crc16(crc, p, size);
+			crc = discferret_crc16(crc, buf + 1, 2);
+
+			if (sector_store(track, cur, p, size, (crc == 0), &used))
+				cur->deleted = (buf[0] == IBM_MARK_DELETED);
+			cur = NULL;
+		}
+	}
+
+	return DISCFERRET_E_OK;
+}
+
+DISCFERRET_ERROR discferret_decode_mfm(const DISCFERRET_FLUX *flux, const unsigned long bitrate, DISCFERRET_TRACK *track)
+{
+	DISCFERRET_ERROR err;
+
+	if ((flux == NULL) || (track == NULL) || (bitrate == 0) || (flux->clock_hz == 0)) return DISCFERRET_E_BAD_PARAMETER;
+
+	// Two bitcells (clock and data) per data bit
+	if ((err = flux_to_cells(flux, (double)flux->clock_hz / (2.0 * bitrate), MFM_SYNC, MFM_SYNC_MASK, 0, track)) != DISCFERRET_E_OK)
+		return err;
+	return decode_ibm_fields(track, IBM_CRC_A1A1A1);
+}
+
+DISCFERRET_ERROR discferret_decode_fm(const DISCFERRET_FLUX *flux, const unsigned long bitrate, DISCFERRET_TRACK *track)
+{
+	DISCFERRET_ERROR err;
+
+	if ((flux == NULL) || (track == NULL) || (bitrate == 0) || (flux->clock_hz == 0)) return DISCFERRET_E_BAD_PARAMETER;
+
+	// Two bitcells (clock and data) per data bit, as with MFM; FM's CRCs start at the mark
+	if ((err = flux_to_cells(flux, (double)flux->clock_hz / (2.0 * bitrate), FM_SYNC, FM_SYNC_MASK, FM_SYNC_BACK, track)) != DISCFERRET_E_OK)
+		return err;
+	return decode_ibm_fields(track, 0xFFFF);
+}
+
+DISCFERRET_ERROR discferret_decode_apple(const DISCFERRET_FLUX *flux, const unsigned long bitrate, DISCFERRET_TRACK *track)
+{
+	DISCFERRET_SECTOR *cur = NULL;
+	struct pll pll;
+	unsigned char *nib, sr = 0;
+	size_t n = 0, id_pos = 0, used = 0;
+	DISCFERRET_ERROR err;
+
+	if ((flux == NULL) || (track == NULL) || (bitrate == 0) || (flux->clock_hz == 0)) return DISCFERRET_E_BAD_PARAMETER;
+
+	// Every nibble has at least one transition in it
+	if (!grow((void **)&track->bits, &track->bits_capacity, flux->count + 1, 1)) return DISCFERRET_E_OUT_OF_MEMORY;
+	nib = track->bits;
+	pll_init(&pll, (double)flux->clock_hz / bitrate);
+
+	// Disk II read logic: shift bits in, ignoring leading zeros; the nibble is
+	// complete when its top bit is set
+	for (size_t i = 0; i < flux->count; i++) {
+		unsigned int cells = pll_step(&pll, flux->intervals[i]);
+
+		while ((--cells > 0) && (sr != 0)) {
+			sr <<= 1;
+			if (sr & 0x80) {
+				nib[n++] = sr;
+				sr = 0;
+			}
+		}
+		sr = (sr << 1) | 1;
+		if (sr & 0x80) {
+			nib[n++] = sr;
+			sr = 0;
+		}
+	}
+	track->cells = n;
+	track->marks_count = 0;
+
+	if ((err = track_begin(track, ((n / APPLE_DATA_NIBBLES) + 1) * 256)) != DISCFERRET_E_OK) return err;
+
+	for (size_t i = 0; i + 3 <= n; i++) {
+		if ((nib[i] != APPLE_PROLOGUE1) || (nib[i+1] != APPLE_PROLOGUE2)) continue;
+
+		if (nib[i+2] == APPLE_MARK_ADDRESS) {
+			unsigned char id[4], f[4];
+			bool is_new;
+
+			// Volume, track, sector, checksum; each 4-and-4 encoded (odd bits, then even bits)
+			cur = NULL;
+			if (i + 3 + 8 > n) break;
+			for (int k = 0; k < 4; k++)
+				f[k] = ((nib[i + 3 + (2 * k)] << 1) | 1) & nib[i + 4 + (2 * k)];
+			if ((f[0] ^ f[1] ^ f[2] ^ f[3]) != 0) {
+				track->bad_ids++;
+				continue;
+			}
+
+			id[0] = f[1];
+			id[1] = 0;
+			id[2] = f[2];
+			id[3] = 1;
+			if ((cur = find_sector(track, id, &is_new)) == NULL) return DISCFERRET_E_OUT_OF_MEMORY;
+			if (is_new) cur->position = i;
+			if (cur->data_ok) cur = NULL;
+			id_pos = i;
+			i += 10;
+		} else if (nib[i+2] == APPLE_MARK_DATA) {
+			const unsigned char *d = &nib[i + 3];
+			unsigned char buf[APPLE_DATA_NIBBLES], *p = track->data + used;
+			unsigned char prev = 0;
+			bool ok = true;
+
+			if ((cur == NULL) || (i - id_pos > APPLE_MAX_ID_GAP)) continue;
+			if (i + 3 + APPLE_DATA_NIBBLES > n) break;
+			if (used + 256 > track->data_capacity) break;
+
+			// Translate, and undo the running XOR; the last nibble is the checksum
+			for (int k = 0; k < APPLE_DATA_NIBBLES; k++) {
+				unsigned char v = (d[k] & 0x80) ? apple_gcr[d[k] & 0x7F] : 0xFF;
+				if (v == 0xFF) {
+					ok = false;
+					v = 0;
+				}
+				buf[k] = v ^ prev;
+				prev = buf[k];
+			}
+			if (buf[APPLE_DATA_NIBBLES - 1] != 0) ok = false;
+
+			// 86 nibbles of low bit pairs (bit-swapped), then 256 of high six bits
+			for (int k = 0; k < 256; k++) {
+				unsigned char two = (buf[k % 86] >> (2 * (k / 86))) & 3;
+				p[k] = (buf[86 + k] << 2) | ((two & 1) << 1) | (two >> 1);
+			}
+
+			sector_store(track, cur, p, 256, ok, &used);
+			cur = NULL;
+			i += 2 + APPLE_DATA_NIBBLES;
+		}
+	}
+
+	return DISCFERRET_E_OK;
+}
+
+/**
+ * @brief	Decode Commodore GCR bytes from the bitcell stream
+ * @returns	true if every 5-bit code was valid.
+ */
+static bool gcr_to_bytes(const unsigned char *bits, size_t pos, unsigned char *out, const size_t len)
+{
+	unsigned char bad = 0;
+
+	for (size_t i = 0; i < len; i++, pos += 10) {
+		uint32_t w = get_cells(bits, pos, 10);
+		unsigned char hi = c1541_gcr[w >> 5], lo = c1541_gcr[w & 0x1F];
+		bad |= hi | lo;
+		out[i] = (hi << 4) | (lo & 0x0F);
+	}
+	return (bad & 0xF0) == 0;
+}
+
+DISCFERRET_ERROR discferret_decode_c1541(const DISCFERRET_FLUX *flux, const unsigned int track_no, DISCFERRET_TRACK *track)
+{
+	DISCFERRET_SECTOR *cur = NULL;
+	unsigned long bitrate = 0;
+	size_t id_pos = 0, used = 0, last = (size_t)-1;
+	unsigned char buf[8];
+	DISCFERRET_ERROR err;
+
+	if ((flux == NULL) || (track == NULL) || (track_no < 1) || (flux->clock_hz == 0)) return DISCFERRET_E_BAD_PARAMETER;
+
+	for (size_t z = 0; z < sizeof(c1541_zones) / sizeof(c1541_zones[0]); z++) {
+		if (track_no >= c1541_zones[z].first_track) {
+			bitrate = c1541_zones[z].bitrate;
+			break;
+		}
+	}
+
+	// No clock cells: one bitcell per bit
+	if ((err = flux_to_cells(flux, (double)flux->clock_hz / bitrate, C1541_SYNC, C1541_SYNC_MASK, 0, track)) != DISCFERRET_E_OK)
+		return err;
+	if ((err = track_begin(track, ((track->cells / (258 * 10)) + 1) * 256)) != DISCFERRET_E_OK) return err;
+
+	for (size_t m = 0; m < track->marks_count; m++) {
+		size_t pos = track->marks[m];
+
+		// A sync run matches at every transition; the block starts at its first 0
+		while ((pos < track->cells) && (get_cells(track->bits, pos, 1) != 0)) pos++;
+		if (pos == last) continue;
+		last = pos;
+
+		if (pos + 10 > track->cells) break;
+		gcr_to_bytes(track->bits, pos, buf, 1);
+
+		if (buf[0] == C1541_BLOCK_HEADER) {
+			unsigned char id[4];
+			bool is_new;
+
+			// ID, checksum, sector, track, ID2, ID1
+			cur = NULL;
+			if (pos + (6 * 10) > track->cells) break;
+			if (!gcr_to_bytes(track->bits, pos, buf, 6) || ((buf[1] ^ buf[2] ^ buf[3] ^ buf[4] ^ buf[5]) != 0)) {
+				track->bad_ids++;
+				continue;
+			}
+
+			id[0] = buf[3];
+			id[1] = 0;
+			id[2] = buf[2];
+			id[3] = 1;
+			if ((cur = find_sector(track, id, &is_new)) == NULL) return DISCFERRET_E_OUT_OF_MEMORY;
+			if (is_new) cur->position = pos;
+			if (cur->data_ok) cur = NULL;
+			id_pos = pos;
+		} else if (buf[0] == C1541_BLOCK_DATA) {
+			unsigned char *p = track->data + used, sum = 0, chk;
+			bool ok;
+
+			if ((cur == NULL) || (pos - id_pos > C1541_MAX_ID_GAP)) continue;
+			// ID, 256 data bytes, checksum
+			if (pos + (258 * 10) > track->cells) break;
+			if (used + 256 > track->data_capacity) break;
+
+			ok = gcr_to_bytes(track->bits, pos + 10, p, 256);
+			ok = gcr_to_bytes(track->bits, pos + (257 * 10), &chk, 1) && ok;
+			for (int k = 0; k < 256; k++) sum ^= p[k];
+
+			sector_store(track, cur, p, 256, ok && (sum == chk), &used);
+			cur = NULL;
+		}
+	}
+
+	return DISCFERRET_E_OK;
+}
+
+/**
+ * @brief	Merge Amiga odd/even bit-split raw MFM blocks
+ * @param	odd		Raw bytes holding the odd data bits.
+ * @param	even	Raw bytes holding the even data bits.
+ * @param	out		Receives the data.
+ * @param	len		Number of data bytes.
+ *
+ * The data bits sit in the same places in every raw byte, so the merge is
+ * byte-wise: ((odd & 0x55) << 1) | (even & 0x55).
+ */
+static void amiga_merge(const unsigned char *odd, const unsigned char *even, unsigned char *out, size_t len)
+{
+#ifdef DECODE_SSE2
+	const __m128i mask = _mm_set1_epi8(AMIGA_DATA_BITS);
+
+	for (; len >= 16; len -= 16, odd += 16, even += 16, out += 16) {
+		__m128i o = _mm_and_si128(_mm_loadu_si128((const __m128i *)odd), mask);
+		__m128i e = _mm_and_si128(_mm_loadu_si128((const __m128i *)even), mask);
+		// Masked, so a 16-bit shift can't carry between bytes
+		_mm_storeu_si128((__m128i *)out, _mm_or_si128(_mm_slli_epi16(o, 1), e));
+	}
+#endif
+	for (size_t i = 0; i < len; i++)
+		out[i] = ((odd[i] & AMIGA_DATA_BITS) << 1) | (even[i] & AMIGA_DATA_BITS);
+}
+
+/**
+ * @brief	Amiga checksum: XOR of the data bits of a run of raw longwords
+ * @param	raw		Raw bytes.
+ * @param	len		Number of raw bytes (a multiple of 4).
+ * @returns	Checksum, as the data bits of a raw longword (big-endian).
+ */
+static uint32_t amiga_checksum(const unsigned char *raw, size_t len)
+{
+	unsigned char x[4] = { 0, 0, 0, 0 };
+
+#ifdef DECODE_SSE2
+	__m128i acc = _mm_setzero_si128();
+	unsigned char lanes[16];
+
+	for (; len >= 16; len -= 16, raw += 16)
+		acc = _mm_xor_si128(acc, _mm_loadu_si128((const __m128i *)raw));
+	_mm_storeu_si128((__m128i *)lanes, acc);
+	for (int i = 0; i < 16; i++) x[i & 3] ^= lanes[i];
+#endif
+	for (size_t i = 0; i < len; i++) x[i & 3] ^= raw[i];
+
+	return (((uint32_t)x[0] << 24) | ((uint32_t)x[1] << 16) | ((uint32_t)x[2] << 8) | x[3]) & 0x55555555UL;
+}
+
+/**
+ * @brief	Read a 32-bit value stored as an odd/even raw longword pair
+ */
+static uint32_t amiga_long(const unsigned char *raw)
+{
+	unsigned char b[4];
+
+	amiga_merge(raw, raw + 4, b, 4);
+	return ((uint32_t)b[0] << 24) | ((uint32_t)b[1] << 16) | ((uint32_t)b[2] << 8) | b[3];
+}
+
+DISCFERRET_ERROR discferret_decode_amiga(const DISCFERRET_FLUX *flux, const unsigned long bitrate, DISCFERRET_TRACK *track)
+{
+	unsigned char raw[AMIGA_RAW_SECTOR];
+	size_t used = 0;
+	DISCFERRET_ERROR err;
+
+	if ((flux == NULL) || (track == NULL) || (bitrate == 0) || (flux->clock_hz == 0)) return DISCFERRET_E_BAD_PARAMETER;
+
+	if ((err = flux_to_cells(flux, (double)flux->clock_hz / (2.0 * bitrate), AMIGA_SYNC, AMIGA_SYNC_MASK, 0, track)) != DISCFERRET_E_OK)
+		return err;
+	if ((err = track_begin(track, ((track->cells / (AMIGA_RAW_SECTOR * 8)) + 1) * 512)) != DISCFERRET_E_OK) return err;
+
+	for (size_t m = 0; m < track->marks_count; m++) {
+		const size_t pos = track->marks[m];
+		const unsigned char *p = track->bits + (pos >> 3);
+		const unsigned int sh = pos & 7;
+		DISCFERRET_SECTOR *cur;
+		unsigned char id[4];
+		uint32_t info;
+		bool is_new;
+
+		if (pos + (AMIGA_RAW_SECTOR * 8) > track->cells) break;
+
+		// Byte-align the sector; the bitcell stream has slack for the extra byte
+		if (sh == 0) {
+			memcpy(raw, p, AMIGA_RAW_SECTOR);
+		} else {
+			for (size_t i = 0; i < AMIGA_RAW_SECTOR; i++)
+				raw[i] = (p[i] << sh) | (p[i + 1] >> (8 - sh));
+		}
+
+		info = amiga_long(raw + AMIGA_RAW_INFO);
+		if (((info >> 24) != AMIGA_FORMAT) ||
+				(amiga_checksum(raw + AMIGA_RAW_INFO, AMIGA_RAW_HDR_SUM - AMIGA_RAW_INFO) != amiga_long(raw + AMIGA_RAW_HDR_SUM))) {
+			track->bad_ids++;
+			continue;
+		}
+
+		// Info: format, track (cylinder * 2 + head), sector, sectors to the gap
+		id[0] = (info >> 17) & 0x7F;
+		id[1] = (info >> 16) & 1;
+		id[2] = (info >> 8) & 0xFF;
+		id[3] = 2;
+		if ((cur = find_sector(track, id, &is_new)) == NULL) return DISCFERRET_E_OUT_OF_MEMORY;
+		if (is_new) cur->position = pos;
+		if (cur->data_ok) continue;
+		if (used + 512 > track->data_capacity) break;
+
+		amiga_merge(raw + AMIGA_RAW_DATA, raw + AMIGA_RAW_DATA + 512, track->data + used, 512);
+		sector_store(track, cur, track->data + used, 512,
+				amiga_checksum(raw + AMIGA_RAW_DATA, 1024) == amiga_long(raw + AMIGA_RAW_DATA_SUM), &used);
+	}
+
+	return DISCFERRET_E_OK;
+}
+
+void discferret_track_free(DISCFERRET_TRACK *track)
+{
+	if (track == NULL) return;
+	free(track->sectors);
+	free(track->bits);
+	free(track->marks);
+	free(track->data);
+	memset(track, 0, sizeof(DISCFERRET_TRACK));
+}
+
+// vim: ts=4 noet sw=4
@@ -0,0 +1,179 @@
+/****************************************************************************
+ *
+ *                - DiscFerret Interface Library for C / C++ -
+ *
+ * Copyright (C) 2010 - 2011 P. A. Pemberton t/a. Red Fox Engineering.
+ * All Rights Reserved.
+ *
+ * Copyright 2010-2011 Philip Pemberton
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ ****************************************************************************/
+
+
+/**
+ * @file	discferret_fleet.c
+ * @brief	Concurrent bring-up of multiple DiscFerret units.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <libusb-1.0/libusb.h>
+#include "discferret.h"
+#include "discferret_fleet.h"
+#include "discferret_private.h"
+
+/**
+ * @brief	Work item for one bring-up thread
+ */
+struct fleet_job {
+	DISCFERRET_FLEET_UNIT	*unit;			///< Unit to bring up
+	libusb_device			*dev;			///< libusb device (referenced), or NULL if not attached
+	bool					load_microcode;	///< True to load the default microcode
+	pthread_t				thread;			///< Bring-up thread
+	bool					started;		///< True if the thread was started
+};
+
+/**
+ * @brief	Open one unit, and load its microcode if asked to
+ */
+static void *bringup_thread(void *arg)
+{
+	struct fleet_job *job = arg;
+	DISCFERRET_FLEET_UNIT *unit = job->unit;
+	double t;
+
+	unit->dh = NULL;
+	unit->load_status = DISCFERRET_E_OK;
+	unit->open_time = unit->load_time = 0.0;
+
+	if (job->dev == NULL) {
+		unit->open_status = DISCFERRET_E_NO_MATCH;
+		return NULL;
+	}
+
+	t = discferret_host_time();
+	unit->open_status = discferret_open_device(job->dev, &unit->dh);
+	unit->open_time = discferret_host_time() - t;
+	if (unit->open_status != DISCFERRET_E_OK) return NULL;
+
+	if (job->load_microcode) {
+		t = discferret_host_time();
+		unit->load_status = discferret_fpga_load_default(unit->dh);
+		unit->load_time = discferret_host_time() - t;
+	}
+
+	return NULL;
+}
+
+DISCFERRET_ERROR discferret_fleet_open(const char * const *serials, const size_t nserials, const bool load_microcode, DISCFERRET_FLEET **fleet)
+{
+	DISCFERRET_DEVICE *devlist = NULL;
+	libusb_device **devs = NULL;
+	struct fleet_job *jobs;
+	DISCFERRET_FLEET *f;
+	double start;
+	int cnt;
+
+	// Check that the library has been initialised
+	if (discferret_usb_context() == NULL) return DISCFERRET_E_NOT_INIT;
+
+	// Make sure the fleet pointer is not NULL
+	if (fleet == NULL) return DISCFERRET_E_BAD_PARAMETER;
+	*fleet = NULL;
+
+	start = discferret_host_time();
+
+	// Get the list of attached units
+	cnt = discferret_registry_list(&devlist, &devs);
+	if (cnt < 0) return cnt;
+
+	f = calloc(1, sizeof(DISCFERRET_FLEET));
+	if (f == NULL) goto oom;
+	f->count = (serials == NULL) ? (size_t)cnt : nserials;
+	f->units = calloc(f->count + 1, sizeof(DISCFERRET_FLEET_UNIT));
+	jobs = calloc(f->count + 1, sizeof(struct fleet_job));
+	if ((f->units == NULL) || (jobs == NULL)) {
+		free(jobs);
+		free(f->units);
+		free(f);
+		goto oom;
+	}
+
+	// Match up the units we've been asked for with the attached devices
+	for (size_t i = 0; i < f->count; i++) {
+		jobs[i].unit = &f->units[i];
+		jobs[i].load_microcode = load_microcode;
+
+		if (serials == NULL) {
+			f->units[i].device = devlist[i];
+			jobs[i].dev = devs[i];
+		} else {
+			strncpy((char *)f->units[i].device.serialnumber, serials[i], sizeof(f->units[i].device.serialnumber) - 1);
+			for (int j = 0; j < cnt; j++) {
+				if (strcmp((const char *)devlist[j].serialnumber, serials[i]) == 0) {
+					f->units[i].device = devlist[j];
+					jobs[i].dev = devs[j];
+					break;
+				}
+			}
+		}
+	}
+
+	// Start all the bring-up threads, then wait for them to finish
+	for (size_t i = 0; i < f->count; i++) {
+		if (pthread_create(&jobs[i].thread, NULL, bringup_thread, &jobs[i]) == 0)
+			jobs[i].started = true;
+		else
+			bringup_thread(&jobs[i]);
+	}
+	for (size_t i = 0; i < f->count; i++) {
+		if (jobs[i].started) pthread_join(jobs[i].thread, NULL);
+		if ((f->units[i].open_status == DISCFERRET_E_OK) && (f->units[i].load_status == DISCFERRET_E_OK))
+			f->ready++;
+	}
+
+	f->elapsed = discferret_host_time() - start;
+
+	free(jobs);
+	discferret_registry_list_free(devs, cnt);
+	discferret_devlist_free(&devlist);
+
+	*fleet = f;
+	return DISCFERRET_E_OK;
+
+oom:
+	discferret_registry_list_free(devs, cnt);
+	discferret_devlist_free(&devlist);
+	return DISCFERRET_E_OUT_OF_MEMORY;
+}
+
+DISCFERRET_ERROR discferret_fleet_close(DISCFERRET_FLEET *fleet)
+{
+	// Make sure the fleet pointer is not NULL
+	if (fleet == NULL) return DISCFERRET_E_BAD_PARAMETER;
+
+	for (size_t i = 0; i < fleet->count; i++)
+		if (fleet->units[i].dh != NULL)
+			discferret_close(fleet->units[i].dh);
+
+	free(fleet->units);
+	free(fleet);
+
+	return DISCFERRET_E_OK;
+}
+
+// vim: ts=4 noet sw=4
@@ -0,0 +1,216 @@
+/****************************************************************************
+ *
+ *                - DiscFerret Interface Library for C / C++ -
+ *
+ * Copyright (C) 2010 - 2011 P. A. Pemberton t/a. Red Fox Engineering.
+ * All Rights Reserved.
+ *
+ * Copyright 2010-2011 Philip Pemberton
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ ****************************************************************************/
+
+
+
+/**
+ * @file	discferret_flux.c
+ * @brief	Conversion of DiscFerret acquisition samples into flux intervals.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <string.h>
+#include <stdlib.h>
+#include "discferret.h"
+#include "discferret_registers.h"
+#include "discferret_flux.h"
+#include "discferret_pool.h"
+#include "discferret_private.h"
+
+unsigned long discferret_acq_clock_hz(const unsigned int clksel)
+{
+	switch (clksel) {
+		case DISCFERRET_ACQ_RATE_100MHZ:	return 100000000UL;
+		case DISCFERRET_ACQ_RATE_50MHZ:		return 50000000UL;
+		case DISCFERRET_ACQ_RATE_25MHZ:		return 25000000UL;
+		case DISCFERRET_ACQ_RATE_12_5MHZ:	return 12500000UL;
+		default:							return 0;
+	}
+}
+
+/**
+ * @brief	Grow an array to hold at least <i>n</i> elements
+ */
+static bool grow(void **array, size_t *capacity, const size_t n, const size_t elemsize)
+{
+	void *p;
+
+	if (n <= *capacity) return true;
+	p = realloc(*array, n * elemsize);
+	if (p == NULL) return false;
+	*array = p;
+	*capacity = n;
+	return true;
+}
+
+DISCFERRET_ERROR discferret_flux_from_samples(const unsigned char *samples, const size_t len, const unsigned int clksel, DISCFERRET_FLUX *flux)
+{
+	uint32_t acc = 0;
+	bool last_index = false;
+	size_t n = 0, ni = 0;
+
+	if ((samples == NULL) || (flux == NULL)) return DISCFERRET_E_BAD_PARAMETER;
+	if ((flux->clock_hz = discferret_acq_clock_hz(clksel)) == 0) return DISCFERRET_E_BAD_PARAMETER;
+
+	// There can't be more transitions than sample bytes, so size the array
+	// once up front and keep the inner loop free of checks
+	if (!grow((void **)&flux->intervals, &flux->capacity, len, sizeof(uint32_t))) return DISCFERRET_E_OUT_OF_MEMORY;
+
+	for (size_t i = 0; i < len; i++) {
+		const unsigned char s = samples[i];
+		const bool index = (s & DISCFERRET_SAMPLE_INDEX) != 0;
+
+		// Record the rising edge of INDEX against the interval it falls in
+		if (index && !last_index) {
+			// Double the array when it fills up, rather than growing it pulse by pulse
+			if ((ni == flux->index_capacity) && !grow((void **)&flux->index, &flux->index_capacity,
+					flux->index_capacity ? flux->index_capacity * 2 : 8, sizeof(size_t)))
+				return DISCFERRET_E_OUT_OF_MEMORY;
+			flux->index[ni++] = n;
+		}
+		last_index = index;
+
+		acc += s & DISCFERRET_SAMPLE_COUNT;
+		if ((s & DISCFERRET_SAMPLE_COUNT) != DISCFERRET_SAMPLE_COUNT) {
+			flux->intervals[n++] = acc;
+			acc = 0;
+		}
+	}
+
+	flux->count = n;
+	flux->index_count = ni;
+	return DISCFERRET_E_OK;
+}
+
+DISCFERRET_ERROR discferret_acq_wait(DISCFERRET_DEVICE_HANDLE *dh, const double expect, const double deadline, unsigned long *polls,
+		const struct discferret_deadline *dl)
+{
+	DISCFERRET_ERROR r;
+
+	r = discferret_wait_status(dh, DISCFERRET_STATUS_ACQSTATUS_MASK, DISCFERRET_STATUS_ACQ_IDLE, expect, deadline, NULL, polls, dl);
+	if ((r == DISCFERRET_E_TIMEOUT) || (r == DISCFERRET_E_CANCELLED))
+		discferret_reg_poke(dh, DISCFERRET_R_ACQCON, DISCFERRET_ACQCON_ABORT);
+	return r;
+}
+
+DISCFERRET_ERROR discferret_acq_start(DISCFERRET_DEVICE_HANDLE *dh, const unsigned int clksel, const unsigned int start_evt,
+		const unsigned int start_num, const unsigned int stop_evt, const unsigned int stop_num, double *start)
+{
+	int r;
+
+	// Keep the RAM and the acquisition registers to ourselves until the capture is under way
+	discferret_lock(dh);
+	if (((r = discferret_ram_addr_set(dh, 0)) != DISCFERRET_E_OK) ||
+			((r = discferret_reg_poke(dh, DISCFERRET_R_ACQ_CLKSEL, clksel)) != DISCFERRET_E_OK) ||
+			((r = discferret_reg_poke(dh, DISCFERRET_R_ACQ_START_EVT, start_evt)) != DISCFERRET_E_OK) ||
+			((r = discferret_reg_poke(dh, DISCFERRET_R_ACQ_START_NUM, start_num)) != DISCFERRET_E_OK) ||
+			((r = discferret_reg_poke(dh, DISCFERRET_R_ACQ_STOP_EVT, stop_evt)) != DISCFERRET_E_OK) ||
+			((r = discferret_reg_poke(dh, DISCFERRET_R_ACQ_STOP_NUM, stop_num)) != DISCFERRET_E_OK)) {
+		discferret_unlock(dh);
+		return r;
+	}
+	*start = discferret_host_time();
+	r = discferret_reg_poke(dh, DISCFERRET_R_ACQCON, DISCFERRET_ACQCON_START);
+	discferret_unlock(dh);
+	return r;
+}
+
+DISCFERRET_ERROR discferret_acq_readback(DISCFERRET_DEVICE_HANDLE *dh, const unsigned int clksel, DISCFERRET_FLUX *flux,
+		const struct discferret_deadline *dl)
+{
+	unsigned char *buf;
+	long len;
+	int r;
+
+	// The RAM address pointer has stopped just past the last sample
+	discferret_lock(dh);
+	if ((len = discferret_ram_addr_get(dh)) < 0) {
+		discferret_unlock(dh);
+		return len;
+	}
+	if (len == 0) {
+		discferret_unlock(dh);
+		flux->count = flux->index_count = 0;
+		flux->clock_hz = discferret_acq_clock_hz(clksel);
+		return DISCFERRET_E_OK;
+	}
+	if ((buf = discferret_buffer_get(dh, len)) == NULL) {
+		discferret_unlock(dh);
+		return DISCFERRET_E_OUT_OF_MEMORY;
+	}
+	if (((r = discferret_ram_addr_set(dh, 0)) == DISCFERRET_E_OK) &&
+			((r = (dl != NULL) ? discferret_ram_read_deadline(dh, buf, len, dl->deadline, dl->cancel)
+					: discferret_ram_read(dh, buf, len)) == DISCFERRET_E_OK)) {
+		discferret_unlock(dh);
+		r = discferret_flux_from_samples(buf, len, clksel, flux);
+	} else {
+		discferret_unlock(dh);
+	}
+
+	discferret_buffer_put(dh, buf);
+	return r;
+}
+
+DISCFERRET_ERROR discferret_flux_capture(DISCFERRET_DEVICE_HANDLE *dh, const DISCFERRET_CAPTURE_CONFIG *config, DISCFERRET_FLUX *flux)
+{
+	return discferret_flux_capture_deadline(dh, config, flux, 0.0, NULL);
+}
+
+DISCFERRET_ERROR discferret_flux_capture_deadline(DISCFERRET_DEVICE_HANDLE *dh, const DISCFERRET_CAPTURE_CONFIG *config, DISCFERRET_FLUX *flux,
+		const double deadline, const DISCFERRET_CANCEL *cancel)
+{
+	struct discferret_deadline dl = { deadline, cancel };
+	DISCFERRET_INDEX_STATS is;
+	double start, expect, abort_at, next;
+	int r;
+
+	if ((dh == NULL) || (config == NULL) || (flux == NULL)) return DISCFERRET_E_BAD_PARAMETER;
+	if ((config->revolutions < 1) || (config->revolutions > 256)) return DISCFERRET_E_BAD_PARAMETER;
+	if (discferret_acq_clock_hz(config->clksel) == 0) return DISCFERRET_E_BAD_PARAMETER;
+	if ((r = discferret_deadline_check(&dl)) != DISCFERRET_E_OK) return r;
+
+	if ((r = discferret_acq_start(dh, config->clksel, config->index_start ? DISCFERRET_ACQ_EVENT_INDEX : DISCFERRET_ACQ_EVENT_ALWAYS, 0,
+			DISCFERRET_ACQ_EVENT_INDEX, config->revolutions - 1, &start)) != DISCFERRET_E_OK)
+		return r;
+
+	// The capture ends on an index pulse; if the index monitor is running it
+	// knows when that will be
+	expect = start;
+	if ((discferret_index_monitor_predict(dh, &next) == DISCFERRET_E_OK) &&
+			(discferret_index_monitor_get(dh, &is) == DISCFERRET_E_OK))
+		expect = next + (is.mean * (config->index_start ? config->revolutions : config->revolutions - 1));
+	abort_at = start + ((config->timeout > 0.0) ? config->timeout : (1.0 + 0.25 * (config->revolutions + 1)));
+
+	if ((r = discferret_acq_wait(dh, expect, abort_at, NULL, &dl)) != DISCFERRET_E_OK) return r;
+	return discferret_acq_readback(dh, config->clksel, flux, &dl);
+}
+
+void discferret_flux_free(DISCFERRET_FLUX *flux)
+{
+	if (flux == NULL) return;
+	free(flux->intervals);
+	free(flux->index);
+	memset(flux, 0, sizeof(DISCFERRET_FLUX));
+}
+
+// vim: ts=4 noet sw=4
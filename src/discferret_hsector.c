@@ -0,0 +1,162 @@
+/****************************************************************************
+ *
+ *                - DiscFerret Interface Library for C / C++ -
+ *
+ * Copyright (C) 2010 - 2011 P. A. Pemberton t/a. Red Fox Engineering.
+ * All Rights Reserved.
+ *
+ * Copyright 2010-2011 Philip Pemberton
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ ****************************************************************************/
+
+
+
+
+/**
+ * @file	discferret_hsector.c
+ * @brief	Hard-sectored disc capture.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <string.h>
+#include <stdlib.h>
+#include "discferret.h"
+#include "discferret_registers.h"
+#include "discferret_flux.h"
+#include "discferret_hsector.h"
+#include "discferret_private.h"
+
+/**
+ * @brief	Check a configuration, and program the HSTMD thresholds
+ * @param	rev		Receives the nominal revolution time, in seconds.
+ *
+ * Caller must hold the handle lock.
+ */
+static DISCFERRET_ERROR hstmd_setup(DISCFERRET_DEVICE_HANDLE *dh, const DISCFERRET_HSECTOR_CONFIG *config, double *rev)
+{
+	unsigned long thr_us, thr;
+	int r;
+
+	if ((config->sectors < 2) || (config->rpm == 0)) return DISCFERRET_E_BAD_PARAMETER;
+	if (discferret_acq_clock_hz(config->clksel) == 0) return DISCFERRET_E_BAD_PARAMETER;
+
+	*rev = 60.0 / config->rpm;
+
+	// The gaps either side of the track mark are half a sector; split the
+	// difference between that and a whole sector
+	thr_us = config->threshold_us;
+	if (thr_us == 0) thr_us = (unsigned long)((*rev * 1e6 * 0.75) / config->sectors);
+	thr = (thr_us + (DISCFERRET_HSTMD_UNIT_US / 2)) / DISCFERRET_HSTMD_UNIT_US;
+	if ((thr < 1) || (thr > 255)) return DISCFERRET_E_BAD_PARAMETER;
+
+	if (((r = discferret_reg_poke(dh, DISCFERRET_R_ACQ_HSTMD_THR_START, thr)) != DISCFERRET_E_OK) ||
+			((r = discferret_reg_poke(dh, DISCFERRET_R_ACQ_HSTMD_THR_STOP, thr)) != DISCFERRET_E_OK))
+		return r;
+	return DISCFERRET_E_OK;
+}
+
+/**
+ * @brief	Run a hard-sector acquisition and read it back
+ * @param	expect	Shortest time the capture can take, in seconds.
+ */
+static DISCFERRET_ERROR hsector_run(DISCFERRET_DEVICE_HANDLE *dh, const DISCFERRET_HSECTOR_CONFIG *config,
+		const unsigned int start_num, const unsigned int stop_evt, const unsigned int stop_num, const double expect, DISCFERRET_FLUX *flux)
+{
+	double rev, start;
+	int r;
+
+	// Keep the thresholds and the acquisition registers together
+	discferret_lock(dh);
+	if (((r = hstmd_setup(dh, config, &rev)) != DISCFERRET_E_OK) ||
+			((r = discferret_acq_start(dh, config->clksel, DISCFERRET_ACQ_EVENT_INDEX | DISCFERRET_ACQ_EVENT_WAIT_HSTMD, start_num,
+					stop_evt, stop_num, &start)) != DISCFERRET_E_OK)) {
+		discferret_unlock(dh);
+		return r;
+	}
+	discferret_unlock(dh);
+
+	// Where the disc was when we started is anyone's guess, so sleep for the
+	// shortest possible capture and poll from there
+	if ((r = discferret_acq_wait(dh, start + (expect * rev),
+			start + ((config->timeout > 0.0) ? config->timeout : (1.0 + (2.0 * rev))), NULL, NULL)) != DISCFERRET_E_OK)
+		return r;
+	return discferret_acq_readback(dh, config->clksel, flux, NULL);
+}
+
+DISCFERRET_ERROR discferret_hsector_capture(DISCFERRET_DEVICE_HANDLE *dh, const DISCFERRET_HSECTOR_CONFIG *config,
+		const unsigned int first, const unsigned int count, DISCFERRET_FLUX *flux)
+{
+	unsigned int holes;
+
+	if ((dh == NULL) || (config == NULL) || (flux == NULL)) return DISCFERRET_E_BAD_PARAMETER;
+	if ((first >= config->sectors) || (count < 1) || (count > config->sectors)) return DISCFERRET_E_BAD_PARAMETER;
+
+	// Holes to pass before stopping; the track mark is one more if the last sector is included
+	holes = count;
+	if (first + count > config->sectors - 1) holes++;
+	if (holes > 256) return DISCFERRET_E_BAD_PARAMETER;
+
+	return hsector_run(dh, config, first, DISCFERRET_ACQ_EVENT_INDEX, holes - 1,
+			(double)(first + count) / config->sectors, flux);
+}
+
+DISCFERRET_ERROR discferret_hsector_capture_track(DISCFERRET_DEVICE_HANDLE *dh, const DISCFERRET_HSECTOR_CONFIG *config, DISCFERRET_FLUX *flux)
+{
+	if ((dh == NULL) || (config == NULL) || (flux == NULL)) return DISCFERRET_E_BAD_PARAMETER;
+
+	// Start at the first hole after a track mark, stop at the first hole after the next one
+	return hsector_run(dh, config, 0, DISCFERRET_ACQ_EVENT_INDEX | DISCFERRET_ACQ_EVENT_WAIT_HSTMD, 0, 1.0, flux);
+}
+
+int discferret_hsector_slices(const DISCFERRET_FLUX *flux, const unsigned int sectors, const unsigned int first,
+		DISCFERRET_FLUX *slices, unsigned int *numbers, const size_t max)
+{
+	size_t pos = 0, hole = 0, n = 0;
+	unsigned int s = first;
+
+	if ((flux == NULL) || (slices == NULL) || (sectors < 2) || (first >= sectors)) return DISCFERRET_E_BAD_PARAMETER;
+	if ((flux->intervals == NULL) && (flux->count > 0)) return DISCFERRET_E_BAD_PARAMETER;
+
+	while ((pos < flux->count) && (n < max)) {
+		size_t end = flux->count;
+		unsigned int skip = (s == sectors - 1) ? 1 : 0;
+
+		// Next hole after this one (the one the capture started on shows up at interval 0)
+		while ((hole < flux->index_count) && (flux->index[hole] <= pos)) hole++;
+		// ...and the one after the track mark, for the last sector
+		while ((hole < flux->index_count) && (end == flux->count)) {
+			if (skip == 0) {
+				end = flux->index[hole];
+			} else {
+				skip--;
+			}
+			hole++;
+		}
+
+		memset(&slices[n], 0, sizeof(DISCFERRET_FLUX));
+		slices[n].intervals = flux->intervals + pos;
+		slices[n].count = end - pos;
+		slices[n].clock_hz = flux->clock_hz;
+		if (numbers != NULL) numbers[n] = s;
+		n++;
+
+		pos = end;
+		s = (s + 1) % sectors;
+	}
+
+	return (int)n;
+}
+
+// vim: ts=4 noet sw=4
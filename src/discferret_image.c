@@ -0,0 +1,573 @@
+/****************************************************************************
+ *
+ *                - DiscFerret Interface Library for C / C++ -
+ *
+ * Copyright (C) 2010 - 2011 P. A. Pemberton t/a. Red Fox Engineering.
+ * All Rights Reserved.
+ *
+ * Copyright 2010-2011 Philip Pemberton
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ ****************************************************************************/
+
+
+
+/**
+ * @file	discferret_image.c
+ * @brief	Streaming writer for flux image files (SuperCard Pro .scp, HxC .hfe).
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <string.h>
+#include <stdlib.h>
+#include "discferret.h"
+#include "discferret_flux.h"
+#include "discferret_image.h"
+
+#ifndef _WIN32
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+/// Output files are grown in steps of at least this many bytes
+#define IMAGE_GROW_STEP			(1024*1024)
+
+/// SCP: number of entries in the track offset table
+#define SCP_MAX_TRACKS			168
+/// SCP: size of the file header (up to the start of the track offset table)
+#define SCP_HEADER_LEN			0x10
+/// SCP: offset of the first track
+#define SCP_DATA_START			(SCP_HEADER_LEN + (SCP_MAX_TRACKS * 4))
+/// SCP: base sample period is 25ns, i.e. a 40MHz clock
+#define SCP_BASE_HZ				40000000ULL
+/// SCP: format version written to the header (2.2)
+#define SCP_VERSION				0x22
+/// SCP: flag bit, tracks start at the index pulse
+#define SCP_FLAG_INDEX			0x01
+/// SCP: most revolutions per track
+#define SCP_MAX_REVS			5
+
+/// HFE: block size; offsets in the file are in blocks
+#define HFE_BLOCK				512
+/// HFE: each block holds this many bytes of each side
+#define HFE_SIDE_CHUNK			256
+/// HFE: filler for padding tracks (alternating cells, valid MFM and FM)
+#define HFE_FILLER				0xAA
+
+struct discferret_image {
+	DISCFERRET_IMAGE_CONFIG	cfg;			///< Settings
+	int						fd;				///< Output file
+	unsigned char			*map;			///< Mapping of the output file
+	size_t					mapsize;		///< Size of the mapping (and of the file, until close)
+	size_t					pos;			///< Bytes written so far
+	DISCFERRET_FLUX			flux;			///< Scratch flux buffer for discferret_image_add_samples()
+
+	// SCP
+	uint32_t				scp_offsets[SCP_MAX_TRACKS];	///< Track offset table
+	uint32_t				scp_checksum;	///< Running sum of every byte after the header
+	int						scp_first;		///< First track written, or -1
+	int						scp_last;		///< Last track written
+
+	// HFE
+	int						hfe_cyl;		///< Cylinder being collected, or -1
+	unsigned int			hfe_next;		///< Next cylinder to be written to the file
+	unsigned char			*side[2];		///< Bitcell buffers for the two sides of the current cylinder
+	size_t					side_len[2];	///< Bytes in each side buffer
+	size_t					side_cap[2];	///< Allocated size of each side buffer
+	uint16_t				*hfe_offset;	///< Track list: first block of each cylinder
+	uint16_t				*hfe_len;		///< Track list: bytes of track data for each cylinder
+	size_t					hfe_data_start;	///< Offset of the first track
+};
+
+static void put_le16(unsigned char *p, const uint16_t v)
+{
+	p[0] = v & 0xff;
+	p[1] = v >> 8;
+}
+
+static void put_le32(unsigned char *p, const uint32_t v)
+{
+	p[0] = v & 0xff;
+	p[1] = (v >> 8) & 0xff;
+	p[2] = (v >> 16) & 0xff;
+	p[3] = v >> 24;
+}
+
+static uint64_t gcd(uint64_t a, uint64_t b)
+{
+	while (b != 0) {
+		uint64_t t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+/**
+ * @brief	Make sure there are at least <i>n</i> bytes of mapped space after the write position
+ *
+ * The file is grown with posix_fallocate(), so a full disc is reported here
+ * rather than as a SIGBUS when the mapping is written to.
+ */
+static DISCFERRET_ERROR reserve(DISCFERRET_IMAGE *img, const size_t n)
+{
+	size_t newsize;
+	void *p;
+
+	if (img->pos + n <= img->mapsize) return DISCFERRET_E_OK;
+
+	newsize = img->mapsize * 2;
+	if (newsize < img->pos + n) newsize = img->pos + n;
+	newsize = (newsize + IMAGE_GROW_STEP - 1) / IMAGE_GROW_STEP * IMAGE_GROW_STEP;
+
+	if (posix_fallocate(img->fd, 0, (off_t)newsize) != 0) return DISCFERRET_E_FILE_ERROR;
+	p = mmap(NULL, newsize, PROT_READ | PROT_WRITE, MAP_SHARED, img->fd, 0);
+	if (p == MAP_FAILED) return DISCFERRET_E_FILE_ERROR;
+	if (img->map != NULL) munmap(img->map, img->mapsize);
+	img->map = p;
+	img->mapsize = newsize;
+	return DISCFERRET_E_OK;
+}
+
+/**
+ * @brief	Get the range of intervals to store: the first <i>revs</i> whole
+ * 			revolutions, or the whole capture if <i>revs</i> is 0
+ */
+static bool rev_range(const DISCFERRET_FLUX *flux, const unsigned int revs, size_t *start, size_t *end)
+{
+	if (revs == 0) {
+		*start = 0;
+		*end = flux->count;
+		return true;
+	}
+	if (flux->index_count < revs + 1) return false;
+	*start = flux->index[0];
+	*end = flux->index[revs];
+	return (*end <= flux->count);
+}
+
+/****************************************************************************
+ * SuperCard Pro
+ ****************************************************************************/
+
+static DISCFERRET_ERROR scp_add_track(DISCFERRET_IMAGE *img, const unsigned int track, const DISCFERRET_FLUX *flux)
+{
+	const unsigned int revs = img->cfg.revolutions;
+	uint64_t num, den, g, cum, total;
+	size_t start, end, words, trk;
+	unsigned char *p, *q;
+	DISCFERRET_ERROR e;
+	uint32_t sum = 0;
+
+	if (!rev_range(flux, revs, &start, &end)) return DISCFERRET_E_BAD_PARAMETER;
+
+	// Resampling ratio: SCP ticks per acquisition tick, as a reduced fraction
+	num = SCP_BASE_HZ;
+	den = (uint64_t)(img->cfg.resolution + 1) * flux->clock_hz;
+	g = gcd(num, den);
+	num /= g;
+	den /= g;
+
+	// Bound the output size: one overflow word per 65536 ticks, and up to two
+	// words per interval (its own, plus one from rounding short intervals up)
+	cum = 0;
+	for (size_t i = start; i < end; i++) cum += flux->intervals[i];
+	total = cum * num / den;
+	words = (2 * (end - start)) + (size_t)(total / 65536) + 1;
+	if ((e = reserve(img, 4 + (revs * 12) + (words * 2))) != DISCFERRET_E_OK) return e;
+
+	// Track header: "TRK", track number, then one entry per revolution
+	trk = img->pos;
+	p = img->map + trk;
+	p[0] = 'T'; p[1] = 'R'; p[2] = 'K'; p[3] = track;
+	q = p + 4 + (revs * 12);
+
+	// Convert each revolution, resampling the cumulative time so rounding
+	// errors don't build up over the track
+	cum = 0;
+	total = 0;
+	for (unsigned int r = 0; r < revs; r++) {
+		const size_t rs = flux->index[r], re = flux->index[r + 1];
+		const uint64_t rev_start = total;
+		unsigned char *revdata = q;
+
+		for (size_t i = rs; i < re; i++) {
+			uint64_t t, v;
+			cum += flux->intervals[i];
+			t = cum * num / den;
+			// Zero would read back as an overflow marker, so every interval is at least one tick
+			v = (t > total) ? (t - total) : 1;
+			total += v;
+			while (v > 0xFFFF) {
+				*q++ = 0;
+				*q++ = 0;
+				v -= 0x10000;
+			}
+			if (v == 0) {
+				// Exact multiple of 65536: can't be stored, round up by one tick
+				v = 1;
+				total++;
+			}
+			*q++ = v >> 8;
+			*q++ = v & 0xff;
+		}
+
+		put_le32(p + 4 + (r * 12), (uint32_t)(total - rev_start));
+		put_le32(p + 4 + (r * 12) + 4, (uint32_t)((q - revdata) / 2));
+		put_le32(p + 4 + (r * 12) + 8, (uint32_t)(revdata - p));
+	}
+
+	for (unsigned char *b = p; b < q; b++) sum += *b;
+	img->scp_checksum += sum;
+	img->scp_offsets[track] = (uint32_t)trk;
+	img->pos += q - p;
+
+	if ((img->scp_first < 0) || ((int)track < img->scp_first)) img->scp_first = track;
+	if ((int)track > img->scp_last) img->scp_last = track;
+
+	return DISCFERRET_E_OK;
+}
+
+static void scp_finish(DISCFERRET_IMAGE *img)
+{
+	unsigned char *h = img->map;
+	uint32_t sum = img->scp_checksum;
+
+	// Track offset table
+	for (unsigned int i = 0; i < SCP_MAX_TRACKS; i++) {
+		put_le32(h + SCP_HEADER_LEN + (i * 4), img->scp_offsets[i]);
+		for (unsigned int b = 0; b < 4; b++) sum += h[SCP_HEADER_LEN + (i * 4) + b];
+	}
+
+	h[0] = 'S'; h[1] = 'C'; h[2] = 'P';
+	h[3] = SCP_VERSION;
+	h[4] = img->cfg.disk_type;
+	h[5] = img->cfg.revolutions;
+	h[6] = (img->scp_first < 0) ? 0 : img->scp_first;
+	h[7] = (img->scp_first < 0) ? 0 : img->scp_last;
+	h[8] = SCP_FLAG_INDEX;
+	h[9] = 0;										// 16-bit cells
+	h[10] = (img->cfg.heads == 1) ? 1 : 0;			// 0 = both heads, 1 = head 0 only
+	h[11] = img->cfg.resolution;
+	put_le32(h + 12, sum);
+}
+
+/****************************************************************************
+ * HxC HFE
+ ****************************************************************************/
+
+/// Bytes of bitcells in one revolution, for blank tracks
+static size_t hfe_blank_bytes(const DISCFERRET_IMAGE_CONFIG *cfg)
+{
+	unsigned int rpm = (cfg->rpm > 0) ? cfg->rpm : 300;
+	return ((size_t)cfg->bitrate_kbps * 2000 * 60 / rpm + 7) / 8;
+}
+
+/**
+ * @brief	Write the current cylinder's sides to the file, interleaved in 256-byte chunks
+ */
+static DISCFERRET_ERROR hfe_write_cylinder(DISCFERRET_IMAGE *img, const unsigned int cyl)
+{
+	size_t len = (img->side_len[0] > img->side_len[1]) ? img->side_len[0] : img->side_len[1];
+	size_t blocks, pos;
+	DISCFERRET_ERROR e;
+	unsigned char *p;
+
+	// Blank cylinder (not captured): one revolution of filler
+	if (len == 0) len = hfe_blank_bytes(&img->cfg);
+	if (len * 2 > 0xFFFF) return DISCFERRET_E_BAD_PARAMETER;
+
+	blocks = (len + HFE_SIDE_CHUNK - 1) / HFE_SIDE_CHUNK;
+	if ((e = reserve(img, blocks * HFE_BLOCK)) != DISCFERRET_E_OK) return e;
+	if ((img->pos / HFE_BLOCK) > 0xFFFF) return DISCFERRET_E_BAD_PARAMETER;
+
+	p = img->map + img->pos;
+	for (size_t b = 0; b < blocks; b++) {
+		for (unsigned int s = 0; s < 2; s++) {
+			unsigned char *dst = p + (b * HFE_BLOCK) + (s * HFE_SIDE_CHUNK);
+			size_t from = b * HFE_SIDE_CHUNK, n = 0;
+			if (from < img->side_len[s]) {
+				n = img->side_len[s] - from;
+				if (n > HFE_SIDE_CHUNK) n = HFE_SIDE_CHUNK;
+				memcpy(dst, img->side[s] + from, n);
+			}
+			memset(dst + n, HFE_FILLER, HFE_SIDE_CHUNK - n);
+		}
+	}
+
+	img->hfe_offset[cyl] = img->pos / HFE_BLOCK;
+	img->hfe_len[cyl] = len * 2;
+	pos = img->pos + blocks * HFE_BLOCK;
+	img->pos = pos;
+	img->side_len[0] = img->side_len[1] = 0;
+	return DISCFERRET_E_OK;
+}
+
+/**
+ * @brief	Write out the cylinder being collected, and blanks for any skipped before <i>upto</i>
+ */
+static DISCFERRET_ERROR hfe_flush(DISCFERRET_IMAGE *img, const unsigned int upto)
+{
+	DISCFERRET_ERROR e;
+
+	if (img->hfe_cyl >= 0) {
+		if ((e = hfe_write_cylinder(img, img->hfe_cyl)) != DISCFERRET_E_OK) return e;
+		img->hfe_next = img->hfe_cyl + 1;
+		img->hfe_cyl = -1;
+	}
+	while (img->hfe_next < upto) {
+		if ((e = hfe_write_cylinder(img, img->hfe_next)) != DISCFERRET_E_OK) return e;
+		img->hfe_next++;
+	}
+	return DISCFERRET_E_OK;
+}
+
+static DISCFERRET_ERROR hfe_add_track(DISCFERRET_IMAGE *img, const unsigned int cyl, const unsigned int head, const DISCFERRET_FLUX *flux)
+{
+	const uint64_t cellrate = (uint64_t)img->cfg.bitrate_kbps * 2000;
+	uint64_t cum = 0, cells = 0, totalcells;
+	size_t start, end, bytes;
+	DISCFERRET_ERROR e;
+	unsigned char *buf;
+
+	// Tracks have to come in cylinder order, since cylinders are written out as they complete
+	if (((img->hfe_cyl >= 0) && ((int)cyl < img->hfe_cyl)) || (cyl < img->hfe_next)) return DISCFERRET_E_BAD_PARAMETER;
+	if ((int)cyl != img->hfe_cyl) {
+		if ((e = hfe_flush(img, cyl)) != DISCFERRET_E_OK) return e;
+		img->hfe_cyl = cyl;
+	}
+
+	// One revolution if there are index pulses either side of it, otherwise everything
+	if (!rev_range(flux, 1, &start, &end) && !rev_range(flux, 0, &start, &end)) return DISCFERRET_E_BAD_PARAMETER;
+
+	for (size_t i = start; i < end; i++) cum += flux->intervals[i];
+	totalcells = (cum * cellrate + flux->clock_hz / 2) / flux->clock_hz;
+	bytes = (size_t)(totalcells + 7) / 8;
+	if (bytes > img->side_cap[head]) {
+		buf = realloc(img->side[head], bytes);
+		if (buf == NULL) return DISCFERRET_E_OUT_OF_MEMORY;
+		img->side[head] = buf;
+		img->side_cap[head] = bytes;
+	}
+	buf = img->side[head];
+	memset(buf, 0, bytes);
+
+	// Quantise each transition to the nearest cell, working from the
+	// cumulative time so rounding errors don't build up; bits are stored
+	// LSB first
+	cum = 0;
+	for (size_t i = start; i < end; i++) {
+		uint64_t c;
+		cum += flux->intervals[i];
+		c = (cum * cellrate + flux->clock_hz / 2) / flux->clock_hz;
+		if (c <= cells) c = cells + 1;		// transitions can't share a cell
+		if (c > totalcells) break;
+		cells = c;
+		buf[(cells - 1) / 8] |= 1 << ((cells - 1) % 8);
+	}
+	img->side_len[head] = bytes;
+
+	return DISCFERRET_E_OK;
+}
+
+static DISCFERRET_ERROR hfe_finish(DISCFERRET_IMAGE *img)
+{
+	unsigned char *h;
+	DISCFERRET_ERROR e;
+
+	// Write out the last cylinder, and blanks for any never captured
+	if ((e = hfe_flush(img, img->cfg.cylinders)) != DISCFERRET_E_OK) return e;
+
+	h = img->map;
+	memset(h, 0xFF, HFE_BLOCK);
+	memcpy(h, "HXCPICFE", 8);
+	h[8] = 0;								// format revision
+	h[9] = img->cfg.cylinders;
+	h[10] = img->cfg.heads;
+	h[11] = img->cfg.encoding;
+	put_le16(h + 12, img->cfg.bitrate_kbps);
+	put_le16(h + 14, img->cfg.rpm);
+	h[16] = img->cfg.interface_mode;
+	h[17] = 1;								// "do not use"
+	put_le16(h + 18, 1);					// track list is in block 1
+	h[20] = 0xFF;							// write allowed
+	h[21] = 0xFF;							// single step
+	h[22] = 0xFF;							// no alternate encoding for track 0
+	h[23] = img->cfg.encoding;
+	h[24] = 0xFF;
+	h[25] = img->cfg.encoding;
+
+	// Track list
+	memset(h + HFE_BLOCK, 0xFF, img->hfe_data_start - HFE_BLOCK);
+	for (unsigned int c = 0; c < img->cfg.cylinders; c++) {
+		put_le16(h + HFE_BLOCK + (c * 4), img->hfe_offset[c]);
+		put_le16(h + HFE_BLOCK + (c * 4) + 2, img->hfe_len[c]);
+	}
+
+	return DISCFERRET_E_OK;
+}
+
+/****************************************************************************
+ * Public API
+ ****************************************************************************/
+
+static void image_free(DISCFERRET_IMAGE *img)
+{
+	if (img->map != NULL) munmap(img->map, img->mapsize);
+	if (img->fd >= 0) close(img->fd);
+	discferret_flux_free(&img->flux);
+	free(img->side[0]);
+	free(img->side[1]);
+	free(img->hfe_offset);
+	free(img->hfe_len);
+	free(img);
+}
+
+DISCFERRET_ERROR discferret_image_create(const char *path, const DISCFERRET_IMAGE_CONFIG *config, DISCFERRET_IMAGE **image)
+{
+	DISCFERRET_IMAGE *img;
+	DISCFERRET_ERROR e;
+	size_t prealloc;
+
+	if ((path == NULL) || (config == NULL) || (image == NULL)) return DISCFERRET_E_BAD_PARAMETER;
+	if ((config->cylinders == 0) || (config->heads < 1) || (config->heads > 2)) return DISCFERRET_E_BAD_PARAMETER;
+
+	switch (config->format) {
+		case DISCFERRET_IMAGE_SCP:
+			if ((config->cylinders * 2 > SCP_MAX_TRACKS) || (config->revolutions < 1) || (config->revolutions > SCP_MAX_REVS))
+				return DISCFERRET_E_BAD_PARAMETER;
+			if ((config->resolution > 255) || (config->disk_type > 255)) return DISCFERRET_E_BAD_PARAMETER;
+			// Roughly 128KiB per revolution covers HD media at 300rpm
+			prealloc = SCP_DATA_START + ((size_t)config->cylinders * config->heads * config->revolutions * 128 * 1024);
+			break;
+		case DISCFERRET_IMAGE_HFE:
+			if ((config->cylinders > 255) || (config->bitrate_kbps == 0) || (config->encoding > 255)) return DISCFERRET_E_BAD_PARAMETER;
+			prealloc = HFE_BLOCK * 2 + (size_t)config->cylinders * 2 * (hfe_blank_bytes(config) + HFE_BLOCK);
+			break;
+		default:
+			return DISCFERRET_E_BAD_PARAMETER;
+	}
+	if (config->preallocate > 0) prealloc = config->preallocate;
+
+	img = calloc(1, sizeof(DISCFERRET_IMAGE));
+	if (img == NULL) return DISCFERRET_E_OUT_OF_MEMORY;
+	img->cfg = *config;
+	img->scp_first = -1;
+	img->hfe_cyl = -1;
+
+	img->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+	if (img->fd < 0) {
+		free(img);
+		return DISCFERRET_E_FILE_ERROR;
+	}
+
+	if (config->format == DISCFERRET_IMAGE_SCP) {
+		img->pos = SCP_DATA_START;
+	} else {
+		img->hfe_offset = calloc(config->cylinders, sizeof(uint16_t));
+		img->hfe_len = calloc(config->cylinders, sizeof(uint16_t));
+		if ((img->hfe_offset == NULL) || (img->hfe_len == NULL)) {
+			image_free(img);
+			return DISCFERRET_E_OUT_OF_MEMORY;
+		}
+		// Header block, then the track list, then the tracks
+		img->hfe_data_start = HFE_BLOCK + (((config->cylinders * 4) + HFE_BLOCK - 1) / HFE_BLOCK) * HFE_BLOCK;
+		img->pos = img->hfe_data_start;
+	}
+
+	// Preallocate and map the file; the header space is filled in at close
+	if ((e = reserve(img, (prealloc > img->pos) ? prealloc - img->pos : 0)) != DISCFERRET_E_OK) {
+		image_free(img);
+		unlink(path);
+		return e;
+	}
+
+	*image = img;
+	return DISCFERRET_E_OK;
+}
+
+DISCFERRET_ERROR discferret_image_add_track(DISCFERRET_IMAGE *image, const unsigned int cyl, const unsigned int head, const DISCFERRET_FLUX *flux)
+{
+	if ((image == NULL) || (flux == NULL) || (flux->clock_hz == 0)) return DISCFERRET_E_BAD_PARAMETER;
+	if ((cyl >= image->cfg.cylinders) || (head >= image->cfg.heads)) return DISCFERRET_E_BAD_PARAMETER;
+
+	if (image->cfg.format == DISCFERRET_IMAGE_SCP)
+		return scp_add_track(image, (cyl * 2) + head, flux);
+	else
+		return hfe_add_track(image, cyl, head, flux);
+}
+
+DISCFERRET_ERROR discferret_image_add_samples(DISCFERRET_IMAGE *image, const unsigned int cyl, const unsigned int head,
+		const unsigned char *samples, const size_t len, const unsigned int clksel)
+{
+	DISCFERRET_ERROR e;
+
+	if (image == NULL) return DISCFERRET_E_BAD_PARAMETER;
+	if ((e = discferret_flux_from_samples(samples, len, clksel, &image->flux)) != DISCFERRET_E_OK) return e;
+	return discferret_image_add_track(image, cyl, head, &image->flux);
+}
+
+DISCFERRET_ERROR discferret_image_close(DISCFERRET_IMAGE *image)
+{
+	DISCFERRET_ERROR e;
+	size_t len;
+
+	if (image == NULL) return DISCFERRET_E_BAD_PARAMETER;
+
+	if (image->cfg.format == DISCFERRET_IMAGE_SCP) {
+		scp_finish(image);
+		e = DISCFERRET_E_OK;
+	} else {
+		e = hfe_finish(image);
+	}
+
+	// Unmap, then cut the file down to what was actually written
+	len = image->pos;
+	munmap(image->map, image->mapsize);
+	image->map = NULL;
+	if ((e == DISCFERRET_E_OK) && (ftruncate(image->fd, (off_t)len) != 0)) e = DISCFERRET_E_FILE_ERROR;
+	if ((close(image->fd) != 0) && (e == DISCFERRET_E_OK)) e = DISCFERRET_E_FILE_ERROR;
+	image->fd = -1;
+
+	image_free(image);
+	return e;
+}
+
+#else // _WIN32
+
+DISCFERRET_ERROR discferret_image_create(const char *path, const DISCFERRET_IMAGE_CONFIG *config, DISCFERRET_IMAGE **image)
+{
+	return DISCFERRET_E_NOT_SUPPORTED;
+}
+
+DISCFERRET_ERROR discferret_image_add_track(DISCFERRET_IMAGE *image, const unsigned int cyl, const unsigned int head, const DISCFERRET_FLUX *flux)
+{
+	return DISCFERRET_E_NOT_SUPPORTED;
+}
+
+DISCFERRET_ERROR discferret_image_add_samples(DISCFERRET_IMAGE *image, const unsigned int cyl, const unsigned int head,
+		const unsigned char *samples, const size_t len, const unsigned int clksel)
+{
+	return DISCFERRET_E_NOT_SUPPORTED;
+}
+
+DISCFERRET_ERROR discferret_image_close(DISCFERRET_IMAGE *image)
+{
+	return DISCFERRET_E_NOT_SUPPORTED;
+}
+
+#endif // _WIN32
+
+// vim: ts=4 noet sw=4
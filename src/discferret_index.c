@@ -0,0 +1,366 @@
+/****************************************************************************
+ *
+ *                - DiscFerret Interface Library for C / C++ -
+ *
+ * Copyright (C) 2010 - 2011 P. A. Pemberton t/a. Red Fox Engineering.
+ * All Rights Reserved.
+ *
+ * Copyright 2010-2011 Philip Pemberton
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ ****************************************************************************/
+
+
+/**
+ * @file	discferret_index.c
+ * @brief	Background index/RPM monitor.
+ *
+ * A background thread polls the DiscFerret's "new index measurement" flag at
+ * a fixed rate, and publishes rolling statistics through a sequence lock.
+ * Readers never block the monitor thread, and never touch the USB bus.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <math.h>
+#include <pthread.h>
+#include "discferret.h"
+#include "discferret_private.h"
+
+/// Default polling interval, in microseconds
+#define INDEX_MONITOR_DEFAULT_INTERVAL	20000
+/// Default statistics window, in index periods
+#define INDEX_MONITOR_DEFAULT_WINDOW	32
+/// Largest statistics window we'll allow
+#define INDEX_MONITOR_MAX_WINDOW		65536
+
+/**
+ * @brief	Index monitor state
+ */
+struct discferret_index_monitor {
+	DISCFERRET_DEVICE_HANDLE	*dh;		///< Device handle being monitored
+	pthread_t		thread;					///< Monitor thread
+	int				stop;					///< Nonzero to ask the monitor thread to exit (atomic)
+	unsigned long	interval_us;			///< Polling interval, in microseconds
+
+	// Owned by the monitor thread
+	double			*periods;				///< Ring buffer of the most recent index periods
+	unsigned int	window;					///< Size of the ring buffer
+	unsigned int	head;					///< Next ring buffer slot to write
+	unsigned long	count;					///< Total number of periods measured
+
+	// Published to readers through the sequence lock
+	unsigned long	seq;					///< Sequence counter; odd while the writer is updating stats
+	DISCFERRET_INDEX_STATS	stats;			///< Published statistics
+	struct discferret_clockfit	fit;		///< Published host/device clock fit
+};
+
+/**
+ * @brief	Publish a new set of statistics
+ */
+static void stats_publish(struct discferret_index_monitor *m, const DISCFERRET_INDEX_STATS *stats,
+		const struct discferret_clockfit *fit)
+{
+	unsigned long seq = __atomic_load_n(&m->seq, __ATOMIC_RELAXED);
+
+	__atomic_store_n(&m->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	m->stats = *stats;
+	m->fit = *fit;
+	__atomic_store_n(&m->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief	Take a consistent snapshot of the published statistics
+ */
+static void stats_read(struct discferret_index_monitor *m, DISCFERRET_INDEX_STATS *stats,
+		struct discferret_clockfit *fit)
+{
+	struct discferret_clockfit dummy;
+	unsigned long s1, s2;
+
+	if (fit == NULL) fit = &dummy;
+
+	do {
+		s1 = __atomic_load_n(&m->seq, __ATOMIC_ACQUIRE);
+		*stats = m->stats;
+		*fit = m->fit;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		s2 = __atomic_load_n(&m->seq, __ATOMIC_RELAXED);
+	} while ((s1 != s2) || ((s1 & 1) != 0));
+}
+
+/**
+ * @brief	Read the index period register pair
+ */
+static DISCFERRET_ERROR read_index_period(DISCFERRET_DEVICE_HANDLE *dh, double *period)
+{
+	int hi, lo;
+
+	// Reading the high byte latches the low byte, so hold the lock across both reads
+	discferret_lock(dh);
+	hi = discferret_reg_peek(dh, DISCFERRET_R_INDEX_FREQ_HIGH);
+	lo = (hi < 0) ? hi : discferret_reg_peek(dh, DISCFERRET_R_INDEX_FREQ_LOW);
+	discferret_unlock(dh);
+	if (hi < 0) return hi;
+	if (lo < 0) return lo;
+
+	*period = ((double)((hi << 8) | lo)) * dh->index_freq_multiplier;
+	return DISCFERRET_E_OK;
+}
+
+/**
+ * @brief	Add an index pulse to the host/device clock fit
+ * @param	fit		Clock fit state.
+ * @param	host	Estimated host time of the index pulse.
+ * @param	period	Index period ending at this pulse, as measured by the device.
+ *
+ * The device's index period measurements give the time between index pulses
+ * on the device clock; summing them gives a device-side timeline. Fitting the
+ * host's (noisy, polled) index timestamps against that timeline gives the
+ * offset and relative rate of the two clocks, and averages out most of the
+ * polling jitter.
+ */
+static void clockfit_update(struct discferret_clockfit *fit, double host, double period)
+{
+	double x, y, dx, dy;
+
+	if (fit->n == 0) {
+		// First pulse: this is where both timelines start
+		fit->host0 = host;
+		fit->index = 0;
+		fit->device_time = 0.0;
+	} else {
+		// If the host saw a gap of more than one revolution, we missed some pulses
+		double gap = host - fit->last_host;
+		long missed = lround(gap / period) - 1;
+		if (missed < 0) missed = 0;
+
+		fit->index += 1 + missed;
+		fit->device_time += period * (1 + missed);
+	}
+	fit->last_host = host;
+	fit->period = period;
+
+	// Online least-squares update (Welford's method)
+	x = fit->device_time;
+	y = host - fit->host0;
+	fit->n++;
+	dx = x - fit->mean_x;
+	fit->mean_x += dx / fit->n;
+	dy = y - fit->mean_y;
+	fit->mean_y += dy / fit->n;
+	fit->m2x += dx * (x - fit->mean_x);
+	fit->m2y += dy * (y - fit->mean_y);
+	fit->cxy += dx * (y - fit->mean_y);
+}
+
+/**
+ * @brief	Index monitor thread
+ */
+static void *monitor_thread(void *arg)
+{
+	struct discferret_index_monitor *m = arg;
+	DISCFERRET_INDEX_STATS stats = { 0 };
+	struct discferret_clockfit fit = { 0 };
+	double last_poll = discferret_host_time();
+
+	stats.window = m->window;
+
+	while (!__atomic_load_n(&m->stop, __ATOMIC_ACQUIRE)) {
+		long status = discferret_get_status(m->dh);
+		double now = discferret_host_time();
+		double period;
+
+		if (status < 0) {
+			// Device error -- report it, and keep trying
+			if (stats.error != status) {
+				stats.error = status;
+				stats_publish(m, &stats, &fit);
+			}
+		} else if ((status & DISCFERRET_STATUS_NEW_INDEX_MEAS) != 0) {
+			DISCFERRET_ERROR err = read_index_period(m->dh, &period);
+
+			if (err != DISCFERRET_E_OK) {
+				stats.error = err;
+			} else {
+				unsigned int n;
+				double sum = 0.0, sumsq = 0.0;
+
+				// Add the new period to the ring buffer
+				m->periods[m->head] = period;
+				m->head = (m->head + 1) % m->window;
+				m->count++;
+
+				// Recalculate the statistics over the window
+				n = (m->count < m->window) ? m->count : m->window;
+				stats.min = stats.max = m->periods[0];
+				for (unsigned int i = 0; i < n; i++) {
+					double p = m->periods[i];
+					sum += p;
+					sumsq += p * p;
+					if (p < stats.min) stats.min = p;
+					if (p > stats.max) stats.max = p;
+				}
+				stats.mean = sum / n;
+				stats.jitter = sqrt(fmax(0.0, (sumsq / n) - (stats.mean * stats.mean)));
+				stats.last = period;
+				stats.count = m->count;
+				stats.window = n;
+
+				// The index pulse arrived at some point since the previous poll
+				stats.last_index = (last_poll + now) / 2.0;
+				stats.error = DISCFERRET_E_OK;
+
+				// Feed the pulse into the host/device clock fit
+				clockfit_update(&fit, stats.last_index, period);
+				stats.index = fit.index;
+			}
+			stats_publish(m, &stats, &fit);
+		} else if (stats.error != DISCFERRET_E_OK) {
+			// Device is talking to us again
+			stats.error = DISCFERRET_E_OK;
+			stats_publish(m, &stats, &fit);
+		}
+
+		last_poll = now;
+		discferret_sleep_us(m->interval_us);
+	}
+
+	return NULL;
+}
+
+DISCFERRET_ERROR discferret_index_monitor_start(DISCFERRET_DEVICE_HANDLE *dh, const unsigned long interval_us, const unsigned int window)
+{
+	struct discferret_index_monitor *m;
+
+	// Check that the library has been initialised
+	if (discferret_usb_context() == NULL) return DISCFERRET_E_NOT_INIT;
+
+	// Make sure device handle is not NULL, and the monitor isn't already running
+	if (dh == NULL) return DISCFERRET_E_BAD_PARAMETER;
+	if (dh->priv->index_monitor != NULL) return DISCFERRET_E_BAD_PARAMETER;
+	if (window > INDEX_MONITOR_MAX_WINDOW) return DISCFERRET_E_BAD_PARAMETER;
+
+	// We need the "new index measurement" flag to know when to read the period
+	if (!dh->has_index_freq_sense || !dh->has_index_freq_avail_flag)
+		return DISCFERRET_E_NOT_SUPPORTED;
+
+	m = calloc(1, sizeof(struct discferret_index_monitor));
+	if (m == NULL) return DISCFERRET_E_OUT_OF_MEMORY;
+
+	m->dh = dh;
+	m->interval_us = (interval_us == 0) ? INDEX_MONITOR_DEFAULT_INTERVAL : interval_us;
+	m->window = (window == 0) ? INDEX_MONITOR_DEFAULT_WINDOW : window;
+	m->periods = calloc(m->window, sizeof(double));
+	if (m->periods == NULL) {
+		free(m);
+		return DISCFERRET_E_OUT_OF_MEMORY;
+	}
+
+	if (pthread_create(&m->thread, NULL, monitor_thread, m) != 0) {
+		free(m->periods);
+		free(m);
+		return DISCFERRET_E_OUT_OF_MEMORY;
+	}
+
+	dh->priv->index_monitor = m;
+	return DISCFERRET_E_OK;
+}
+
+DISCFERRET_ERROR discferret_index_monitor_stop(DISCFERRET_DEVICE_HANDLE *dh)
+{
+	struct discferret_index_monitor *m;
+
+	// Make sure device handle is not NULL, and the monitor is running
+	if (dh == NULL) return DISCFERRET_E_BAD_PARAMETER;
+	if ((m = dh->priv->index_monitor) == NULL) return DISCFERRET_E_BAD_PARAMETER;
+
+	// Ask the thread to stop, and wait for it to do so
+	__atomic_store_n(&m->stop, 1, __ATOMIC_RELEASE);
+	pthread_join(m->thread, NULL);
+
+	dh->priv->index_monitor = NULL;
+	free(m->periods);
+	free(m);
+
+	return DISCFERRET_E_OK;
+}
+
+DISCFERRET_ERROR discferret_index_monitor_get(DISCFERRET_DEVICE_HANDLE *dh, DISCFERRET_INDEX_STATS *stats)
+{
+	// Make sure parameters are not NULL, and the monitor is running
+	if ((dh == NULL) || (stats == NULL)) return DISCFERRET_E_BAD_PARAMETER;
+	if (dh->priv->index_monitor == NULL) return DISCFERRET_E_BAD_PARAMETER;
+
+	stats_read(dh->priv->index_monitor, stats, NULL);
+	return DISCFERRET_E_OK;
+}
+
+DISCFERRET_ERROR discferret_index_monitor_predict(DISCFERRET_DEVICE_HANDLE *dh, double *next)
+{
+	DISCFERRET_INDEX_STATS stats;
+	double now, revs;
+
+	// Make sure parameters are not NULL, and the monitor is running
+	if ((dh == NULL) || (next == NULL)) return DISCFERRET_E_BAD_PARAMETER;
+	if (dh->priv->index_monitor == NULL) return DISCFERRET_E_BAD_PARAMETER;
+
+	stats_read(dh->priv->index_monitor, &stats, NULL);
+	if ((stats.count == 0) || (stats.mean <= 0.0)) return DISCFERRET_E_NO_MATCH;
+
+	// Step forward from the last index pulse in whole revolutions until we pass "now"
+	now = discferret_host_time();
+	revs = floor((now - stats.last_index) / stats.mean) + 1.0;
+	if (revs < 1.0) revs = 1.0;
+	*next = stats.last_index + (revs * stats.mean);
+
+	return DISCFERRET_E_OK;
+}
+
+bool discferret_index_monitor_clockfit(DISCFERRET_DEVICE_HANDLE *dh, struct discferret_clockfit *fit)
+{
+	DISCFERRET_INDEX_STATS stats;
+
+	if (dh->priv->index_monitor == NULL) return false;
+
+	stats_read(dh->priv->index_monitor, &stats, fit);
+	return true;
+}
+
+DISCFERRET_ERROR discferret_index_monitor_sample(DISCFERRET_DEVICE_HANDLE *dh, const bool wait, double *timeval)
+{
+	struct discferret_index_monitor *m = dh->priv->index_monitor;
+	DISCFERRET_INDEX_STATS stats;
+	unsigned long start;
+	double deadline = discferret_host_time() + DISCFERRET_INDEX_TIMEOUT;
+
+	stats_read(m, &stats, NULL);
+	start = stats.count;
+
+	// Wait for a new measurement if asked to, or if there isn't one yet
+	while ((wait && (stats.count == start)) || (stats.count == 0)) {
+		if (stats.error != DISCFERRET_E_OK) return stats.error;
+		if (discferret_host_time() > deadline) return DISCFERRET_E_TIMEOUT;
+		discferret_sleep_us(m->interval_us / 2);
+		stats_read(m, &stats, NULL);
+	}
+
+	*timeval = stats.last;
+	return DISCFERRET_E_OK;
+}
+
+// vim: ts=4 noet sw=4
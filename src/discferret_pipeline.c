@@ -0,0 +1,378 @@
+/****************************************************************************
+ *
+ *                - DiscFerret Interface Library for C / C++ -
+ *
+ * Copyright (C) 2010 - 2011 P. A. Pemberton t/a. Red Fox Engineering.
+ * All Rights Reserved.
+ *
+ * Copyright 2010-2011 Philip Pemberton
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ ****************************************************************************/
+
+
+
+/**
+ * @file	discferret_pipeline.c
+ * @brief	Capture/decode/output pipeline.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <libusb-1.0/libusb.h>
+#include "discferret.h"
+#include "discferret_pipeline.h"
+#include "discferret_pool.h"
+#include "discferret_private.h"
+
+/// Default ring depth per worker
+#define PIPELINE_DEFAULT_DEPTH	2
+/// Number of polls before a waiting stage starts to sleep
+#define PIPELINE_SPIN			64
+/// Longest sleep between polls of a ring, in microseconds
+#define PIPELINE_MAX_SLEEP_US	1000
+/// Size of a cache line, to keep the producer's and consumer's counters apart
+#define CACHE_LINE				64
+
+/**
+ * @brief	Bounded single-producer/single-consumer ring of slot indices
+ *
+ * The producer only writes <i>head</i>, the consumer only writes <i>tail</i>.
+ * Both count up forever; the slot is the count modulo the depth.
+ */
+struct spsc {
+	unsigned long	head;		///< Number of items pushed
+	char			pad1[CACHE_LINE - sizeof(unsigned long)];
+	unsigned long	tail;		///< Number of items popped
+	char			pad2[CACHE_LINE - sizeof(unsigned long)];
+	unsigned int	depth;		///< Number of slots
+};
+
+/// Captured data waiting to be decoded
+struct raw_slot {
+	unsigned int	job;
+	size_t			len;
+};
+
+/// Decoded result waiting to be output
+struct result_slot {
+	unsigned int		job;
+	DISCFERRET_ERROR	status;
+	void				*result;
+	size_t				len;
+};
+
+struct pipeline;
+
+/**
+ * @brief	One decode worker and its two rings
+ */
+struct worker {
+	struct pipeline					*p;
+	unsigned int					index;		///< Worker number
+	struct spsc						in;			///< Capture -> worker
+	struct raw_slot					*raw;		///< Input slot descriptors
+	unsigned char					*bufs;		///< Input slot buffers (depth x buffer_size)
+	struct spsc						out;		///< Worker -> output
+	struct result_slot				*results;	///< Output slots
+	DISCFERRET_PIPELINE_STAGE_STATS	stats;		///< This worker's statistics
+	pthread_t						thread;
+	bool							started;
+};
+
+struct pipeline {
+	const DISCFERRET_PIPELINE_CONFIG	*cfg;
+	unsigned int						nworkers;
+	unsigned int						depth;
+	struct worker						*workers;
+	int									abort;		///< Set to stop every stage
+	DISCFERRET_ERROR					output_err;	///< Error returned by the output callback
+	DISCFERRET_PIPELINE_STAGE_STATS		output;		///< Output stage statistics
+};
+
+/**
+ * @brief	Wait until a ring has space (producer) or an item (consumer)
+ * @param	p		Pipeline.
+ * @param	r		Ring.
+ * @param	produce	True to wait for space, false to wait for an item.
+ * @param	stalled	Accumulates the time spent waiting.
+ * @returns	true if the ring is ready, false if the pipeline was aborted.
+ *
+ * Polls without a lock; spins briefly, then backs off with increasing sleeps
+ * so an idle stage doesn't burn a CPU.
+ */
+static bool ring_wait(struct pipeline *p, struct spsc *r, bool produce, double *stalled)
+{
+	unsigned long spins = 0, sleep_us = 1;
+	double t0 = 0.0;
+
+	for (;;) {
+		unsigned long head, tail;
+
+		if (produce) {
+			head = r->head;
+			tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+			if (head - tail < r->depth) break;
+		} else {
+			head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+			tail = r->tail;
+			if (head != tail) break;
+		}
+
+		if (__atomic_load_n(&p->abort, __ATOMIC_RELAXED)) return false;
+
+		if (spins == 0) t0 = discferret_host_time();
+		if (++spins > PIPELINE_SPIN) {
+			discferret_sleep_us(sleep_us);
+			if (sleep_us < PIPELINE_MAX_SLEEP_US) sleep_us *= 2;
+		}
+	}
+
+	if (spins > 0) *stalled += discferret_host_time() - t0;
+	return true;
+}
+
+/// Publish the slot at the head of a ring
+static void ring_push(struct spsc *r)
+{
+	__atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+}
+
+/// Release the slot at the tail of a ring
+static void ring_pop(struct spsc *r)
+{
+	__atomic_store_n(&r->tail, r->tail + 1, __ATOMIC_RELEASE);
+}
+
+static void pipeline_abort(struct pipeline *p)
+{
+	__atomic_store_n(&p->abort, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief	Decode worker: takes every <i>nworkers</i>'th job
+ */
+static void *worker_thread(void *arg)
+{
+	struct worker *w = arg;
+	struct pipeline *p = w->p;
+	const DISCFERRET_PIPELINE_CONFIG *cfg = p->cfg;
+
+	for (unsigned int job = w->index; job < cfg->jobs; job += p->nworkers) {
+		struct raw_slot *in;
+		struct result_slot *out;
+		double t;
+
+		if (!ring_wait(p, &w->in, false, &w->stats.stalled)) break;
+		if (!ring_wait(p, &w->out, true, &w->stats.stalled)) break;
+
+		in = &w->raw[w->in.tail % p->depth];
+		out = &w->results[w->out.head % p->depth];
+		out->job = in->job;
+		out->result = NULL;
+		out->len = 0;
+
+		t = discferret_host_time();
+		out->status = cfg->decode(cfg->ctx, in->job, w->bufs + (w->in.tail % p->depth) * cfg->buffer_size,
+				in->len, &out->result, &out->len);
+		w->stats.busy += discferret_host_time() - t;
+		w->stats.items++;
+		w->stats.bytes += in->len;
+
+		// The capture buffer can be reused as soon as it has been decoded
+		ring_pop(&w->in);
+		ring_push(&w->out);
+	}
+
+	return NULL;
+}
+
+/**
+ * @brief	Output writer: collects jobs from the workers in order
+ */
+static void *output_thread(void *arg)
+{
+	struct pipeline *p = arg;
+	const DISCFERRET_PIPELINE_CONFIG *cfg = p->cfg;
+
+	for (unsigned int job = 0; job < cfg->jobs; job++) {
+		struct worker *w = &p->workers[job % p->nworkers];
+		struct result_slot *r;
+		DISCFERRET_ERROR e;
+		double t;
+
+		if (!ring_wait(p, &w->out, false, &p->output.stalled)) break;
+		r = &w->results[w->out.tail % p->depth];
+
+		t = discferret_host_time();
+		e = cfg->output(cfg->ctx, r->job, r->status, r->result, r->len);
+		p->output.busy += discferret_host_time() - t;
+		p->output.items++;
+		p->output.bytes += r->len;
+		ring_pop(&w->out);
+
+		if (e != DISCFERRET_E_OK) {
+			p->output_err = e;
+			pipeline_abort(p);
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+static unsigned int default_workers(void)
+{
+#ifdef _SC_NPROCESSORS_ONLN
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n > 1) return (unsigned int)n;
+#endif
+	return 1;
+}
+
+static void stage_rate(DISCFERRET_PIPELINE_STAGE_STATS *s)
+{
+	s->rate = (s->busy > 0.0) ? (s->bytes / s->busy) : 0.0;
+}
+
+DISCFERRET_ERROR discferret_pipeline_run(DISCFERRET_DEVICE_HANDLE *dh, const DISCFERRET_PIPELINE_CONFIG *config, DISCFERRET_PIPELINE_STATS *stats)
+{
+	DISCFERRET_PIPELINE_STAGE_STATS capture;
+	DISCFERRET_ERROR err = DISCFERRET_E_OK;
+	struct pipeline p;
+	pthread_t out_thread;
+	bool out_started = false;
+	double start;
+
+	if ((dh == NULL) || (config == NULL)) return DISCFERRET_E_BAD_PARAMETER;
+	if ((config->capture == NULL) || (config->decode == NULL) || (config->output == NULL)) return DISCFERRET_E_BAD_PARAMETER;
+	if (config->buffer_size == 0) return DISCFERRET_E_BAD_PARAMETER;
+
+	memset(&p, 0, sizeof(p));
+	memset(&capture, 0, sizeof(capture));
+	p.cfg = config;
+	p.nworkers = (config->workers > 0) ? config->workers : default_workers();
+	p.depth = (config->depth > 0) ? config->depth : PIPELINE_DEFAULT_DEPTH;
+	// No point in having more workers than jobs
+	if ((config->jobs > 0) && (p.nworkers > config->jobs)) p.nworkers = config->jobs;
+
+	// Allocate the workers and their rings
+	p.workers = calloc(p.nworkers, sizeof(struct worker));
+	if (p.workers == NULL) return DISCFERRET_E_OUT_OF_MEMORY;
+	for (unsigned int i = 0; i < p.nworkers; i++) {
+		struct worker *w = &p.workers[i];
+		w->p = &p;
+		w->index = i;
+		w->in.depth = w->out.depth = p.depth;
+		w->raw = calloc(p.depth, sizeof(struct raw_slot));
+		w->results = calloc(p.depth, sizeof(struct result_slot));
+		// Capture buffers come from the handle's pool, so repeated runs reuse them
+		w->bufs = discferret_buffer_get(dh, p.depth * config->buffer_size);
+		if ((w->raw == NULL) || (w->results == NULL) || (w->bufs == NULL)) {
+			err = DISCFERRET_E_OUT_OF_MEMORY;
+			goto cleanup;
+		}
+	}
+
+	start = discferret_host_time();
+
+	// Start the decode workers and the output writer
+	for (unsigned int i = 0; i < p.nworkers; i++) {
+		if (pthread_create(&p.workers[i].thread, NULL, worker_thread, &p.workers[i]) != 0) {
+			err = DISCFERRET_E_OUT_OF_MEMORY;
+			pipeline_abort(&p);
+			goto join;
+		}
+		p.workers[i].started = true;
+	}
+	if (pthread_create(&out_thread, NULL, output_thread, &p) != 0) {
+		err = DISCFERRET_E_OUT_OF_MEMORY;
+		pipeline_abort(&p);
+		goto join;
+	}
+	out_started = true;
+
+	// Capture stage: deal the jobs out to the workers in turn
+	for (unsigned int job = 0; job < config->jobs; job++) {
+		struct worker *w = &p.workers[job % p.nworkers];
+		struct raw_slot *slot;
+		double t;
+
+		if (!ring_wait(&p, &w->in, true, &capture.stalled)) break;
+		slot = &w->raw[w->in.head % p.depth];
+		slot->job = job;
+		slot->len = 0;
+
+		t = discferret_host_time();
+		err = config->capture(dh, config->ctx, job, w->bufs + (w->in.head % p.depth) * config->buffer_size,
+				config->buffer_size, &slot->len);
+		capture.busy += discferret_host_time() - t;
+		if (err != DISCFERRET_E_OK) {
+			pipeline_abort(&p);
+			break;
+		}
+		if (slot->len > config->buffer_size) slot->len = config->buffer_size;
+		capture.items++;
+		capture.bytes += slot->len;
+
+		ring_push(&w->in);
+	}
+
+join:
+	if (out_started) pthread_join(out_thread, NULL);
+	for (unsigned int i = 0; i < p.nworkers; i++) {
+		if (p.workers[i].started) pthread_join(p.workers[i].thread, NULL);
+	}
+	if ((err == DISCFERRET_E_OK) && (p.output_err != DISCFERRET_E_OK)) err = p.output_err;
+
+	if (stats != NULL) {
+		memset(stats, 0, sizeof(DISCFERRET_PIPELINE_STATS));
+		stats->capture = capture;
+		stats->output = p.output;
+		for (unsigned int i = 0; i < p.nworkers; i++) {
+			stats->decode.items += p.workers[i].stats.items;
+			stats->decode.bytes += p.workers[i].stats.bytes;
+			stats->decode.busy += p.workers[i].stats.busy;
+			stats->decode.stalled += p.workers[i].stats.stalled;
+		}
+		stage_rate(&stats->capture);
+		stage_rate(&stats->decode);
+		stage_rate(&stats->output);
+		stats->workers = p.nworkers;
+		stats->elapsed = discferret_host_time() - start;
+		stats->rate = (stats->elapsed > 0.0) ? (capture.bytes / stats->elapsed) : 0.0;
+	}
+
+cleanup:
+	// Free any results decoded but never output (pipeline stopped early)
+	for (unsigned int i = 0; i < p.nworkers; i++) {
+		struct worker *w = &p.workers[i];
+		if (w->results != NULL) {
+			for (unsigned long n = w->out.tail; n != w->out.head; n++)
+				free(w->results[n % p.depth].result);
+		}
+		free(w->raw);
+		free(w->results);
+		discferret_buffer_put(dh, w->bufs);
+	}
+	free(p.workers);
+
+	return err;
+}
+
+// vim: ts=4 noet sw=4
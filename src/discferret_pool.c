@@ -0,0 +1,236 @@
+/****************************************************************************
+ *
+ *                - DiscFerret Interface Library for C / C++ -
+ *
+ * Copyright (C) 2010 - 2011 P. A. Pemberton t/a. Red Fox Engineering.
+ * All Rights Reserved.
+ *
+ * Copyright 2010-2011 Philip Pemberton
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ ****************************************************************************/
+
+
+
+/**
+ * @file	discferret_pool.c
+ * @brief	Per-handle pool of reusable capture and decode buffers.
+ */
+
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <libusb-1.0/libusb.h>
+#include "discferret.h"
+#include "discferret_pool.h"
+#include "discferret_private.h"
+
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+/// Alignment of every buffer (one cache line); also the size of the buffer header
+#define POOL_ALIGN			64
+/// Alignment of huge-page backed buffers
+#define POOL_HUGE_ALIGN		(2*1024*1024)
+/// Smallest size class (log2): 4 KiB
+#define POOL_MIN_CLASS		12
+/// Number of size classes (4 KiB .. 2 GiB)
+#define POOL_CLASSES		20
+
+/**
+ * @brief	Header stored in the cache line in front of every buffer
+ */
+struct pool_buffer {
+	struct pool_buffer	*next;		///< Next buffer on the free list
+	void				*base;		///< Start of the underlying allocation
+	unsigned int		cls;		///< Size class
+};
+
+struct discferret_pool {
+	pthread_mutex_t			lock;
+	unsigned int			flags;						///< DISCFERRET_POOL_xxx flags
+	struct pool_buffer		*free[POOL_CLASSES];		///< Free list per size class
+	DISCFERRET_POOL_STATS	stats;
+};
+
+static void *aligned_alloc_bytes(size_t align, size_t size)
+{
+#ifdef _WIN32
+	return _aligned_malloc(size, align);
+#else
+	void *p;
+	if (posix_memalign(&p, align, size) != 0) return NULL;
+	return p;
+#endif
+}
+
+static void aligned_free(void *p)
+{
+#ifdef _WIN32
+	_aligned_free(p);
+#else
+	free(p);
+#endif
+}
+
+static void free_buffer(struct pool_buffer *b)
+{
+	aligned_free(b->base);
+}
+
+struct discferret_pool *discferret_pool_create(void)
+{
+	struct discferret_pool *pool = calloc(1, sizeof(struct discferret_pool));
+	if (pool == NULL) return NULL;
+	if (pthread_mutex_init(&pool->lock, NULL) != 0) {
+		free(pool);
+		return NULL;
+	}
+	return pool;
+}
+
+static void pool_trim(struct discferret_pool *pool)
+{
+	for (unsigned int c = 0; c < POOL_CLASSES; c++) {
+		while (pool->free[c] != NULL) {
+			struct pool_buffer *b = pool->free[c];
+			pool->free[c] = b->next;
+			free_buffer(b);
+		}
+	}
+	pool->stats.cached = 0;
+	pool->stats.bytes_cached = 0;
+}
+
+void discferret_pool_destroy(struct discferret_pool *pool)
+{
+	if (pool == NULL) return;
+	pool_trim(pool);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool);
+}
+
+void *discferret_pool_get(struct discferret_pool *pool, const size_t size)
+{
+	struct pool_buffer *b;
+	unsigned int cls = 0;
+	size_t bytes, align;
+	unsigned char *p;
+
+	// Find the smallest size class which will hold the buffer
+	while ((cls < POOL_CLASSES) && (((size_t)1 << (cls + POOL_MIN_CLASS)) < size)) cls++;
+	if (cls >= POOL_CLASSES) return NULL;
+	bytes = (size_t)1 << (cls + POOL_MIN_CLASS);
+
+	pthread_mutex_lock(&pool->lock);
+	if ((b = pool->free[cls]) != NULL) {
+		pool->free[cls] = b->next;
+		pool->stats.reuses++;
+		pool->stats.in_use++;
+		pool->stats.cached--;
+		pool->stats.bytes_cached -= bytes;
+		pthread_mutex_unlock(&pool->lock);
+		return (unsigned char *)b + POOL_ALIGN;
+	}
+	pool->stats.allocations++;
+	pool->stats.in_use++;
+	align = ((pool->flags & DISCFERRET_POOL_HUGE_PAGES) && (bytes >= POOL_HUGE_ALIGN)) ? POOL_HUGE_ALIGN : POOL_ALIGN;
+	pthread_mutex_unlock(&pool->lock);
+
+	// Allocate a new buffer. The header goes in the cache line in front of
+	// the data; for huge-page buffers that means the data starts one cache
+	// line into the first huge page, which costs nothing.
+	p = aligned_alloc_bytes(align, bytes + POOL_ALIGN);
+	if (p == NULL) {
+		pthread_mutex_lock(&pool->lock);
+		pool->stats.allocations--;
+		pool->stats.in_use--;
+		pthread_mutex_unlock(&pool->lock);
+		return NULL;
+	}
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+	if (align == POOL_HUGE_ALIGN) madvise(p, bytes + POOL_ALIGN, MADV_HUGEPAGE);
+#endif
+
+	b = (struct pool_buffer *)p;
+	b->next = NULL;
+	b->base = p;
+	b->cls = cls;
+	return p + POOL_ALIGN;
+}
+
+void discferret_pool_put(struct discferret_pool *pool, void *buf)
+{
+	struct pool_buffer *b;
+
+	if (buf == NULL) return;
+	b = (struct pool_buffer *)((unsigned char *)buf - POOL_ALIGN);
+
+	// Push onto the front of the free list, so the most recently used
+	// (and most likely cache-warm) buffer is handed out next
+	pthread_mutex_lock(&pool->lock);
+	b->next = pool->free[b->cls];
+	pool->free[b->cls] = b;
+	pool->stats.in_use--;
+	pool->stats.cached++;
+	pool->stats.bytes_cached += (size_t)1 << (b->cls + POOL_MIN_CLASS);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+DISCFERRET_ERROR discferret_pool_configure(DISCFERRET_DEVICE_HANDLE *dh, const unsigned int flags)
+{
+	if ((dh == NULL) || (dh->priv == NULL)) return DISCFERRET_E_BAD_PARAMETER;
+	if (flags & ~DISCFERRET_POOL_HUGE_PAGES) return DISCFERRET_E_BAD_PARAMETER;
+
+	pthread_mutex_lock(&dh->priv->pool->lock);
+	dh->priv->pool->flags = flags;
+	pthread_mutex_unlock(&dh->priv->pool->lock);
+	return DISCFERRET_E_OK;
+}
+
+void *discferret_buffer_get(DISCFERRET_DEVICE_HANDLE *dh, const size_t size)
+{
+	if ((dh == NULL) || (dh->priv == NULL) || (size == 0)) return NULL;
+	return discferret_pool_get(dh->priv->pool, size);
+}
+
+void discferret_buffer_put(DISCFERRET_DEVICE_HANDLE *dh, void *buf)
+{
+	if ((dh == NULL) || (dh->priv == NULL)) return;
+	discferret_pool_put(dh->priv->pool, buf);
+}
+
+DISCFERRET_ERROR discferret_pool_trim(DISCFERRET_DEVICE_HANDLE *dh)
+{
+	if ((dh == NULL) || (dh->priv == NULL)) return DISCFERRET_E_BAD_PARAMETER;
+
+	pthread_mutex_lock(&dh->priv->pool->lock);
+	pool_trim(dh->priv->pool);
+	pthread_mutex_unlock(&dh->priv->pool->lock);
+	return DISCFERRET_E_OK;
+}
+
+DISCFERRET_ERROR discferret_pool_get_stats(DISCFERRET_DEVICE_HANDLE *dh, DISCFERRET_POOL_STATS *stats)
+{
+	if ((dh == NULL) || (dh->priv == NULL) || (stats == NULL)) return DISCFERRET_E_BAD_PARAMETER;
+
+	pthread_mutex_lock(&dh->priv->pool->lock);
+	*stats = dh->priv->pool->stats;
+	pthread_mutex_unlock(&dh->priv->pool->lock);
+	return DISCFERRET_E_OK;
+}
+
+// vim: ts=4 noet sw=4
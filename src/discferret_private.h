@@ -0,0 +1,272 @@
+/****************************************************************************
+ *
+ *                - DiscFerret Interface Library for C / C++ -
+ *
+ * Copyright (C) 2010 - 2011 P. A. Pemberton t/a. Red Fox Engineering.
+ * All Rights Reserved.
+ *
+ * Copyright 2010-2011 Philip Pemberton
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ ****************************************************************************/
+
+
+/**
+ * @file	discferret_private.h
+ * @brief	libdiscferret internal definitions, shared between the library's source modules.
+ *
+ * Nothing in this file is part of the public API. Applications must not
+ * include it.
+ */
+
+#ifndef _DISCFERRET_PRIVATE_H
+#define _DISCFERRET_PRIVATE_H
+
+#include <pthread.h>
+#include <libusb-1.0/libusb.h>
+#include "discferret.h"
+#include "discferret_flux.h"
+
+/// DiscFerret USB Vendor ID
+#define DISCFERRET_USB_VID	0x04d8
+/// DiscFerret USB Product ID
+#define DISCFERRET_USB_PID	0xfbbb
+
+struct discferret_index_monitor;
+struct discferret_watcher;
+struct discferret_pool;
+
+/// Size of the per-handle USB packet buffer (largest Fast Write packet, header included)
+#define DISCFERRET_PACKET_SIZE	65536
+
+/**
+ * @brief	Host/device clock fit, maintained by the index monitor.
+ *
+ * Index pulses are numbered from zero (the first pulse the monitor saw).
+ * The fit relates device time (the sum of the device's index period
+ * measurements since pulse zero) to host time minus <i>host0</i>.
+ */
+struct discferret_clockfit {
+	unsigned long	n;				///< Number of index pulses in the fit
+	unsigned long	index;			///< Number of the most recent index pulse
+	double			device_time;	///< Device time of the most recent index pulse, in seconds
+	double			period;			///< Most recent index period, in seconds
+	double			host0;			///< Host time estimate of index pulse zero
+	double			last_host;		///< Host time estimate of the most recent index pulse
+	double			mean_x;			///< Running mean of device times
+	double			mean_y;			///< Running mean of host times (relative to host0)
+	double			m2x;			///< Sum of squared deviations of device times
+	double			m2y;			///< Sum of squared deviations of host times
+	double			cxy;			///< Sum of co-deviations
+};
+
+/**
+ * @brief	Library-private per-handle state.
+ */
+struct discferret_private {
+	pthread_mutex_t	lock;		///< Handle lock (recursive). Held across every command/response transaction.
+	struct discferret_index_monitor *index_monitor;	///< Index monitor state, or NULL if the monitor isn't running
+	struct discferret_watcher *watcher;	///< Status watcher state, or NULL if the watcher isn't running
+	unsigned long	step_rate_us;	///< Step rate last set with discferret_seek_set_rate(), or 0 if unknown
+	bool			autotuning;		///< True while discferret_seek_autotune() holds the handle lock for a measurement; suppresses the profile's settle delay. Protected by the handle lock.
+	double			index_period;	///< Last index period read by discferret_get_index_time(), or 0 if none. Protected by the handle lock.
+	double			index_seen;		///< Host time a new index measurement was last seen. Protected by the handle lock.
+	DISCFERRET_WAIT_STATS	wait_stats;	///< Status wait statistics (updated atomically)
+	DISCFERRET_USB_STATS	usb_stats;	///< USB error recovery statistics (updated atomically)
+	long			ram_addr;		///< RAM address pointer as last set or advanced by the library, or -1 if unknown. Protected by the handle lock.
+	bool			usb_lost;		///< True if the last USB error couldn't be recovered from. Protected by the handle lock.
+	struct discferret_pool *pool;	///< Buffer pool
+	unsigned char	*packet;	///< USB packet buffer (DISCFERRET_PACKET_SIZE bytes, from the pool). Protected by the handle lock.
+};
+
+/**
+ * @brief	Get the library's libusb context.
+ * @returns	libusb context, or NULL if the library has not been initialised.
+ */
+libusb_context *discferret_usb_context(void);
+
+/**
+ * @brief	Start the device registry.
+ * @param	ctx		libusb context.
+ *
+ * Registers for hotplug notification (if libusb supports it on this platform)
+ * and starts the libusb event handling thread.
+ */
+DISCFERRET_ERROR discferret_registry_init(libusb_context *ctx);
+
+/**
+ * @brief	Shut down the device registry and free its resources.
+ */
+void discferret_registry_done(void);
+
+/**
+ * @brief	Get a list of the attached DiscFerrets.
+ * @param	devlist		Pointer which will receive a malloc()ed array of device
+ * 						information blocks, or NULL.
+ * @param	devs		Pointer which will receive a malloc()ed array of referenced
+ * 						libusb devices, in the same order as devlist, or NULL.
+ * 						Free with discferret_registry_list_free().
+ * @returns	Number of devices, or one of the DISCFERRET_E_xxx constants on error.
+ */
+int discferret_registry_list(DISCFERRET_DEVICE **devlist, libusb_device ***devs);
+
+/**
+ * @brief	Free a libusb device list returned by discferret_registry_list().
+ */
+void discferret_registry_list_free(libusb_device **devs, int count);
+
+/**
+ * @brief	Look up a DiscFerret by serial number.
+ * @param	serialnum	Serial number.
+ * @param	dev			Pointer which will receive a referenced libusb device.
+ * @returns	DISCFERRET_E_OK, DISCFERRET_E_NO_MATCH if the serial number isn't
+ * 			known, or one of the other DISCFERRET_E_xxx constants on error.
+ */
+DISCFERRET_ERROR discferret_registry_lookup(const char *serialnum, libusb_device **dev);
+
+/**
+ * @brief	Open and claim a DiscFerret, and set up a device handle for it.
+ * @param	dev		libusb device.
+ * @param	dh		Pointer which will receive the device handle.
+ * @returns	DISCFERRET_E_OK on success, one of the DISCFERRET_E_xxx constants on error.
+ */
+DISCFERRET_ERROR discferret_open_device(libusb_device *dev, DISCFERRET_DEVICE_HANDLE **dh);
+
+/**
+ * @brief	Sleep for (at least) a given number of microseconds.
+ */
+void discferret_sleep_us(unsigned long us);
+
+/**
+ * @brief	Deadline and cancellation token for a long-running operation.
+ *
+ * Passed down from the public _deadline functions; a NULL pointer means no
+ * deadline and no cancellation.
+ */
+struct discferret_deadline {
+	double					deadline;	///< Host time by which the operation must finish, or 0 for none
+	const DISCFERRET_CANCEL	*cancel;	///< Cancellation token, or NULL
+};
+
+/**
+ * @brief	Check whether an operation should stop.
+ * @param	dl		Deadline, or NULL.
+ * @returns	DISCFERRET_E_CANCELLED if the token has been cancelled, DISCFERRET_E_TIMEOUT
+ * 			if the deadline has passed, or DISCFERRET_E_OK.
+ */
+DISCFERRET_ERROR discferret_deadline_check(const struct discferret_deadline *dl);
+
+/// Longest time to wait for an index pulse, in seconds
+#define DISCFERRET_INDEX_TIMEOUT	1.0
+
+/**
+ * @brief	Wait for the status register to reach a given state.
+ * @param	dh			DiscFerret device handle.
+ * @param	mask		Status bits to check.
+ * @param	value		Value the masked status bits must have.
+ * @param	expect		Host time at which the condition is expected to become true.
+ * @param	deadline	Host time after which to give up.
+ * @param	status		Receives the last status word read, or NULL.
+ * @param	polls		Incremented for each status poll, or NULL.
+ * @param	dl			Caller's deadline and cancellation token, or NULL.
+ * @returns	DISCFERRET_E_OK when the condition is met, DISCFERRET_E_TIMEOUT if
+ * 			either deadline passed first, DISCFERRET_E_CANCELLED, or one of the
+ * 			other DISCFERRET_E_xxx constants on error.
+ *
+ * Sleeps until shortly before <i>expect</i> (pass the current time if there's
+ * no estimate), then polls with an exponential backoff, never sleeping past
+ * the deadline. Every wait is counted in the handle's wait statistics.
+ */
+DISCFERRET_ERROR discferret_wait_status(DISCFERRET_DEVICE_HANDLE *dh, const unsigned long mask, const unsigned long value,
+		const double expect, const double deadline, long *status, unsigned long *polls, const struct discferret_deadline *dl);
+
+/**
+ * @brief	Get an index time measurement from the index monitor.
+ * @param	dh		DiscFerret device handle.
+ * @param	wait	If true, wait for the monitor to take a new measurement.
+ * @param	timeval	Pointer to a double, which will receive the time value, in seconds.
+ *
+ * Used by discferret_get_index_time() when the index monitor is running.
+ * Does not generate any USB traffic.
+ */
+DISCFERRET_ERROR discferret_index_monitor_sample(DISCFERRET_DEVICE_HANDLE *dh, const bool wait, double *timeval);
+
+/**
+ * @brief	Get a snapshot of the index monitor's host/device clock fit.
+ * @returns	true if the index monitor is running, false if not.
+ */
+bool discferret_index_monitor_clockfit(DISCFERRET_DEVICE_HANDLE *dh, struct discferret_clockfit *fit);
+
+/**
+ * @brief	Program the acquisition registers and start an acquisition into RAM address zero.
+ * @param	dh			DiscFerret device handle.
+ * @param	clksel		DISCFERRET_ACQ_RATE_xxx value.
+ * @param	start_evt	ACQ_START_EVT value.
+ * @param	start_num	ACQ_START_NUM value.
+ * @param	stop_evt	ACQ_STOP_EVT value.
+ * @param	stop_num	ACQ_STOP_NUM value.
+ * @param	start		Receives the host time at which the acquisition was started.
+ */
+DISCFERRET_ERROR discferret_acq_start(DISCFERRET_DEVICE_HANDLE *dh, const unsigned int clksel, const unsigned int start_evt,
+		const unsigned int start_num, const unsigned int stop_evt, const unsigned int stop_num, double *start);
+
+/**
+ * @brief	Read back a finished acquisition from RAM and convert it to flux.
+ * @param	dh		DiscFerret device handle.
+ * @param	clksel	DISCFERRET_ACQ_RATE_xxx value the acquisition ran at.
+ * @param	flux	DISCFERRET_FLUX which will receive the intervals.
+ * @param	dl		Deadline and cancellation token, or NULL.
+ */
+DISCFERRET_ERROR discferret_acq_readback(DISCFERRET_DEVICE_HANDLE *dh, const unsigned int clksel, DISCFERRET_FLUX *flux,
+		const struct discferret_deadline *dl);
+
+/**
+ * @brief	Wait for an acquisition or write to finish.
+ * @param	dh			DiscFerret device handle.
+ * @param	expect		Host time at which the operation is expected to end.
+ * @param	deadline	Host time after which the operation is aborted.
+ * @param	polls		Incremented for each status poll, or NULL.
+ * @param	dl			Caller's deadline and cancellation token, or NULL.
+ * @returns	DISCFERRET_E_OK when the DiscFerret is idle, DISCFERRET_E_TIMEOUT
+ * 			if the deadline passed, or one of the other DISCFERRET_E_xxx constants on error.
+ *
+ * Waits with discferret_wait_status(), and aborts the operation if the
+ * deadline passes or the wait is cancelled.
+ */
+DISCFERRET_ERROR discferret_acq_wait(DISCFERRET_DEVICE_HANDLE *dh, const double expect, const double deadline, unsigned long *polls,
+		const struct discferret_deadline *dl);
+
+/**
+ * @brief	Create a buffer pool.
+ * @returns	Pool, or NULL if out of memory.
+ */
+struct discferret_pool *discferret_pool_create(void);
+
+/**
+ * @brief	Free a buffer pool and all its cached buffers.
+ */
+void discferret_pool_destroy(struct discferret_pool *pool);
+
+/**
+ * @brief	Get a buffer of at least <i>size</i> bytes from a pool.
+ */
+void *discferret_pool_get(struct discferret_pool *pool, const size_t size);
+
+/**
+ * @brief	Return a buffer to a pool.
+ */
+void discferret_pool_put(struct discferret_pool *pool, void *buf);
+
+#endif // _DISCFERRET_PRIVATE_H
+
+// vim: ts=4 noet sw=4
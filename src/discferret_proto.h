@@ -0,0 +1,172 @@
+/****************************************************************************
+ *
+ *                - DiscFerret Interface Library for C / C++ -
+ *
+ * Copyright (C) 2010 - 2011 P. A. Pemberton t/a. Red Fox Engineering.
+ * All Rights Reserved.
+ *
+ * Copyright 2010-2011 Philip Pemberton
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ ****************************************************************************/
+
+
+/**
+ * @file	discferret_proto.h
+ * @brief	Wire protocol between the DiscFerret daemon (discferretd) and the
+ * 			remote client library.
+ *
+ * Every request is a 12-byte header followed by <i>len</i> bytes of payload;
+ * every response is an 8-byte header (status and payload length) followed by
+ * the payload. All integers are little-endian. Doubles are sent as the
+ * little-endian bit pattern of an IEEE 754 binary64.
+ *
+ * Nothing in this file is part of the public API.
+ */
+
+#ifndef _DISCFERRET_PROTO_H
+#define _DISCFERRET_PROTO_H
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+/// Protocol magic number ("DFd1")
+#define PROTO_MAGIC				0x31644644
+/// Largest payload either side will accept
+#define PROTO_MAX_PAYLOAD		(16*1024*1024)
+/// Size of a request header
+#define PROTO_REQ_HDR_LEN		12
+/// Size of a response header
+#define PROTO_RESP_HDR_LEN		8
+
+/// Request opcodes
+enum {
+	OP_LIST					= 1,	///< List units. Response: count(u32), then per unit: serial, product, manufacturer, location (NUL-terminated)
+	OP_OPEN					= 2,	///< Open unit by serial (NUL-terminated, empty = first). Response: unit(u32)
+	OP_CLOSE				= 3,	///< Release unit (drops any lock held by this client)
+	OP_LOCK					= 4,	///< Gain exclusive access to a unit
+	OP_UNLOCK				= 5,	///< Release exclusive access
+	OP_GET_INFO				= 6,	///< Response: fwver(u32) mctype(u32) mcver(u32) hwrev(4 bytes), then product, manufacturer, serial (NUL-terminated)
+	OP_REG_PEEK				= 7,	///< addr(u32). Response: value(u32)
+	OP_REG_POKE				= 8,	///< addr(u32) data(u32)
+	OP_RAM_ADDR_GET			= 9,	///< Response: addr(u32)
+	OP_RAM_ADDR_SET			= 10,	///< addr(u32)
+	OP_RAM_READ				= 11,	///< len(u32). Response: data
+	OP_RAM_WRITE			= 12,	///< data
+	OP_GET_STATUS			= 13,	///< Response: status(u32)
+	OP_GET_INDEX_TIME		= 14,	///< wait(u32). Response: time(double)
+	OP_SEEK_SET_RATE		= 15,	///< steprate_us(u32)
+	OP_SEEK_RECALIBRATE		= 16,	///< maxsteps(u32)
+	OP_SEEK_RELATIVE		= 17,	///< numsteps(i32)
+	OP_SEEK_ABSOLUTE		= 18,	///< track(u32)
+	OP_FPGA_LOAD_DEFAULT	= 19,	///< Reload the default microcode
+	OP_FLUX_CAPTURE			= 20	///< clksel(u32) index_start(u32) revolutions(u32) timeout(double).
+									///< Response: clock_hz(u32) count(u32) index_count(u32), index[index_count](u32), intervals[count](u32)
+};
+
+/**
+ * @brief	Request header
+ */
+struct proto_request {
+	uint32_t	magic;		///< PROTO_MAGIC
+	uint16_t	op;			///< Opcode (OP_xxx)
+	uint16_t	unit;		///< Unit number returned by OP_OPEN (ignored by OP_LIST and OP_OPEN)
+	uint32_t	len;		///< Payload length
+};
+
+static inline void proto_put_u32(unsigned char *p, uint32_t v)
+{
+	p[0] = v & 0xff;
+	p[1] = (v >> 8) & 0xff;
+	p[2] = (v >> 16) & 0xff;
+	p[3] = (v >> 24) & 0xff;
+}
+
+static inline uint32_t proto_get_u32(const unsigned char *p)
+{
+	return ((uint32_t)p[0]) | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline void proto_put_double(unsigned char *p, double d)
+{
+	uint64_t v;
+	memcpy(&v, &d, sizeof(v));
+	proto_put_u32(p, v & 0xffffffff);
+	proto_put_u32(p + 4, v >> 32);
+}
+
+static inline double proto_get_double(const unsigned char *p)
+{
+	uint64_t v = ((uint64_t)proto_get_u32(p + 4) << 32) | proto_get_u32(p);
+	double d;
+	memcpy(&d, &v, sizeof(d));
+	return d;
+}
+
+static inline void proto_put_request(unsigned char *p, const struct proto_request *req)
+{
+	proto_put_u32(p, req->magic);
+	p[4] = req->op & 0xff;
+	p[5] = req->op >> 8;
+	p[6] = req->unit & 0xff;
+	p[7] = req->unit >> 8;
+	proto_put_u32(p + 8, req->len);
+}
+
+static inline void proto_get_request(const unsigned char *p, struct proto_request *req)
+{
+	req->magic = proto_get_u32(p);
+	req->op = p[4] | (p[5] << 8);
+	req->unit = p[6] | (p[7] << 8);
+	req->len = proto_get_u32(p + 8);
+}
+
+/**
+ * @brief	Write a whole buffer to a socket
+ * @returns	0 on success, -1 on error or end-of-file
+ */
+static inline int proto_write_all(int fd, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	while (len > 0) {
+		ssize_t n = write(fd, p, len);
+		if ((n < 0) && (errno == EINTR)) continue;
+		if (n <= 0) return -1;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/**
+ * @brief	Read a whole buffer from a socket
+ * @returns	0 on success, -1 on error or end-of-file
+ */
+static inline int proto_read_all(int fd, void *buf, size_t len)
+{
+	unsigned char *p = buf;
+	while (len > 0) {
+		ssize_t n = read(fd, p, len);
+		if ((n < 0) && (errno == EINTR)) continue;
+		if (n <= 0) return -1;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+#endif // _DISCFERRET_PROTO_H
+
+// vim: ts=4 noet sw=4
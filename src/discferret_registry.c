@@ -0,0 +1,518 @@
+/****************************************************************************
+ *
+ *                - DiscFerret Interface Library for C / C++ -
+ *
+ * Copyright (C) 2010 - 2011 P. A. Pemberton t/a. Red Fox Engineering.
+ * All Rights Reserved.
+ *
+ * Copyright 2010-2011 Philip Pemberton
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ ****************************************************************************/
+
+
+/**
+ * @file	discferret_registry.c
+ * @brief	Cached DiscFerret device registry.
+ *
+ * Keeps a list of attached DiscFerret units, keyed by USB bus/port, with
+ * their string descriptors read once when the unit is first seen. Where
+ * libusb supports hotplug notification, a background thread keeps the
+ * registry up to date; otherwise the bus is rescanned on each lookup, but
+ * descriptors are still only read for newly attached units.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <libusb-1.0/libusb.h>
+#include "discferret.h"
+#include "discferret_private.h"
+
+/// Maximum USB port path depth (USB 3.0 spec limit)
+#define MAX_PORT_DEPTH	7
+
+/**
+ * @brief	Registry entry for one attached DiscFerret
+ */
+struct registry_entry {
+	libusb_device		*dev;					///< libusb device (we hold a reference)
+	uint8_t				bus;					///< USB bus number
+	uint8_t				ports[MAX_PORT_DEPTH];	///< USB port path
+	int					nports;					///< Number of valid entries in ports[]
+	bool				loaded;					///< True once the string descriptors have been read
+	DISCFERRET_DEVICE	info;					///< Device information
+};
+
+/// Registry lock. Never held across USB I/O (hotplug callbacks need to take it).
+static pthread_mutex_t reg_lock = PTHREAD_MUTEX_INITIALIZER;
+/// Registry entries
+static struct registry_entry *entries = NULL;
+/// Number of registry entries, and allocated size of the entries array
+static size_t num_entries = 0, max_entries = 0;
+/// Hash tables (entry index + 1, 0 = empty slot) keyed by bus/port and by serial number
+static size_t *loc_hash = NULL, *serial_hash = NULL;
+/// Size of the hash tables (always a power of two)
+static size_t hash_size = 0;
+
+/// libusb context the registry belongs to
+static libusb_context *reg_ctx = NULL;
+/// True if we have hotplug notification; false if we have to rescan
+static bool have_hotplug = false;
+/// Hotplug callback handle
+static libusb_hotplug_callback_handle hotplug_handle;
+/// Event handling thread (only runs if we have hotplug notification)
+static pthread_t event_thread;
+/// Nonzero to stop the event thread (atomic)
+static int event_thread_stop = 0;
+
+/**
+ * @brief	FNV-1a hash
+ */
+static size_t hash_bytes(const void *data, size_t len, size_t h)
+{
+	const unsigned char *p = data;
+	while (len--) {
+		h ^= *p++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static size_t hash_location(uint8_t bus, const uint8_t *ports, int nports)
+{
+	return hash_bytes(ports, nports, hash_bytes(&bus, 1, 2166136261u));
+}
+
+static size_t hash_serial(const unsigned char *serial)
+{
+	return hash_bytes(serial, strlen((const char *)serial), 2166136261u);
+}
+
+/**
+ * @brief	Rebuild both hash tables from the entry list
+ *
+ * Called with the registry lock held. Devices come and go rarely, so a full
+ * rebuild on each change is cheaper than it sounds.
+ */
+static DISCFERRET_ERROR rehash(void)
+{
+	size_t sz = 16;
+
+	while (sz < (num_entries * 2)) sz *= 2;
+	if (sz != hash_size) {
+		size_t *a = calloc(sz, sizeof(size_t)), *b = calloc(sz, sizeof(size_t));
+		if ((a == NULL) || (b == NULL)) {
+			free(a);
+			free(b);
+			return DISCFERRET_E_OUT_OF_MEMORY;
+		}
+		free(loc_hash);
+		free(serial_hash);
+		loc_hash = a;
+		serial_hash = b;
+		hash_size = sz;
+	} else {
+		memset(loc_hash, 0, sz * sizeof(size_t));
+		memset(serial_hash, 0, sz * sizeof(size_t));
+	}
+
+	for (size_t i = 0; i < num_entries; i++) {
+		size_t h = hash_location(entries[i].bus, entries[i].ports, entries[i].nports) & (hash_size - 1);
+		while (loc_hash[h] != 0) h = (h + 1) & (hash_size - 1);
+		loc_hash[h] = i + 1;
+
+		if (entries[i].loaded && (entries[i].info.serialnumber[0] != '\0')) {
+			h = hash_serial(entries[i].info.serialnumber) & (hash_size - 1);
+			while (serial_hash[h] != 0) h = (h + 1) & (hash_size - 1);
+			serial_hash[h] = i + 1;
+		}
+	}
+
+	return DISCFERRET_E_OK;
+}
+
+/**
+ * @brief	Find the registry entry for a USB bus/port, or -1 if there isn't one
+ */
+static long find_location(uint8_t bus, const uint8_t *ports, int nports)
+{
+	if (hash_size == 0) return -1;
+
+	size_t h = hash_location(bus, ports, nports) & (hash_size - 1);
+	while (loc_hash[h] != 0) {
+		struct registry_entry *e = &entries[loc_hash[h] - 1];
+		if ((e->bus == bus) && (e->nports == nports) && (memcmp(e->ports, ports, nports) == 0))
+			return loc_hash[h] - 1;
+		h = (h + 1) & (hash_size - 1);
+	}
+	return -1;
+}
+
+/**
+ * @brief	Find the registry entry for a serial number, or -1 if there isn't one
+ */
+static long find_serial(const char *serial)
+{
+	if (hash_size == 0) return -1;
+
+	size_t h = hash_serial((const unsigned char *)serial) & (hash_size - 1);
+	while (serial_hash[h] != 0) {
+		struct registry_entry *e = &entries[serial_hash[h] - 1];
+		if (strcmp((const char *)e->info.serialnumber, serial) == 0)
+			return serial_hash[h] - 1;
+		h = (h + 1) & (hash_size - 1);
+	}
+	return -1;
+}
+
+/**
+ * @brief	Add a device to the registry (registry lock held)
+ */
+static void device_arrived(libusb_device *dev)
+{
+	struct libusb_device_descriptor desc;
+	struct registry_entry e;
+	char *p;
+
+	if (libusb_get_device_descriptor(dev, &desc) != 0) return;
+	if ((desc.idVendor != DISCFERRET_USB_VID) || (desc.idProduct != DISCFERRET_USB_PID)) return;
+
+	memset(&e, 0, sizeof(e));
+	e.bus = libusb_get_bus_number(dev);
+	e.nports = libusb_get_port_numbers(dev, e.ports, MAX_PORT_DEPTH);
+	if (e.nports < 0) e.nports = 0;
+
+	// Already got it?
+	if (find_location(e.bus, e.ports, e.nports) >= 0) return;
+
+	e.dev = libusb_ref_device(dev);
+	e.info.vid = desc.idVendor;
+	e.info.pid = desc.idProduct;
+
+	// Location string, in the same "bus-port.port.port" form Linux uses
+	p = e.info.location;
+	p += sprintf(p, "%u", e.bus);
+	for (int i = 0; i < e.nports; i++)
+		p += sprintf(p, (i == 0) ? "-%u" : ".%u", e.ports[i]);
+
+	// Grow the entry list if we need to
+	if (num_entries == max_entries) {
+		size_t n = (max_entries == 0) ? 8 : (max_entries * 2);
+		struct registry_entry *tmp = realloc(entries, n * sizeof(struct registry_entry));
+		if (tmp == NULL) {
+			libusb_unref_device(e.dev);
+			return;
+		}
+		entries = tmp;
+		max_entries = n;
+	}
+
+	entries[num_entries++] = e;
+	if (rehash() != DISCFERRET_E_OK) {
+		libusb_unref_device(entries[--num_entries].dev);
+		rehash();
+	}
+}
+
+/**
+ * @brief	Remove a registry entry (registry lock held)
+ */
+static void entry_remove(size_t idx)
+{
+	libusb_unref_device(entries[idx].dev);
+	memmove(&entries[idx], &entries[idx+1], (num_entries - idx - 1) * sizeof(struct registry_entry));
+	num_entries--;
+	rehash();
+}
+
+/**
+ * @brief	libusb hotplug callback
+ */
+static int hotplug_callback(libusb_context *ctx, libusb_device *dev, libusb_hotplug_event event, void *user_data)
+{
+	pthread_mutex_lock(&reg_lock);
+	if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED) {
+		device_arrived(dev);
+	} else if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT) {
+		for (size_t i = 0; i < num_entries; i++) {
+			if (entries[i].dev == dev) {
+				entry_remove(i);
+				break;
+			}
+		}
+	}
+	pthread_mutex_unlock(&reg_lock);
+
+	// Keep the callback registered
+	return 0;
+}
+
+/**
+ * @brief	libusb event handling thread
+ *
+ * Hotplug notifications are only delivered while someone is handling libusb
+ * events, so we do it here rather than relying on the application.
+ */
+static void *event_thread_fn(void *arg)
+{
+	while (!__atomic_load_n(&event_thread_stop, __ATOMIC_ACQUIRE)) {
+		struct timeval tv = { 0, 100000 };
+		libusb_handle_events_timeout_completed(reg_ctx, &tv, NULL);
+	}
+	return NULL;
+}
+
+/**
+ * @brief	Rescan the bus (used if hotplug notification isn't available)
+ */
+static DISCFERRET_ERROR rescan(void)
+{
+	libusb_device **usb_devices;
+	ssize_t cnt;
+
+	cnt = libusb_get_device_list(reg_ctx, &usb_devices);
+	if (cnt < 0) return DISCFERRET_E_USB_ERROR;
+
+	pthread_mutex_lock(&reg_lock);
+
+	// Drop entries for devices which have gone away
+	for (size_t i = num_entries; i > 0; i--) {
+		bool present = false;
+		for (ssize_t j = 0; (j < cnt) && !present; j++)
+			present = (usb_devices[j] == entries[i-1].dev);
+		if (!present) entry_remove(i-1);
+	}
+
+	// Add any new ones
+	for (ssize_t j = 0; j < cnt; j++)
+		device_arrived(usb_devices[j]);
+
+	pthread_mutex_unlock(&reg_lock);
+
+	libusb_free_device_list(usb_devices, true);
+	return DISCFERRET_E_OK;
+}
+
+/**
+ * @brief	Read a device's string descriptors
+ */
+static bool load_descriptors(libusb_device *dev, DISCFERRET_DEVICE *info)
+{
+	struct libusb_device_descriptor desc;
+	struct libusb_device_handle *dh;
+
+	if (libusb_get_device_descriptor(dev, &desc) != 0) return false;
+	if (libusb_open(dev, &dh) != 0) return false;
+
+	info->productname[0] = '\0';
+	if (desc.iProduct != 0) {
+		int len = libusb_get_string_descriptor_ascii(dh, desc.iProduct, info->productname, sizeof(info->productname));
+		if (len <= 0) info->productname[0] = '\0';
+	}
+
+	info->manufacturer[0] = '\0';
+	if (desc.iManufacturer != 0) {
+		int len = libusb_get_string_descriptor_ascii(dh, desc.iManufacturer, info->manufacturer, sizeof(info->manufacturer));
+		if (len <= 0) info->manufacturer[0] = '\0';
+	}
+
+	info->serialnumber[0] = '\0';
+	if (desc.iSerialNumber != 0) {
+		int len = libusb_get_string_descriptor_ascii(dh, desc.iSerialNumber, info->serialnumber, sizeof(info->serialnumber));
+		if (len <= 0) info->serialnumber[0] = '\0';
+	}
+
+	libusb_close(dh);
+	return true;
+}
+
+/**
+ * @brief	Bring the registry up to date
+ *
+ * Rescans the bus if we don't have hotplug notification, then reads the
+ * string descriptors of any devices we haven't seen before. Descriptor reads
+ * are done without the registry lock held.
+ */
+static DISCFERRET_ERROR refresh(void)
+{
+	DISCFERRET_ERROR err;
+
+	if (!have_hotplug && ((err = rescan()) != DISCFERRET_E_OK))
+		return err;
+
+	// Take a list of the devices which need their descriptors reading
+	libusb_device **pending;
+	size_t npending = 0;
+
+	pthread_mutex_lock(&reg_lock);
+	pending = malloc((num_entries + 1) * sizeof(libusb_device *));
+	if (pending == NULL) {
+		pthread_mutex_unlock(&reg_lock);
+		return DISCFERRET_E_OUT_OF_MEMORY;
+	}
+	for (size_t i = 0; i < num_entries; i++)
+		if (!entries[i].loaded)
+			pending[npending++] = libusb_ref_device(entries[i].dev);
+	pthread_mutex_unlock(&reg_lock);
+
+	for (size_t p = 0; p < npending; p++) {
+		DISCFERRET_DEVICE info;
+
+		// If we can't open it (e.g. permissions), leave it for next time
+		if (load_descriptors(pending[p], &info)) {
+			// Store the descriptors, if the device is still there
+			pthread_mutex_lock(&reg_lock);
+			for (size_t i = 0; i < num_entries; i++) {
+				if (entries[i].dev == pending[p]) {
+					memcpy(entries[i].info.productname, info.productname, sizeof(info.productname));
+					memcpy(entries[i].info.manufacturer, info.manufacturer, sizeof(info.manufacturer));
+					memcpy(entries[i].info.serialnumber, info.serialnumber, sizeof(info.serialnumber));
+					entries[i].loaded = true;
+					rehash();
+					break;
+				}
+			}
+			pthread_mutex_unlock(&reg_lock);
+		}
+		libusb_unref_device(pending[p]);
+	}
+	free(pending);
+
+	return DISCFERRET_E_OK;
+}
+
+DISCFERRET_ERROR discferret_registry_init(libusb_context *ctx)
+{
+	reg_ctx = ctx;
+	have_hotplug = libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG) != 0;
+
+	if (have_hotplug) {
+		// ENUMERATE makes libusb call us back for devices which are already attached
+		int r = libusb_hotplug_register_callback(ctx,
+				LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+				LIBUSB_HOTPLUG_ENUMERATE, DISCFERRET_USB_VID, DISCFERRET_USB_PID,
+				LIBUSB_HOTPLUG_MATCH_ANY, hotplug_callback, NULL, &hotplug_handle);
+		if (r != 0) {
+			have_hotplug = false;
+		} else {
+			__atomic_store_n(&event_thread_stop, 0, __ATOMIC_RELEASE);
+			if (pthread_create(&event_thread, NULL, event_thread_fn, NULL) != 0) {
+				libusb_hotplug_deregister_callback(ctx, hotplug_handle);
+				have_hotplug = false;
+			}
+		}
+	}
+
+	return DISCFERRET_E_OK;
+}
+
+void discferret_registry_done(void)
+{
+	if (have_hotplug) {
+		__atomic_store_n(&event_thread_stop, 1, __ATOMIC_RELEASE);
+		// Deregistering the callback wakes up the event thread
+		libusb_hotplug_deregister_callback(reg_ctx, hotplug_handle);
+		pthread_join(event_thread, NULL);
+		have_hotplug = false;
+	}
+
+	pthread_mutex_lock(&reg_lock);
+	while (num_entries > 0)
+		libusb_unref_device(entries[--num_entries].dev);
+	free(entries);
+	free(loc_hash);
+	free(serial_hash);
+	entries = NULL;
+	loc_hash = serial_hash = NULL;
+	max_entries = hash_size = 0;
+	pthread_mutex_unlock(&reg_lock);
+
+	reg_ctx = NULL;
+}
+
+int discferret_registry_list(DISCFERRET_DEVICE **devlist, libusb_device ***devs)
+{
+	DISCFERRET_ERROR err;
+	size_t count = 0;
+
+	if (devlist != NULL) *devlist = NULL;
+	if (devs != NULL) *devs = NULL;
+
+	if ((err = refresh()) != DISCFERRET_E_OK) return err;
+
+	pthread_mutex_lock(&reg_lock);
+
+	// Only report devices whose descriptors have been read
+	for (size_t i = 0; i < num_entries; i++)
+		if (entries[i].loaded) count++;
+
+	if ((count > 0) && (devlist != NULL)) {
+		*devlist = malloc(count * sizeof(DISCFERRET_DEVICE));
+		if (*devlist == NULL) {
+			pthread_mutex_unlock(&reg_lock);
+			return DISCFERRET_E_OUT_OF_MEMORY;
+		}
+	}
+	if ((count > 0) && (devs != NULL)) {
+		*devs = malloc(count * sizeof(libusb_device *));
+		if (*devs == NULL) {
+			pthread_mutex_unlock(&reg_lock);
+			if (devlist != NULL) {
+				free(*devlist);
+				*devlist = NULL;
+			}
+			return DISCFERRET_E_OUT_OF_MEMORY;
+		}
+	}
+
+	for (size_t i = 0, j = 0; i < num_entries; i++) {
+		if (!entries[i].loaded) continue;
+		if (devlist != NULL) (*devlist)[j] = entries[i].info;
+		if (devs != NULL) (*devs)[j] = libusb_ref_device(entries[i].dev);
+		j++;
+	}
+
+	pthread_mutex_unlock(&reg_lock);
+	return count;
+}
+
+void discferret_registry_list_free(libusb_device **devs, int count)
+{
+	if (devs == NULL) return;
+	for (int i = 0; i < count; i++)
+		libusb_unref_device(devs[i]);
+	free(devs);
+}
+
+DISCFERRET_ERROR discferret_registry_lookup(const char *serialnum, libusb_device **dev)
+{
+	DISCFERRET_ERROR err;
+	long idx;
+
+	if ((err = refresh()) != DISCFERRET_E_OK) return err;
+
+	pthread_mutex_lock(&reg_lock);
+	idx = find_serial(serialnum);
+	*dev = (idx < 0) ? NULL : libusb_ref_device(entries[idx].dev);
+	pthread_mutex_unlock(&reg_lock);
+
+	return (*dev == NULL) ? DISCFERRET_E_NO_MATCH : DISCFERRET_E_OK;
+}
+
+// vim: ts=4 noet sw=4
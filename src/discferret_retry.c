@@ -0,0 +1,338 @@
+/****************************************************************************
+ *
+ *                - DiscFerret Interface Library for C / C++ -
+ *
+ * Copyright (C) 2010 - 2011 P. A. Pemberton t/a. Red Fox Engineering.
+ * All Rights Reserved.
+ *
+ * Copyright 2010-2011 Philip Pemberton
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ ****************************************************************************/
+
+
+
+
+/**
+ * @file	discferret_retry.c
+ * @brief	Sector reads with targeted retries.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+#include "discferret.h"
+#include "discferret_registers.h"
+#include "discferret_flux.h"
+#include "discferret_decode.h"
+#include "discferret_retry.h"
+#include "discferret_private.h"
+
+/// Default revolutions in the first capture
+#define RETRY_FIRST_REVS	2
+/// Default revolution budget
+#define RETRY_BUDGET		20
+
+/// Sync word detector clock for each data rate
+static const struct {
+	unsigned long	bitrate;
+	unsigned int	clksel;
+} mfm_rates[] = {
+	{ 1000000, DISCFERRET_MFM_CLKSEL_1MBPS },
+	{ 500000,  DISCFERRET_MFM_CLKSEL_500KBPS },
+	{ 250000,  DISCFERRET_MFM_CLKSEL_250KBPS },
+	{ 125000,  DISCFERRET_MFM_CLKSEL_125KBPS }
+};
+
+/**
+ * @brief	Look up the sync word detector clock for a data rate
+ * @returns	MFM_CLKSEL value, or -1 if the detector can't run at this rate.
+ */
+static int mfm_clksel(const unsigned long bitrate)
+{
+	for (size_t i = 0; i < sizeof(mfm_rates) / sizeof(mfm_rates[0]); i++) {
+		if (mfm_rates[i].bitrate == bitrate) return mfm_rates[i].clksel;
+	}
+	return -1;
+}
+
+/**
+ * @brief	Capture from the index pulse to a given number of sync words
+ * @param	stop_num	ACQ_STOP_NUM value: sync words to let pass before stopping.
+ * @param	fraction	Expected fraction of a revolution the capture will take.
+ */
+static DISCFERRET_ERROR targeted_capture(DISCFERRET_DEVICE_HANDLE *dh, const DISCFERRET_RETRY_CONFIG *config,
+		const unsigned int stop_num, const double fraction, DISCFERRET_FLUX *flux)
+{
+	DISCFERRET_INDEX_STATS is;
+	double start, expect, next;
+	int r;
+
+	// Keep the sync word detector and the acquisition registers together
+	discferret_lock(dh);
+	if (((r = discferret_reg_poke(dh, DISCFERRET_R_MFM_CLKSEL, mfm_clksel(config->bitrate))) != DISCFERRET_E_OK) ||
+			((r = discferret_reg_poke(dh, DISCFERRET_R_MFM_SYNCWORD_STOP_L, config->sync_word & 0xFF)) != DISCFERRET_E_OK) ||
+			((r = discferret_reg_poke(dh, DISCFERRET_R_MFM_SYNCWORD_STOP_H, config->sync_word >> 8)) != DISCFERRET_E_OK) ||
+			((r = discferret_reg_poke(dh, DISCFERRET_R_MFM_MASK_STOP_L, 0xFF)) != DISCFERRET_E_OK) ||
+			((r = discferret_reg_poke(dh, DISCFERRET_R_MFM_MASK_STOP_H, 0xFF)) != DISCFERRET_E_OK) ||
+			((r = discferret_acq_start(dh, config->clksel, DISCFERRET_ACQ_EVENT_INDEX, 0,
+					DISCFERRET_ACQ_EVENT_SYNC_WORD, stop_num, &start)) != DISCFERRET_E_OK)) {
+		discferret_unlock(dh);
+		return r;
+	}
+	discferret_unlock(dh);
+
+	expect = start;
+	if ((discferret_index_monitor_predict(dh, &next) == DISCFERRET_E_OK) &&
+			(discferret_index_monitor_get(dh, &is) == DISCFERRET_E_OK))
+		expect = next + (is.mean * fraction);
+
+	if ((r = discferret_acq_wait(dh, expect, start + ((config->timeout > 0.0) ? config->timeout : 1.5), NULL, NULL)) != DISCFERRET_E_OK)
+		return r;
+	return discferret_acq_readback(dh, config->clksel, flux, NULL);
+}
+
+/**
+ * @brief	Move the heads away and back, alternating the side they come back from
+ * @returns	true if the heads were moved.
+ */
+static bool reseek(DISCFERRET_DEVICE_HANDLE *dh, const DISCFERRET_RETRY_CONFIG *config, const unsigned int n)
+{
+	const long steps = (config->reseek_steps > 0) ? config->reseek_steps : 1;
+	const long track = dh->current_track;
+	long away = ((n & 1) == 0) ? steps : -steps;
+
+	if (track < 0) return false;
+	if (track + away < 0) away = steps;
+
+	if (discferret_seek_relative(dh, away) != DISCFERRET_E_OK) return false;
+	return discferret_seek_absolute(dh, track) == DISCFERRET_E_OK;
+}
+
+/**
+ * @brief	Find how far round the track a point in a capture is
+ * @param	t		Time from the start of the capture, in clock ticks.
+ * @returns	Time since the index pulse before <i>t</i>, in clock ticks.
+ *
+ * Points before the first index pulse or past the end of a revolution are
+ * wrapped round using the mean revolution time, if the capture has one.
+ */
+static double rotation_offset(const DISCFERRET_FLUX *flux, const double t)
+{
+	double tick = 0.0, first = 0.0, prev = 0.0, off;
+	size_t i = 0;
+
+	if (flux->index_count == 0) return t;
+	for (size_t k = 0; k < flux->index_count; k++) {
+		for (; (i < flux->index[k]) && (i < flux->count); i++) tick += flux->intervals[i];
+		if (k == 0) first = prev = tick;
+		else if (tick <= t) prev = tick;
+	}
+
+	off = (t >= first) ? t - prev : t - first;
+	if (flux->index_count > 1) {
+		const double period = (tick - first) / (flux->index_count - 1);
+		if (period > 0.0) {
+			off = fmod(off, period);
+			if (off < 0.0) off += period;
+		}
+	}
+	return off;
+}
+
+/**
+ * @brief	Fold a decoded capture into the per-sector status
+ * @param	full	True if the capture covered whole revolutions from the index pulse.
+ * @param	placed	Set to true if the capture placed every sector around the track.
+ * @returns	Number of sectors newly read with a good checksum, or DISCFERRET_E_OUT_OF_MEMORY.
+ */
+static int merge(const DISCFERRET_RETRY_CONFIG *config, DISCFERRET_RETRY_RESULT *result, const bool full, bool *placed)
+{
+	const DISCFERRET_TRACK *track = &result->track;
+	unsigned int seen = 0;
+	int gained = 0;
+
+	for (size_t i = 0; i < track->count; i++) {
+		const DISCFERRET_SECTOR *s = &track->sectors[i];
+		DISCFERRET_RETRY_SECTOR *slot;
+
+		if ((s->sector < config->first_sector) || (s->sector >= config->first_sector + config->sectors)) continue;
+		slot = &result->sectors[s->sector - config->first_sector];
+		seen++;
+
+		slot->found = true;
+		slot->cyl = s->cyl;
+		slot->head = s->head;
+		slot->size_code = s->size_code;
+
+		// Keep the good copy, or failing that the first bad one
+		if ((s->data == NULL) || slot->data_ok || ((slot->data != NULL) && !s->data_ok)) continue;
+		if (slot->size < s->size) {
+			unsigned char *p = realloc(slot->data, s->size);
+			if (p == NULL) return DISCFERRET_E_OUT_OF_MEMORY;
+			slot->data = p;
+		}
+		memcpy(slot->data, s->data, s->size);
+		slot->size = s->size;
+		if (s->data_ok) {
+			slot->data_ok = true;
+			result->missing--;
+			gained++;
+		}
+	}
+
+	// A capture which saw every ID from the index pulse on places them all
+	// around the track. An ID may first have been read on a later revolution
+	// than its neighbours, so order them by their offset from the index pulse
+	// before them rather than by where they fell in the capture.
+	if (full && (seen >= config->sectors) && (track->cells > 0)) {
+		const DISCFERRET_FLUX *flux = &result->flux;
+		double offset[256], total = 0.0;
+		unsigned int distinct = 0;
+
+		for (size_t i = 0; i < flux->count; i++) total += flux->intervals[i];
+		for (unsigned int i = 0; i < config->sectors; i++) offset[i] = -1.0;
+		for (size_t i = 0; i < track->count; i++) {
+			const DISCFERRET_SECTOR *s = &track->sectors[i];
+			double *o;
+
+			if ((s->sector < config->first_sector) || (s->sector >= config->first_sector + config->sectors)) continue;
+			o = &offset[s->sector - config->first_sector];
+			if (*o >= 0.0) continue;
+			distinct++;
+			*o = rotation_offset(flux, (double)s->position * total / track->cells);
+		}
+		if (distinct < config->sectors) return gained;
+		for (unsigned int i = 0; i < config->sectors; i++) {
+			unsigned int order = 0;
+			for (unsigned int j = 0; j < config->sectors; j++) {
+				if ((offset[j] < offset[i]) || ((offset[j] == offset[i]) && (j < i))) order++;
+			}
+			result->sectors[i].order = order;
+		}
+		*placed = true;
+	}
+	return gained;
+}
+
+DISCFERRET_ERROR discferret_retry_track(DISCFERRET_DEVICE_HANDLE *dh, const DISCFERRET_RETRY_CONFIG *config, DISCFERRET_RETRY_RESULT *result)
+{
+	const unsigned int budget = (config != NULL) && (config->budget > 0) ? config->budget : RETRY_BUDGET;
+	unsigned int stalled = 0;
+	bool placed = false, moved = false;
+	double t0 = discferret_host_time();
+	int r = DISCFERRET_E_OK;
+
+	if ((dh == NULL) || (config == NULL) || (result == NULL) || (config->decoder == NULL)) return DISCFERRET_E_BAD_PARAMETER;
+	if ((config->sectors < 1) || (config->first_sector + config->sectors > 256)) return DISCFERRET_E_BAD_PARAMETER;
+	if (discferret_acq_clock_hz(config->clksel) == 0) return DISCFERRET_E_BAD_PARAMETER;
+
+	// One slot per expected sector
+	if (result->capacity < config->sectors) {
+		DISCFERRET_RETRY_SECTOR *p = realloc(result->sectors, config->sectors * sizeof(DISCFERRET_RETRY_SECTOR));
+		if (p == NULL) return DISCFERRET_E_OUT_OF_MEMORY;
+		memset(p + result->capacity, 0, (config->sectors - result->capacity) * sizeof(DISCFERRET_RETRY_SECTOR));
+		result->sectors = p;
+		result->capacity = config->sectors;
+	}
+	for (size_t i = 0; i < result->capacity; i++) free(result->sectors[i].data);
+	memset(result->sectors, 0, result->capacity * sizeof(DISCFERRET_RETRY_SECTOR));
+	for (unsigned int i = 0; i < config->sectors; i++) result->sectors[i].sector = config->first_sector + i;
+	result->count = config->sectors;
+	result->missing = config->sectors;
+	result->captures = result->targeted = result->revolutions = result->reseeks = 0;
+
+	while ((result->missing > 0) && (result->revolutions < budget)) {
+		DISCFERRET_CAPTURE_CONFIG cc;
+		unsigned int revs = 1, last = 0;
+		bool targeted = false;
+		double t;
+		int gained;
+
+		if ((config->reseek_after > 0) && (stalled >= config->reseek_after)) {
+			if (reseek(dh, config, result->reseeks)) {
+				result->reseeks++;
+				moved = true;
+			}
+			stalled = 0;
+		}
+
+		// Aim at the missing sectors if they have all been placed, and the
+		// capture can stop (with a sector to spare) before the end of the track
+		if (placed && (config->syncs_per_sector > 0) && (mfm_clksel(config->bitrate) >= 0)) {
+			for (unsigned int i = 0; i < config->sectors; i++) {
+				if (!result->sectors[i].data_ok && (result->sectors[i].order > last)) last = result->sectors[i].order;
+			}
+			targeted = (last + 2 < config->sectors) && ((last + 2) * config->syncs_per_sector <= 256);
+		}
+
+		t = discferret_host_time();
+		if (targeted) {
+			r = targeted_capture(dh, config, ((last + 2) * config->syncs_per_sector) - 1,
+					(double)(last + 2) / config->sectors, &result->flux);
+		} else {
+			if (result->captures == 0)
+				revs = (config->first_revs > 0) ? config->first_revs : RETRY_FIRST_REVS;
+			else if (config->retry_revs > 0)
+				revs = config->retry_revs;
+			if (revs > budget - result->revolutions) revs = budget - result->revolutions;
+
+			memset(&cc, 0, sizeof(cc));
+			cc.clksel = config->clksel;
+			cc.index_start = true;
+			cc.revolutions = revs;
+			cc.timeout = config->timeout;
+			r = discferret_flux_capture(dh, &cc, &result->flux);
+		}
+		if (r == DISCFERRET_E_OK) r = config->decoder(&result->flux, config->bitrate, &result->track);
+		if (r != DISCFERRET_E_OK) break;
+		t = discferret_host_time() - t;
+
+		// Charge the capture to every sector that was outstanding
+		for (unsigned int i = 0; i < config->sectors; i++) {
+			DISCFERRET_RETRY_SECTOR *slot = &result->sectors[i];
+			if (slot->data_ok) continue;
+			slot->captures++;
+			slot->revolutions += revs;
+			slot->time += t;
+			if (moved) slot->reseeks++;
+		}
+		result->captures++;
+		result->revolutions += revs;
+		if (targeted) result->targeted++;
+		moved = false;
+
+		if ((gained = merge(config, result, !targeted, &placed)) < 0) {
+			r = gained;
+			break;
+		}
+		stalled = (gained > 0) ? 0 : stalled + 1;
+	}
+
+	result->time = discferret_host_time() - t0;
+	return (r < 0) ? r : DISCFERRET_E_OK;
+}
+
+void discferret_retry_free(DISCFERRET_RETRY_RESULT *result)
+{
+	if (result == NULL) return;
+	for (size_t i = 0; i < result->capacity; i++) free(result->sectors[i].data);
+	free(result->sectors);
+	discferret_flux_free(&result->flux);
+	discferret_track_free(&result->track);
+	memset(result, 0, sizeof(DISCFERRET_RETRY_RESULT));
+}
+
+// vim: ts=4 noet sw=4
@@ -0,0 +1,455 @@
+/****************************************************************************
+ *
+ *                - DiscFerret Interface Library for C / C++ -
+ *
+ * Copyright (C) 2010 - 2011 P. A. Pemberton t/a. Red Fox Engineering.
+ * All Rights Reserved.
+ *
+ * Copyright 2010-2011 Philip Pemberton
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ ****************************************************************************/
+
+
+
+/**
+ * @file	discferret_shm.c
+ * @brief	Shared-memory capture ring for handing RAM dumps to other processes.
+ */
+
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <stdlib.h>
+#include "discferret.h"
+#include "discferret_shm.h"
+
+#ifdef __linux__
+
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+/// Magic number at the start of the shared memory ("DFSR")
+#define SHM_MAGIC	0x52534644
+/// Layout version
+#define SHM_VERSION	1
+
+/**
+ * @brief	Per-slot descriptor in the shared header
+ *
+ * <i>seq</i> is zero while the producer is filling the slot, and the
+ * capture's sequence number once it has been published.
+ */
+struct shm_slot {
+	uint32_t	seq;			///< Sequence number of the capture in this slot, or 0
+	uint32_t	reserved;
+	uint64_t	len;			///< Length of the capture
+	double		host_time;		///< Time at which the capture was published
+};
+
+/**
+ * @brief	Header at the start of the shared memory
+ */
+struct shm_header {
+	uint32_t		magic;			///< SHM_MAGIC
+	uint32_t		version;		///< SHM_VERSION
+	uint32_t		nslots;			///< Number of slots
+	uint32_t		head;			///< Sequence number of the newest capture (futex word)
+	uint64_t		slot_size;		///< Size of each slot in bytes
+	uint64_t		data_offset;	///< Offset of the first slot from the start of the shared memory
+	struct shm_slot	slots[];		///< Slot descriptors
+};
+
+struct discferret_shm_ring {
+	int					fd;			///< memfd
+	size_t				size;		///< Size of the mapping
+	struct shm_header	*hdr;		///< Shared header
+	unsigned char		*data;		///< First slot
+	bool				writable;	///< True if this process created the ring
+	uint32_t			pending;	///< Sequence number of the slot opened by begin(), or 0
+};
+
+static size_t round_to_page(size_t n)
+{
+	size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	return (n + page - 1) / page * page;
+}
+
+static DISCFERRET_ERROR map_ring(const int fd, const size_t size, const bool writable, DISCFERRET_SHM_RING **ring)
+{
+	DISCFERRET_SHM_RING *r = malloc(sizeof(DISCFERRET_SHM_RING));
+	void *p;
+
+	if (r == NULL) return DISCFERRET_E_OUT_OF_MEMORY;
+
+	p = mmap(NULL, size, writable ? (PROT_READ | PROT_WRITE) : PROT_READ, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED) {
+		free(r);
+		return DISCFERRET_E_OUT_OF_MEMORY;
+	}
+
+	r->fd = fd;
+	r->size = size;
+	r->hdr = p;
+	r->writable = writable;
+	r->pending = 0;
+	*ring = r;
+	return DISCFERRET_E_OK;
+}
+
+DISCFERRET_ERROR discferret_shm_ring_create(const size_t slot_size, const unsigned int nslots, DISCFERRET_SHM_RING **ring)
+{
+	size_t hdrsize, slotsize, size;
+	DISCFERRET_ERROR e;
+	int fd;
+
+	if ((slot_size == 0) || (nslots < 2) || (ring == NULL)) return DISCFERRET_E_BAD_PARAMETER;
+
+	hdrsize = round_to_page(sizeof(struct shm_header) + nslots * sizeof(struct shm_slot));
+	slotsize = round_to_page(slot_size);
+	if (slotsize > (SIZE_MAX - hdrsize) / nslots) return DISCFERRET_E_BAD_PARAMETER;
+	size = hdrsize + slotsize * nslots;
+
+	fd = memfd_create("discferret-capture", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd < 0) return DISCFERRET_E_OUT_OF_MEMORY;
+	if (ftruncate(fd, (off_t)size) != 0) {
+		close(fd);
+		return DISCFERRET_E_OUT_OF_MEMORY;
+	}
+	// Stop anyone resizing the memory under the consumers' mappings
+	fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL);
+
+	if ((e = map_ring(fd, size, true, ring)) != DISCFERRET_E_OK) {
+		close(fd);
+		return e;
+	}
+
+	// ftruncate zero-fills, so the head and all the slot sequence numbers start at 0
+	(*ring)->hdr->magic = SHM_MAGIC;
+	(*ring)->hdr->version = SHM_VERSION;
+	(*ring)->hdr->nslots = nslots;
+	(*ring)->hdr->slot_size = slotsize;
+	(*ring)->hdr->data_offset = hdrsize;
+	(*ring)->data = (unsigned char *)(*ring)->hdr + hdrsize;
+
+	return DISCFERRET_E_OK;
+}
+
+DISCFERRET_ERROR discferret_shm_ring_attach(const int fd, DISCFERRET_SHM_RING **ring)
+{
+	struct shm_header *hdr;
+	DISCFERRET_ERROR e;
+	struct stat st;
+	int myfd;
+
+	if ((fd < 0) || (ring == NULL)) return DISCFERRET_E_BAD_PARAMETER;
+	if ((fstat(fd, &st) != 0) || ((size_t)st.st_size < sizeof(struct shm_header))) return DISCFERRET_E_BAD_PARAMETER;
+	if ((myfd = fcntl(fd, F_DUPFD_CLOEXEC, 0)) < 0) return DISCFERRET_E_OUT_OF_MEMORY;
+
+	if ((e = map_ring(myfd, (size_t)st.st_size, false, ring)) != DISCFERRET_E_OK) {
+		close(myfd);
+		return e;
+	}
+
+	// Make sure this really is a capture ring, and that it fits in the mapping
+	hdr = (*ring)->hdr;
+	if ((hdr->magic != SHM_MAGIC) || (hdr->version != SHM_VERSION) || (hdr->nslots < 2) ||
+			(hdr->data_offset < sizeof(struct shm_header) + hdr->nslots * sizeof(struct shm_slot)) ||
+			(hdr->data_offset + hdr->slot_size * hdr->nslots > (uint64_t)st.st_size)) {
+		discferret_shm_ring_close(*ring);
+		*ring = NULL;
+		return DISCFERRET_E_BAD_PARAMETER;
+	}
+	(*ring)->data = (unsigned char *)hdr + hdr->data_offset;
+
+	return DISCFERRET_E_OK;
+}
+
+int discferret_shm_ring_fd(DISCFERRET_SHM_RING *ring)
+{
+	if (ring == NULL) return DISCFERRET_E_BAD_PARAMETER;
+	return ring->fd;
+}
+
+DISCFERRET_ERROR discferret_shm_ring_send(const int sock, DISCFERRET_SHM_RING *ring)
+{
+	union {
+		struct cmsghdr	hdr;
+		char			buf[CMSG_SPACE(sizeof(int))];
+	} ctl;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	char c = 'R';
+
+	if (ring == NULL) return DISCFERRET_E_BAD_PARAMETER;
+
+	memset(&msg, 0, sizeof(msg));
+	memset(&ctl, 0, sizeof(ctl));
+	iov.iov_base = &c;
+	iov.iov_len = 1;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctl.buf;
+	msg.msg_controllen = sizeof(ctl.buf);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &ring->fd, sizeof(int));
+
+	if (sendmsg(sock, &msg, MSG_NOSIGNAL) != 1) return DISCFERRET_E_CONNECTION_ERROR;
+	return DISCFERRET_E_OK;
+}
+
+DISCFERRET_ERROR discferret_shm_ring_receive(const int sock, DISCFERRET_SHM_RING **ring)
+{
+	union {
+		struct cmsghdr	hdr;
+		char			buf[CMSG_SPACE(sizeof(int))];
+	} ctl;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	DISCFERRET_ERROR e;
+	char c;
+	int fd;
+
+	if (ring == NULL) return DISCFERRET_E_BAD_PARAMETER;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &c;
+	iov.iov_len = 1;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctl.buf;
+	msg.msg_controllen = sizeof(ctl.buf);
+
+	if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != 1) return DISCFERRET_E_CONNECTION_ERROR;
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if ((cmsg == NULL) || (cmsg->cmsg_level != SOL_SOCKET) || (cmsg->cmsg_type != SCM_RIGHTS) ||
+			(cmsg->cmsg_len != CMSG_LEN(sizeof(int))))
+		return DISCFERRET_E_CONNECTION_ERROR;
+	memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+
+	e = discferret_shm_ring_attach(fd, ring);
+	close(fd);
+	return e;
+}
+
+DISCFERRET_ERROR discferret_shm_ring_close(DISCFERRET_SHM_RING *ring)
+{
+	if (ring == NULL) return DISCFERRET_E_BAD_PARAMETER;
+
+	munmap(ring->hdr, ring->size);
+	close(ring->fd);
+	free(ring);
+	return DISCFERRET_E_OK;
+}
+
+void *discferret_shm_ring_begin(DISCFERRET_SHM_RING *ring)
+{
+	struct shm_slot *slot;
+	uint32_t seq;
+
+	if ((ring == NULL) || !ring->writable) return NULL;
+
+	seq = ring->hdr->head + 1;
+	if (seq == 0) seq = 1;		// skip 0 on wraparound, it means "empty"
+	slot = &ring->hdr->slots[(seq - 1) % ring->hdr->nslots];
+
+	// Withdraw the slot before touching the data, so consumers still holding
+	// the old capture see it change when they call discferret_shm_ring_check()
+	__atomic_store_n(&slot->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	ring->pending = seq;
+	return ring->data + (size_t)((seq - 1) % ring->hdr->nslots) * ring->hdr->slot_size;
+}
+
+DISCFERRET_ERROR discferret_shm_ring_commit(DISCFERRET_SHM_RING *ring, const size_t len, uint32_t *seq)
+{
+	struct shm_slot *slot;
+
+	if ((ring == NULL) || !ring->writable || (ring->pending == 0)) return DISCFERRET_E_BAD_PARAMETER;
+	if (len > ring->hdr->slot_size) return DISCFERRET_E_BAD_PARAMETER;
+
+	slot = &ring->hdr->slots[(ring->pending - 1) % ring->hdr->nslots];
+	slot->len = len;
+	slot->host_time = discferret_host_time();
+	__atomic_store_n(&slot->seq, ring->pending, __ATOMIC_RELEASE);
+	__atomic_store_n(&ring->hdr->head, ring->pending, __ATOMIC_RELEASE);
+
+	// Wake every consumer waiting on the head
+	syscall(SYS_futex, &ring->hdr->head, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+
+	if (seq != NULL) *seq = ring->pending;
+	ring->pending = 0;
+	return DISCFERRET_E_OK;
+}
+
+DISCFERRET_ERROR discferret_shm_ring_capture(DISCFERRET_SHM_RING *ring, DISCFERRET_DEVICE_HANDLE *dh, const size_t len, uint32_t *seq)
+{
+	DISCFERRET_ERROR e;
+	void *p;
+
+	if ((ring == NULL) || (dh == NULL) || (len == 0)) return DISCFERRET_E_BAD_PARAMETER;
+	if (len > ring->hdr->slot_size) return DISCFERRET_E_BAD_PARAMETER;
+	if ((p = discferret_shm_ring_begin(ring)) == NULL) return DISCFERRET_E_BAD_PARAMETER;
+
+	// Read straight into the shared slot; on failure the slot stays withdrawn
+	if ((e = discferret_ram_read(dh, p, len)) != DISCFERRET_E_OK) {
+		ring->pending = 0;
+		return e;
+	}
+
+	return discferret_shm_ring_commit(ring, len, seq);
+}
+
+DISCFERRET_ERROR discferret_shm_ring_wait(DISCFERRET_SHM_RING *ring, const uint32_t after, const int timeout_ms, uint32_t *seq)
+{
+	double deadline = 0.0;
+	uint32_t head;
+
+	if ((ring == NULL) || (seq == NULL)) return DISCFERRET_E_BAD_PARAMETER;
+	if (timeout_ms >= 0) deadline = discferret_host_time() + (timeout_ms / 1000.0);
+
+	while ((head = __atomic_load_n(&ring->hdr->head, __ATOMIC_ACQUIRE)) == after) {
+		struct timespec ts, *tsp = NULL;
+
+		if (timeout_ms >= 0) {
+			double left = deadline - discferret_host_time();
+			if (left <= 0.0) return DISCFERRET_E_TIMEOUT;
+			ts.tv_sec = (time_t)left;
+			ts.tv_nsec = (long)((left - ts.tv_sec) * 1e9);
+			tsp = &ts;
+		}
+
+		// Sleeps only if the head still equals 'after'; EAGAIN/EINTR just go round again
+		if ((syscall(SYS_futex, &ring->hdr->head, FUTEX_WAIT, after, tsp, NULL, 0) != 0) &&
+				(errno != EAGAIN) && (errno != EINTR) && (errno != ETIMEDOUT))
+			return DISCFERRET_E_NOT_SUPPORTED;
+	}
+
+	*seq = head;
+	return DISCFERRET_E_OK;
+}
+
+DISCFERRET_ERROR discferret_shm_ring_get(DISCFERRET_SHM_RING *ring, const uint32_t seq, const void **data, DISCFERRET_SHM_CAPTURE *info)
+{
+	struct shm_slot *slot;
+	size_t len;
+	double t;
+
+	if ((ring == NULL) || (data == NULL) || (seq == 0)) return DISCFERRET_E_BAD_PARAMETER;
+
+	slot = &ring->hdr->slots[(seq - 1) % ring->hdr->nslots];
+	if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != seq) return DISCFERRET_E_NO_MATCH;
+	len = slot->len;
+	t = slot->host_time;
+	// Make sure the descriptor wasn't rewritten while we were reading it
+	if (discferret_shm_ring_check(ring, seq) != DISCFERRET_E_OK) return DISCFERRET_E_NO_MATCH;
+	if (len > ring->hdr->slot_size) return DISCFERRET_E_NO_MATCH;
+
+	*data = ring->data + (size_t)((seq - 1) % ring->hdr->nslots) * ring->hdr->slot_size;
+	if (info != NULL) {
+		info->seq = seq;
+		info->len = len;
+		info->host_time = t;
+	}
+	return DISCFERRET_E_OK;
+}
+
+DISCFERRET_ERROR discferret_shm_ring_check(DISCFERRET_SHM_RING *ring, const uint32_t seq)
+{
+	if ((ring == NULL) || (seq == 0)) return DISCFERRET_E_BAD_PARAMETER;
+
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&ring->hdr->slots[(seq - 1) % ring->hdr->nslots].seq, __ATOMIC_RELAXED) != seq)
+		return DISCFERRET_E_NO_MATCH;
+	return DISCFERRET_E_OK;
+}
+
+#else // __linux__
+
+DISCFERRET_ERROR discferret_shm_ring_create(const size_t slot_size, const unsigned int nslots, DISCFERRET_SHM_RING **ring)
+{
+	return DISCFERRET_E_NOT_SUPPORTED;
+}
+
+DISCFERRET_ERROR discferret_shm_ring_attach(const int fd, DISCFERRET_SHM_RING **ring)
+{
+	return DISCFERRET_E_NOT_SUPPORTED;
+}
+
+int discferret_shm_ring_fd(DISCFERRET_SHM_RING *ring)
+{
+	return DISCFERRET_E_NOT_SUPPORTED;
+}
+
+DISCFERRET_ERROR discferret_shm_ring_send(const int sock, DISCFERRET_SHM_RING *ring)
+{
+	return DISCFERRET_E_NOT_SUPPORTED;
+}
+
+DISCFERRET_ERROR discferret_shm_ring_receive(const int sock, DISCFERRET_SHM_RING **ring)
+{
+	return DISCFERRET_E_NOT_SUPPORTED;
+}
+
+DISCFERRET_ERROR discferret_shm_ring_close(DISCFERRET_SHM_RING *ring)
+{
+	return DISCFERRET_E_NOT_SUPPORTED;
+}
+
+DISCFERRET_ERROR discferret_shm_ring_capture(DISCFERRET_SHM_RING *ring, DISCFERRET_DEVICE_HANDLE *dh, const size_t len, uint32_t *seq)
+{
+	return DISCFERRET_E_NOT_SUPPORTED;
+}
+
+void *discferret_shm_ring_begin(DISCFERRET_SHM_RING *ring)
+{
+	return NULL;
+}
+
+DISCFERRET_ERROR discferret_shm_ring_commit(DISCFERRET_SHM_RING *ring, const size_t len, uint32_t *seq)
+{
+	return DISCFERRET_E_NOT_SUPPORTED;
+}
+
+DISCFERRET_ERROR discferret_shm_ring_wait(DISCFERRET_SHM_RING *ring, const uint32_t after, const int timeout_ms, uint32_t *seq)
+{
+	return DISCFERRET_E_NOT_SUPPORTED;
+}
+
+DISCFERRET_ERROR discferret_shm_ring_get(DISCFERRET_SHM_RING *ring, const uint32_t seq, const void **data, DISCFERRET_SHM_CAPTURE *info)
+{
+	return DISCFERRET_E_NOT_SUPPORTED;
+}
+
+DISCFERRET_ERROR discferret_shm_ring_check(DISCFERRET_SHM_RING *ring, const uint32_t seq)
+{
+	return DISCFERRET_E_NOT_SUPPORTED;
+}
+
+#endif // __linux__
+
+// vim: ts=4 noet sw=4
@@ -0,0 +1,522 @@
+/****************************************************************************
+ *
+ *                - DiscFerret Interface Library for C / C++ -
+ *
+ * Copyright (C) 2010 - 2011 P. A. Pemberton t/a. Red Fox Engineering.
+ * All Rights Reserved.
+ *
+ * Copyright 2010-2011 Philip Pemberton
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ ****************************************************************************/
+
+
+
+
+
+/**
+ * @file	discferret_watch.c
+ * @brief	Background status watcher.
+ *
+ * One thread per device handle polls the status registers and fires any
+ * registered watches whose conditions have become true. The polling interval
+ * drops to the minimum while the device is busy (acquiring, writing or
+ * stepping) or its status has just changed, and doubles on each quiet poll up
+ * to the maximum.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <pthread.h>
+#ifndef _WIN32
+#include <unistd.h>
+#include <fcntl.h>
+#endif
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+#include "discferret.h"
+#include "discferret_watch.h"
+#include "discferret_private.h"
+
+/// Default fastest polling interval, in microseconds
+#define WATCH_DEFAULT_MIN_INTERVAL	1000
+/// Default slowest polling interval, in microseconds
+#define WATCH_DEFAULT_MAX_INTERVAL	50000
+/// How long to keep polling at the fastest rate after a status change or a poke, in seconds
+#define WATCH_FAST_HOLD				0.1
+/// Status bits which mean the device is busy, and will change again soon
+#define WATCH_BUSY_BITS				(DISCFERRET_STATUS_ACQSTATUS_MASK | DISCFERRET_STATUS_STEPPING)
+
+/**
+ * @brief	A registered status watch
+ */
+struct discferret_watch {
+	struct discferret_watch		*next;		///< Next watch in the watcher's list
+	unsigned long				mask;		///< Status bits being watched
+	DISCFERRET_WATCH_MODE		mode;		///< When the watch fires
+	DISCFERRET_WATCH_CALLBACK	callback;	///< Callback, or NULL
+	void						*user;		///< Callback user pointer
+	int							rfd;		///< Notification descriptor handed to the application, or -1
+	int							wfd;		///< Notification descriptor the watcher writes to (same as rfd for an eventfd)
+	bool						primed;		///< The watch has seen at least one good status poll
+	bool						active;		///< The watch's condition was true at the last poll
+	unsigned long				bits;		///< Masked status bits at the last poll
+	unsigned long				count;		///< Firings not yet collected by discferret_watch_read()
+	long						status;		///< Status word (or error) from the most recent firing
+	struct discferret_watch		*fire_next;	///< Next watch whose callback is due from this poll
+	long						fire_status;	///< Status word to pass to the callback
+};
+
+/**
+ * @brief	Status watcher state
+ */
+struct discferret_watcher {
+	DISCFERRET_DEVICE_HANDLE	*dh;		///< Device handle being watched
+	pthread_t				thread;			///< Watcher thread
+	pthread_mutex_t			lock;			///< Protects everything below
+	pthread_cond_t			cond;			///< Signalled when watches are added, on a poke, and on stop
+	bool					quit;			///< Nonzero to ask the watcher thread to exit
+	unsigned long			min_interval;	///< Fastest polling interval, in microseconds
+	unsigned long			max_interval;	///< Slowest polling interval, in microseconds
+	double					fast_until;		///< Host time until which to poll at the fastest rate
+	bool					failed;			///< The last poll failed
+	bool					calling;		///< Callbacks are being made, without the lock
+	struct discferret_watch	*watches;		///< Registered watches
+	struct discferret_watch	*fired;			///< Watches whose callbacks are due from this poll
+	DISCFERRET_WATCH_STATS	stats;			///< Statistics
+};
+
+/**
+ * @brief	Create a watch's notification descriptor
+ */
+static DISCFERRET_ERROR notify_open(struct discferret_watch *w)
+{
+#if defined(__linux__)
+	w->rfd = w->wfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (w->rfd < 0) return DISCFERRET_E_OUT_OF_MEMORY;
+	return DISCFERRET_E_OK;
+#elif !defined(_WIN32)
+	int p[2];
+
+	if (pipe(p) != 0) return DISCFERRET_E_OUT_OF_MEMORY;
+	for (int i = 0; i < 2; i++) {
+		fcntl(p[i], F_SETFL, fcntl(p[i], F_GETFL) | O_NONBLOCK);
+		fcntl(p[i], F_SETFD, FD_CLOEXEC);
+	}
+	w->rfd = p[0];
+	w->wfd = p[1];
+	return DISCFERRET_E_OK;
+#else
+	(void)w;
+	return DISCFERRET_E_NOT_SUPPORTED;
+#endif
+}
+
+/**
+ * @brief	Make a watch's notification descriptor readable
+ */
+static void notify_signal(struct discferret_watch *w)
+{
+#if defined(__linux__)
+	uint64_t one = 1;
+	if (write(w->wfd, &one, sizeof(one)) < 0) { /* counter saturated; it's readable anyway */ }
+#elif !defined(_WIN32)
+	unsigned char one = 1;
+	if (write(w->wfd, &one, sizeof(one)) < 0) { /* pipe full; it's readable anyway */ }
+#else
+	(void)w;
+#endif
+}
+
+/**
+ * @brief	Reset a watch's notification descriptor
+ */
+static void notify_drain(struct discferret_watch *w)
+{
+#ifndef _WIN32
+	unsigned char buf[64];
+	while (read(w->rfd, buf, sizeof(buf)) > 0)
+		;
+#else
+	(void)w;
+#endif
+}
+
+/**
+ * @brief	Close a watch's notification descriptor(s)
+ */
+static void notify_close(struct discferret_watch *w)
+{
+#ifndef _WIN32
+	if (w->wfd != w->rfd) close(w->wfd);
+	close(w->rfd);
+#endif
+	w->rfd = w->wfd = -1;
+}
+
+/**
+ * @brief	Fire a watch. Caller must hold the watcher lock.
+ *
+ * The callback isn't made here, but queued for watch_call() to make once
+ * the lock has been dropped.
+ */
+static void watch_fire(struct discferret_watcher *wr, struct discferret_watch *w, const long status)
+{
+	w->count++;
+	w->status = status;
+	wr->stats.fired++;
+
+	if (w->callback != NULL) {
+		w->fire_status = status;
+		w->fire_next = wr->fired;
+		wr->fired = w;
+	}
+	if (w->rfd >= 0) notify_signal(w);
+}
+
+/**
+ * @brief	Make the callbacks queued by watch_fire(). Caller must hold the watcher lock.
+ *
+ * The lock is dropped while the callbacks run, so a callback waiting for
+ * something (such as the handle lock) can't deadlock against a thread which
+ * holds that and is waiting for the watcher. discferret_watch_remove() waits
+ * for the callbacks to finish before freeing a watch.
+ */
+static void watch_call(struct discferret_watcher *wr)
+{
+	struct discferret_watch *w = wr->fired;
+
+	if (w == NULL) return;
+	wr->fired = NULL;
+	wr->calling = true;
+	pthread_mutex_unlock(&wr->lock);
+
+	for (; w != NULL; w = w->fire_next)
+		w->callback(wr->dh, w->fire_status, w->user);
+
+	pthread_mutex_lock(&wr->lock);
+	wr->calling = false;
+	pthread_cond_broadcast(&wr->cond);
+}
+
+/**
+ * @brief	Check a watch against a new status word
+ * @returns	true if the watch should fire.
+ */
+static bool watch_check(struct discferret_watch *w, const long status)
+{
+	unsigned long bits = (unsigned long)status & w->mask;
+	bool active, fire;
+
+	switch (w->mode) {
+		case DISCFERRET_WATCH_SET:
+			active = (bits != 0);
+			fire = active && !(w->primed && w->active);
+			break;
+		case DISCFERRET_WATCH_CLEAR:
+			active = (bits == 0);
+			fire = active && !(w->primed && w->active);
+			break;
+		default:
+			active = w->primed && (bits != w->bits);
+			fire = active;
+			break;
+	}
+
+	w->primed = true;
+	w->active = active;
+	w->bits = bits;
+	return fire;
+}
+
+/**
+ * @brief	Sleep on the watcher's condition variable for up to <i>us</i> microseconds.
+ * 			Caller must hold the watcher lock.
+ */
+static void watcher_sleep(struct discferret_watcher *wr, const unsigned long us)
+{
+	struct timespec ts;
+
+#ifdef __linux__
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+#else
+	clock_gettime(CLOCK_REALTIME, &ts);
+#endif
+	ts.tv_sec += us / 1000000;
+	ts.tv_nsec += (long)(us % 1000000) * 1000;
+	if (ts.tv_nsec >= 1000000000L) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000L;
+	}
+	pthread_cond_timedwait(&wr->cond, &wr->lock, &ts);
+}
+
+/**
+ * @brief	Status watcher thread
+ */
+static void *watcher_thread(void *arg)
+{
+	struct discferret_watcher *wr = arg;
+	long last = -1;
+
+	pthread_mutex_lock(&wr->lock);
+	while (!wr->quit) {
+		long status;
+		double now;
+
+		// Nothing to watch -- don't poll the device at all
+		if (wr->watches == NULL) {
+			pthread_cond_wait(&wr->cond, &wr->lock);
+			continue;
+		}
+
+		// Don't hold the watcher lock across the USB transactions
+		pthread_mutex_unlock(&wr->lock);
+		status = discferret_get_status(wr->dh);
+		now = discferret_host_time();
+		pthread_mutex_lock(&wr->lock);
+		if (wr->quit) break;
+
+		wr->stats.polls++;
+		if (status < 0) {
+			// Wake everyone once, so nobody waits forever on a dead device
+			wr->stats.errors++;
+			if (!wr->failed) {
+				for (struct discferret_watch *w = wr->watches; w != NULL; w = w->next) {
+					w->primed = false;
+					watch_fire(wr, w, status);
+				}
+			}
+			wr->failed = true;
+			wr->stats.interval_us = wr->max_interval;
+		} else {
+			if (wr->failed || (status != last)) {
+				wr->stats.changes++;
+				wr->fast_until = now + WATCH_FAST_HOLD;
+			}
+			wr->failed = false;
+			last = status;
+
+			for (struct discferret_watch *w = wr->watches; w != NULL; w = w->next) {
+				if (watch_check(w, status)) watch_fire(wr, w, status);
+			}
+
+			// Poll fast while something is happening, and back off while it isn't
+			if (((status & WATCH_BUSY_BITS) != 0) || (now < wr->fast_until)) {
+				wr->stats.interval_us = wr->min_interval;
+			} else {
+				wr->stats.interval_us *= 2;
+				if (wr->stats.interval_us > wr->max_interval) wr->stats.interval_us = wr->max_interval;
+			}
+		}
+		wr->stats.status = status;
+
+		watch_call(wr);
+		if (wr->quit) break;
+		watcher_sleep(wr, wr->stats.interval_us);
+	}
+	pthread_mutex_unlock(&wr->lock);
+
+	return NULL;
+}
+
+DISCFERRET_ERROR discferret_watch_start(DISCFERRET_DEVICE_HANDLE *dh, const DISCFERRET_WATCH_CONFIG *config)
+{
+	struct discferret_watcher *wr;
+	pthread_condattr_t attr;
+
+	// Check that the library has been initialised
+	if (discferret_usb_context() == NULL) return DISCFERRET_E_NOT_INIT;
+
+	// Make sure device handle is not NULL, and the watcher isn't already running
+	if ((dh == NULL) || (dh->priv == NULL)) return DISCFERRET_E_BAD_PARAMETER;
+	if (dh->priv->watcher != NULL) return DISCFERRET_E_BAD_PARAMETER;
+
+	if ((wr = calloc(1, sizeof(struct discferret_watcher))) == NULL) return DISCFERRET_E_OUT_OF_MEMORY;
+	wr->dh = dh;
+	wr->min_interval = ((config != NULL) && (config->min_interval_us > 0)) ? config->min_interval_us : WATCH_DEFAULT_MIN_INTERVAL;
+	wr->max_interval = ((config != NULL) && (config->max_interval_us > 0)) ? config->max_interval_us : WATCH_DEFAULT_MAX_INTERVAL;
+	if (wr->max_interval < wr->min_interval) wr->max_interval = wr->min_interval;
+	wr->stats.interval_us = wr->min_interval;
+	wr->stats.status = DISCFERRET_E_OK;
+
+	// Time the polling interval on the monotonic clock where we can
+	pthread_condattr_init(&attr);
+#ifdef __linux__
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+#endif
+	pthread_mutex_init(&wr->lock, NULL);
+	pthread_cond_init(&wr->cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	if (pthread_create(&wr->thread, NULL, watcher_thread, wr) != 0) {
+		pthread_cond_destroy(&wr->cond);
+		pthread_mutex_destroy(&wr->lock);
+		free(wr);
+		return DISCFERRET_E_OUT_OF_MEMORY;
+	}
+
+	dh->priv->watcher = wr;
+	return DISCFERRET_E_OK;
+}
+
+DISCFERRET_ERROR discferret_watch_stop(DISCFERRET_DEVICE_HANDLE *dh)
+{
+	struct discferret_watcher *wr;
+	struct discferret_watch *w;
+
+	// Make sure device handle is not NULL, and the watcher is running
+	if ((dh == NULL) || (dh->priv == NULL)) return DISCFERRET_E_BAD_PARAMETER;
+	if ((wr = dh->priv->watcher) == NULL) return DISCFERRET_E_BAD_PARAMETER;
+
+	// Ask the thread to stop, and wait for it to do so
+	pthread_mutex_lock(&wr->lock);
+	wr->quit = true;
+	pthread_cond_broadcast(&wr->cond);
+	pthread_mutex_unlock(&wr->lock);
+	pthread_join(wr->thread, NULL);
+
+	while ((w = wr->watches) != NULL) {
+		wr->watches = w->next;
+		if (w->rfd >= 0) notify_close(w);
+		free(w);
+	}
+
+	dh->priv->watcher = NULL;
+	pthread_cond_destroy(&wr->cond);
+	pthread_mutex_destroy(&wr->lock);
+	free(wr);
+
+	return DISCFERRET_E_OK;
+}
+
+DISCFERRET_ERROR discferret_watch_add(DISCFERRET_DEVICE_HANDLE *dh, const unsigned long mask, const DISCFERRET_WATCH_MODE mode,
+		DISCFERRET_WATCH_CALLBACK callback, void *user, int *fd, DISCFERRET_WATCH **watch)
+{
+	struct discferret_watcher *wr;
+	struct discferret_watch *w;
+	DISCFERRET_ERROR err;
+
+	// Make sure parameters are valid, and the watcher is running
+	if ((dh == NULL) || (dh->priv == NULL) || (watch == NULL) || (mask == 0)) return DISCFERRET_E_BAD_PARAMETER;
+	if ((mode != DISCFERRET_WATCH_SET) && (mode != DISCFERRET_WATCH_CLEAR) && (mode != DISCFERRET_WATCH_CHANGE))
+		return DISCFERRET_E_BAD_PARAMETER;
+	if ((wr = dh->priv->watcher) == NULL) return DISCFERRET_E_BAD_PARAMETER;
+
+	if ((w = calloc(1, sizeof(struct discferret_watch))) == NULL) return DISCFERRET_E_OUT_OF_MEMORY;
+	w->mask = mask;
+	w->mode = mode;
+	w->callback = callback;
+	w->user = user;
+	w->rfd = w->wfd = -1;
+	if ((fd != NULL) && ((err = notify_open(w)) != DISCFERRET_E_OK)) {
+		free(w);
+		return err;
+	}
+
+	// Add the watch, and poll straight away so it sees the current status
+	pthread_mutex_lock(&wr->lock);
+	w->next = wr->watches;
+	wr->watches = w;
+	wr->stats.watches++;
+	wr->stats.interval_us = wr->min_interval;
+	pthread_cond_broadcast(&wr->cond);
+	pthread_mutex_unlock(&wr->lock);
+
+	if (fd != NULL) *fd = w->rfd;
+	*watch = w;
+	return DISCFERRET_E_OK;
+}
+
+DISCFERRET_ERROR discferret_watch_remove(DISCFERRET_DEVICE_HANDLE *dh, DISCFERRET_WATCH *watch)
+{
+	struct discferret_watcher *wr;
+	struct discferret_watch **p;
+
+	// Make sure parameters are not NULL, and the watcher is running
+	if ((dh == NULL) || (dh->priv == NULL) || (watch == NULL)) return DISCFERRET_E_BAD_PARAMETER;
+	if ((wr = dh->priv->watcher) == NULL) return DISCFERRET_E_BAD_PARAMETER;
+
+	pthread_mutex_lock(&wr->lock);
+	for (p = &wr->watches; (*p != NULL) && (*p != watch); p = &(*p)->next)
+		;
+	if (*p == NULL) {
+		pthread_mutex_unlock(&wr->lock);
+		return DISCFERRET_E_BAD_PARAMETER;
+	}
+	*p = watch->next;
+	wr->stats.watches--;
+
+	// The watcher may be part way through making this watch's callback
+	while (wr->calling)
+		pthread_cond_wait(&wr->cond, &wr->lock);
+	pthread_mutex_unlock(&wr->lock);
+
+	if (watch->rfd >= 0) notify_close(watch);
+	free(watch);
+	return DISCFERRET_E_OK;
+}
+
+DISCFERRET_ERROR discferret_watch_read(DISCFERRET_DEVICE_HANDLE *dh, DISCFERRET_WATCH *watch, unsigned long *count, long *status)
+{
+	struct discferret_watcher *wr;
+
+	// Make sure parameters are not NULL, and the watcher is running
+	if ((dh == NULL) || (dh->priv == NULL) || (watch == NULL)) return DISCFERRET_E_BAD_PARAMETER;
+	if ((wr = dh->priv->watcher) == NULL) return DISCFERRET_E_BAD_PARAMETER;
+
+	// Drain the descriptor under the lock, so a firing can't slip in between
+	pthread_mutex_lock(&wr->lock);
+	if (watch->rfd >= 0) notify_drain(watch);
+	if (count != NULL) *count = watch->count;
+	if (status != NULL) *status = watch->status;
+	watch->count = 0;
+	pthread_mutex_unlock(&wr->lock);
+
+	return DISCFERRET_E_OK;
+}
+
+void discferret_watch_poke(DISCFERRET_DEVICE_HANDLE *dh)
+{
+	struct discferret_watcher *wr;
+
+	if ((dh == NULL) || (dh->priv == NULL) || ((wr = dh->priv->watcher) == NULL)) return;
+
+	pthread_mutex_lock(&wr->lock);
+	wr->fast_until = discferret_host_time() + WATCH_FAST_HOLD;
+	wr->stats.interval_us = wr->min_interval;
+	pthread_cond_broadcast(&wr->cond);
+	pthread_mutex_unlock(&wr->lock);
+}
+
+DISCFERRET_ERROR discferret_watch_stats(DISCFERRET_DEVICE_HANDLE *dh, DISCFERRET_WATCH_STATS *stats)
+{
+	struct discferret_watcher *wr;
+
+	// Make sure parameters are not NULL, and the watcher is running
+	if ((dh == NULL) || (dh->priv == NULL) || (stats == NULL)) return DISCFERRET_E_BAD_PARAMETER;
+	if ((wr = dh->priv->watcher) == NULL) return DISCFERRET_E_BAD_PARAMETER;
+
+	pthread_mutex_lock(&wr->lock);
+	*stats = wr->stats;
+	pthread_mutex_unlock(&wr->lock);
+
+	return DISCFERRET_E_OK;
+}
+
+// vim: ts=4 noet sw=4
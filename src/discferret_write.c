@@ -0,0 +1,554 @@
+/****************************************************************************
+ *
+ *                - DiscFerret Interface Library for C / C++ -
+ *
+ * Copyright (C) 2010 - 2011 P. A. Pemberton t/a. Red Fox Engineering.
+ * All Rights Reserved.
+ *
+ * Copyright 2010-2011 Philip Pemberton
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ ****************************************************************************/
+
+
+
+
+/**
+ * @file	discferret_write.c
+ * @brief	Flux encoding and disc writing.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+#include "discferret.h"
+#include "discferret_registers.h"
+#include "discferret_flux.h"
+#include "discferret_decode.h"
+#include "discferret_write.h"
+#include "discferret_private.h"
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define WRITE_SSE2
+#endif
+
+/// Fractional bits in encoder timestamps
+#define FRAC_BITS			16
+/// One write clock tick, as an encoder timestamp
+#define FRAC_ONE			((uint64_t)1 << FRAC_BITS)
+/// Blank (no transition) samples played after the data, in microseconds; covers the host's stop latency
+#define WRITE_GUARD_US		20000
+
+/**
+ * Times are in 1/65536ths of a write clock tick, measured from the start of
+ * the track. Transitions are held back by one so precompensation can look at
+ * the gaps on both sides.
+ */
+struct discferret_encoder {
+	DISCFERRET_ENCODER_CONFIG config;
+	unsigned long	clock_hz;		///< Write clock rate
+	uint16_t		table[256];		///< Bitcells for each data byte (MFM: assuming the previous data bit was 0)
+	uint64_t		cell;			///< Bitcell period
+	uint64_t		precomp;		///< Precompensation shift
+	uint64_t		now;			///< Start of the next bitcell
+	uint64_t		prev;			///< Nominal time of the last transition written
+	uint64_t		pending;		///< Nominal time of the held-back transition
+	bool			have_prev;		///< True if <i>prev</i> is valid
+	bool			have_pending;	///< True if there is a held-back transition
+	bool			pending_precomp;	///< True if the held-back transition is to be precompensated
+	uint64_t		written;		///< Tick at which the last sample byte ended
+	unsigned int	last_bit;		///< Previous data bit (MFM clock rule)
+	unsigned char	*samples;		///< Sample bytes
+	size_t			len;			///< Number of sample bytes
+	size_t			capacity;		///< Allocated size of <i>samples</i>
+};
+
+/**
+ * @brief	Build the byte -> bitcell table for an encoding
+ */
+static void build_table(uint16_t *table, const DISCFERRET_ENCODING encoding)
+{
+	for (unsigned int d = 0; d < 256; d++) {
+		uint16_t w = 0;
+		unsigned int prev = 0;
+
+		for (int i = 7; i >= 0; i--) {
+			unsigned int bit = (d >> i) & 1;
+			unsigned int clock = (encoding == DISCFERRET_ENCODING_FM) ? 1 : !(prev | bit);
+			w = (w << 2) | (clock << 1) | bit;
+			prev = bit;
+		}
+		table[d] = w;
+	}
+}
+
+DISCFERRET_ERROR discferret_encoder_create(const DISCFERRET_ENCODER_CONFIG *config, DISCFERRET_ENCODER **enc)
+{
+	DISCFERRET_ENCODER *e;
+	unsigned long clock_hz;
+
+	if ((config == NULL) || (enc == NULL)) return DISCFERRET_E_BAD_PARAMETER;
+	if ((config->encoding != DISCFERRET_ENCODING_MFM) && (config->encoding != DISCFERRET_ENCODING_FM)) return DISCFERRET_E_BAD_PARAMETER;
+	if ((clock_hz = discferret_acq_clock_hz(config->clksel)) == 0) return DISCFERRET_E_BAD_PARAMETER;
+	// A bitcell has to be at least a couple of ticks long to mean anything
+	if ((config->bitrate > 0) && (config->bitrate * 4 > clock_hz)) return DISCFERRET_E_BAD_PARAMETER;
+
+	if ((e = calloc(1, sizeof(DISCFERRET_ENCODER))) == NULL) return DISCFERRET_E_OUT_OF_MEMORY;
+	e->config = *config;
+	e->clock_hz = clock_hz;
+	build_table(e->table, config->encoding);
+
+	// Two bitcells (clock and data) per data bit
+	if (config->bitrate > 0)
+		e->cell = (uint64_t)llround((double)clock_hz * FRAC_ONE / (2.0 * config->bitrate));
+	e->precomp = (uint64_t)llround((double)config->precomp_ns * clock_hz * FRAC_ONE / 1e9);
+
+	*enc = e;
+	return DISCFERRET_E_OK;
+}
+
+void discferret_encoder_reset(DISCFERRET_ENCODER *enc)
+{
+	if (enc == NULL) return;
+	enc->now = enc->prev = enc->pending = enc->written = 0;
+	enc->have_prev = enc->have_pending = enc->pending_precomp = false;
+	enc->last_bit = 0;
+	enc->len = 0;
+}
+
+void discferret_encoder_free(DISCFERRET_ENCODER *enc)
+{
+	if (enc == NULL) return;
+	free(enc->samples);
+	free(enc);
+}
+
+/**
+ * @brief	Store a transition as sample bytes
+ * @param	t	Time of the transition (after precompensation).
+ */
+static DISCFERRET_ERROR emit(DISCFERRET_ENCODER *enc, const uint64_t t)
+{
+	uint64_t tick = (t + FRAC_ONE / 2) >> FRAC_BITS;
+	uint64_t n = (tick > enc->written) ? (tick - enc->written) : 1;
+	size_t need = (size_t)(n / DISCFERRET_SAMPLE_COUNT) + 1;
+
+	if (enc->len + need > enc->capacity) {
+		size_t cap = (enc->capacity > 0) ? enc->capacity * 2 : 65536;
+		unsigned char *p;
+		while (cap < enc->len + need) cap *= 2;
+		if ((p = realloc(enc->samples, cap)) == NULL) return DISCFERRET_E_OUT_OF_MEMORY;
+		enc->samples = p;
+		enc->capacity = cap;
+	}
+
+	enc->written += n;
+	// Carry bytes, then the remainder. A count of exactly 127 needs a
+	// trailing zero, or it would read as a carry.
+	while (n >= DISCFERRET_SAMPLE_COUNT) {
+		enc->samples[enc->len++] = DISCFERRET_SAMPLE_COUNT;
+		n -= DISCFERRET_SAMPLE_COUNT;
+	}
+	enc->samples[enc->len++] = (unsigned char)n;
+	return DISCFERRET_E_OK;
+}
+
+/**
+ * @brief	Add a transition, and write out the one before it
+ * @param	t		Nominal time of the transition.
+ * @param	precomp	True if the transition may be precompensated.
+ *
+ * Adjacent transitions repel each other on the disc (peak shift), so a
+ * transition with a close neighbour on one side and a distant one on the
+ * other is read back displaced towards the distant one. Precompensation
+ * writes it the same distance the other way.
+ */
+static DISCFERRET_ERROR transition(DISCFERRET_ENCODER *enc, const uint64_t t, const bool precomp)
+{
+	if (enc->have_pending) {
+		uint64_t at = enc->pending;
+		DISCFERRET_ERROR err;
+
+		if (enc->pending_precomp && enc->have_prev && (enc->precomp > 0)) {
+			uint64_t before = enc->pending - enc->prev;
+			uint64_t after = t - enc->pending;
+			if (before + enc->cell / 2 < after)
+				at -= (at > enc->precomp) ? enc->precomp : at;
+			else if (before > after + enc->cell / 2)
+				at += enc->precomp;
+		}
+		if ((err = emit(enc, at)) != DISCFERRET_E_OK) return err;
+		enc->prev = enc->pending;
+		enc->have_prev = true;
+	}
+
+	enc->pending = t;
+	enc->pending_precomp = precomp;
+	enc->have_pending = true;
+	return DISCFERRET_E_OK;
+}
+
+/**
+ * @brief	Append bitcells, most significant first
+ */
+static DISCFERRET_ERROR put_cells(DISCFERRET_ENCODER *enc, uint32_t cells, const unsigned int count)
+{
+	const uint64_t base = enc->now;
+	DISCFERRET_ERROR err;
+
+	if (count < 32) cells &= ((uint32_t)1 << count) - 1;
+
+	// Skip straight from one transition to the next
+	while (cells != 0) {
+		unsigned int bit = 31 - __builtin_clz(cells);
+		if ((err = transition(enc, base + (count - 1 - bit) * enc->cell, true)) != DISCFERRET_E_OK) return err;
+		cells &= ~((uint32_t)1 << bit);
+	}
+
+	enc->now = base + count * enc->cell;
+	return DISCFERRET_E_OK;
+}
+
+DISCFERRET_ERROR discferret_encoder_bytes(DISCFERRET_ENCODER *enc, const unsigned char *data, const size_t len)
+{
+	DISCFERRET_ERROR err;
+
+	if ((enc == NULL) || ((data == NULL) && (len > 0))) return DISCFERRET_E_BAD_PARAMETER;
+	if (enc->cell == 0) return DISCFERRET_E_BAD_PARAMETER;
+
+	for (size_t i = 0; i < len; i++) {
+		uint32_t w = enc->table[data[i]];
+		// MFM: no clock bit between two ones
+		if ((enc->config.encoding == DISCFERRET_ENCODING_MFM) && enc->last_bit) w &= 0x7FFF;
+		if ((err = put_cells(enc, w, 16)) != DISCFERRET_E_OK) return err;
+		enc->last_bit = data[i] & 1;
+	}
+	return DISCFERRET_E_OK;
+}
+
+DISCFERRET_ERROR discferret_encoder_cells(DISCFERRET_ENCODER *enc, const uint32_t cells, const unsigned int count)
+{
+	DISCFERRET_ERROR err;
+
+	if ((enc == NULL) || (count == 0) || (count > 32)) return DISCFERRET_E_BAD_PARAMETER;
+	if (enc->cell == 0) return DISCFERRET_E_BAD_PARAMETER;
+
+	if ((err = put_cells(enc, cells, count)) != DISCFERRET_E_OK) return err;
+	enc->last_bit = cells & 1;
+	return DISCFERRET_E_OK;
+}
+
+DISCFERRET_ERROR discferret_encoder_flux(DISCFERRET_ENCODER *enc, const uint32_t *intervals, const size_t count, const unsigned long clock_hz)
+{
+	DISCFERRET_ERROR err;
+	double scale;
+
+	if ((enc == NULL) || ((intervals == NULL) && (count > 0)) || (clock_hz == 0)) return DISCFERRET_E_BAD_PARAMETER;
+
+	scale = (double)enc->clock_hz * FRAC_ONE / clock_hz;
+	if (enc->clock_hz == clock_hz) {
+		for (size_t i = 0; i < count; i++) {
+			enc->now += (uint64_t)intervals[i] << FRAC_BITS;
+			if ((err = transition(enc, enc->now, false)) != DISCFERRET_E_OK) return err;
+		}
+	} else {
+		for (size_t i = 0; i < count; i++) {
+			enc->now += (uint64_t)llround(intervals[i] * scale);
+			if ((err = transition(enc, enc->now, false)) != DISCFERRET_E_OK) return err;
+		}
+	}
+	return DISCFERRET_E_OK;
+}
+
+DISCFERRET_ERROR discferret_encoder_finish(DISCFERRET_ENCODER *enc, const unsigned char **samples, size_t *len)
+{
+	DISCFERRET_ERROR err;
+
+	if ((enc == NULL) || (samples == NULL) || (len == NULL)) return DISCFERRET_E_BAD_PARAMETER;
+
+	// The last transition has no successor, so it goes out as it is
+	if (enc->have_pending) {
+		if ((err = emit(enc, enc->pending)) != DISCFERRET_E_OK) return err;
+		enc->prev = enc->pending;
+		enc->have_prev = true;
+		enc->have_pending = false;
+	}
+
+	*samples = enc->samples;
+	*len = enc->len;
+	return DISCFERRET_E_OK;
+}
+
+/****************************************************************************
+ * Writing
+ ****************************************************************************/
+
+/**
+ * @brief	Upload blank samples after the data, so a write which runs on past it writes no transitions
+ * @param	n	Number of blank sample bytes.
+ */
+static DISCFERRET_ERROR upload_guard(DISCFERRET_DEVICE_HANDLE *dh, size_t n)
+{
+	unsigned char blank[1024];
+	int r;
+
+	memset(blank, DISCFERRET_SAMPLE_COUNT, sizeof(blank));
+	while (n > 0) {
+		const size_t k = (n < sizeof(blank)) ? n : sizeof(blank);
+		if ((r = discferret_ram_write(dh, blank, k)) != DISCFERRET_E_OK) return r;
+		n -= k;
+	}
+	return DISCFERRET_E_OK;
+}
+
+DISCFERRET_ERROR discferret_write_samples(DISCFERRET_DEVICE_HANDLE *dh, const unsigned char *samples, const size_t len, const DISCFERRET_WRITE_CONFIG *config, DISCFERRET_WRITE_STATS *stats)
+{
+	DISCFERRET_WRITE_STATS st;
+	unsigned long clock_hz;
+	uint64_t ticks = 0;
+	size_t guard;
+	double t0, start, lead = 0.0, expect, deadline, next, end;
+	long status;
+	int r;
+
+	if ((dh == NULL) || (samples == NULL) || (config == NULL)) return DISCFERRET_E_BAD_PARAMETER;
+	if ((len == 0) || (len > DISCFERRET_RAM_SIZE)) return DISCFERRET_E_BAD_PARAMETER;
+	if ((clock_hz = discferret_acq_clock_hz(config->clksel)) == 0) return DISCFERRET_E_BAD_PARAMETER;
+
+	memset(&st, 0, sizeof(st));
+	for (size_t i = 0; i < len; i++) ticks += samples[i] & DISCFERRET_SAMPLE_COUNT;
+	st.duration = (double)ticks / clock_hz;
+	st.bytes = len;
+
+	guard = ((uint64_t)clock_hz * WRITE_GUARD_US / 1000000 + DISCFERRET_SAMPLE_COUNT - 1) / DISCFERRET_SAMPLE_COUNT;
+	if (guard > DISCFERRET_RAM_SIZE - len) guard = DISCFERRET_RAM_SIZE - len;
+
+	// Keep the RAM and the acquisition registers to ourselves until the write is under way
+	discferret_lock(dh);
+
+	if ((status = discferret_get_status(dh)) < 0) {
+		discferret_unlock(dh);
+		return status;
+	}
+	if ((status & DISCFERRET_STATUS_WRITE_PROTECT) != 0) {
+		discferret_unlock(dh);
+		return DISCFERRET_E_WRITE_PROTECTED;
+	}
+
+	t0 = discferret_host_time();
+	if (((r = discferret_ram_addr_set(dh, 0)) != DISCFERRET_E_OK) ||
+			((r = discferret_ram_write(dh, samples, len)) != DISCFERRET_E_OK) ||
+			((r = upload_guard(dh, guard)) != DISCFERRET_E_OK)) {
+		discferret_unlock(dh);
+		return r;
+	}
+	st.upload_time = discferret_host_time() - t0;
+
+	// Start at the first index pulse (or straight away), stop at the first
+	// index pulse after that. The DiscFerret has no event for the end of the
+	// data, so without an index stop the write is aborted once the data has
+	// played out. Playback starts wherever the RAM pointer is, and the
+	// upload has left it past the end of the data.
+	if (((r = discferret_reg_poke(dh, DISCFERRET_R_ACQ_CLKSEL, config->clksel)) != DISCFERRET_E_OK) ||
+			((r = discferret_reg_poke(dh, DISCFERRET_R_ACQ_START_EVT, config->index_start ? DISCFERRET_ACQ_EVENT_INDEX : DISCFERRET_ACQ_EVENT_ALWAYS)) != DISCFERRET_E_OK) ||
+			((r = discferret_reg_poke(dh, DISCFERRET_R_ACQ_START_NUM, 0)) != DISCFERRET_E_OK) ||
+			((r = discferret_reg_poke(dh, DISCFERRET_R_ACQ_STOP_EVT, config->index_stop ? DISCFERRET_ACQ_EVENT_INDEX : DISCFERRET_ACQ_EVENT_NEVER)) != DISCFERRET_E_OK) ||
+			((r = discferret_reg_poke(dh, DISCFERRET_R_ACQ_STOP_NUM, 0)) != DISCFERRET_E_OK) ||
+			((r = discferret_ram_addr_set(dh, 0)) != DISCFERRET_E_OK)) {
+		discferret_unlock(dh);
+		return r;
+	}
+
+	start = discferret_host_time();
+	r = discferret_reg_poke(dh, DISCFERRET_R_ACQCON, DISCFERRET_ACQCON_WRITE);
+	discferret_unlock(dh);
+	if (r != DISCFERRET_E_OK) return r;
+
+	// Work out when the write should end. If the index monitor is running it
+	// knows when the next index pulse (and so the start) is due.
+	expect = st.duration;
+	if (discferret_index_monitor_predict(dh, &next) == DISCFERRET_E_OK) {
+		DISCFERRET_INDEX_STATS is;
+		if (config->index_start && (next > start)) lead = next - start;
+		if (config->index_stop && (discferret_index_monitor_get(dh, &is) == DISCFERRET_E_OK) && (is.mean < expect))
+			expect = is.mean;
+	}
+	expect += start + lead;
+	deadline = start + ((config->timeout > 0.0) ? config->timeout : (1.0 + lead + st.duration));
+
+	if (!config->index_stop) {
+		// Find out when the write actually began, then stop it at the end of the data
+		end = start;
+		if (config->index_start) {
+			r = discferret_wait_status(dh, DISCFERRET_STATUS_ACQ_WAITING, 0, start + lead, deadline, NULL, &st.polls, NULL);
+			if (r != DISCFERRET_E_OK) {
+				discferret_reg_poke(dh, DISCFERRET_R_ACQCON, DISCFERRET_ACQCON_ABORT);
+				return r;
+			}
+			end = discferret_host_time();
+		}
+		end += st.duration;
+		if ((next = discferret_host_time()) < end) discferret_sleep_us((unsigned long)((end - next) * 1e6));
+		if ((r = discferret_reg_poke(dh, DISCFERRET_R_ACQCON, DISCFERRET_ACQCON_ABORT)) != DISCFERRET_E_OK) return r;
+
+		// Stopped after the blank guard ran out: stale RAM was written past the data
+		if (discferret_host_time() > end + (guard * (double)DISCFERRET_SAMPLE_COUNT / clock_hz)) return DISCFERRET_E_TIMEOUT;
+		expect = discferret_host_time();
+	}
+
+	if ((r = discferret_acq_wait(dh, expect, deadline, &st.polls, NULL)) != DISCFERRET_E_OK) return r;
+	st.write_time = discferret_host_time() - start;
+
+	if (stats != NULL) *stats = st;
+	return DISCFERRET_E_OK;
+}
+
+DISCFERRET_ERROR discferret_write_flux(DISCFERRET_DEVICE_HANDLE *dh, const DISCFERRET_FLUX *flux, const DISCFERRET_WRITE_CONFIG *config, DISCFERRET_WRITE_STATS *stats)
+{
+	DISCFERRET_ENCODER_CONFIG ec;
+	DISCFERRET_ENCODER *enc;
+	const unsigned char *samples;
+	size_t first = 0, last, len;
+	DISCFERRET_ERROR err;
+
+	if ((dh == NULL) || (flux == NULL) || (config == NULL)) return DISCFERRET_E_BAD_PARAMETER;
+	if ((flux->count == 0) || (flux->clock_hz == 0)) return DISCFERRET_E_BAD_PARAMETER;
+
+	// One revolution, index to index, if the capture has one
+	last = flux->count;
+	if (flux->index_count > 0) first = flux->index[0];
+	if (flux->index_count > 1) last = flux->index[1];
+	if (first >= last) return DISCFERRET_E_BAD_PARAMETER;
+
+	memset(&ec, 0, sizeof(ec));
+	ec.encoding = DISCFERRET_ENCODING_MFM;
+	ec.clksel = config->clksel;
+	if ((err = discferret_encoder_create(&ec, &enc)) != DISCFERRET_E_OK) return err;
+
+	if (((err = discferret_encoder_flux(enc, flux->intervals + first, last - first, flux->clock_hz)) == DISCFERRET_E_OK) &&
+			((err = discferret_encoder_finish(enc, &samples, &len)) == DISCFERRET_E_OK))
+		err = discferret_write_samples(dh, samples, len, config, stats);
+
+	discferret_encoder_free(enc);
+	return err;
+}
+
+/**
+ * @brief	Compare two buffers
+ * @returns	true if they are identical.
+ */
+static bool block_equal(const unsigned char *a, const unsigned char *b, size_t len)
+{
+#ifdef WRITE_SSE2
+	// 64 bytes per iteration; fold the four compares together and test once
+	while (len >= 64) {
+		__m128i e0 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)a), _mm_loadu_si128((const __m128i *)b));
+		__m128i e1 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a + 16)), _mm_loadu_si128((const __m128i *)(b + 16)));
+		__m128i e2 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a + 32)), _mm_loadu_si128((const __m128i *)(b + 32)));
+		__m128i e3 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a + 48)), _mm_loadu_si128((const __m128i *)(b + 48)));
+		if (_mm_movemask_epi8(_mm_and_si128(_mm_and_si128(e0, e1), _mm_and_si128(e2, e3))) != 0xFFFF) return false;
+		a += 64;
+		b += 64;
+		len -= 64;
+	}
+	while (len >= 16) {
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)a), _mm_loadu_si128((const __m128i *)b))) != 0xFFFF)
+			return false;
+		a += 16;
+		b += 16;
+		len -= 16;
+	}
+#endif
+	return memcmp(a, b, len) == 0;
+}
+
+/**
+ * @brief	Check a decoded track against the sectors it should hold
+ * @returns	Number of expected sectors which are missing, damaged or different.
+ */
+static size_t compare_track(const DISCFERRET_TRACK *track, const DISCFERRET_SECTOR *expected, const size_t nexpected)
+{
+	size_t bad = 0;
+
+	for (size_t i = 0; i < nexpected; i++) {
+		const DISCFERRET_SECTOR *e = &expected[i];
+		const DISCFERRET_SECTOR *s = NULL;
+
+		for (size_t j = 0; j < track->count; j++) {
+			const DISCFERRET_SECTOR *t = &track->sectors[j];
+			if ((t->cyl == e->cyl) && (t->head == e->head) && (t->sector == e->sector) && (t->size_code == e->size_code)) {
+				s = t;
+				break;
+			}
+		}
+
+		// A good data CRC over an identical payload means the CRC on disc matches the source too
+		if ((s == NULL) || !s->data_ok || (s->deleted != e->deleted) || (s->size != e->size) ||
+				!block_equal(s->data, e->data, e->size))
+			bad++;
+	}
+
+	return bad;
+}
+
+DISCFERRET_ERROR discferret_write_verify(DISCFERRET_DEVICE_HANDLE *dh, const unsigned char *samples, const size_t len,
+		const DISCFERRET_WRITE_CONFIG *config, const DISCFERRET_SECTOR *expected, const size_t nexpected,
+		const DISCFERRET_VERIFY_CONFIG *vconfig, DISCFERRET_VERIFY_RESULT *result)
+{
+	DISCFERRET_VERIFY_RESULT res;
+	DISCFERRET_CAPTURE_CONFIG cc;
+	DISCFERRET_FLUX flux;
+	DISCFERRET_TRACK track;
+	DISCFERRET_ERROR err = DISCFERRET_E_OK;
+	double t0;
+
+	if ((dh == NULL) || (samples == NULL) || (config == NULL) || (vconfig == NULL)) return DISCFERRET_E_BAD_PARAMETER;
+	if ((expected == NULL) && (nexpected > 0)) return DISCFERRET_E_BAD_PARAMETER;
+	for (size_t i = 0; i < nexpected; i++)
+		if ((expected[i].data == NULL) || (expected[i].size != ((size_t)128 << (expected[i].size_code & 7)))) return DISCFERRET_E_BAD_PARAMETER;
+
+	memset(&res, 0, sizeof(res));
+	memset(&flux, 0, sizeof(flux));
+	memset(&track, 0, sizeof(track));
+
+	// One revolution, starting as soon as the write ends
+	memset(&cc, 0, sizeof(cc));
+	cc.clksel = config->clksel;
+	cc.index_start = !config->index_stop;
+	cc.revolutions = 1;
+
+	do {
+		res.attempts++;
+		if ((err = discferret_write_samples(dh, samples, len, config, &res.write)) != DISCFERRET_E_OK) break;
+
+		t0 = discferret_host_time();
+		if (((err = discferret_flux_capture(dh, &cc, &flux)) != DISCFERRET_E_OK) ||
+				((err = discferret_decode_mfm(&flux, vconfig->bitrate, &track)) != DISCFERRET_E_OK))
+			break;
+		res.sectors_bad = compare_track(&track, expected, nexpected);
+		res.sectors_ok = nexpected - res.sectors_bad;
+		res.verify_time += discferret_host_time() - t0;
+
+		err = (res.sectors_bad == 0) ? DISCFERRET_E_OK : DISCFERRET_E_VERIFY_FAILED;
+	} while ((err == DISCFERRET_E_VERIFY_FAILED) && (res.attempts <= vconfig->retries));
+
+	discferret_flux_free(&flux);
+	discferret_track_free(&track);
+	if (result != NULL) *result = res;
+	return err;
+}
+
+// vim: ts=4 noet sw=4
@@ -0,0 +1,128 @@
+// make output/codectest && LD_LIBRARY_PATH=output ./output/codectest
+//
+// Flux codec round-trip tests and ratio/throughput benchmark, on synthetic
+// MFM, FM and GCR flux. Doesn't need a DiscFerret.
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include "discferret.h"
+#include "discferret_codec.h"
+#include "testutil.h"
+
+// Bytes per second a DiscFerret can deliver over USB 2.0 (Fast Read), for comparison
+#define USB_RATE	(40.0 * 1024 * 1024)
+
+/**
+ * Synthetic flux: intervals of <cells[rand]> bit cells of <cell> ticks, with
+ * gaussian jitter and slow speed wobble. An occasional long gap stands in
+ * for unformatted areas.
+ */
+static void make_flux(uint32_t *buf, size_t n, double cell, const unsigned int *cells, unsigned int ncells)
+{
+	for (size_t i = 0; i < n; i++) {
+		double wobble = 1.0 + 0.01 * sin(i / 5000.0);
+		double v = cells[(unsigned int)(uniform() * ncells)] * cell * wobble + gaussian() * (cell * 0.04);
+		if (uniform() < 0.0001) v = 50000 + uniform() * 200000;
+		buf[i] = (v < 1) ? 1 : (uint32_t)v;
+	}
+}
+
+static int roundtrip(const char *name, const uint32_t *in, size_t n)
+{
+	size_t bound = discferret_codec_bound(n), clen, dn;
+	unsigned char *c = malloc(bound);
+	uint32_t *d = malloc((n + 1) * sizeof(uint32_t));
+	int e, ok;
+
+	e = discferret_codec_encode(in, n, c, bound, &clen);
+	if (e == DISCFERRET_E_OK) e = discferret_codec_decode(c, clen, d, n, &dn);
+	ok = (e == DISCFERRET_E_OK) && (dn == n) && ((n == 0) || (memcmp(in, d, n * sizeof(uint32_t)) == 0));
+	printf("roundtrip %-12s %8zu intervals -> %8zu bytes: %s\n", name, n, clen, ok ? "OK" : "FAIL");
+
+	// Truncated or corrupted input must be rejected (or decode to something), never crash
+	if (ok && (n > 0)) {
+		for (size_t cut = 0; cut < clen; cut += 1 + clen / 50) discferret_codec_decode(c, cut, d, n, &dn);
+		for (int i = 0; i < 50; i++) {
+			unsigned char *x = malloc(clen);
+			memcpy(x, c, clen);
+			x[(size_t)(uniform() * clen)] ^= 1 << (int)(uniform() * 8);
+			discferret_codec_decode(x, clen, d, n, &dn);
+			free(x);
+		}
+	}
+
+	free(c);
+	free(d);
+	return ok ? 0 : 1;
+}
+
+static int bench(const char *name, const uint32_t *in, size_t n)
+{
+	size_t bound = discferret_codec_bound(n), clen = 0, dn;
+	unsigned char *c = malloc(bound);
+	uint32_t *d = malloc(n * sizeof(uint32_t));
+	size_t raw = 0;
+	double t, enc, dec;
+	int reps = 20;
+
+	// Size of the DiscFerret RAM dump this flux came from (one byte per 127 ticks, plus one)
+	for (size_t i = 0; i < n; i++) raw += in[i] / 127 + 1;
+
+	t = now();
+	for (int r = 0; r < reps; r++) discferret_codec_encode(in, n, c, bound, &clen);
+	enc = (now() - t) / reps;
+	t = now();
+	for (int r = 0; r < reps; r++) discferret_codec_decode(c, clen, d, n, &dn);
+	dec = (now() - t) / reps;
+
+	printf("%-12s %5.2f bits/interval, %5.1fx vs RAM dump; encode %7.1f MB/s (%5.1fx USB), decode %7.1f MB/s\n",
+			name, clen * 8.0 / n, (double)raw / clen,
+			raw / enc / 1048576.0, raw / enc / USB_RATE, raw / dec / 1048576.0);
+
+	free(c);
+	free(d);
+	return 0;
+}
+
+int main(void)
+{
+	static const unsigned int mfm[] = { 2, 3, 4 }, fm[] = { 1, 2 }, gcr[] = { 1, 2, 3 };
+	const size_t n = 1000000;
+	uint32_t *buf = calloc(n, sizeof(uint32_t));
+	int fail = 0;
+
+	// Edge cases
+	fail += roundtrip("empty", buf, 0);
+	buf[0] = 0;
+	fail += roundtrip("zero", buf, 1);
+	for (size_t i = 0; i < 5000; i++) buf[i] = 400;
+	fail += roundtrip("constant", buf, 5000);
+	for (size_t i = 0; i < 10000; i++) buf[i] = (uint32_t)(uniform() * 4294967295.0);
+	fail += roundtrip("random32", buf, 10000);
+	for (size_t i = 0; i < 4097; i++) buf[i] = (i & 1) ? 0xFFFFFFFF : 0;
+	fail += roundtrip("extremes", buf, 4097);
+
+	// Synthetic flux at 100MHz: DD MFM (2us cells), FM (4us cells), GCR (4us cells)
+	make_flux(buf, n, 200, mfm, 3);
+	fail += roundtrip("mfm", buf, n);
+	fail += roundtrip("mfm-odd", buf, 12345);
+	bench("mfm", buf, n);
+	make_flux(buf, n, 400, fm, 2);
+	fail += roundtrip("fm", buf, n);
+	bench("fm", buf, n);
+	make_flux(buf, n, 400, gcr, 3);
+	fail += roundtrip("gcr", buf, n);
+	bench("gcr", buf, n);
+
+	// HD MFM at 25MHz (1us cells, 25 ticks): small values, tests small k
+	make_flux(buf, n, 25, mfm, 3);
+	fail += roundtrip("mfm-hd-25", buf, n);
+	bench("mfm-hd-25", buf, n);
+
+	free(buf);
+	printf("%s\n", fail ? "FAILED" : "all tests passed");
+	return fail ? 1 : 0;
+}
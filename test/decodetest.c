@@ -0,0 +1,378 @@
+// make output/decodetest && LD_LIBRARY_PATH=output ./output/decodetest
+//
+// Sector decoder tests and throughput benchmark, on synthetic IBM MFM, Amiga,
+// IBM FM, Apple 6-and-2 and Commodore 1541 GCR tracks with jitter and speed
+// drift. Doesn't need a DiscFerret.
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include "discferret.h"
+#include "discferret_decode.h"
+#include "testutil.h"
+
+// Flux clock for the synthetic captures (DISCFERRET_ACQ_RATE_100MHZ)
+#define CLOCK_HZ	100000000UL
+// Decodes per format for the benchmark
+#define RUNS		200
+
+/////////////////////////////////////////////////////////////////////////////
+// Bitcell stream builder
+
+typedef struct {
+	unsigned char	*cells;		// one byte per cell
+	size_t			n;
+	int				prev;		// MFM: last data bit
+} STREAM;
+
+static void put_cells(STREAM *s, uint32_t v, unsigned int n)
+{
+	while (n--) s->cells[s->n++] = (v >> n) & 1;
+}
+
+static void put_mfm(STREAM *s, const unsigned char *buf, size_t len)
+{
+	for (size_t i = 0; i < len; i++) {
+		for (int b = 7; b >= 0; b--) {
+			int d = (buf[i] >> b) & 1;
+			put_cells(s, (!(d | s->prev) << 1) | d, 2);
+			s->prev = d;
+		}
+	}
+}
+
+static void put_fm(STREAM *s, const unsigned char *buf, size_t len, unsigned char clock)
+{
+	for (size_t i = 0; i < len; i++) {
+		for (int b = 7; b >= 0; b--)
+			put_cells(s, (((clock >> b) & 1) << 1) | ((buf[i] >> b) & 1), 2);
+	}
+}
+
+static void fill(STREAM *s, unsigned char v, size_t len, int fm)
+{
+	unsigned char buf[256];
+	memset(buf, v, len);
+	if (fm) put_fm(s, buf, len, 0xFF); else put_mfm(s, buf, len);
+}
+
+/**
+ * Turn a bitcell stream into flux: a transition on each 1 cell, with
+ * gaussian jitter of 4% of a cell and the speed drifting by 2% across the track.
+ */
+static void to_flux(const STREAM *s, double cell, DISCFERRET_FLUX *flux)
+{
+	double t = 0, last = 0;
+
+	flux->count = 0;
+	flux->clock_hz = CLOCK_HZ;
+	for (size_t i = 0; i < s->n; i++) {
+		t += cell * (1.0 + 0.02 * ((double)i / s->n));
+		if (s->cells[i]) {
+			double at = t + gaussian() * cell * 0.04;
+			flux->intervals[flux->count++] = (uint32_t)(at - last + 0.5);
+			last = at;
+		}
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Track builders. Each fills in the payloads it wrote to <data>.
+
+static void make_ibm(STREAM *s, int fm, unsigned int nsec, unsigned int size_code, unsigned char data[][512])
+{
+	const size_t size = (size_t)128 << size_code;
+	const uint16_t crc0 = fm ? 0xFFFF : 0xCDB4;
+
+	fill(s, fm ? 0xFF : 0x4E, 40, fm);
+	for (unsigned int i = 0; i < nsec; i++) {
+		unsigned char id[7] = { 0xFE, 5, 0, i + 1, size_code, 0, 0 }, mark = 0xFB, crc[2];
+		uint16_t c;
+
+		c = discferret_crc16(crc0, id, 5);
+		id[5] = c >> 8;
+		id[6] = c & 0xFF;
+		for (size_t j = 0; j < size; j++) data[i][j] = (unsigned char)(uniform() * 256);
+		c = discferret_crc16(discferret_crc16(crc0, &mark, 1), data[i], size);
+		crc[0] = c >> 8;
+		crc[1] = c & 0xFF;
+
+		fill(s, 0x00, fm ? 6 : 12, fm);
+		if (fm) {
+			put_fm(s, id, 1, 0xC7);
+			put_fm(s, id + 1, 6, 0xFF);
+		} else {
+			put_cells(s, 0x448944894489ULL >> 16, 32);
+			put_cells(s, 0x4489, 16);
+			put_mfm(s, id, 7);
+		}
+		fill(s, fm ? 0xFF : 0x4E, fm ? 11 : 22, fm);
+		fill(s, 0x00, fm ? 6 : 12, fm);
+		if (fm) {
+			put_fm(s, &mark, 1, 0xC7);
+			put_fm(s, data[i], size, 0xFF);
+			put_fm(s, crc, 2, 0xFF);
+		} else {
+			put_cells(s, 0x44894489, 32);
+			put_cells(s, 0x4489, 16);
+			put_mfm(s, &mark, 1);
+			put_mfm(s, data[i], size);
+			put_mfm(s, crc, 2);
+		}
+		fill(s, fm ? 0xFF : 0x4E, fm ? 27 : 54, fm);
+	}
+}
+
+/**
+ * Amiga: write the data bits of a raw longword (mask 0x55555555), adding
+ * the MFM clock bits.
+ */
+static void amiga_raw(STREAM *s, uint32_t v)
+{
+	for (int b = 30; b >= 0; b -= 2) {
+		int d = (v >> b) & 1;
+		put_cells(s, (!(d | s->prev) << 1) | d, 2);
+		s->prev = d;
+	}
+}
+
+/**
+ * Amiga: write longwords odd bits first, then even bits. Returns the XOR
+ * of the raw longwords' data bits, for the checksums.
+ */
+static uint32_t amiga_longs(STREAM *s, const uint32_t *v, size_t n)
+{
+	uint32_t sum = 0;
+
+	for (size_t i = 0; i < n; i++) {
+		amiga_raw(s, (v[i] >> 1) & 0x55555555UL);
+		sum ^= (v[i] >> 1) & 0x55555555UL;
+	}
+	for (size_t i = 0; i < n; i++) {
+		amiga_raw(s, v[i] & 0x55555555UL);
+		sum ^= v[i] & 0x55555555UL;
+	}
+	return sum;
+}
+
+static void make_amiga(STREAM *s, unsigned int trk, unsigned char data[][512])
+{
+	fill(s, 0x00, 200, 0);
+	for (unsigned int sec = 0; sec < 11; sec++) {
+		uint32_t hdr[5] = { 0xFF000000UL | (trk << 16) | (sec << 8) | (11 - sec), 0, 0, 0, 0 }, d[128], sum;
+		STREAM scratch;
+
+		for (int j = 0; j < 512; j++) data[sec][j] = (unsigned char)(uniform() * 256);
+		for (int j = 0; j < 128; j++)
+			d[j] = ((uint32_t)data[sec][4*j] << 24) | ((uint32_t)data[sec][4*j+1] << 16) | ((uint32_t)data[sec][4*j+2] << 8) | data[sec][4*j+3];
+
+		fill(s, 0x00, 2, 0);
+		put_cells(s, 0x44894489, 32);
+		s->prev = 1;
+		amiga_longs(s, hdr, 1);
+		sum = amiga_longs(s, hdr + 1, 4) ^ (((hdr[0] >> 1) ^ hdr[0]) & 0x55555555UL);
+		amiga_longs(s, &sum, 1);
+
+		// Data checksum comes first on disk; work it out on a scratch stream
+		scratch = *s;
+		sum = amiga_longs(&scratch, d, 128);
+		amiga_longs(s, &sum, 1);
+		amiga_longs(s, d, 128);
+	}
+	fill(s, 0x00, 250, 0);
+}
+
+static const unsigned char apple_nib[64] = {
+	0x96, 0x97, 0x9A, 0x9B, 0x9D, 0x9E, 0x9F, 0xA6, 0xA7, 0xAB, 0xAC, 0xAD, 0xAE, 0xAF, 0xB2, 0xB3,
+	0xB4, 0xB5, 0xB6, 0xB7, 0xB9, 0xBA, 0xBB, 0xBC, 0xBD, 0xBE, 0xBF, 0xCB, 0xCD, 0xCE, 0xCF, 0xD3,
+	0xD6, 0xD7, 0xD9, 0xDA, 0xDB, 0xDC, 0xDD, 0xDE, 0xDF, 0xE5, 0xE6, 0xE7, 0xE9, 0xEA, 0xEB, 0xEC,
+	0xED, 0xEE, 0xEF, 0xF2, 0xF3, 0xF4, 0xF5, 0xF6, 0xF7, 0xF9, 0xFA, 0xFB, 0xFC, 0xFD, 0xFE, 0xFF
+};
+
+static void apple_sync(STREAM *s, unsigned int n)
+{
+	// 10-bit self-sync nibbles
+	while (n--) put_cells(s, 0xFF << 2, 10);
+}
+
+static void apple_44(STREAM *s, unsigned char v)
+{
+	put_cells(s, (v >> 1) | 0xAA, 8);
+	put_cells(s, v | 0xAA, 8);
+}
+
+static void make_apple(STREAM *s, unsigned char data[][512])
+{
+	const unsigned char vol = 254, trk = 17;
+
+	apple_sync(s, 48);
+	for (unsigned int sec = 0; sec < 16; sec++) {
+		unsigned char v[342], prev = 0;
+
+		for (int j = 0; j < 256; j++) data[sec][j] = (unsigned char)(uniform() * 256);
+
+		put_cells(s, 0xD5AA96, 24);
+		apple_44(s, vol);
+		apple_44(s, trk);
+		apple_44(s, sec);
+		apple_44(s, vol ^ trk ^ sec);
+		put_cells(s, 0xDEAAEB, 24);
+		apple_sync(s, 6);
+
+		// 6-and-2: low bit pairs (swapped) of bytes i, i+86 and i+172, then the high six bits
+		for (int j = 0; j < 86; j++) {
+			unsigned char a = 0;
+			for (int k = 0; k < 3; k++) {
+				unsigned int n = j + (86 * k);
+				unsigned char two = (n < 256) ? (data[sec][n] & 3) : 0;
+				a |= (((two & 1) << 1) | (two >> 1)) << (2 * k);
+			}
+			v[j] = a;
+		}
+		for (int j = 0; j < 256; j++) v[86 + j] = data[sec][j] >> 2;
+
+		put_cells(s, 0xD5AAAD, 24);
+		for (int j = 0; j < 342; j++) {
+			put_cells(s, apple_nib[v[j] ^ prev], 8);
+			prev = v[j];
+		}
+		put_cells(s, apple_nib[prev], 8);
+		put_cells(s, 0xDEAAEB, 24);
+		apple_sync(s, 20);
+	}
+}
+
+static const unsigned char c1541_code[16] = {
+	0x0A, 0x0B, 0x12, 0x13, 0x0E, 0x0F, 0x16, 0x17, 0x09, 0x19, 0x1A, 0x1B, 0x0D, 0x1D, 0x1E, 0x15
+};
+
+static void put_gcr(STREAM *s, const unsigned char *buf, size_t len)
+{
+	for (size_t i = 0; i < len; i++) {
+		put_cells(s, c1541_code[buf[i] >> 4], 5);
+		put_cells(s, c1541_code[buf[i] & 0x0F], 5);
+	}
+}
+
+static void make_c1541(STREAM *s, unsigned int trk, unsigned int nsec, unsigned char data[][512])
+{
+	for (unsigned int sec = 0; sec < nsec; sec++) {
+		unsigned char hdr[8] = { 0x08, 0, sec, trk, 'A', 'B', 0x0F, 0x0F }, id = 0x07, sum = 0, gap[9];
+
+		hdr[1] = hdr[2] ^ hdr[3] ^ hdr[4] ^ hdr[5];
+		for (int j = 0; j < 256; j++) {
+			data[sec][j] = (unsigned char)(uniform() * 256);
+			sum ^= data[sec][j];
+		}
+		memset(gap, 0x55, sizeof(gap));
+
+		put_cells(s, 0xFFFFFFFF, 32);
+		put_cells(s, 0xFF, 8);
+		put_gcr(s, hdr, 8);
+		put_gcr(s, gap, 9);
+		put_cells(s, 0xFFFFFFFF, 32);
+		put_cells(s, 0xFF, 8);
+		put_gcr(s, &id, 1);
+		put_gcr(s, data[sec], 256);
+		put_gcr(s, &sum, 1);
+		put_gcr(s, gap, 8);
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+typedef DISCFERRET_ERROR (*DECODER)(const DISCFERRET_FLUX *flux, const unsigned long param, DISCFERRET_TRACK *track);
+
+static DISCFERRET_ERROR decode_c1541(const DISCFERRET_FLUX *flux, const unsigned long param, DISCFERRET_TRACK *track)
+{
+	return discferret_decode_c1541(flux, (unsigned int)param, track);
+}
+
+/**
+ * Decode a track RUNS times, then check every sector came back intact.
+ */
+static int run(const char *name, DECODER decode, unsigned long param, const DISCFERRET_FLUX *flux,
+		unsigned int nsec, unsigned int first, size_t size, unsigned char data[][512])
+{
+	DISCFERRET_TRACK track;
+	unsigned int good = 0;
+	double t0, dt;
+
+	memset(&track, 0, sizeof(track));
+	t0 = now();
+	for (int i = 0; i < RUNS; i++) {
+		if (decode(flux, param, &track) != DISCFERRET_E_OK) {
+			printf("%-14s decode failed\n", name);
+			discferret_track_free(&track);
+			return 1;
+		}
+	}
+	dt = now() - t0;
+
+	for (size_t i = 0; i < track.count; i++) {
+		const DISCFERRET_SECTOR *s = &track.sectors[i];
+		if ((s->sector < first) || (s->sector >= first + nsec)) continue;
+		if (s->data_ok && (s->size == size) && (memcmp(s->data, data[s->sector - first], size) == 0)) good++;
+	}
+
+	printf("%-14s %2u/%2u sectors  %6zu transitions  %8.0f tracks/s\n", name, good, nsec, flux->count, RUNS / dt);
+	discferret_track_free(&track);
+	return (good == nsec) ? 0 : 1;
+}
+
+int main(void)
+{
+	static unsigned char data[32][512];
+	STREAM s;
+	DISCFERRET_FLUX flux;
+	int fail = 0;
+
+	s.cells = malloc(1 << 20);
+	memset(&flux, 0, sizeof(flux));
+	flux.intervals = malloc((1 << 20) * sizeof(uint32_t));
+	if ((s.cells == NULL) || (flux.intervals == NULL)) return 1;
+
+	// IBM MFM, 9 x 512 at 250 kbit/s (5.25" DD)
+	s.n = 0; s.prev = 0;
+	make_ibm(&s, 0, 9, 2, data);
+	to_flux(&s, CLOCK_HZ / 500000.0, &flux);
+	fail |= run("IBM MFM", discferret_decode_mfm, 250000, &flux, 9, 1, 512, data);
+
+	// Amiga, 11 x 512 at 250 kbit/s (DD)
+	s.n = 0; s.prev = 0;
+	make_amiga(&s, 80, data);
+	to_flux(&s, CLOCK_HZ / 500000.0, &flux);
+	fail |= run("Amiga", discferret_decode_amiga, 250000, &flux, 11, 0, 512, data);
+
+	// IBM FM, 10 x 256 at 125 kbit/s (5.25" SD)
+	s.n = 0;
+	make_ibm(&s, 1, 10, 1, data);
+	to_flux(&s, CLOCK_HZ / 250000.0, &flux);
+	fail |= run("IBM FM", discferret_decode_fm, 125000, &flux, 10, 1, 256, data);
+
+	// Apple II 16 sector, 4us cells
+	s.n = 0;
+	make_apple(&s, data);
+	to_flux(&s, CLOCK_HZ / 250000.0, &flux);
+	fail |= run("Apple 6-and-2", discferret_decode_apple, 250000, &flux, 16, 0, 256, data);
+
+	// Commodore 1541, fastest and slowest zones
+	s.n = 0;
+	make_c1541(&s, 1, 21, data);
+	to_flux(&s, CLOCK_HZ / 307692.0, &flux);
+	fail |= run("C1541 track 1", decode_c1541, 1, &flux, 21, 0, 256, data);
+
+	s.n = 0;
+	make_c1541(&s, 35, 17, data);
+	to_flux(&s, CLOCK_HZ / 250000.0, &flux);
+	fail |= run("C1541 track 35", decode_c1541, 35, &flux, 17, 0, 256, data);
+
+	free(s.cells);
+	free(flux.intervals);
+	printf(fail ? "FAILED\n" : "OK\n");
+	return fail;
+}
+
+// vim: ts=4 noet sw=4
@@ -107,6 +107,24 @@ int main(void)
 
 	printf("get status: %ld\n", discferret_get_status(devh));
 
+	// RAM upload throughput: one pipelined 512K write, against the same data
+	// sent one Fast Write packet per call (send, wait for the ack, repeat)
+	size_t biglen = 8 * 65533;
+	unsigned char *big = malloc(biglen);
+	for (size_t k=0; k<biglen; k++) big[k] = k * 7;
+	double t0, t1;
+	discferret_ram_addr_set(devh, 0);
+	t0 = discferret_host_time();
+	for (size_t k=0; k<biglen; k+=65533) discferret_ram_write(devh, &big[k], 65533);
+	t1 = discferret_host_time();
+	printf("ram write %zu bytes, one packet per call: %.2f MB/s\n", biglen, biglen / (t1 - t0) / 1e6);
+	discferret_ram_addr_set(devh, 0);
+	t0 = discferret_host_time();
+	i = discferret_ram_write(devh, big, biglen);
+	t1 = discferret_host_time();
+	printf("ram write %zu bytes, pipelined: %d, %.2f MB/s\n", biglen, i, biglen / (t1 - t0) / 1e6);
+	free(big);
+
 	printf("close: %d\n", discferret_close(devh));
 	printf("done: %d\n", discferret_done());
 
@@ -0,0 +1,35 @@
+// Helpers shared by the tests which don't need a DiscFerret: a fixed-seed
+// random number generator (so runs are repeatable) and a monotonic clock for
+// the benchmarks. Define _POSIX_C_SOURCE before including this.
+#ifndef _DISCFERRET_TESTUTIL_H
+#define _DISCFERRET_TESTUTIL_H
+
+#include <math.h>
+#include <time.h>
+
+static unsigned long rng = 12345;
+
+/// Uniform random number in [0, 1)
+static inline double uniform(void)
+{
+	rng = rng * 6364136223846793005UL + 1442695040888963407UL;
+	return ((rng >> 11) & 0xFFFFFFFFFFFFFUL) / (double)0x10000000000000UL;
+}
+
+/// Normally distributed random number (mean 0, standard deviation 1)
+static inline double gaussian(void)
+{
+	double u1 = uniform(), u2 = uniform();
+	if (u1 < 1e-12) u1 = 1e-12;
+	return sqrt(-2.0 * log(u1)) * cos(6.283185307179586 * u2);
+}
+
+/// Monotonic time, in seconds
+static inline double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+#endif // _DISCFERRET_TESTUTIL_H
@@ -0,0 +1,563 @@
+/****************************************************************************
+ *
+ *                - DiscFerret Interface Library for C / C++ -
+ *
+ * Copyright (C) 2010 - 2011 P. A. Pemberton t/a. Red Fox Engineering.
+ * All Rights Reserved.
+ *
+ * Copyright 2010-2011 Philip Pemberton
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ ****************************************************************************/
+
+
+/**
+ * @file	discferretd.c
+ * @brief	DiscFerret daemon: keeps DiscFerret units open and configured, and
+ * 			serves jobs from clients over a Unix socket.
+ *
+ * Usage: discferretd [-s socket_path] [-n]
+ *   -s   Socket path (default DISCFERRET_DAEMON_SOCKET)
+ *   -n   Don't load the default microcode at startup
+ *
+ * Each client connection gets a thread of its own. Every request runs with
+ * its unit's arbiter held, so requests from different clients never
+ * interleave on the USB bus; a client which has locked a unit with OP_LOCK
+ * keeps it to itself until OP_UNLOCK, OP_CLOSE or disconnect.
+ *
+ * On shutdown, every client connection is closed and its thread joined
+ * before the units are released.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "discferret.h"
+#include "discferret_flux.h"
+#include "discferret_fleet.h"
+#include "discferret_client.h"
+#include "discferret_proto.h"
+
+/**
+ * @brief	Per-unit arbiter
+ */
+struct unit {
+	DISCFERRET_FLEET_UNIT	*fu;		///< Fleet unit (device handle and info)
+	pthread_mutex_t			lock;		///< Held while a request runs on this unit
+	pthread_cond_t			released;	///< Signalled when a client unlocks the unit
+	unsigned long			owner;		///< Client holding the unit's lock, or 0
+};
+
+/// Initial size of a client's request and response buffers; enough for any fixed-size reply
+#define CLIENT_BUF_MIN		4096
+
+/**
+ * @brief	Client connection
+ */
+struct client {
+	unsigned long		id;				///< Client ID (used as the unit lock owner)
+	int					fd;				///< Socket
+	pthread_t			thread;			///< Connection thread
+	int					done;			///< Set by the thread when it has finished (atomic)
+	unsigned char		*payload;		///< Request payload buffer
+	size_t				payload_size;	///< Allocated size of <i>payload</i>
+	unsigned char		*resp;			///< Response payload buffer
+	size_t				resp_size;		///< Allocated size of <i>resp</i>
+	DISCFERRET_FLUX		flux;			///< Flux buffer for OP_FLUX_CAPTURE, kept between captures
+	struct client		*next;			///< Next client in the list
+};
+
+/// Units being served
+static struct unit *units = NULL;
+/// Number of units being served
+static size_t num_units = 0;
+/// Set by the signal handler to shut the daemon down
+static volatile sig_atomic_t quit = 0;
+
+static void sighandler(int sig)
+{
+	quit = 1;
+}
+
+/**
+ * @brief	Wait until no other client owns a unit, then take its request lock
+ */
+static void unit_acquire(struct unit *u, unsigned long client)
+{
+	pthread_mutex_lock(&u->lock);
+	while ((u->owner != 0) && (u->owner != client))
+		pthread_cond_wait(&u->released, &u->lock);
+}
+
+static void unit_release(struct unit *u)
+{
+	pthread_mutex_unlock(&u->lock);
+}
+
+/**
+ * @brief	Make sure a buffer can hold at least <i>n</i> bytes
+ * @returns	true on success, false if out of memory (the buffer is left as it was)
+ */
+static bool reserve(unsigned char **buf, size_t *size, const size_t n)
+{
+	unsigned char *p;
+
+	if (n <= *size) return true;
+	if ((p = realloc(*buf, n)) == NULL) return false;
+	*buf = p;
+	*size = n;
+	return true;
+}
+
+/**
+ * @brief	Append a NUL-terminated string to a response buffer
+ */
+static size_t put_string(unsigned char *buf, size_t pos, const unsigned char *str)
+{
+	size_t len = strlen((const char *)str) + 1;
+	memcpy(buf + pos, str, len);
+	return pos + len;
+}
+
+/**
+ * @brief	Run one request
+ * @param	c		Client. Its response buffer holds at least CLIENT_BUF_MIN
+ * 					bytes, and is grown for requests with larger responses.
+ * @param	req		Request header.
+ * @param	resplen	Pointer which will receive the response length.
+ * @returns	Status code to send back to the client.
+ */
+static int dispatch(struct client *c, const struct proto_request *req, size_t *resplen)
+{
+	const unsigned long client = c->id;
+	const unsigned char *payload = c->payload;
+	unsigned char *resp = c->resp;
+	DISCFERRET_DEVICE_HANDLE *dh;
+	struct unit *u;
+	double d;
+	long r;
+
+	*resplen = 0;
+
+	// Requests which don't need a unit
+	if (req->op == OP_LIST) {
+		const DISCFERRET_DEVICE *dev0 = NULL;
+		size_t pos = 4, n = 0;
+		if (!reserve(&c->resp, &c->resp_size, 4 + (num_units * (sizeof(dev0->serialnumber) +
+				sizeof(dev0->productname) + sizeof(dev0->manufacturer) + sizeof(dev0->location)))))
+			return DISCFERRET_E_OUT_OF_MEMORY;
+		resp = c->resp;
+		for (size_t i = 0; i < num_units; i++) {
+			DISCFERRET_DEVICE *dev = &units[i].fu->device;
+			pos = put_string(resp, pos, dev->serialnumber);
+			pos = put_string(resp, pos, dev->productname);
+			pos = put_string(resp, pos, dev->manufacturer);
+			pos = put_string(resp, pos, (const unsigned char *)dev->location);
+			n++;
+		}
+		proto_put_u32(resp, n);
+		*resplen = pos;
+		return DISCFERRET_E_OK;
+	}
+
+	if (req->op == OP_OPEN) {
+		const char *serial = (const char *)payload;
+		if ((req->len == 0) || (payload[req->len - 1] != '\0')) return DISCFERRET_E_BAD_PARAMETER;
+		for (size_t i = 0; i < num_units; i++) {
+			if ((serial[0] == '\0') || (strcmp(serial, (const char *)units[i].fu->device.serialnumber) == 0)) {
+				proto_put_u32(resp, i);
+				*resplen = 4;
+				return DISCFERRET_E_OK;
+			}
+		}
+		return DISCFERRET_E_NO_MATCH;
+	}
+
+	// Everything else runs on a unit, with the unit's arbiter held
+	if (req->unit >= num_units) return DISCFERRET_E_BAD_PARAMETER;
+	u = &units[req->unit];
+	dh = u->fu->dh;
+
+	// Check the payload is long enough for the parameters each request needs
+	switch (req->op) {
+		case OP_REG_POKE:
+			if (req->len < 8) return DISCFERRET_E_BAD_PARAMETER;
+			break;
+		case OP_REG_PEEK: case OP_RAM_ADDR_SET: case OP_RAM_READ: case OP_GET_INDEX_TIME:
+		case OP_SEEK_SET_RATE: case OP_SEEK_RECALIBRATE: case OP_SEEK_RELATIVE: case OP_SEEK_ABSOLUTE:
+			if (req->len < 4) return DISCFERRET_E_BAD_PARAMETER;
+			break;
+		case OP_FLUX_CAPTURE:
+			if (req->len < 20) return DISCFERRET_E_BAD_PARAMETER;
+			break;
+	}
+
+	// Make room for the data a RAM read sends back
+	if (req->op == OP_RAM_READ) {
+		uint32_t len = proto_get_u32(payload);
+		if ((len == 0) || (len > PROTO_MAX_PAYLOAD)) return DISCFERRET_E_BAD_PARAMETER;
+		if (!reserve(&c->resp, &c->resp_size, len)) return DISCFERRET_E_OUT_OF_MEMORY;
+		resp = c->resp;
+	}
+
+	unit_acquire(u, client);
+
+	switch (req->op) {
+		case OP_CLOSE:
+		case OP_UNLOCK:
+			if (u->owner == client) {
+				u->owner = 0;
+				pthread_cond_broadcast(&u->released);
+			}
+			r = DISCFERRET_E_OK;
+			break;
+
+		case OP_LOCK:
+			u->owner = client;
+			r = DISCFERRET_E_OK;
+			break;
+
+		case OP_GET_INFO: {
+			DISCFERRET_DEVICE_INFO info;
+			size_t pos = 16;
+			if ((r = discferret_get_info(dh, &info)) != DISCFERRET_E_OK) break;
+			proto_put_u32(resp, info.firmware_ver);
+			proto_put_u32(resp + 4, info.microcode_type);
+			proto_put_u32(resp + 8, info.microcode_ver);
+			memcpy(resp + 12, info.hardware_rev, 4);
+			pos = put_string(resp, pos, info.productname);
+			pos = put_string(resp, pos, info.manufacturer);
+			pos = put_string(resp, pos, info.serialnumber);
+			*resplen = pos;
+			break;
+		}
+
+		case OP_FPGA_LOAD_DEFAULT:
+			r = discferret_fpga_load_default(dh);
+			break;
+
+		case OP_REG_PEEK:
+			if ((r = discferret_reg_peek(dh, proto_get_u32(payload))) >= 0) {
+				proto_put_u32(resp, r);
+				*resplen = 4;
+				r = DISCFERRET_E_OK;
+			}
+			break;
+
+		case OP_REG_POKE:
+			r = discferret_reg_poke(dh, proto_get_u32(payload), proto_get_u32(payload + 4));
+			break;
+
+		case OP_RAM_ADDR_GET:
+			if ((r = discferret_ram_addr_get(dh)) >= 0) {
+				proto_put_u32(resp, r);
+				*resplen = 4;
+				r = DISCFERRET_E_OK;
+			}
+			break;
+
+		case OP_RAM_ADDR_SET:
+			r = discferret_ram_addr_set(dh, proto_get_u32(payload));
+			break;
+
+		case OP_RAM_READ: {
+			uint32_t len = proto_get_u32(payload);
+			if ((r = discferret_ram_read(dh, resp, len)) == DISCFERRET_E_OK)
+				*resplen = len;
+			break;
+		}
+
+		case OP_RAM_WRITE:
+			r = discferret_ram_write(dh, payload, req->len);
+			break;
+
+		case OP_GET_STATUS:
+			if ((r = discferret_get_status(dh)) >= 0) {
+				proto_put_u32(resp, r);
+				*resplen = 4;
+				r = DISCFERRET_E_OK;
+			}
+			break;
+
+		case OP_GET_INDEX_TIME:
+			if ((r = discferret_get_index_time(dh, proto_get_u32(payload) != 0, &d)) == DISCFERRET_E_OK) {
+				proto_put_double(resp, d);
+				*resplen = 8;
+			}
+			break;
+
+		case OP_SEEK_SET_RATE:
+			r = discferret_seek_set_rate(dh, proto_get_u32(payload));
+			break;
+
+		case OP_SEEK_RECALIBRATE:
+			r = discferret_seek_recalibrate(dh, proto_get_u32(payload));
+			break;
+
+		case OP_SEEK_RELATIVE:
+			r = discferret_seek_relative(dh, (int32_t)proto_get_u32(payload));
+			break;
+
+		case OP_SEEK_ABSOLUTE:
+			r = discferret_seek_absolute(dh, proto_get_u32(payload));
+			break;
+
+		case OP_FLUX_CAPTURE: {
+			DISCFERRET_CAPTURE_CONFIG cfg;
+			DISCFERRET_FLUX *flux = &c->flux;
+			size_t len, pos = 12;
+
+			cfg.clksel = proto_get_u32(payload);
+			cfg.index_start = proto_get_u32(payload + 4) != 0;
+			cfg.revolutions = proto_get_u32(payload + 8);
+			cfg.timeout = proto_get_double(payload + 12);
+			if ((r = discferret_flux_capture(dh, &cfg, flux)) != DISCFERRET_E_OK) break;
+
+			len = 12 + (4 * (flux->index_count + flux->count));
+			if ((len > PROTO_MAX_PAYLOAD) || !reserve(&c->resp, &c->resp_size, len)) {
+				r = DISCFERRET_E_OUT_OF_MEMORY;
+				break;
+			}
+			resp = c->resp;
+			proto_put_u32(resp, flux->clock_hz);
+			proto_put_u32(resp + 4, flux->count);
+			proto_put_u32(resp + 8, flux->index_count);
+			for (size_t i = 0; i < flux->index_count; i++, pos += 4)
+				proto_put_u32(resp + pos, flux->index[i]);
+			for (size_t i = 0; i < flux->count; i++, pos += 4)
+				proto_put_u32(resp + pos, flux->intervals[i]);
+			*resplen = len;
+			break;
+		}
+
+		default:
+			r = DISCFERRET_E_NOT_SUPPORTED;
+			break;
+	}
+
+	unit_release(u);
+	return r;
+}
+
+/**
+ * @brief	Client connection thread
+ */
+static void *client_thread(void *arg)
+{
+	struct client *c = arg;
+
+	while (reserve(&c->payload, &c->payload_size, CLIENT_BUF_MIN) && reserve(&c->resp, &c->resp_size, CLIENT_BUF_MIN)) {
+		unsigned char hdr[PROTO_REQ_HDR_LEN];
+		struct proto_request req;
+		size_t resplen;
+		int status;
+
+		if (proto_read_all(c->fd, hdr, sizeof(hdr)) != 0) break;
+		proto_get_request(hdr, &req);
+		if ((req.magic != PROTO_MAGIC) || (req.len > PROTO_MAX_PAYLOAD)) break;
+		if (!reserve(&c->payload, &c->payload_size, req.len)) break;
+		if ((req.len > 0) && (proto_read_all(c->fd, c->payload, req.len) != 0)) break;
+
+		status = dispatch(c, &req, &resplen);
+
+		proto_put_u32(hdr, (uint32_t)status);
+		proto_put_u32(hdr + 4, resplen);
+		if (proto_write_all(c->fd, hdr, PROTO_RESP_HDR_LEN) != 0) break;
+		if ((resplen > 0) && (proto_write_all(c->fd, c->resp, resplen) != 0)) break;
+	}
+
+	// Client has gone away; release anything it had locked
+	for (size_t i = 0; i < num_units; i++) {
+		pthread_mutex_lock(&units[i].lock);
+		if (units[i].owner == c->id) {
+			units[i].owner = 0;
+			pthread_cond_broadcast(&units[i].released);
+		}
+		pthread_mutex_unlock(&units[i].lock);
+	}
+
+	// The socket and client block are freed by whoever joins this thread
+	__atomic_store_n(&c->done, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+/**
+ * @brief	Join a client's thread and free it
+ */
+static void client_reap(struct client *c)
+{
+	pthread_join(c->thread, NULL);
+	close(c->fd);
+	discferret_flux_free(&c->flux);
+	free(c->payload);
+	free(c->resp);
+	free(c);
+}
+
+int main(int argc, char **argv)
+{
+	const char *path = DISCFERRET_DAEMON_SOCKET;
+	bool load_microcode = true;
+	DISCFERRET_FLEET *fleet;
+	struct client *clients = NULL;
+	unsigned long next_client = 1;
+	struct sockaddr_un addr;
+	struct sigaction sa;
+	sigset_t sigs, oldsigs;
+	int opt, lfd;
+
+	while ((opt = getopt(argc, argv, "s:n")) != -1) {
+		switch (opt) {
+			case 's':	path = optarg; break;
+			case 'n':	load_microcode = false; break;
+			default:
+				fprintf(stderr, "usage: %s [-s socket_path] [-n]\n", argv[0]);
+				return 1;
+		}
+	}
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "socket path too long: %s\n", path);
+		return 1;
+	}
+
+	// Only the main thread takes SIGINT/SIGTERM, and only while it waits in
+	// pselect(); every other thread (the library's included) inherits the block
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGINT);
+	sigaddset(&sigs, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &sigs, &oldsigs);
+
+	// Open and configure every attached unit
+	if (discferret_init() != DISCFERRET_E_OK) {
+		fprintf(stderr, "unable to initialise libdiscferret\n");
+		return 1;
+	}
+	if (discferret_fleet_open(NULL, 0, load_microcode, &fleet) != DISCFERRET_E_OK) {
+		fprintf(stderr, "unable to open DiscFerret units\n");
+		discferret_done();
+		return 1;
+	}
+
+	units = calloc(fleet->count + 1, sizeof(struct unit));
+	if (units == NULL) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+	for (size_t i = 0; i < fleet->count; i++) {
+		DISCFERRET_FLEET_UNIT *fu = &fleet->units[i];
+		if ((fu->open_status != DISCFERRET_E_OK) || (fu->load_status != DISCFERRET_E_OK)) {
+			fprintf(stderr, "unit %s (%s): open %d, microcode load %d -- not serving it\n",
+					fu->device.serialnumber, fu->device.location, fu->open_status, fu->load_status);
+			continue;
+		}
+		units[num_units].fu = fu;
+		pthread_mutex_init(&units[num_units].lock, NULL);
+		pthread_cond_init(&units[num_units].released, NULL);
+		printf("unit %zu: %s (%s), ready in %.3fs\n", num_units, fu->device.serialnumber,
+				fu->device.location, fu->open_time + fu->load_time);
+		num_units++;
+	}
+	printf("%zu unit(s) ready in %.3fs\n", num_units, fleet->elapsed);
+
+	// Shut down cleanly on SIGINT/SIGTERM, which interrupt pselect() in the accept loop
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sighandler;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sa.sa_handler = SIG_IGN;
+	sigaction(SIGPIPE, &sa, NULL);
+
+	// Start listening
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	unlink(path);
+	lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if ((lfd < 0) || (bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) != 0) || (listen(lfd, 16) != 0) ||
+			(fcntl(lfd, F_SETFL, fcntl(lfd, F_GETFL) | O_NONBLOCK) != 0)) {
+		perror(path);
+		discferret_fleet_close(fleet);
+		discferret_done();
+		return 1;
+	}
+
+	while (!quit) {
+		struct client *c, **pp;
+		fd_set rfds;
+		int fd = -1;
+
+		// The signals are only unblocked inside pselect(), so one that arrives
+		// after the quit check still interrupts the wait. The listening socket
+		// is non-blocking in case the connection goes away before accept().
+		FD_ZERO(&rfds);
+		FD_SET(lfd, &rfds);
+		if ((pselect(lfd + 1, &rfds, NULL, NULL, NULL, &oldsigs) > 0) && ((fd = accept(lfd, NULL, NULL)) >= 0))
+			fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+
+		// Clean up after clients which have disconnected
+		for (pp = &clients; *pp != NULL; ) {
+			if (__atomic_load_n(&(*pp)->done, __ATOMIC_ACQUIRE)) {
+				c = *pp;
+				*pp = c->next;
+				client_reap(c);
+			} else {
+				pp = &(*pp)->next;
+			}
+		}
+
+		if (fd < 0) continue;
+
+		if ((c = calloc(1, sizeof(struct client))) == NULL) {
+			close(fd);
+			continue;
+		}
+		c->id = next_client++;
+		c->fd = fd;
+		if (pthread_create(&c->thread, NULL, client_thread, c) != 0) {
+			close(fd);
+			free(c);
+			continue;
+		}
+		c->next = clients;
+		clients = c;
+	}
+
+	// Kick every client off and wait for its thread, so none is still using the fleet when it's closed
+	for (struct client *c = clients; c != NULL; c = c->next)
+		shutdown(c->fd, SHUT_RDWR);
+	while (clients != NULL) {
+		struct client *c = clients;
+		clients = c->next;
+		client_reap(c);
+	}
+
+	close(lfd);
+	unlink(path);
+	discferret_fleet_close(fleet);
+	discferret_done();
+	free(units);
+
+	return 0;
+}
+
+// vim: ts=4 noet sw=4
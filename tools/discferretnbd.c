@@ -0,0 +1,792 @@
+/****************************************************************************
+ *
+ *                - DiscFerret Interface Library for C / C++ -
+ *
+ * Copyright (C) 2010 - 2011 P. A. Pemberton t/a. Red Fox Engineering.
+ * All Rights Reserved.
+ *
+ * Copyright 2010-2011 Philip Pemberton
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ ****************************************************************************/
+
+
+/**
+ * @file	discferretnbd.c
+ * @brief	NBD server: exposes a disc's logical sectors as a read-only block device.
+ *
+ * Usage: discferretnbd [options]
+ *   -f fmt     Format: mfm, fm or amiga (default mfm)
+ *   -g C:H:S   Geometry: cylinders, heads, sectors per track (default 80:2:9)
+ *   -z size    Sector size in bytes (default 512)
+ *   -0         Sectors are numbered from 0 (default 1; amiga is always 0)
+ *   -r rate    Data rate in bits/s (default 250000)
+ *   -d n       Drive select line 0-3 (default 0)
+ *   -S serial  DiscFerret serial number (default: the first one found)
+ *   -p port    Listen on TCP port <port> on 127.0.0.1 (default 10809)
+ *   -u path    Listen on a Unix socket instead
+ *   -i image   Simulate the drive with a raw sector image (no DiscFerret needed)
+ *   -L ms      Simulated drive: milliseconds to read a track (default 200; seeks add 3ms a step)
+ *   -b         Benchmark sequential and random reads, then exit
+ *
+ * Reads go through the libdiscferret sector cache, which reads the next
+ * track ahead while sequential reads are under way. A simulated drive sits
+ * under the cache in place of the DiscFerret, so it is cached and read
+ * ahead in just the same way. Clients may have several
+ * requests in flight: whatever has arrived is collected into a batch and
+ * served in elevator order from the current head position, so a burst of
+ * random reads costs one sweep across the disc rather than a seek each.
+ * Replies go out as each request is served (NBD allows them in any order).
+ *
+ * Try it with:
+ *   discferretnbd -g 80:2:18 -r 500000 &
+ *   nbd-client -N "" 127.0.0.1 10809 /dev/nbd0 -readonly
+ *   dd if=/dev/nbd0 of=disc.img bs=64k
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "discferret.h"
+#include "discferret_registers.h"
+#include "discferret_decode.h"
+#include "discferret_cache.h"
+#include "discferret_proto.h"
+
+/// NBD handshake and transmission constants
+#define NBD_MAGIC				0x4e42444d41474943ULL	// "NBDMAGIC"
+#define NBD_OPTS_MAGIC			0x49484156454F5054ULL	// "IHAVEOPT"
+#define NBD_REP_MAGIC			0x0003e889045565a9ULL
+#define NBD_REQUEST_MAGIC		0x25609513
+#define NBD_REPLY_MAGIC			0x67446698
+
+enum {
+	NBD_FLAG_FIXED_NEWSTYLE	= 1 << 0,
+	NBD_FLAG_NO_ZEROES		= 1 << 1
+};
+
+enum {
+	NBD_FLAG_HAS_FLAGS		= 1 << 0,
+	NBD_FLAG_READ_ONLY		= 1 << 1,
+	NBD_FLAG_SEND_FLUSH		= 1 << 2
+};
+
+enum {
+	NBD_OPT_EXPORT_NAME		= 1,
+	NBD_OPT_ABORT			= 2,
+	NBD_OPT_INFO			= 6,
+	NBD_OPT_GO				= 7
+};
+
+enum {
+	NBD_REP_ACK				= 1,
+	NBD_REP_INFO			= 3
+};
+#define NBD_REP_ERR_UNSUP		0x80000001UL
+#define NBD_REP_ERR_INVALID		0x80000003UL
+
+enum {
+	NBD_INFO_EXPORT			= 0,
+	NBD_INFO_BLOCK_SIZE		= 3
+};
+
+enum {
+	NBD_CMD_READ			= 0,
+	NBD_CMD_WRITE			= 1,
+	NBD_CMD_DISC			= 2,
+	NBD_CMD_FLUSH			= 3
+};
+
+/// Longest read request served
+#define NBD_MAX_READ			(32 * 1024 * 1024)
+/// Most requests collected into one batch
+#define BATCH_MAX				64
+/// Simulated drive: step rate, in microseconds per cylinder
+#define SIM_STEP_US				3000
+
+/**
+ * @brief	Disc geometry
+ */
+struct geometry {
+	unsigned int	cylinders;
+	unsigned int	heads;
+	unsigned int	sectors;		///< Sectors per track
+	unsigned int	first;			///< First sector number
+	unsigned int	size;			///< Sector size in bytes
+};
+
+/**
+ * @brief	Where sectors come from: the sector cache, over a DiscFerret or a simulated drive
+ */
+struct backend {
+	struct geometry			geom;
+	DISCFERRET_CACHE		*cache;		///< Sector cache
+	int						image;		///< Simulated drive: raw image file, or -1
+	unsigned long			track_ms;	///< Simulated drive: time to read a track
+	long					sim_track;	///< Simulated drive: track last read (used by the cache's worker thread)
+	long					pos;		///< Track (cylinder * heads + head) last read from
+	unsigned long			reads;		///< Sectors read
+	unsigned long			errors;		///< Sectors which couldn't be read cleanly
+};
+
+/**
+ * @brief	A read request waiting in a batch
+ */
+struct request {
+	uint64_t		handle;
+	uint64_t		offset;
+	uint32_t		length;
+	long			track;			///< First track the request touches
+};
+
+/// Set by the signal handler to shut the server down
+static volatile sig_atomic_t quit = 0;
+
+static void sighandler(int sig)
+{
+	quit = 1;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void put_be16(unsigned char *p, uint16_t v)
+{
+	p[0] = v >> 8;
+	p[1] = v & 0xff;
+}
+
+static void put_be32(unsigned char *p, uint32_t v)
+{
+	put_be16(p, v >> 16);
+	put_be16(p + 2, v & 0xffff);
+}
+
+static void put_be64(unsigned char *p, uint64_t v)
+{
+	put_be32(p, v >> 32);
+	put_be32(p + 4, v & 0xffffffff);
+}
+
+static uint32_t get_be32(const unsigned char *p)
+{
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static uint64_t get_be64(const unsigned char *p)
+{
+	return ((uint64_t)get_be32(p) << 32) | get_be32(p + 4);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Sector access
+
+static uint64_t disc_size(const struct geometry *g)
+{
+	return (uint64_t)g->cylinders * g->heads * g->sectors * g->size;
+}
+
+/**
+ * @brief	Largest power of two no bigger than a track (at least one sector)
+ */
+static uint32_t preferred_block(const struct geometry *g)
+{
+	const uint32_t track = g->size * g->sectors;
+	uint32_t b = 1;
+
+	while (b * 2 <= track) b *= 2;
+	return b;
+}
+
+/**
+ * @brief	Simulated drive: read a track from the image, taking as long as a capture would
+ *
+ * Called by the sector cache's worker thread in place of a seek and
+ * discferret_retry_track(). Sectors the image is too short to hold are
+ * returned with bad checksums.
+ */
+static DISCFERRET_ERROR sim_read_track(void *ctx, unsigned int cyl, unsigned int head,
+		const DISCFERRET_RETRY_CONFIG *config, DISCFERRET_RETRY_RESULT *result)
+{
+	struct backend *be = ctx;
+	const struct geometry *g = &be->geom;
+	const long track = ((long)cyl * g->heads) + head;
+	const long steps = labs((long)cyl - ((be->sim_track < 0) ? 0 : be->sim_track / g->heads));
+	const unsigned long us = (be->track_ms * 1000) + (steps * SIM_STEP_US);
+	struct timespec ts = { us / 1000000, (us % 1000000) * 1000L };
+	unsigned int size_code = 0;
+
+	nanosleep(&ts, NULL);
+	be->sim_track = track;
+
+	if (result->capacity < g->sectors) {
+		DISCFERRET_RETRY_SECTOR *p = realloc(result->sectors, g->sectors * sizeof(DISCFERRET_RETRY_SECTOR));
+		if (p == NULL) return DISCFERRET_E_OUT_OF_MEMORY;
+		memset(p + result->capacity, 0, (g->sectors - result->capacity) * sizeof(DISCFERRET_RETRY_SECTOR));
+		result->sectors = p;
+		result->capacity = g->sectors;
+	}
+	while ((128u << size_code) < g->size) size_code++;
+
+	result->count = g->sectors;
+	result->missing = 0;
+	result->captures = result->revolutions = 1;
+	result->targeted = result->reseeks = 0;
+	result->time = us / 1e6;
+	for (unsigned int i = 0; i < g->sectors; i++) {
+		DISCFERRET_RETRY_SECTOR *s = &result->sectors[i];
+		unsigned char *p = realloc(s->data, g->size);
+
+		if (p == NULL) return DISCFERRET_E_OUT_OF_MEMORY;
+		s->data = p;
+		s->sector = config->first_sector + i;
+		s->found = true;
+		s->cyl = cyl;
+		s->head = head;
+		s->size_code = size_code;
+		s->size = g->size;
+		s->order = i;
+		s->data_ok = (pread(be->image, p, g->size, (off_t)((track * g->sectors) + i) * g->size) == (ssize_t)g->size);
+		if (!s->data_ok) result->missing++;
+	}
+	return DISCFERRET_E_OK;
+}
+
+/**
+ * @brief	Read one sector
+ * @returns	0, or an errno value for the NBD reply.
+ */
+static int read_sector(struct backend *be, const unsigned long lba, unsigned char *buf)
+{
+	const struct geometry *g = &be->geom;
+	const long track = lba / g->sectors;
+	const unsigned int cyl = track / g->heads, head = track % g->heads, sec = g->first + (lba % g->sectors);
+	int r;
+
+	be->reads++;
+	be->pos = track;
+
+	r = discferret_cache_read(be->cache, cyl, head, sec, buf, g->size, NULL);
+	if (r == DISCFERRET_E_OK) return 0;
+	be->errors++;
+	fprintf(stderr, "C%u H%u S%u: error %d\n", cyl, head, sec, r);
+	return EIO;
+}
+
+/**
+ * @brief	Read a byte range
+ * @returns	0, or an errno value for the NBD reply.
+ */
+static int read_range(struct backend *be, uint64_t offset, uint32_t length, unsigned char *out, unsigned char *secbuf)
+{
+	const unsigned int size = be->geom.size;
+	int err = 0;
+
+	while (length > 0) {
+		const unsigned long lba = offset / size;
+		const unsigned int skip = offset % size;
+		const uint32_t n = (length < size - skip) ? length : size - skip;
+		int r;
+
+		// Whole sectors go straight into the reply; keep going past bad ones
+		if ((skip == 0) && (n == size)) {
+			r = read_sector(be, lba, out);
+		} else {
+			r = read_sector(be, lba, secbuf);
+			memcpy(out, secbuf + skip, n);
+		}
+		if (r != 0) err = r;
+
+		offset += n;
+		out += n;
+		length -= n;
+	}
+	return err;
+}
+
+/**
+ * @brief	Order a batch of reads for one sweep from the current head position
+ *
+ * Tracks at or beyond the head come first, in ascending order, then the
+ * ones behind it (C-SCAN).
+ */
+static void sort_batch(struct request *reqs, const size_t n, const long pos)
+{
+	for (size_t i = 1; i < n; i++) {
+		struct request r = reqs[i];
+		size_t j = i;
+
+		while (j > 0) {
+			const struct request *p = &reqs[j - 1];
+			const bool p_ahead = (p->track >= pos), r_ahead = (r.track >= pos);
+			const bool before = (r_ahead != p_ahead) ? r_ahead :
+					((r.track != p->track) ? (r.track < p->track) : (r.offset < p->offset));
+
+			if (!before) break;
+			reqs[j] = reqs[j - 1];
+			j--;
+		}
+		reqs[j] = r;
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// NBD protocol
+
+static int send_reply(int fd, const uint64_t handle, const uint32_t error, const unsigned char *data, const uint32_t len)
+{
+	unsigned char hdr[16];
+
+	put_be32(hdr, NBD_REPLY_MAGIC);
+	put_be32(hdr + 4, error);
+	put_be64(hdr + 8, handle);
+	if (proto_write_all(fd, hdr, sizeof(hdr)) != 0) return -1;
+	if ((error == 0) && (len > 0) && (proto_write_all(fd, data, len) != 0)) return -1;
+	return 0;
+}
+
+static int send_option_reply(int fd, const uint32_t opt, const uint32_t type, const unsigned char *data, const uint32_t len)
+{
+	unsigned char hdr[20];
+
+	put_be64(hdr, NBD_REP_MAGIC);
+	put_be32(hdr + 8, opt);
+	put_be32(hdr + 12, type);
+	put_be32(hdr + 16, len);
+	if (proto_write_all(fd, hdr, sizeof(hdr)) != 0) return -1;
+	if ((len > 0) && (proto_write_all(fd, data, len) != 0)) return -1;
+	return 0;
+}
+
+/**
+ * @brief	Fixed newstyle handshake
+ * @returns	0 when the client is ready for transmission, -1 to drop it.
+ */
+static int handshake(int fd, const struct backend *be)
+{
+	const uint16_t tflags = NBD_FLAG_HAS_FLAGS | NBD_FLAG_READ_ONLY | NBD_FLAG_SEND_FLUSH;
+	unsigned char buf[18 + 124];
+	uint32_t cflags;
+
+	put_be64(buf, NBD_MAGIC);
+	put_be64(buf + 8, NBD_OPTS_MAGIC);
+	put_be16(buf + 16, NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES);
+	if ((proto_write_all(fd, buf, 18) != 0) || (proto_read_all(fd, buf, 4) != 0)) return -1;
+	cflags = get_be32(buf);
+
+	for (;;) {
+		unsigned char info[14];
+		uint32_t opt, len;
+
+		if (proto_read_all(fd, buf, 16) != 0) return -1;
+		if (get_be64(buf) != NBD_OPTS_MAGIC) return -1;
+		opt = get_be32(buf + 8);
+		len = get_be32(buf + 12);
+
+		// There's one export; its name doesn't matter, so skip the option data
+		for (uint32_t left = len; left > 0; ) {
+			uint32_t n = (left < sizeof(buf)) ? left : sizeof(buf);
+			if (proto_read_all(fd, buf, n) != 0) return -1;
+			left -= n;
+		}
+
+		switch (opt) {
+			case NBD_OPT_EXPORT_NAME:
+				put_be64(buf, disc_size(&be->geom));
+				put_be16(buf + 8, tflags);
+				memset(buf + 10, 0, 124);
+				return proto_write_all(fd, buf, (cflags & NBD_FLAG_NO_ZEROES) ? 10 : 134);
+
+			case NBD_OPT_ABORT:
+				send_option_reply(fd, opt, NBD_REP_ACK, NULL, 0);
+				return -1;
+
+			case NBD_OPT_INFO:
+			case NBD_OPT_GO:
+				if (len < 6) {
+					if (send_option_reply(fd, opt, NBD_REP_ERR_INVALID, NULL, 0) != 0) return -1;
+					break;
+				}
+				put_be16(info, NBD_INFO_EXPORT);
+				put_be64(info + 2, disc_size(&be->geom));
+				put_be16(info + 10, tflags);
+				if (send_option_reply(fd, opt, NBD_REP_INFO, info, 12) != 0) return -1;
+				// A track is the natural transfer size, but the preferred size
+				// must be a power of two: use the largest one within a track
+				put_be16(info, NBD_INFO_BLOCK_SIZE);
+				put_be32(info + 2, 1);
+				put_be32(info + 6, preferred_block(&be->geom));
+				put_be32(info + 10, NBD_MAX_READ);
+				if (send_option_reply(fd, opt, NBD_REP_INFO, info, 14) != 0) return -1;
+				if (send_option_reply(fd, opt, NBD_REP_ACK, NULL, 0) != 0) return -1;
+				if (opt == NBD_OPT_GO) return 0;
+				break;
+
+			default:
+				if (send_option_reply(fd, opt, NBD_REP_ERR_UNSUP, NULL, 0) != 0) return -1;
+				break;
+		}
+	}
+}
+
+/**
+ * @brief	Serve one client until it disconnects
+ */
+static void serve(int fd, struct backend *be)
+{
+	const uint64_t size = disc_size(&be->geom);
+	unsigned char *data = malloc(NBD_MAX_READ), *secbuf = malloc(be->geom.size);
+	struct request batch[BATCH_MAX];
+	bool done = false;
+
+	if ((data == NULL) || (secbuf == NULL) || (handshake(fd, be) != 0)) done = true;
+
+	while (!done && !quit) {
+		size_t n = 0;
+		int deferred = -1;
+		uint64_t deferred_handle = 0;
+		struct pollfd pfd = { fd, POLLIN, 0 };
+
+		// Collect whatever reads are waiting; anything else ends the batch
+		do {
+			unsigned char hdr[28];
+			uint32_t len, type;
+			uint64_t handle, offset;
+
+			if (proto_read_all(fd, hdr, sizeof(hdr)) != 0) {
+				done = true;
+				break;
+			}
+			if (get_be32(hdr) != NBD_REQUEST_MAGIC) {
+				done = true;
+				break;
+			}
+			type = hdr[7];
+			handle = get_be64(hdr + 8);
+			offset = get_be64(hdr + 16);
+			len = get_be32(hdr + 24);
+
+			if (type == NBD_CMD_READ) {
+				if ((len > NBD_MAX_READ) || (offset > size) || (len > size - offset)) {
+					if (send_reply(fd, handle, EINVAL, NULL, 0) != 0) done = true;
+					continue;
+				}
+				batch[n].handle = handle;
+				batch[n].offset = offset;
+				batch[n].length = len;
+				batch[n].track = offset / ((uint64_t)be->geom.size * be->geom.sectors);
+				n++;
+			} else if (type == NBD_CMD_WRITE) {
+				// Read-only; drain the payload
+				for (uint32_t left = len; left > 0; ) {
+					uint32_t k = (left < be->geom.size) ? left : be->geom.size;
+					if (proto_read_all(fd, secbuf, k) != 0) {
+						done = true;
+						break;
+					}
+					left -= k;
+				}
+				if (!done && (send_reply(fd, handle, EPERM, NULL, 0) != 0)) done = true;
+			} else if (type == NBD_CMD_DISC) {
+				done = true;
+			} else {
+				// Flush and the rest: answer once the reads before them are served
+				deferred = (type == NBD_CMD_FLUSH) ? 0 : EINVAL;
+				deferred_handle = handle;
+				break;
+			}
+		} while (!done && (n < BATCH_MAX) && (poll(&pfd, 1, 0) == 1) && (pfd.revents & POLLIN));
+
+		if (n > 1) sort_batch(batch, n, be->pos);
+		for (size_t i = 0; i < n; i++) {
+			int err = read_range(be, batch[i].offset, batch[i].length, data, secbuf);
+			if (send_reply(fd, batch[i].handle, err, data, batch[i].length) != 0) {
+				done = true;
+				break;
+			}
+		}
+		if ((deferred >= 0) && !done && (send_reply(fd, deferred_handle, deferred, NULL, 0) != 0)) done = true;
+	}
+
+	free(data);
+	free(secbuf);
+	close(fd);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief	Time sequential and random reads through the sector cache
+ *
+ * The sequential pass reads the whole disc in 64KiB requests, as dd would.
+ * The random pass reads 4KiB blocks, first one at a time and then in
+ * batches of 16 sorted into elevator order, as a client with a deep queue
+ * would send them.
+ */
+static void benchmark(struct backend *be)
+{
+	const uint64_t size = disc_size(&be->geom);
+	const uint32_t seq = 64 * 1024, blk = 4096, nrand = 256;
+	unsigned char *data = malloc(seq), *secbuf = malloc(be->geom.size);
+	unsigned long rng = 12345;
+	struct request reqs[16];
+	double t;
+
+	if ((data == NULL) || (secbuf == NULL)) return;
+
+	t = now();
+	for (uint64_t off = 0; off < size; off += seq)
+		read_range(be, off, (size - off < seq) ? (uint32_t)(size - off) : seq, data, secbuf);
+	t = now() - t;
+	printf("sequential (dd, 64KiB):   %8.1f KiB/s  (%.1fs)\n", size / 1024.0 / t, t);
+
+	for (int batched = 0; batched < 2; batched++) {
+		t = now();
+		for (uint32_t i = 0; i < nrand; i += 16) {
+			for (int k = 0; k < 16; k++) {
+				rng = rng * 6364136223846793005UL + 1442695040888963407UL;
+				reqs[k].offset = ((rng >> 20) % (size / blk)) * blk;
+				reqs[k].length = blk;
+				reqs[k].track = reqs[k].offset / ((uint64_t)be->geom.size * be->geom.sectors);
+			}
+			if (batched) sort_batch(reqs, 16, be->pos);
+			for (int k = 0; k < 16; k++) read_range(be, reqs[k].offset, reqs[k].length, data, secbuf);
+		}
+		t = now() - t;
+		printf("random 4KiB, %s: %8.1f KiB/s  (%.1f reads/s)\n", batched ? "batched   " : "one by one",
+				nrand * (blk / 1024.0) / t, nrand / t);
+	}
+
+	free(data);
+	free(secbuf);
+}
+
+int main(int argc, char **argv)
+{
+	const char *fmt = "mfm", *serial = NULL, *sock_path = NULL, *image = NULL;
+	unsigned int port = 10809, drive = 0;
+	bool bench = false, zero_based = false;
+	DISCFERRET_DEVICE_HANDLE *dh = NULL;
+	DISCFERRET_CACHE_CONFIG cc;
+	DISCFERRET_CACHE_STATS st;
+	struct backend be;
+	struct sigaction sa;
+	int opt, lfd, r;
+
+	memset(&be, 0, sizeof(be));
+	memset(&cc, 0, sizeof(cc));
+	be.geom.cylinders = 80;
+	be.geom.heads = 2;
+	be.geom.sectors = 9;
+	be.geom.size = 512;
+	be.track_ms = 200;
+	be.image = -1;
+	be.sim_track = -1;
+	cc.read.bitrate = 250000;
+
+	while ((opt = getopt(argc, argv, "f:g:z:0r:d:S:p:u:i:L:b")) != -1) {
+		switch (opt) {
+			case 'f':	fmt = optarg; break;
+			case 'g':
+				if (sscanf(optarg, "%u:%u:%u", &be.geom.cylinders, &be.geom.heads, &be.geom.sectors) != 3) goto usage;
+				break;
+			case 'z':	be.geom.size = strtoul(optarg, NULL, 0); break;
+			case '0':	zero_based = true; break;
+			case 'r':	cc.read.bitrate = strtoul(optarg, NULL, 0); break;
+			case 'd':	drive = strtoul(optarg, NULL, 0); break;
+			case 'S':	serial = optarg; break;
+			case 'p':	port = strtoul(optarg, NULL, 0); break;
+			case 'u':	sock_path = optarg; break;
+			case 'i':	image = optarg; break;
+			case 'L':	be.track_ms = strtoul(optarg, NULL, 0); break;
+			case 'b':	bench = true; break;
+			default:
+				goto usage;
+		}
+	}
+
+	if (strcmp(fmt, "mfm") == 0) {
+		cc.read.decoder = discferret_decode_mfm;
+		cc.read.sync_word = 0x4489;
+		cc.read.syncs_per_sector = 6;
+	} else if (strcmp(fmt, "fm") == 0) {
+		cc.read.decoder = discferret_decode_fm;
+	} else if (strcmp(fmt, "amiga") == 0) {
+		cc.read.decoder = discferret_decode_amiga;
+		cc.read.sync_word = 0x4489;
+		cc.read.syncs_per_sector = 2;
+		zero_based = true;
+	} else {
+		goto usage;
+	}
+	if ((be.geom.cylinders < 1) || (be.geom.heads < 1) || (be.geom.heads > 2) || (be.geom.sectors < 1) ||
+			(drive > 3) || (be.geom.size < 128) || (be.geom.size > 16384))
+		goto usage;
+	be.geom.first = zero_based ? 0 : 1;
+
+	cc.read.clksel = DISCFERRET_ACQ_RATE_100MHZ;
+	cc.read.first_sector = be.geom.first;
+	cc.read.sectors = be.geom.sectors;
+	cc.read.budget = 10;
+	cc.read.reseek_after = 2;
+	cc.cylinders = be.geom.cylinders;
+	cc.heads = be.geom.heads;
+	cc.read_ahead = true;
+
+	if (image != NULL) {
+		// Simulated drive, read by the cache in place of the DiscFerret
+		if ((be.image = open(image, O_RDONLY)) < 0) {
+			perror(image);
+			return 1;
+		}
+		cc.reader = sim_read_track;
+		cc.ctx = &be;
+		if ((r = discferret_cache_open(NULL, &cc, &be.cache)) != DISCFERRET_E_OK) {
+			fprintf(stderr, "unable to start the sector cache (error %d)\n", r);
+			close(be.image);
+			return 1;
+		}
+	} else {
+		static const unsigned int ds[4] = {
+			DISCFERRET_DRIVE_CONTROL_DS0, DISCFERRET_DRIVE_CONTROL_DS1, DISCFERRET_DRIVE_CONTROL_DS2, DISCFERRET_DRIVE_CONTROL_DS3
+		};
+
+		if (discferret_init() != DISCFERRET_E_OK) {
+			fprintf(stderr, "unable to initialise libdiscferret\n");
+			return 1;
+		}
+		r = (serial != NULL) ? discferret_open(serial, &dh) : discferret_open_first(&dh);
+		if ((r != DISCFERRET_E_OK) || ((r = discferret_fpga_load_default(dh)) != DISCFERRET_E_OK)) {
+			fprintf(stderr, "unable to open DiscFerret (error %d)\n", r);
+			discferret_done();
+			return 1;
+		}
+
+		// Select the drive, spin up and find track 0
+		cc.drive_control = ds[drive] | DISCFERRET_DRIVE_CONTROL_MOTEN;
+		discferret_reg_poke(dh, DISCFERRET_R_DRIVE_CONTROL, cc.drive_control);
+		sleep(1);
+		if ((r = discferret_seek_recalibrate(dh, be.geom.cylinders + 10)) != DISCFERRET_E_OK) {
+			fprintf(stderr, "recalibrate failed (error %d)\n", r);
+			discferret_close(dh);
+			discferret_done();
+			return 1;
+		}
+
+		if ((r = discferret_cache_open(dh, &cc, &be.cache)) != DISCFERRET_E_OK) {
+			fprintf(stderr, "unable to start the sector cache (error %d)\n", r);
+			discferret_close(dh);
+			discferret_done();
+			return 1;
+		}
+	}
+
+	if (bench) {
+		benchmark(&be);
+		goto done_nolisten;
+	}
+
+	// Shut down cleanly on SIGINT/SIGTERM. No SA_RESTART, so accept() gets interrupted.
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sighandler;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sa.sa_handler = SIG_IGN;
+	sigaction(SIGPIPE, &sa, NULL);
+
+	if (sock_path != NULL) {
+		struct sockaddr_un addr;
+
+		if (strlen(sock_path) >= sizeof(addr.sun_path)) {
+			fprintf(stderr, "socket path too long: %s\n", sock_path);
+			goto done_nolisten;
+		}
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		strcpy(addr.sun_path, sock_path);
+		unlink(sock_path);
+		lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if ((lfd < 0) || (bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) != 0) || (listen(lfd, 4) != 0)) {
+			perror(sock_path);
+			goto done_nolisten;
+		}
+	} else {
+		struct sockaddr_in addr;
+		int one = 1;
+
+		// Localhost only: NBD has no authentication
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_port = htons(port);
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		lfd = socket(AF_INET, SOCK_STREAM, 0);
+		if (lfd >= 0) setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if ((lfd < 0) || (bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) != 0) || (listen(lfd, 4) != 0)) {
+			perror("listen");
+			goto done_nolisten;
+		}
+	}
+	printf("serving %llu bytes (%u:%u:%u x %u) on %s\n", (unsigned long long)disc_size(&be.geom),
+			be.geom.cylinders, be.geom.heads, be.geom.sectors, be.geom.size, (sock_path != NULL) ? sock_path : "127.0.0.1");
+
+	// One client at a time: there's only one set of heads
+	while (!quit) {
+		int one = 1;
+		int fd = accept(lfd, NULL, NULL);
+		if (fd < 0) continue;
+		if (sock_path == NULL) setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		serve(fd, &be);
+	}
+
+	close(lfd);
+	if (sock_path != NULL) unlink(sock_path);
+done_nolisten:
+	printf("%lu sectors read, %lu errors\n", be.reads, be.errors);
+	if (be.cache != NULL) {
+		discferret_cache_stats(be.cache, &st);
+		printf("cache: %lu hits, %lu misses, %lu tracks read (%lu ahead, %lu used), %.1fs waiting\n",
+				st.hits, st.misses, st.tracks_read, st.ahead, st.ahead_used, st.wait);
+		discferret_cache_close(be.cache);
+	}
+	if (dh != NULL) {
+		discferret_reg_poke(dh, DISCFERRET_R_DRIVE_CONTROL, 0);
+		discferret_close(dh);
+		discferret_done();
+	}
+	if (be.image >= 0) close(be.image);
+	return 0;
+
+usage:
+	fprintf(stderr, "usage: %s [-f mfm|fm|amiga] [-g C:H:S] [-z size] [-0] [-r rate] [-d drive] [-S serial]\n"
+			"       [-p port | -u socket_path] [-i image [-L ms]] [-b]\n", argv[0]);
+	return 1;
+}
+
+// vim: ts=4 noet sw=4